@@ -0,0 +1,240 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+
+#define AL_BATCH_SIZE (64 << 10)  /* Written out in one go, at most. */
+#define AL_LINE_MAX (AL_PATH_SIZE * 4 + 160)
+#define AL_INTERVAL_MS 50         /* Pause once every ring is empty. */
+
+typedef struct al_record {
+  long long time_ns;
+  unsigned long long latency_us;
+  unsigned long long bytes;
+  int status_code;
+  char method[12];
+  char path[AL_PATH_SIZE];
+} al_record_t;
+
+/* Only its thread moves HEAD, and only the drainer moves TAIL. */
+typedef struct al_ring {
+  unsigned long head __attribute__((aligned(64)));
+  unsigned long dropped;
+  unsigned long tail __attribute__((aligned(64)));
+  unsigned long dropped_reported;
+  int unowned;                  /* Left by a thread that exited. */
+  struct al_ring *next;
+  al_record_t records[AL_RING_SIZE];
+} al_ring_t;
+
+static int al_fd = -1;
+static __thread al_ring_t *al_self;
+static al_ring_t *al_rings;
+
+/* Copies at most SIZE - 1 bytes of SOURCE, and a terminator, to DESTINATION. */
+static void al_copy(char *destination, const char *source, size_t size) {
+  size_t i;
+  for (i = 0; i + 1 < size && source[i] != '\0'; i++)
+    destination[i] = source[i];
+  destination[i] = '\0';
+}
+
+/* The calling thread's ring, taken over from an exited thread or made and
+ * linked in on its first request. */
+static al_ring_t *al_ring(void) {
+  al_ring_t *ring;
+  int unowned;
+
+  if (al_self != NULL) return al_self;
+  for (ring = __atomic_load_n(&al_rings, __ATOMIC_ACQUIRE); ring != NULL;
+      ring = ring->next) {
+    unowned = 1;
+    if (__atomic_compare_exchange_n(&ring->unowned, &unowned, 0, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      al_self = ring;
+      return ring;
+    }
+  }
+
+  if (posix_memalign((void **) &ring, 64, sizeof(al_ring_t))) return NULL;
+  ring->head = ring->tail = 0;
+  ring->dropped = ring->dropped_reported = 0;
+  ring->unowned = 0;
+  ring->next = __atomic_load_n(&al_rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&al_rings, &ring->next, ring, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  al_self = ring;
+  return ring;
+}
+
+void al_log(const char *method, const char *path, int status_code,
+    size_t bytes, long long latency_ns) {
+  al_ring_t *ring;
+  al_record_t *record;
+  struct timespec now;
+  unsigned long head;
+
+  if (al_fd < 0 || (ring = al_ring()) == NULL) return;
+  head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == AL_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  record = &ring->records[head & (AL_RING_SIZE - 1)];
+  clock_gettime(CLOCK_REALTIME, &now);
+  record->time_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+  record->latency_us = latency_ns > 0 ? latency_ns / 1000 : 0;
+  record->bytes = bytes;
+  record->status_code = status_code;
+  al_copy(record->method, method, sizeof(record->method));
+  al_copy(record->path, path, sizeof(record->path));
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void al_unregister(void) {
+  if (al_self == NULL) return;
+  __atomic_store_n(&al_self->unowned, 1, __ATOMIC_RELEASE);
+  al_self = NULL;
+}
+
+/* Formats TIME_NS (UTC) into LINE, reusing the date while the second is the
+ * same as last time. Returns the length. */
+static size_t al_format_time(char *line, long long time_ns) {
+  static char date[32];
+  static time_t date_second = -1;
+  time_t second = time_ns / 1000000000LL;
+  struct tm tm;
+
+  if (second != date_second) {
+    gmtime_r(&second, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+    date_second = second;
+  }
+  return sprintf(line, "time=%s.%03dZ", date, (int) (time_ns / 1000000 % 1000));
+}
+
+/* Formats RECORD as a line of key=value pairs into LINE, which has room
+ * for AL_LINE_MAX bytes. Returns the length. */
+static size_t al_format(char *line, al_record_t *record) {
+  static const char hex[] = "0123456789abcdef";
+  size_t length = al_format_time(line, record->time_ns);
+  unsigned char *c;
+
+  length += sprintf(line + length, " method=%s path=\"",
+      record->method[0] != '\0' ? record->method : "-");
+  for (c = (unsigned char *) record->path; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      line[length++] = '\\';
+      line[length++] = *c;
+    } else if (*c < 0x20 || *c >= 0x7f) {
+      line[length++] = '\\';
+      line[length++] = 'x';
+      line[length++] = hex[*c >> 4];
+      line[length++] = hex[*c & 15];
+    } else {
+      line[length++] = *c;
+    }
+  }
+  length += sprintf(line + length, "\" status=%d bytes=%llu duration_us=%llu\n",
+      record->status_code, record->bytes, record->latency_us);
+  return length;
+}
+
+static void al_write(const char *data, size_t length) {
+  ssize_t written;
+
+  while (length > 0) {
+    written = write(al_fd, data, length);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return;
+    data += written;
+    length -= written;
+  }
+}
+
+/* Empties every ring in turn, writing out a batch whenever the buffer
+ * fills, and what is left once all are empty. Drops are logged as a line
+ * of their own. */
+static void *al_drain_routine(void *aux) {
+  static char batch[AL_BATCH_SIZE];
+  struct timespec pause = { 0, AL_INTERVAL_MS * 1000000L };
+  struct timespec now;
+  al_ring_t *ring;
+  unsigned long head, tail, dropped, new_drops;
+  size_t length;
+  int drained;
+
+  while (1) {
+    length = 0;
+    drained = 0;
+    new_drops = 0;
+    for (ring = __atomic_load_n(&al_rings, __ATOMIC_ACQUIRE); ring != NULL;
+        ring = ring->next) {
+      head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      for (tail = ring->tail; tail != head; tail++) {
+        if (length + AL_LINE_MAX > AL_BATCH_SIZE) {
+          al_write(batch, length);
+          length = 0;
+        }
+        length += al_format(batch + length,
+            &ring->records[tail & (AL_RING_SIZE - 1)]);
+        drained = 1;
+      }
+      /* Formatted, so the records can be written over again. */
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+      dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+      new_drops += dropped - ring->dropped_reported;
+      ring->dropped_reported = dropped;
+    }
+
+    if (new_drops > 0) {
+      if (length + AL_LINE_MAX > AL_BATCH_SIZE) {
+        al_write(batch, length);
+        length = 0;
+      }
+      clock_gettime(CLOCK_REALTIME, &now);
+      length += al_format_time(batch + length,
+          now.tv_sec * 1000000000LL + now.tv_nsec);
+      length += sprintf(batch + length, " dropped=%lu\n", new_drops);
+    }
+    if (length > 0) al_write(batch, length);
+    if (!drained) nanosleep(&pause, NULL);
+  }
+  return NULL;
+}
+
+int al_init(const char *path) {
+  pthread_t thread;
+
+  al_fd = strcmp(path, "-") == 0 ? STDOUT_FILENO :
+      open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (al_fd == -1) return -1;
+  if (pthread_create(&thread, NULL, al_drain_routine, NULL) != 0) {
+    al_fd = -1;
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+int al_enabled(void) {
+  return al_fd >= 0;
+}
+
+unsigned long al_dropped(void) {
+  unsigned long dropped = 0;
+  al_ring_t *ring;
+
+  for (ring = __atomic_load_n(&al_rings, __ATOMIC_ACQUIRE); ring != NULL;
+      ring = ring->next)
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  return dropped;
+}
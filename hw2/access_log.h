@@ -0,0 +1,35 @@
+#ifndef __ACCESS_LOG__
+#define __ACCESS_LOG__
+
+#include <stddef.h>
+
+/* ACCESS_LOG writes one line per request answered, with its method, path,
+ * status code, body bytes and latency, without holding up the request:
+ * every serving thread appends records to a ring of its own (one producer,
+ * one consumer, no locks), and a background thread drains all the rings,
+ * formats the records and writes them out in batches. When a thread's ring
+ * is full the record is dropped and counted instead of waiting. */
+
+#define AL_RING_SIZE 1024         /* Records per thread; a power of two. */
+#define AL_PATH_SIZE 232          /* Longer paths are cut short. */
+
+/* Starts logging to the file at PATH ("-" for standard output), appending.
+ * Returns -1 if it cannot be opened. Until then al_log does nothing. */
+int al_init(const char *path);
+
+/* Logs a request for PATH with METHOD, answered with STATUS_CODE and BYTES
+ * of body, LATENCY_NS nanoseconds after it was read. */
+void al_log(const char *method, const char *path, int status_code,
+    size_t bytes, long long latency_ns);
+
+/* Leaves the calling thread's ring to the next thread that logs, for a
+ * thread about to exit. Records still in it are written all the same. */
+void al_unregister(void);
+
+/* Whether al_init has been called. */
+int al_enabled(void);
+
+/* Records dropped so far because a ring was full. */
+unsigned long al_dropped(void);
+
+#endif
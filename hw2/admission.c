@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "admission.h"
+
+#define AD_TARGET_NS (AD_CODEL_TARGET_MS * 1000000LL)
+#define AD_INTERVAL_NS (AD_CODEL_INTERVAL_MS * 1000000LL)
+
+typedef struct ad_queue {
+  wq_t *wq;
+  unsigned long admitted;
+  unsigned long shed_full;
+  unsigned long shed_oldest;
+  unsigned long shed_waited;
+
+  /* CoDel's state, shared by the queue's workers. */
+  pthread_mutex_t lock;
+  long long first_above_ns;   /* When waits will have been long for an interval. */
+  long long drop_next_ns;
+  unsigned int count;         /* Shed since dropping started. */
+  unsigned int last_count;
+  int dropping;
+} __attribute__((aligned(64))) ad_queue_t;
+
+static ad_queue_t *ad_queues;
+static int ad_num_queues;
+static enum ad_policy ad_policy;
+static unsigned long ad_limit;
+static void (*ad_shed)(int fd);
+
+static const char *ad_policy_names[] = { "block", "reject", "drop-oldest", "codel" };
+
+static long long ad_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void ad_count(unsigned long *counter) {
+  __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+void ad_init(wq_t *queues, int num_queues, enum ad_policy policy,
+    unsigned long limit, void (*shed)(int fd)) {
+  if (posix_memalign((void **) &ad_queues, 64, sizeof(ad_queue_t) * num_queues)) {
+    perror("Failed to allocate admission control");
+    exit(ENOMEM);
+  }
+  for (int i = 0; i < num_queues; i++) {
+    ad_queues[i].wq = &queues[i];
+    ad_queues[i].admitted = 0;
+    ad_queues[i].shed_full = 0;
+    ad_queues[i].shed_oldest = 0;
+    ad_queues[i].shed_waited = 0;
+    pthread_mutex_init(&ad_queues[i].lock, NULL);
+    ad_queues[i].first_above_ns = 0;
+    ad_queues[i].drop_next_ns = 0;
+    ad_queues[i].count = 0;
+    ad_queues[i].last_count = 0;
+    ad_queues[i].dropping = 0;
+    if (policy == AD_CODEL) wq_set_timed(&queues[i]);
+  }
+  ad_num_queues = num_queues;
+  ad_policy = policy;
+  ad_limit = limit;
+  ad_shed = shed;
+}
+
+int ad_admit(int queue, int fd) {
+  ad_queue_t *q = &ad_queues[queue];
+  int oldest;
+
+  if (ad_policy == AD_BLOCK || wq_size(q->wq) < ad_limit) {
+    ad_count(&q->admitted);
+    return 1;
+  }
+  if (ad_policy == AD_DROP_OLDEST && wq_try_pop(q->wq, &oldest)) {
+    if (oldest >= 0) {
+      ad_shed(oldest);
+      ad_count(&q->shed_oldest);
+      ad_count(&q->admitted);
+      return 1;
+    }
+    /* Meant for a worker, not a connection: it goes back, the new one goes. */
+    wq_push(q->wq, oldest);
+  }
+  ad_shed(fd);
+  ad_count(&q->shed_full);
+  return 0;
+}
+
+static long long ad_control_law(long long t, unsigned int count) {
+  return t + (long long) (AD_INTERVAL_NS / sqrt(count));
+}
+
+/* Decides whether a connection that waited WAITED_NS, popped at NOW_NS,
+ * is to be shed; RFC 8289's dequeue, one connection at a time. */
+static int ad_codel_sheds(ad_queue_t *q, long long waited_ns, long long now_ns) {
+  int ok_to_drop = 0, drop = 0;
+  unsigned int delta;
+
+  pthread_mutex_lock(&q->lock);
+  if (waited_ns < AD_TARGET_NS || wq_size(q->wq) == 0) {
+    q->first_above_ns = 0;
+  } else if (q->first_above_ns == 0) {
+    q->first_above_ns = now_ns + AD_INTERVAL_NS;
+  } else if (now_ns >= q->first_above_ns) {
+    ok_to_drop = 1;
+  }
+
+  if (q->dropping) {
+    if (!ok_to_drop) {
+      q->dropping = 0;
+    } else if (now_ns >= q->drop_next_ns) {
+      drop = 1;
+      q->count++;
+      q->drop_next_ns = ad_control_law(q->drop_next_ns, q->count);
+    }
+  } else if (ok_to_drop) {
+    /* Start again near the last rate if dropping stopped only recently. */
+    drop = 1;
+    q->dropping = 1;
+    delta = q->count - q->last_count;
+    q->count = delta > 1 && now_ns - q->drop_next_ns < 16 * AD_INTERVAL_NS ? delta : 1;
+    q->drop_next_ns = ad_control_law(now_ns, q->count);
+    q->last_count = q->count;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return drop;
+}
+
+int ad_pop(int queue) {
+  ad_queue_t *q = &ad_queues[queue];
+  long long pushed_ns, now_ns;
+  int fd;
+
+  if (ad_policy != AD_CODEL) return wq_pop(q->wq);
+  while (1) {
+    fd = wq_pop_timed(q->wq, &pushed_ns);
+    if (fd < 0) return fd;
+    now_ns = ad_now_ns();
+    if (!ad_codel_sheds(q, now_ns - pushed_ns, now_ns)) return fd;
+    ad_shed(fd);
+    ad_count(&q->shed_waited);
+  }
+}
+
+void ad_report(FILE *out) {
+  fprintf(out, "# HELP httpserver_admitted_total New connections let into each "
+      "work queue.\n"
+      "# TYPE httpserver_admitted_total counter\n");
+  for (int i = 0; i < ad_num_queues; i++)
+    fprintf(out, "httpserver_admitted_total{queue=\"listener%d\"} %lu\n", i,
+        __atomic_load_n(&ad_queues[i].admitted, __ATOMIC_RELAXED));
+  fprintf(out, "# HELP httpserver_shed_total Connections answered 503 under "
+      "overload, by reason: queue full, oldest in a full queue, or waited too long.\n"
+      "# TYPE httpserver_shed_total counter\n");
+  for (int i = 0; i < ad_num_queues; i++) {
+    fprintf(out, "httpserver_shed_total{queue=\"listener%d\",policy=\"%s\",reason=\"full\"} %lu\n",
+        i, ad_policy_names[ad_policy],
+        __atomic_load_n(&ad_queues[i].shed_full, __ATOMIC_RELAXED));
+    fprintf(out, "httpserver_shed_total{queue=\"listener%d\",policy=\"%s\",reason=\"oldest\"} %lu\n",
+        i, ad_policy_names[ad_policy],
+        __atomic_load_n(&ad_queues[i].shed_oldest, __ATOMIC_RELAXED));
+    fprintf(out, "httpserver_shed_total{queue=\"listener%d\",policy=\"%s\",reason=\"waited\"} %lu\n",
+        i, ad_policy_names[ad_policy],
+        __atomic_load_n(&ad_queues[i].shed_waited, __ATOMIC_RELAXED));
+  }
+  if (ad_policy == AD_CODEL) {
+    fprintf(out, "# HELP httpserver_codel_dropping Whether each queue is shedding "
+        "connections that waited too long.\n"
+        "# TYPE httpserver_codel_dropping gauge\n");
+    for (int i = 0; i < ad_num_queues; i++)
+      fprintf(out, "httpserver_codel_dropping{queue=\"listener%d\"} %d\n", i,
+          __atomic_load_n(&ad_queues[i].dropping, __ATOMIC_RELAXED));
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef __ADMISSION__
+#define __ADMISSION__
+
+#include <stdio.h>
+
+#include "wq.h"
+
+/* ADMISSION decides what happens to connections when the workers of a
+ * listener's work queue fall behind, so an overload sheds some clients
+ * quickly instead of making every client wait until it times out. Shed
+ * connections are handed to the SHED callback, which answers them with a
+ * 503 and closes them.
+ *
+ *   AD_BLOCK        the acceptor waits for room in the queue (WQ_CAPACITY),
+ *                   leaving new connections in the listen backlog
+ *   AD_REJECT       a connection arriving at a queue holding LIMIT is shed
+ *   AD_DROP_OLDEST  the oldest connection in a queue holding LIMIT is shed
+ *                   to make room for the new one: of the two, it is the one
+ *                   whose client is most likely to have given up
+ *   AD_CODEL        workers shed the connections they pop once those have
+ *                   waited over AD_CODEL_TARGET_MS for a whole
+ *                   AD_CODEL_INTERVAL_MS, and then ever more often (the
+ *                   interval over the square root of the number shed) until
+ *                   one has waited less; as CoDel does with packets. A queue
+ *                   holding LIMIT sheds new arrivals as with AD_REJECT.
+ *
+ * Only new connections are held to LIMIT: keep-alive connections coming
+ * back to a queue belong to clients already being served (CoDel may still
+ * shed them). */
+
+#define AD_DEFAULT_LIMIT 1024
+#define AD_CODEL_TARGET_MS 5
+#define AD_CODEL_INTERVAL_MS 100
+
+enum ad_policy { AD_BLOCK, AD_REJECT, AD_DROP_OLDEST, AD_CODEL };
+
+/* Applies POLICY to the NUM_QUEUES QUEUES, holding up to LIMIT connections
+ * each. Call before any connection is pushed. */
+void ad_init(wq_t *queues, int num_queues, enum ad_policy policy,
+    unsigned long limit, void (*shed)(int fd));
+
+/* Called by queue QUEUE's acceptor for each new connection FD. Returns 1 if
+ * FD should be pushed; otherwise it was shed. May shed the oldest queued
+ * connection instead. */
+int ad_admit(int queue, int fd);
+
+/* Pops the next connection for a worker of queue QUEUE, as wq_pop, shedding
+ * the ones that waited too long first. */
+int ad_pop(int queue);
+
+/* Prints the connections admitted and shed by each queue, by reason, in the
+ * Prometheus text format. */
+void ad_report(FILE *out);
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define AR_ALIGN(size) (((size) + 15) & ~(size_t) 15)
+
+static ar_block_t *ar_block_new(size_t size) {
+  ar_block_t *block;
+
+  if (posix_memalign((void **) &block, 16, sizeof(ar_block_t) + size)) return NULL;
+  block->next = NULL;
+  block->size = size;
+  return block;
+}
+
+void ar_init(arena_t *arena, size_t block_size) {
+  memset(arena, 0, sizeof(*arena));
+  arena->block_size = block_size;
+}
+
+void *ar_alloc(arena_t *arena, size_t size) {
+  ar_block_t *block;
+
+  size = AR_ALIGN(size);
+  if (size > arena->block_size) {
+    if ((block = ar_block_new(size)) == NULL) return NULL;
+    block->next = arena->large;
+    arena->large = block;
+    arena->last = NULL;
+    return block->data;
+  }
+
+  if (arena->current == NULL || arena->used + size > arena->current->size) {
+    /* On to the next kept block, or a new one at the end. */
+    block = arena->current != NULL ? arena->current->next : arena->first;
+    if (block == NULL) {
+      if ((block = ar_block_new(arena->block_size)) == NULL) return NULL;
+      if (arena->current != NULL)
+        arena->current->next = block;
+      else
+        arena->first = block;
+    }
+    arena->current = block;
+    arena->used = 0;
+  }
+  arena->last = arena->current->data + arena->used;
+  arena->used += size;
+  return arena->last;
+}
+
+void *ar_grow(arena_t *arena, void *pointer, size_t old_size, size_t size) {
+  void *grown;
+
+  if (pointer != NULL && pointer == arena->last &&
+      (char *) pointer + AR_ALIGN(size) <= arena->current->data + arena->current->size) {
+    arena->used = (char *) pointer - arena->current->data + AR_ALIGN(size);
+    return pointer;
+  }
+  if ((grown = ar_alloc(arena, size)) == NULL) return NULL;
+  if (pointer != NULL) memcpy(grown, pointer, old_size);
+  return grown;
+}
+
+void ar_reset(arena_t *arena) {
+  ar_block_t *block;
+
+  while ((block = arena->large) != NULL) {
+    arena->large = block->next;
+    free(block);
+  }
+  arena->current = arena->first;
+  arena->used = 0;
+  arena->last = NULL;
+}
+
+void ar_destroy(arena_t *arena) {
+  ar_block_t *block;
+
+  ar_reset(arena);
+  while ((block = arena->first) != NULL) {
+    arena->first = block->next;
+    free(block);
+  }
+  arena->current = NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <stddef.h>
+
+/* ARENA is a bump allocator for memory that lives as long as one response:
+ * allocations are carved one after another out of blocks, nothing is freed
+ * on its own, and ar_reset takes everything back at once by rewinding to
+ * the first block. The blocks stay for the next response, so once an arena
+ * has grown to what its responses need, serving them allocates nothing.
+ * An allocation larger than a block gets a block of its own, which is
+ * given back to malloc on reset rather than kept. */
+
+#define AR_BLOCK_SIZE (16 << 10)  /* Default size of a kept block. */
+
+typedef struct ar_block {
+  struct ar_block *next;
+  size_t size;
+  char data[] __attribute__((aligned(16)));
+} ar_block_t;
+
+typedef struct arena {
+  size_t block_size;
+  ar_block_t *first;          /* Kept blocks, in the order they are used. */
+  ar_block_t *current;
+  size_t used;                /* Bytes taken from the current block. */
+  ar_block_t *large;          /* Own blocks of large allocations. */
+  void *last;                 /* The last allocation, which may grow in place. */
+} arena_t;
+
+/* Sets up an empty ARENA. Its first block is allocated when first needed. */
+void ar_init(arena_t *arena, size_t block_size);
+
+/* Returns SIZE bytes aligned to 16, or NULL if malloc fails. */
+void *ar_alloc(arena_t *arena, size_t size);
+
+/* Grows POINTER, an allocation of OLD_SIZE bytes, to SIZE: in place if it
+ * was the last allocation and there is room behind it, by copying otherwise.
+ * Returns NULL if malloc fails, leaving POINTER as it was. */
+void *ar_grow(arena_t *arena, void *pointer, size_t old_size, size_t size);
+
+/* Takes back everything allocated since the last reset. */
+void ar_reset(arena_t *arena);
+
+/* Returns every block to malloc. */
+void ar_destroy(arena_t *arena);
+
+#endif
@@ -0,0 +1,132 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "autoscale.h"
+
+typedef struct as_queue {
+  wq_t *wq;
+  int workers;                /* Counting those told to exit already. */
+  unsigned long popped;       /* At the last sample. */
+  unsigned long long wait_us; /* The last estimate. */
+  long long idle_since_ms;    /* 0 unless idle at the last sample. */
+} as_queue_t;
+
+/* Written by the sizing thread only; read by as_report. */
+static as_queue_t *as_queues;
+static int as_num_queues;
+static int as_workers;
+static unsigned long as_added;
+static unsigned long as_removed;
+
+static long long as_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static void as_set(int *field, int value) {
+  __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
+
+static void as_sample(as_queue_t *queue, as_config_t *config, long long now) {
+  unsigned long depth = wq_size(queue->wq);
+  unsigned long popped = wq_popped(queue->wq);
+  unsigned long departures = popped - queue->popped;
+  unsigned long long wait_us;
+  int add, started;
+
+  queue->popped = popped;
+  if (depth == 0)
+    wait_us = 0;
+  else if (departures == 0)
+    wait_us = AS_INTERVAL_MS * 1000ULL;
+  else
+    wait_us = depth * AS_INTERVAL_MS * 1000ULL / departures;
+  __atomic_store_n(&queue->wait_us, wait_us, __ATOMIC_RELAXED);
+
+  if (wait_us > AS_TARGET_WAIT_MS * 1000ULL &&
+      wq_sleeping_consumers(queue->wq) == 0 && as_workers < config->max_workers) {
+    add = queue->workers / 2 > 1 ? queue->workers / 2 : 1;
+    if (add > config->max_workers - as_workers) add = config->max_workers - as_workers;
+    if ((unsigned long) add > depth) add = depth;
+    /* Only count the workers that started, so the sizes stay true when
+     * the slots of retiring workers have not freed up yet. */
+    for (started = 0; started < add; started++)
+      if (config->add_worker(queue - as_queues) == -1) break;
+    add = started;
+    as_set(&queue->workers, queue->workers + add);
+    as_set(&as_workers, as_workers + add);
+    __atomic_store_n(&as_added, as_added + add, __ATOMIC_RELAXED);
+    queue->idle_since_ms = 0;
+  } else if (depth == 0 && wq_sleeping_consumers(queue->wq) > 0) {
+    if (queue->idle_since_ms == 0) {
+      queue->idle_since_ms = now;
+    } else if (now - queue->idle_since_ms >= AS_IDLE_MS && queue->workers > 1 &&
+        as_workers > config->min_workers) {
+      config->remove_worker(queue - as_queues);
+      as_set(&queue->workers, queue->workers - 1);
+      as_set(&as_workers, as_workers - 1);
+      __atomic_store_n(&as_removed, as_removed + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    queue->idle_since_ms = 0;
+  }
+}
+
+static void *as_routine(void *aux) {
+  as_config_t *config = aux;
+  struct timespec interval = { 0, AS_INTERVAL_MS * 1000000L };
+
+  while (1) {
+    nanosleep(&interval, NULL);
+    for (int i = 0; i < as_num_queues; i++)
+      as_sample(&as_queues[i], config, as_now_ms());
+  }
+  return NULL;
+}
+
+void as_init(wq_t *queues, int num_queues, int *workers, as_config_t *config) {
+  pthread_t thread;
+
+  as_queues = calloc(num_queues, sizeof(as_queue_t));
+  if (as_queues == NULL) {
+    perror("Failed to allocate the pool sizer");
+    exit(ENOMEM);
+  }
+  for (int i = 0; i < num_queues; i++) {
+    as_queues[i].wq = &queues[i];
+    as_queues[i].workers = workers[i];
+    as_queues[i].popped = wq_popped(&queues[i]);
+    as_workers += workers[i];
+  }
+  as_num_queues = num_queues;
+  if (pthread_create(&thread, NULL, as_routine, config) != 0) {
+    perror("Failed to start the pool sizer");
+    exit(errno);
+  }
+  pthread_detach(thread);
+}
+
+void as_report(FILE *out) {
+  fprintf(out, "# HELP httpserver_pool_workers Workers serving each queue.\n"
+      "# TYPE httpserver_pool_workers gauge\n");
+  for (int i = 0; i < as_num_queues; i++)
+    fprintf(out, "httpserver_pool_workers{queue=\"listener%d\"} %d\n", i,
+        __atomic_load_n(&as_queues[i].workers, __ATOMIC_RELAXED));
+  fprintf(out, "# HELP httpserver_queue_wait_seconds Estimated wait of the "
+      "connections queued at the last sample.\n"
+      "# TYPE httpserver_queue_wait_seconds gauge\n");
+  for (int i = 0; i < as_num_queues; i++)
+    fprintf(out, "httpserver_queue_wait_seconds{queue=\"listener%d\"} %.6f\n", i,
+        __atomic_load_n(&as_queues[i].wait_us, __ATOMIC_RELAXED) / 1e6);
+  fprintf(out, "# HELP httpserver_pool_scaling_total Workers added to and "
+      "removed from the pool.\n"
+      "# TYPE httpserver_pool_scaling_total counter\n"
+      "httpserver_pool_scaling_total{direction=\"up\"} %lu\n"
+      "httpserver_pool_scaling_total{direction=\"down\"} %lu\n",
+      __atomic_load_n(&as_added, __ATOMIC_RELAXED),
+      __atomic_load_n(&as_removed, __ATOMIC_RELAXED));
+}
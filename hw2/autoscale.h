@@ -0,0 +1,41 @@
+#ifndef __AUTOSCALE__
+#define __AUTOSCALE__
+
+#include <stdio.h>
+
+#include "wq.h"
+
+/* AUTOSCALE sizes the worker pool of each work queue from how the queue
+ * fares. Every AS_INTERVAL_MS a thread samples each queue's depth and how
+ * many connections were popped since the last look, and estimates how long
+ * the connections queued now will wait: the depth over the pop rate
+ * (Little's law), or the whole interval if nothing was popped at all.
+ *
+ * A queue whose wait is over AS_TARGET_WAIT_MS while none of its workers
+ * sleeps gets more: half as many again as it has, but no more than are
+ * queued. A queue that has had sleeping workers and nothing queued for
+ * AS_IDLE_MS gives one back per interval. The pool as a whole stays
+ * between MIN and MAX workers, and every queue keeps at least one. */
+
+#define AS_INTERVAL_MS 100
+#define AS_TARGET_WAIT_MS 5
+#define AS_IDLE_MS 2000
+
+typedef struct as_config {
+  int min_workers;
+  int max_workers;
+  /* Start a worker on queue QUEUE, or have one of its workers exit.
+   * ADD_WORKER returns -1 if it could not start one. */
+  int (*add_worker)(int queue);
+  void (*remove_worker)(int queue);
+} as_config_t;
+
+/* Starts watching NUM_QUEUES QUEUES, served by WORKERS[i] workers each to
+ * begin with. */
+void as_init(wq_t *queues, int num_queues, int *workers, as_config_t *config);
+
+/* Prints the workers per queue, the last wait estimates and the number of
+ * times the pool grew and shrank, in the Prometheus text format. */
+void as_report(FILE *out);
+
+#endif
@@ -0,0 +1,128 @@
+#!/bin/bash
+#
+# Runs loadgen against httpserver serving a mix of file sizes, then against
+# httpserver proxying to loadgen's stand-in upstream, and prints throughput
+# and latency percentiles for each. Arguments are passed on to httpserver,
+# so that one configuration can be compared with another:
+#
+#   ./bench.sh
+#   ./bench.sh --event-loop
+#   ./bench.sh --num-threads 8 --scheduler steal
+#   ./bench.sh --io-uring
+#
+# Serving files, it also reports the server's system calls per request:
+# counted by strace, when installed, over a separate run (tracing slows the
+# server down), and with --io-uring, the io_uring_enter calls the server
+# counts itself on /__stats.
+#
+# DURATION, CONNECTIONS, RATE (for the open loop run) and PORT can be set
+# in the environment.
+
+set -e
+cd "$(dirname "$0")"
+make -s all loadgen
+
+DURATION=${DURATION:-10}
+CONNECTIONS=${CONNECTIONS:-64}
+RATE=${RATE:-5000}
+PORT=${PORT:-8090}
+UPSTREAM_PORT=$((PORT + 1))
+MIX=/small.html:70,/medium.bin:25,/large.bin:5
+
+root=$(mktemp -d)
+server=
+upstream=
+cleanup() {
+  [ -n "$server" ] && kill "$server" 2>/dev/null
+  [ -n "$upstream" ] && kill "$upstream" 2>/dev/null
+  rm -rf "$root"
+}
+trap cleanup EXIT INT TERM
+
+head -c 1024 /dev/urandom | base64 > "$root/small.html"
+head -c 65536 /dev/urandom > "$root/medium.bin"
+head -c 1048576 /dev/urandom > "$root/large.bin"
+
+# Waits until something accepts connections on port $1.
+wait_for() {
+  for i in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/"$1") 2>/dev/null && return 0
+    sleep 0.1
+  done
+  echo "Nothing listening on port $1" >&2
+  exit 1
+}
+
+# Waits until nothing accepts connections on port $1. io_uring lets go of
+# the server's socket a little after the server exits.
+wait_closed() {
+  for i in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/"$1") 2>/dev/null || return 0
+    sleep 0.1
+  done
+}
+
+run() {
+  echo
+  ./loadgen --duration "$DURATION" --connections "$CONNECTIONS" "$@"
+}
+
+# Prints the sum of the server's counters named $1 on /__stats.
+stat_value() {
+  curl -s "localhost:$PORT/__stats" |
+    awk -v name="$1" 'index($1, name) == 1 { sum += $2 } END { print sum + 0 }'
+}
+
+# Runs loadgen with strace counting the server's system calls, and prints
+# them per request.
+trace_run() {
+  command -v strace > /dev/null || {
+    echo
+    echo "syscalls/request: install strace to count them"
+    return
+  }
+  strace -c -f -p "$server" -o "$root/strace" 2> /dev/null &
+  tracer=$!
+  sleep 1
+  ./loadgen --duration 2 --connections "$CONNECTIONS" "$@" > "$root/traced"
+  kill -INT "$tracer"
+  wait "$tracer" 2>/dev/null || true
+  echo
+  awk '$1 == "requests" { requests = $2 }
+      FNR != NR && $NF == "total" { calls = $4 }
+      END { if (requests > 0) printf "syscalls/request %.2f (strace, %d requests)\n", calls / requests, requests }' \
+    "$root/traced" "$root/strace"
+}
+
+echo "== files: $MIX $*"
+./httpserver --files "$root" --port "$PORT" "$@" > /dev/null &
+server=$!
+wait_for "$PORT"
+requests=$(stat_value httpserver_requests_total)
+enters=$(stat_value httpserver_uring_enters_total)
+submissions=$(stat_value httpserver_uring_submissions_total)
+run --mix "$MIX" "localhost:$PORT"
+requests=$(($(stat_value httpserver_requests_total) - requests))
+enters=$(($(stat_value httpserver_uring_enters_total) - enters))
+submissions=$(($(stat_value httpserver_uring_submissions_total) - submissions))
+if [ "$enters" -gt 0 ]; then
+  awk -v r="$requests" -v e="$enters" -v s="$submissions" 'BEGIN {
+    printf "io_uring     %.2f io_uring_enter/request, %.1f operations/enter\n", e / r, s / e }'
+fi
+trace_run --mix "$MIX" "localhost:$PORT"
+run --mix "$MIX" --rate "$RATE" "localhost:$PORT"
+run --mix /small.html --no-keepalive "localhost:$PORT"
+kill "$server"
+wait "$server" 2>/dev/null || true
+wait_closed "$PORT"
+
+echo
+echo "== proxy: 1 KiB responses from a local upstream $*"
+./loadgen --upstream "$UPSTREAM_PORT" --body-size 1024 > /dev/null &
+upstream=$!
+./httpserver --proxy "localhost:$UPSTREAM_PORT" --port "$PORT" "$@" > /dev/null &
+server=$!
+wait_for "$UPSTREAM_PORT"
+wait_for "$PORT"
+run "localhost:$PORT"
+run --rate "$RATE" "localhost:$PORT"
@@ -0,0 +1,69 @@
+#include "deque.h"
+
+void dq_init(dq_t *dq) {
+  dq->top = 0;
+  dq->bottom = 0;
+}
+
+int dq_push(dq_t *dq, int client_socket_fd) {
+  long bottom = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+
+  if (bottom - top >= DQ_CAPACITY) return 0;
+  __atomic_store_n(&dq->items[bottom & (DQ_CAPACITY - 1)], client_socket_fd,
+      __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&dq->bottom, bottom + 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+int dq_pop(dq_t *dq, int *client_socket_fd) {
+  long bottom = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+  long top;
+  int taken = 1;
+
+  /* Claim the bottom item before looking at top, so that a thief either
+   * sees the claim or is seen here. */
+  __atomic_store_n(&dq->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  top = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+  if (top > bottom) {
+    /* Empty. */
+    __atomic_store_n(&dq->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  *client_socket_fd = __atomic_load_n(&dq->items[bottom & (DQ_CAPACITY - 1)],
+      __ATOMIC_RELAXED);
+  if (top == bottom) {
+    /* The last item: race the thieves for it. */
+    taken = __atomic_compare_exchange_n(&dq->top, &top, top + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&dq->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return taken;
+}
+
+int dq_steal(dq_t *dq, int *client_socket_fd) {
+  long top = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+  long bottom;
+  int item;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bottom = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) return 0;
+
+  item = __atomic_load_n(&dq->items[top & (DQ_CAPACITY - 1)], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&dq->top, &top, top + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return 0;
+  *client_socket_fd = item;
+  return 1;
+}
+
+long dq_size(dq_t *dq) {
+  long size = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) -
+      __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+  return size > 0 ? size : 0;
+}
@@ -0,0 +1,34 @@
+#ifndef __DEQUE__
+#define __DEQUE__
+
+/* DEQUE is a Chase-Lev work-stealing deque of client sockets. Its owner
+ * pushes and pops at the bottom without contention, while any other thread
+ * may steal from the top; only the last item is ever contended, and then a
+ * single compare-and-swap on top decides who gets it. The memory orderings
+ * follow Le, Pop, Cohen and Zappa Nardelli, "Correct and Efficient
+ * Work-Stealing for Weak Memory Models" (PPoPP 2013). */
+
+#define DQ_CAPACITY 1024 /* Must be a power of two. */
+
+typedef struct dq {
+  long top __attribute__((aligned(64)));    /* Next to steal. */
+  long bottom __attribute__((aligned(64))); /* Next free slot, owner only. */
+  int items[DQ_CAPACITY] __attribute__((aligned(64)));
+} dq_t;
+
+void dq_init(dq_t *dq);
+
+/* Owner only. Returns 0 if the deque is full. */
+int dq_push(dq_t *dq, int client_socket_fd);
+
+/* Owner only: takes the most recently pushed item. Returns 0 if empty. */
+int dq_pop(dq_t *dq, int *client_socket_fd);
+
+/* Any thread: takes the oldest item. Returns 0 if the deque is empty or
+ * another thread took the item first. */
+int dq_steal(dq_t *dq, int *client_socket_fd);
+
+/* A snapshot of the number of items, exact only for the owner. */
+long dq_size(dq_t *dq);
+
+#endif
@@ -0,0 +1,223 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dir_listing.h"
+
+/* A growing output buffer. Once an allocation fails, appends are dropped and
+ * dl_finish returns NULL. */
+typedef struct dl_buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+  int failed;
+} dl_buffer_t;
+
+static void dl_append(dl_buffer_t *buffer, const char *data, size_t n) {
+  if (buffer->failed) return;
+  if (buffer->length + n > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->length + n) capacity *= 2;
+    char *grown = realloc(buffer->data, capacity);
+    if (grown == NULL) {
+      buffer->failed = 1;
+      return;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->length, data, n);
+  buffer->length += n;
+}
+
+static void dl_append_string(dl_buffer_t *buffer, const char *string) {
+  dl_append(buffer, string, strlen(string));
+}
+
+static void dl_printf(dl_buffer_t *buffer, const char *format, ...) {
+  char line[256];
+  va_list arguments;
+  int n;
+
+  va_start(arguments, format);
+  n = vsnprintf(line, sizeof(line), format, arguments);
+  va_end(arguments);
+  if (n > 0) dl_append(buffer, line, (size_t) n < sizeof(line) ? n : sizeof(line) - 1);
+}
+
+/* Percent-encodes everything but unreserved characters, so that no name can
+ * end the attribute or pass for a scheme ("javascript:..."). */
+static void dl_append_url(dl_buffer_t *buffer, const char *name) {
+  static const char hex[] = "0123456789ABCDEF";
+  char escaped[3] = { '%' };
+
+  for (const unsigned char *c = (const unsigned char *) name; *c; c++) {
+    if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+        (*c >= '0' && *c <= '9') || *c == '-' || *c == '.' || *c == '_' ||
+        *c == '~') {
+      dl_append(buffer, (const char *) c, 1);
+    } else {
+      escaped[1] = hex[*c >> 4];
+      escaped[2] = hex[*c & 15];
+      dl_append(buffer, escaped, 3);
+    }
+  }
+}
+
+static void dl_append_html(dl_buffer_t *buffer, const char *text) {
+  for (; *text; text++) {
+    switch (*text) {
+      case '&': dl_append_string(buffer, "&amp;"); break;
+      case '<': dl_append_string(buffer, "&lt;"); break;
+      case '>': dl_append_string(buffer, "&gt;"); break;
+      case '"': dl_append_string(buffer, "&quot;"); break;
+      case '\'': dl_append_string(buffer, "&#39;"); break;
+      default: dl_append(buffer, text, 1);
+    }
+  }
+}
+
+static void dl_append_json(dl_buffer_t *buffer, const char *text) {
+  dl_append(buffer, "\"", 1);
+  for (const unsigned char *c = (const unsigned char *) text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      dl_append(buffer, "\\", 1);
+      dl_append(buffer, (const char *) c, 1);
+    } else if (*c < 0x20) {
+      dl_printf(buffer, "\\u%04x", *c);
+    } else {
+      dl_append(buffer, (const char *) c, 1);
+    }
+  }
+  dl_append(buffer, "\"", 1);
+}
+
+static char *dl_finish(dl_buffer_t *buffer, size_t *length) {
+  if (buffer->failed) {
+    free(buffer->data);
+    return NULL;
+  }
+  *length = buffer->length;
+  return buffer->data;
+}
+
+static int dl_compare(const void *a, const void *b) {
+  return strcmp(((const dl_entry_t *) a)->name, ((const dl_entry_t *) b)->name);
+}
+
+int dl_read(int directory_fd, dl_listing_t *listing) {
+  DIR *dir = directory_fd >= 0 ? fdopendir(directory_fd) : NULL;
+  struct dirent *dir_entry;
+  struct stat entry_stat;
+  size_t capacity = 0;
+
+  listing->entries = NULL;
+  listing->num_entries = 0;
+  if (dir == NULL) {
+    if (directory_fd >= 0) close(directory_fd);
+    return -1;
+  }
+
+  while ((dir_entry = readdir(dir)) != NULL) {
+    if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0)
+      continue;
+    if (listing->num_entries == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      dl_entry_t *grown = realloc(listing->entries, capacity * sizeof(dl_entry_t));
+      if (grown == NULL) goto fail;
+      listing->entries = grown;
+    }
+
+    dl_entry_t *entry = &listing->entries[listing->num_entries];
+    entry->name = strdup(dir_entry->d_name);
+    if (entry->name == NULL) goto fail;
+    listing->num_entries++;
+
+    /* Followed, so that a link to a directory is listed as one. */
+    if (fstatat(dirfd(dir), dir_entry->d_name, &entry_stat, 0) == 0) {
+      entry->type = S_ISDIR(entry_stat.st_mode) ? DL_DIRECTORY :
+          S_ISREG(entry_stat.st_mode) ? DL_FILE : DL_OTHER;
+      entry->size = entry_stat.st_size;
+      entry->mtime = entry_stat.st_mtime;
+    } else {
+      entry->type = DL_OTHER;
+      entry->size = 0;
+      entry->mtime = 0;
+    }
+  }
+  closedir(dir);
+
+  qsort(listing->entries, listing->num_entries, sizeof(dl_entry_t), dl_compare);
+  return 0;
+
+fail:
+  closedir(dir);
+  dl_free(listing);
+  errno = ENOMEM;
+  return -1;
+}
+
+void dl_free(dl_listing_t *listing) {
+  for (size_t i = 0; i < listing->num_entries; i++)
+    free(listing->entries[i].name);
+  free(listing->entries);
+  listing->entries = NULL;
+  listing->num_entries = 0;
+}
+
+char *dl_html(dl_listing_t *listing, const char *url_path, size_t *length) {
+  dl_buffer_t buffer = { 0 };
+
+  dl_append_string(&buffer, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\">"
+      "<title>Index of ");
+  dl_append_html(&buffer, url_path);
+  dl_append_string(&buffer, "</title></head>\n<body><h1>Index of ");
+  dl_append_html(&buffer, url_path);
+  dl_append_string(&buffer, "</h1><hr>\n");
+  if (strcmp(url_path, "/") != 0)
+    dl_append_string(&buffer, "<a href=\"../\">../</a>\n");
+
+  for (size_t i = 0; i < listing->num_entries; i++) {
+    dl_entry_t *entry = &listing->entries[i];
+    const char *slash = entry->type == DL_DIRECTORY ? "/" : "";
+
+    dl_append_string(&buffer, "<a href=\"");
+    dl_append_url(&buffer, entry->name);
+    dl_append_string(&buffer, slash);
+    dl_append_string(&buffer, "\">");
+    dl_append_html(&buffer, entry->name);
+    dl_append_string(&buffer, slash);
+    dl_append_string(&buffer, "</a>\n");
+  }
+  dl_append_string(&buffer, "<hr></body></html>\n");
+  return dl_finish(&buffer, length);
+}
+
+char *dl_json(dl_listing_t *listing, const char *url_path, size_t offset,
+    size_t limit, size_t *length) {
+  static const char *types[] = { "file", "directory", "other" };
+  dl_buffer_t buffer = { 0 };
+  size_t end = offset < listing->num_entries && limit < listing->num_entries - offset ?
+      offset + limit : listing->num_entries;
+
+  dl_append_string(&buffer, "{\"path\":");
+  dl_append_json(&buffer, url_path);
+  dl_printf(&buffer, ",\"total\":%zu,\"offset\":%zu,\"entries\":[",
+      listing->num_entries, offset);
+  for (size_t i = offset; i < end; i++) {
+    dl_entry_t *entry = &listing->entries[i];
+
+    dl_append_string(&buffer, i > offset ? ",{\"name\":" : "{\"name\":");
+    dl_append_json(&buffer, entry->name);
+    dl_printf(&buffer, ",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld}",
+        types[entry->type], (long long) entry->size, (long long) entry->mtime);
+  }
+  dl_append_string(&buffer, "]}\n");
+  return dl_finish(&buffer, length);
+}
@@ -0,0 +1,46 @@
+#ifndef __DIR_LISTING__
+#define __DIR_LISTING__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* DIR_LISTING renders the index of a directory that has no index.html, as
+ * HTML for browsers or as paginated JSON for scripts. A directory is read
+ * once per rendering, entries sorted by name; the caller caches the result
+ * until the directory changes. Names are escaped for where they land (URL,
+ * HTML text, JSON string), so any name a file system allows is safe. */
+
+enum dl_type {
+  DL_FILE,
+  DL_DIRECTORY,
+  DL_OTHER,
+};
+
+typedef struct dl_entry {
+  char *name;
+  enum dl_type type;
+  off_t size;
+  time_t mtime;
+} dl_entry_t;
+
+typedef struct dl_listing {
+  dl_entry_t *entries;
+  size_t num_entries;
+} dl_listing_t;
+
+/* Reads the directory open as DIRECTORY_FD (which it closes) into LISTING,
+ * without "." and "..", sorted by name. Returns -1 if it cannot be read,
+ * or DIRECTORY_FD is -1. */
+int dl_read(int directory_fd, dl_listing_t *listing);
+void dl_free(dl_listing_t *listing);
+
+/* Renders LISTING, the directory at URL_PATH (ending in "/"), into a new
+ * buffer of *LENGTH bytes. The JSON holds at most LIMIT entries from OFFSET,
+ * and the total, so that a client can page through a large directory.
+ * Returns NULL if out of memory. */
+char *dl_html(dl_listing_t *listing, const char *url_path, size_t *length);
+char *dl_json(dl_listing_t *listing, const char *url_path, size_t offset,
+    size_t limit, size_t *length);
+
+#endif
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "docroot.h"
+
+#define DR_OPEN_FLAGS (O_RDONLY | O_NONBLOCK | O_CLOEXEC)
+
+static int dr_openat2(int dir_fd, const char *relative, int flags) {
+  struct open_how how = {
+    .flags = flags,
+    .resolve = RESOLVE_BENEATH,
+  };
+  return syscall(SYS_openat2, dir_fd, relative, &how, sizeof(how));
+}
+
+int dr_init(docroot_t *root, const char *path, size_t capacity) {
+  int probe;
+
+  root->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root->fd == -1) return -1;
+  root->path = strdup(path);
+  probe = dr_openat2(root->fd, ".", DR_OPEN_FLAGS);
+  root->beneath = probe >= 0 || errno != ENOSYS;
+  if (probe >= 0) close(probe);
+  /* Every file counts as one byte, so the budget is the number kept open. */
+  fc_init(&root->cache, capacity, 1);
+  return 0;
+}
+
+static int dr_hex(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+int dr_normalize(const char *path, char *relative, size_t size) {
+  char *read, *write;
+  size_t length = 0, segment;
+
+  if (strlen(path) >= size) return -1;
+
+  /* Decode first, so that "%2e%2e" is caught as ".." below. */
+  for (; *path != '\0'; path++) {
+    if (*path == '%' && dr_hex(path[1]) >= 0 && dr_hex(path[2]) >= 0) {
+      relative[length] = dr_hex(path[1]) << 4 | dr_hex(path[2]);
+      if (relative[length] == '\0') return -1;
+      path += 2;
+    } else {
+      relative[length] = *path;
+    }
+    length++;
+  }
+  relative[length] = '\0';
+
+  /* Then rebuild it in place, one segment at a time. */
+  read = write = relative;
+  while (*read != '\0') {
+    while (*read == '/') read++;
+    segment = strcspn(read, "/");
+    if (segment == 0 || (segment == 1 && read[0] == '.')) {
+      /* Nothing to keep. */
+    } else if (segment == 2 && read[0] == '.' && read[1] == '.') {
+      if (write == relative) return -1;
+      while (write > relative && write[-1] != '/') write--;
+      if (write > relative) write--;
+    } else {
+      if (write > relative) *write++ = '/';
+      memmove(write, read, segment);
+      write += segment;
+    }
+    read += segment;
+  }
+  *write = '\0';
+  return 0;
+}
+
+int dr_open(docroot_t *root, const char *relative, int flags) {
+  if (*relative == '\0') relative = ".";
+  if (root->beneath) return dr_openat2(root->fd, relative, flags);
+  return openat(root->fd, relative, flags);
+}
+
+static void dr_file_destroy(void *data) {
+  dr_file_t *file = data;
+  close(file->fd);
+  free(file);
+}
+
+/* Watches the directory RELATIVE is in, for the tag to cache it with. */
+static int dr_watch_parent(docroot_t *root, const char *relative) {
+  const char *slash = strrchr(relative, '/');
+  int length = slash != NULL ? slash - relative : 0;
+  char directory[strlen(root->path) + length + 2];
+
+  if (*relative == '\0') return fc_watch(root->path);
+  snprintf(directory, sizeof(directory), "%s/%.*s", root->path, length, relative);
+  return fc_watch(directory);
+}
+
+int dr_lookup(docroot_t *root, const char *relative, struct stat *stat) {
+  fc_entry_t *entry = fc_lookup(&root->cache, relative);
+  dr_file_t *file;
+  int fd, tag;
+  unsigned long generation;
+
+  if (entry != NULL) {
+    file = (dr_file_t *) entry->data;
+    fd = fcntl(file->fd, F_DUPFD_CLOEXEC, 0);
+    *stat = file->stat;
+    fc_release(entry);
+    return fd;
+  }
+
+  /* As for responses, the tag and generation come before the open. */
+  tag = dr_watch_parent(root, relative);
+  generation = fc_generation(&root->cache);
+  fd = dr_open(root, relative, DR_OPEN_FLAGS);
+  if (fd == -1) return -1;
+  if (fstat(fd, stat) == -1 || !(S_ISREG(stat->st_mode) || S_ISDIR(stat->st_mode))) {
+    close(fd);
+    errno = ENOENT;
+    return -1;
+  }
+  /* O_NONBLOCK only kept the open from waiting on a FIFO. Left on, it
+   * makes io_uring splices of uncached pages fail with EAGAIN. */
+  fcntl(fd, F_SETFL, 0);
+  if (tag == -1) return fd;
+
+  file = malloc(sizeof(dr_file_t));
+  if (file == NULL) return fd;
+  file->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  file->stat = *stat;
+  if (file->fd == -1) {
+    free(file);
+    return fd;
+  }
+  entry = fc_insert_object(&root->cache, relative, file, 1, dr_file_destroy,
+      tag, generation);
+  if (entry != NULL) fc_release(entry);
+  return fd;
+}
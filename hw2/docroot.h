@@ -0,0 +1,48 @@
+#ifndef __DOCROOT__
+#define __DOCROOT__
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "file_cache.h"
+
+/* DOCROOT resolves request paths to files under the served directory, which
+ * is opened once. Paths are decoded and normalized, then opened relative to
+ * the directory with openat2(RESOLVE_BENEATH), so that neither ".." nor a
+ * symbolic link can lead out of it; kernels without openat2 get openat, and
+ * only the ".." check. Files and directories found are kept open in a cache
+ * keyed by normalized path, so a hot path costs one dup rather than a walk
+ * of every component; entries are dropped when inotify reports a change in
+ * their directory (see fc_watch). */
+
+typedef struct docroot {
+  int fd;
+  char *path;
+  int beneath;                /* openat2 can be used. */
+  file_cache_t cache;         /* Normalized path -> dr_file_t. */
+} docroot_t;
+
+typedef struct dr_file {
+  int fd;
+  struct stat stat;
+} dr_file_t;
+
+/* Opens the directory PATH as ROOT, caching up to CAPACITY open files.
+ * Returns -1 if it cannot be opened. */
+int dr_init(docroot_t *root, const char *path, size_t capacity);
+
+/* Decodes the URL path PATH into RELATIVE (SIZE bytes, at least the length
+ * of PATH plus one): no leading or trailing "/", no empty, "." or ".."
+ * segments, and "" for the root itself. Returns -1 if PATH climbs above the
+ * root or decodes to a NUL. */
+int dr_normalize(const char *path, char *relative, size_t size);
+
+/* Opens RELATIVE (normalized) beneath ROOT with FLAGS. */
+int dr_open(docroot_t *root, const char *relative, int flags);
+
+/* Returns a new descriptor, opened read-only and non-blocking, for the
+ * regular file or directory RELATIVE (normalized), with its status in
+ * *STAT; or -1 with errno set (ENOENT for anything else there). */
+int dr_lookup(docroot_t *root, const char *relative, struct stat *stat);
+
+#endif
@@ -0,0 +1,103 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "encoding.h"
+
+#define ENC_GZIP_LEVEL 6
+
+int enc_accepted(const char *accept_encoding) {
+  const char *item = accept_encoding, *end, *parameters, *q;
+  int accepted = 0, refused = 0, any = 0, encoding;
+  size_t name_length;
+
+  if (accept_encoding == NULL) return 0;
+
+  while (*item != '\0') {
+    while (*item == ' ' || *item == '\t' || *item == ',') item++;
+    if (*item == '\0') break;
+    end = strchr(item, ',');
+    if (end == NULL) end = item + strlen(item);
+    parameters = memchr(item, ';', end - item);
+    name_length = (parameters ? parameters : end) - item;
+    while (name_length > 0 &&
+        (item[name_length - 1] == ' ' || item[name_length - 1] == '\t'))
+      name_length--;
+
+    encoding = 0;
+    if (name_length == 4 && strncasecmp(item, "gzip", 4) == 0)
+      encoding = ENC_GZIP;
+    else if (name_length == 2 && strncasecmp(item, "br", 2) == 0)
+      encoding = ENC_BR;
+    else if (name_length == 1 && *item == '*')
+      encoding = -1;
+
+    /* Only "q=0" (or 0.0, 0.00...) refuses a coding. */
+    q = parameters ? strcasestr(parameters, "q=") : NULL;
+    if (q != NULL && q < end && strtod(q + 2, NULL) <= 0) {
+      if (encoding > 0) refused |= encoding;
+      else if (encoding < 0) any = -1;
+    } else if (encoding > 0) {
+      accepted |= encoding;
+    } else if (encoding < 0 && any == 0) {
+      any = 1;
+    }
+    item = end;
+  }
+
+  /* "*" stands for every coding not listed on its own. */
+  if (any > 0) accepted |= (ENC_GZIP | ENC_BR) & ~refused;
+  return accepted & ~refused;
+}
+
+int enc_compressible(const char *content_type) {
+  return strncmp(content_type, "text/", 5) == 0 ||
+      strcmp(content_type, "application/javascript") == 0 ||
+      strcmp(content_type, "application/json") == 0 ||
+      strcmp(content_type, "image/svg+xml") == 0;
+}
+
+const char *enc_name(int encoding) {
+  return encoding == ENC_BR ? "br" : "gzip";
+}
+
+const char *enc_suffix(int encoding) {
+  return encoding == ENC_BR ? ".br" : ".gz";
+}
+
+int enc_gzip(const char *data, size_t length, char **output,
+    size_t *output_length) {
+  z_stream stream;
+  size_t bound;
+  char *buffer;
+
+  memset(&stream, 0, sizeof(stream));
+  /* 15 window bits, plus 16 for a gzip wrapper instead of zlib's. */
+  if (deflateInit2(&stream, ENC_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+  bound = deflateBound(&stream, length);
+  buffer = malloc(bound);
+  if (buffer == NULL) {
+    deflateEnd(&stream);
+    return -1;
+  }
+
+  stream.next_in = (Bytef *) data;
+  stream.avail_in = length;
+  stream.next_out = (Bytef *) buffer;
+  stream.avail_out = bound;
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END || stream.total_out >= length) {
+    deflateEnd(&stream);
+    free(buffer);
+    return -1;
+  }
+  deflateEnd(&stream);
+
+  *output = buffer;
+  *output_length = stream.total_out;
+  return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef __ENCODING__
+#define __ENCODING__
+
+#include <stddef.h>
+
+/* ENCODING negotiates the Content-Encoding of static files. Files can be
+ * served from precompressed siblings (index.html.br, index.html.gz) or
+ * gzipped on the fly; the caller keeps the results in a cache, so that
+ * each file is compressed once rather than for every request. */
+
+#define ENC_GZIP 1
+#define ENC_BR 2
+
+/* The codings an Accept-Encoding value allows (q > 0), as a mask. */
+int enc_accepted(const char *accept_encoding);
+
+/* Whether responses of CONTENT_TYPE get smaller when compressed. */
+int enc_compressible(const char *content_type);
+
+/* Content-Encoding name and file suffix of ENCODING. */
+const char *enc_name(int encoding);
+const char *enc_suffix(int encoding);
+
+/* Gzips LENGTH bytes of DATA into a new buffer of *OUTPUT_LENGTH bytes,
+ * returned in *OUTPUT. Returns -1 if compressing fails or does not make DATA
+ * smaller. */
+int enc_gzip(const char *data, size_t length, char **output,
+    size_t *output_length);
+
+#endif
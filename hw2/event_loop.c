@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "arena.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "relay.h"
+
+#define EL_MAX_EVENTS 256
+#define EL_ARENA_BLOCK_SIZE (8 << 10)  /* Room for an error page or two. */
+
+enum el_state {
+  EL_READ_REQUEST,   /* Waiting for the next request from the client. */
+  EL_WRITE_RESPONSE, /* Flushing the response head, body and file. */
+  EL_CONNECT,        /* Waiting for the connect to the upstream to finish. */
+  EL_RELAY,          /* Copying bytes between the client and the upstream. */
+};
+
+typedef struct el_conn {
+  int fd;
+  enum el_state state;
+  uint32_t events;            /* Events currently registered with epoll. */
+
+  /* Requests read from the client, including any pipelined ones. */
+  struct http_connection *connection;
+
+  /* The response headers. */
+  char *buffer;
+  size_t buffer_capacity;
+  size_t buffer_length;
+  size_t buffer_offset;
+
+  /* Response bytes still to send ahead of the file. */
+  struct iovec output[3];
+  struct iovec *output_iov;
+  int output_count;
+
+  struct http_response response;
+  arena_t arena;              /* What the response is built in. */
+  int file_part;              /* Where sending the file has got to. */
+  off_t file_position;
+  int keep_alive;
+  long long request_start_ns;
+
+  /* Idle list, in deadline order, while waiting for a request. */
+  long long idle_deadline;
+  int idle;
+  struct el_conn *idle_prev;
+  struct el_conn *idle_next;
+
+  struct el_conn *peer;       /* Other end of a relayed connection. */
+  up_pool_t *pool;            /* The upstream end's server, while counted. */
+  unsigned long long tried;   /* Servers the client end failed to reach. */
+  rl_direction_t relay;       /* Bytes read from this end for the peer. */
+  int unwatched;              /* Taken out of epoll while relaying. */
+  int bad_gateway;            /* Answer 502 once the request head is read. */
+  struct el_conn *next_closed;
+} el_conn_t;
+
+typedef struct el_reactor {
+  int index;
+  int epoll_fd;
+  int server_socket;
+  el_config_t *config;
+  el_conn_t *closed;          /* Freed once the current batch is handled. */
+  el_conn_t *idle_head;
+  el_conn_t *idle_tail;
+  pthread_t thread;
+} el_reactor_t;
+
+static void el_write_response(el_reactor_t *reactor, el_conn_t *conn);
+
+static long long el_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/* Starts CONN's idle timeout. Every connection waits for the same timeout,
+ * so appending keeps the list in deadline order. */
+static void el_idle_add(el_reactor_t *reactor, el_conn_t *conn) {
+  if (conn->idle || reactor->config->keepalive_timeout_ms <= 0) return;
+  conn->idle = 1;
+  conn->idle_deadline = el_now_ms() + reactor->config->keepalive_timeout_ms;
+  conn->idle_prev = reactor->idle_tail;
+  conn->idle_next = NULL;
+  if (reactor->idle_tail) reactor->idle_tail->idle_next = conn;
+  else reactor->idle_head = conn;
+  reactor->idle_tail = conn;
+}
+
+static void el_idle_remove(el_reactor_t *reactor, el_conn_t *conn) {
+  if (!conn->idle) return;
+  conn->idle = 0;
+  if (conn->idle_prev) conn->idle_prev->idle_next = conn->idle_next;
+  else reactor->idle_head = conn->idle_next;
+  if (conn->idle_next) conn->idle_next->idle_prev = conn->idle_prev;
+  else reactor->idle_tail = conn->idle_prev;
+}
+
+static void el_reserve(el_conn_t *conn, size_t capacity) {
+  if (conn->buffer_capacity >= capacity) return;
+  conn->buffer = realloc(conn->buffer, capacity);
+  if (!conn->buffer) {
+    perror("Failed to grow connection buffer");
+    exit(ENOMEM);
+  }
+  conn->buffer_capacity = capacity;
+}
+
+static void el_set_events(el_reactor_t *reactor, el_conn_t *conn,
+    uint32_t events) {
+  struct epoll_event event;
+
+  if (conn->events == events) return;
+  event.events = events;
+  event.data.ptr = conn;
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+  conn->events = events;
+}
+
+static el_conn_t *el_conn_new(el_reactor_t *reactor, int fd,
+    enum el_state state, uint32_t events) {
+  struct epoll_event event;
+  el_conn_t *conn = calloc(1, sizeof(el_conn_t));
+  if (!conn) {
+    close(fd);
+    return NULL;
+  }
+
+  conn->fd = fd;
+  conn->state = state;
+  conn->events = events;
+  conn->relay.pipe[0] = -1;
+  ar_init(&conn->arena, EL_ARENA_BLOCK_SIZE);
+  http_response_init(&conn->response, 0, NULL);
+  conn->response.arena = &conn->arena;
+
+  event.events = events;
+  event.data.ptr = conn;
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    close(fd);
+    free(conn);
+    return NULL;
+  }
+  return conn;
+}
+
+/* Closes CONN (and its relay peer). The memory stays valid until the end of
+ * the current batch, since later events in the batch may still point at it. */
+static void el_close(el_reactor_t *reactor, el_conn_t *conn) {
+  el_conn_t *peer = conn->peer;
+
+  if (conn->fd < 0) return;
+  close(conn->fd);
+  conn->fd = -1;
+  if (conn->pool) up_pool_leave(conn->pool);
+  el_idle_remove(reactor, conn);
+  http_response_free(&conn->response);
+  rl_direction_free(&conn->relay);
+  conn->next_closed = reactor->closed;
+  reactor->closed = conn;
+
+  if (peer != NULL) {
+    conn->peer = NULL;
+    peer->peer = NULL;
+    el_close(reactor, peer);
+  }
+}
+
+/* Turns CONN into the response decided for REQUEST. */
+static void el_dispatch(el_reactor_t *reactor, el_conn_t *conn,
+    struct http_request *request) {
+  struct http_response *response = &conn->response;
+  el_config_t *config = reactor->config;
+
+  conn->request_start_ns = mt_now_ns();
+  http_use_arena(&conn->arena);
+  if (conn->bad_gateway) {
+    char *message = "<center><h1>502 Bad Gateway</h1><hr></center>";
+    http_response_init(response, 502, "text/html");
+    http_response_append_body(response, message, strlen(message));
+    conn->keep_alive = 0;
+  } else {
+    config->files_handler(request, response);
+    conn->keep_alive = config->keepalive_timeout_ms > 0 && request->keep_alive &&
+        conn->connection->num_requests < config->keepalive_max_requests;
+  }
+  http_response_set_keep_alive(response, request, conn->keep_alive);
+
+  http_use_arena(NULL);
+
+  el_reserve(conn, LIBHTTP_HEAD_MAX_SIZE);
+  conn->output_iov = conn->output;
+  conn->output_count = http_response_prepare(response, conn->buffer,
+      LIBHTTP_HEAD_MAX_SIZE, conn->output);
+  conn->file_part = 0;
+  conn->file_position = 0;
+  conn->state = EL_WRITE_RESPONSE;
+
+  /* Most responses fit in the socket buffer, so try before asking epoll. */
+  el_write_response(reactor, conn);
+}
+
+/* Answers every complete request CONN has buffered, until one has to wait
+ * for the socket or the next one has not fully arrived. */
+static void el_serve_requests(el_reactor_t *reactor, el_conn_t *conn) {
+  struct http_request *request;
+
+  while (conn->fd >= 0 && conn->state == EL_READ_REQUEST) {
+    switch (http_connection_parse(conn->connection, &request)) {
+      case HTTP_PARSE_OK:
+        el_idle_remove(reactor, conn);
+        el_dispatch(reactor, conn, request);
+        break;
+      case HTTP_PARSE_INCOMPLETE:
+        el_idle_add(reactor, conn);
+        el_set_events(reactor, conn, EPOLLIN);
+        return;
+      case HTTP_PARSE_ERROR:
+        el_close(reactor, conn);
+        return;
+    }
+  }
+}
+
+static void el_read_request(el_reactor_t *reactor, el_conn_t *conn) {
+  ssize_t bytes_read = http_connection_read(conn->connection);
+  if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+  if (bytes_read <= 0) {
+    el_close(reactor, conn);
+    return;
+  }
+  el_serve_requests(reactor, conn);
+}
+
+/* Writes until the socket would block or the response is complete, then
+ * either closes CONN or goes back to waiting for its next request. */
+static void el_write_response(el_reactor_t *reactor, el_conn_t *conn) {
+  struct http_response *response = &conn->response;
+  int file_pending = response->file_fd >= 0 &&
+      (response->file_length > 0 || response->parts != NULL);
+  long long latency;
+  size_t bytes;
+
+  /* MSG_MORE lets the headers share a segment with the start of the file. */
+  if (http_send_iov(conn->fd, &conn->output_iov, &conn->output_count,
+        MSG_NOSIGNAL | (file_pending ? MSG_MORE : 0)) < 0 ||
+      (response->file_fd >= 0 && http_response_send_file(conn->fd, response,
+         &conn->file_part, &conn->file_position) < 0)) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      el_set_events(reactor, conn, EPOLLOUT);
+    else
+      el_close(reactor, conn);
+    return;
+  }
+
+  latency = mt_now_ns() - conn->request_start_ns;
+  bytes = http_response_content_length(response);
+  /* The request stays parsed until the next one is. */
+  mt_record(conn->connection->request.path, response->status_code, bytes,
+      latency);
+  al_log(conn->connection->request.method, conn->connection->request.path,
+      response->status_code, bytes, latency);
+  http_response_free(response);
+  if (!conn->keep_alive) {
+    el_close(reactor, conn);
+    return;
+  }
+  conn->state = EL_READ_REQUEST;
+}
+
+static el_conn_t *el_client_new(el_reactor_t *reactor, int fd) {
+  el_conn_t *conn = el_conn_new(reactor, fd, EL_READ_REQUEST, EPOLLIN);
+  if (conn == NULL) return NULL;
+
+  conn->connection = malloc(sizeof(struct http_connection));
+  if (conn->connection == NULL) {
+    el_close(reactor, conn);
+    return NULL;
+  }
+  http_connection_init(conn->connection, fd);
+  el_idle_add(reactor, conn);
+  return conn;
+}
+
+/* Answers the client with a 502 once its request head has arrived. */
+static void el_bad_gateway(el_reactor_t *reactor, el_conn_t *client) {
+  client->peer = NULL;
+  client->bad_gateway = 1;
+  client->state = EL_READ_REQUEST;
+  if (client->connection == NULL) {
+    client->connection = malloc(sizeof(struct http_connection));
+    if (client->connection == NULL) {
+      el_close(reactor, client);
+      return;
+    }
+    http_connection_init(client->connection, client->fd);
+  }
+  el_idle_add(reactor, client);
+  el_set_events(reactor, client, EPOLLIN);
+}
+
+/* Starts a non-blocking connect from CLIENT to the next server the group
+ * picks, skipping those it already failed to reach, or answers 502 once
+ * there are none left. Paths are not known yet, so UP_HASH falls back to
+ * round-robin. */
+static void el_connect_upstream(el_reactor_t *reactor, el_conn_t *client) {
+  up_group_t *group = reactor->config->upstreams;
+  struct sockaddr_in address;
+  el_conn_t *upstream;
+  up_pool_t *pool;
+  int upstream_fd;
+
+  while ((pool = up_group_pick(group, NULL, client->tried)) != NULL) {
+    client->tried |= 1ULL << pool->index;
+    if (up_resolve(pool->host, pool->port, &address) == -1) {
+      up_pool_failed(pool);
+      continue;
+    }
+    upstream_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (upstream_fd == -1) break;
+    if (connect(upstream_fd, (struct sockaddr *) &address,
+          sizeof(address)) == -1 && errno != EINPROGRESS) {
+      close(upstream_fd);
+      up_pool_failed(pool);
+      continue;
+    }
+
+    upstream = el_conn_new(reactor, upstream_fd, EL_CONNECT, EPOLLOUT);
+    if (upstream == NULL) break;
+    up_pool_enter(pool);
+    upstream->pool = pool;
+    client->peer = upstream;
+    upstream->peer = client;
+    return;
+  }
+  el_bad_gateway(reactor, client);
+}
+
+static void el_proxy_connect(el_reactor_t *reactor, int client_fd) {
+  el_conn_t *client;
+
+  /* The client is not read from until the upstream is connected. */
+  client = el_conn_new(reactor, client_fd, EL_CONNECT, 0);
+  if (client == NULL) return;
+  el_connect_upstream(reactor, client);
+}
+
+/* Watches CONN for what its relay directions wait on. A socket waiting on
+ * nothing leaves epoll, which would otherwise keep reporting its hangup. */
+static void el_relay_watch(el_reactor_t *reactor, el_conn_t *conn) {
+  struct epoll_event event;
+  uint32_t events = 0;
+
+  if (rl_wants_read(&conn->relay)) events |= EPOLLIN;
+  if (rl_wants_write(&conn->peer->relay)) events |= EPOLLOUT;
+
+  if (events == 0 && !conn->unwatched) {
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn->unwatched = 1;
+    conn->events = 0;
+  } else if (events != 0 && conn->unwatched) {
+    event.events = events;
+    event.data.ptr = conn;
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+    conn->unwatched = 0;
+    conn->events = events;
+  } else {
+    el_set_events(reactor, conn, events);
+  }
+}
+
+/* Splices whatever CONN's events allow in either direction. Each end's EOF
+ * is passed on separately; the pair closes once both directions are done. */
+static void el_relay(el_reactor_t *reactor, el_conn_t *conn, uint32_t events) {
+  el_conn_t *peer = conn->peer;
+
+  if ((events & EPOLLERR) ||
+      ((events & (EPOLLIN | EPOLLHUP)) && rl_pump(&conn->relay) < 0) ||
+      ((events & (EPOLLOUT | EPOLLHUP)) && rl_pump(&peer->relay) < 0) ||
+      (rl_done(&conn->relay) && rl_done(&peer->relay))) {
+    el_close(reactor, conn);
+    return;
+  }
+
+  el_relay_watch(reactor, conn);
+  el_relay_watch(reactor, peer);
+}
+
+static void el_finish_connect(el_reactor_t *reactor, el_conn_t *upstream) {
+  el_conn_t *client = upstream->peer;
+  socklen_t error_length = sizeof(int);
+  int error = 0;
+
+  if (getsockopt(upstream->fd, SOL_SOCKET, SO_ERROR, &error,
+        &error_length) == -1 || error != 0) {
+    up_pool_failed(upstream->pool);
+    upstream->peer = NULL;
+    client->peer = NULL;
+    el_close(reactor, upstream);
+    el_connect_upstream(reactor, client);
+    return;
+  }
+
+  if (rl_direction_init(&client->relay, client->fd, upstream->fd) == -1 ||
+      rl_direction_init(&upstream->relay, upstream->fd, client->fd) == -1) {
+    perror("Failed to create relay pipe");
+    el_close(reactor, client);
+    return;
+  }
+
+  up_pool_succeeded(upstream->pool, -1);
+  upstream->state = EL_RELAY;
+  client->state = EL_RELAY;
+  el_relay_watch(reactor, upstream);
+  el_relay_watch(reactor, client);
+}
+
+static void el_accept(el_reactor_t *reactor) {
+  int client_socket_number;
+
+  while (1) {
+    client_socket_number = accept4(reactor->server_socket, NULL, NULL,
+        SOCK_NONBLOCK);
+    if (client_socket_number < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Error accepting socket");
+      return;
+    }
+
+    if (reactor->config->files_handler != NULL)
+      el_client_new(reactor, client_socket_number);
+    else
+      el_proxy_connect(reactor, client_socket_number);
+  }
+}
+
+static void el_handle(el_reactor_t *reactor, el_conn_t *conn, uint32_t events) {
+  switch (conn->state) {
+    case EL_READ_REQUEST:
+      el_read_request(reactor, conn);
+      break;
+    case EL_WRITE_RESPONSE:
+      el_write_response(reactor, conn);
+      el_serve_requests(reactor, conn);
+      break;
+    case EL_CONNECT:
+      /* Only the upstream waits for EPOLLOUT; the client can only hang up. */
+      if (conn->events & EPOLLOUT)
+        el_finish_connect(reactor, conn);
+      else
+        el_close(reactor, conn);
+      break;
+    case EL_RELAY:
+      el_relay(reactor, conn, events);
+      break;
+  }
+}
+
+static void *el_reactor_routine(void *aux) {
+  el_reactor_t *reactor = aux;
+  struct epoll_event events[EL_MAX_EVENTS];
+  el_conn_t *conn;
+  int num_events, timeout, i;
+  long long now, busy_start;
+
+  mt_register("reactor", reactor->index);
+  if (reactor->config->pin_reactors) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(reactor->index % (num_cpus > 0 ? num_cpus : 1), &cpu_set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  }
+
+  while (1) {
+    timeout = -1;
+    if (reactor->idle_head != NULL) {
+      now = el_now_ms();
+      timeout = reactor->idle_head->idle_deadline <= now ? 0 :
+          (int) (reactor->idle_head->idle_deadline - now);
+    }
+
+    num_events = epoll_wait(reactor->epoll_fd, events, EL_MAX_EVENTS, timeout);
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to wait for events");
+      exit(errno);
+    }
+
+    busy_start = mt_now_ns();
+    for (i = 0; i < num_events; i++) {
+      conn = events[i].data.ptr;
+      if (conn == NULL)
+        el_accept(reactor);
+      else if (conn->fd >= 0)
+        el_handle(reactor, conn, events[i].events);
+    }
+
+    now = el_now_ms();
+    while (reactor->idle_head != NULL &&
+        reactor->idle_head->idle_deadline <= now)
+      el_close(reactor, reactor->idle_head);
+
+    while (reactor->closed != NULL) {
+      conn = reactor->closed;
+      reactor->closed = conn->next_closed;
+      free(conn->connection);
+      free(conn->buffer);
+      ar_destroy(&conn->arena);
+      free(conn);
+    }
+    mt_busy(mt_now_ns() - busy_start);
+  }
+
+  return NULL;
+}
+
+void el_serve_forever(int *server_sockets, int num_server_sockets,
+    el_config_t *config) {
+  struct epoll_event event;
+  el_reactor_t *reactor;
+  int server_socket, i;
+
+  for (i = 0; i < num_server_sockets; i++)
+    fcntl(server_sockets[i], F_SETFL,
+        fcntl(server_sockets[i], F_GETFL) | O_NONBLOCK);
+
+  for (i = 0; i < config->num_reactors; i++) {
+    server_socket = server_sockets[i % num_server_sockets];
+    reactor = calloc(1, sizeof(el_reactor_t));
+    reactor->index = i;
+    reactor->server_socket = server_socket;
+    reactor->config = config;
+    reactor->epoll_fd = epoll_create1(0);
+    if (reactor->epoll_fd == -1) {
+      perror("Failed to create epoll instance");
+      exit(errno);
+    }
+
+    /* Every reactor accepts; EPOLLEXCLUSIVE wakes only one per connection. */
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, server_socket, &event) == -1) {
+      perror("Failed to watch server socket");
+      exit(errno);
+    }
+
+    /* The calling thread becomes the last reactor. */
+    if (i == config->num_reactors - 1)
+      el_reactor_routine(reactor);
+    else
+      pthread_create(&reactor->thread, NULL, el_reactor_routine, reactor);
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef __EVENT_LOOP__
+#define __EVENT_LOOP__
+
+#include "libhttp.h"
+#include "upstream.h"
+
+/* EVENT_LOOP serves connections from a set of epoll reactor threads. Every
+ * socket is non-blocking and every connection is a small state machine, so a
+ * slow client costs a few bytes of state instead of a whole pool thread. */
+
+typedef void (*el_files_handler_t)(struct http_request *request,
+    struct http_response *response);
+
+typedef struct el_config {
+  int num_reactors;
+  int pin_reactors;           /* Pin reactor i to CPU i. */
+  /* Persistent connections: idle timeout (0 disables) and request cap. */
+  int keepalive_timeout_ms;
+  int keepalive_max_requests;
+  /* Files mode: decides the response for each parsed request. */
+  el_files_handler_t files_handler;
+  /* Proxy mode (files_handler == NULL): upstreams to relay connections to. */
+  up_group_t *upstreams;
+} el_config_t;
+
+/* Serves SERVER_SOCKETS (already bound and listening) forever. Reactor i
+ * accepts from socket i % NUM_SERVER_SOCKETS, so there should be at least as
+ * many reactors as sockets. */
+void el_serve_forever(int *server_sockets, int num_server_sockets,
+    el_config_t *config);
+
+#endif
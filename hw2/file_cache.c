@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+
+#define FC_WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+    IN_DELETE | IN_DELETE_SELF | IN_MOVE | IN_MOVE_SELF)
+
+/* Every cache is invalidated from the one inotify instance. */
+static pthread_mutex_t fc_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static file_cache_t *fc_caches;
+static pthread_once_t fc_inotify_once = PTHREAD_ONCE_INIT;
+static int fc_inotify_fd = -1;
+
+static unsigned int fc_hash(const char *key) {
+  unsigned int hash = 2166136261u;
+  while (*key) {
+    hash ^= (unsigned char) *key++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void fc_init(file_cache_t *cache, size_t budget, size_t max_entry) {
+  memset(cache, 0, sizeof(*cache));
+  cache->budget = budget;
+  cache->max_entry = max_entry;
+  for (int i = 0; i < FC_NUM_LOCKS; i++)
+    pthread_rwlock_init(&cache->locks[i], NULL);
+  pthread_mutex_init(&cache->clock_lock, NULL);
+
+  pthread_mutex_lock(&fc_caches_lock);
+  cache->next_cache = fc_caches;
+  fc_caches = cache;
+  pthread_mutex_unlock(&fc_caches_lock);
+}
+
+fc_entry_t *fc_lookup(file_cache_t *cache, const char *key) {
+  unsigned int hash = fc_hash(key);
+  pthread_rwlock_t *lock = &cache->locks[hash % FC_NUM_LOCKS];
+  fc_entry_t *entry;
+
+  pthread_rwlock_rdlock(lock);
+  for (entry = cache->buckets[hash % FC_NUM_BUCKETS]; entry != NULL;
+      entry = entry->bucket_next) {
+    if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+      __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL);
+      if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED))
+        __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  pthread_rwlock_unlock(lock);
+  return entry;
+}
+
+void fc_release(fc_entry_t *entry) {
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+  free(entry->key);
+  if (entry->destroy != NULL)
+    entry->destroy(entry->data);
+  else
+    free(entry->data);
+  free(entry);
+}
+
+unsigned long fc_generation(file_cache_t *cache) {
+  return __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+}
+
+/* Removes ENTRY from its bucket and the CLOCK ring. Needs clock_lock. */
+static void fc_unlink(file_cache_t *cache, fc_entry_t *entry) {
+  pthread_rwlock_t *lock = &cache->locks[entry->hash % FC_NUM_LOCKS];
+  fc_entry_t **link;
+
+  pthread_rwlock_wrlock(lock);
+  for (link = &cache->buckets[entry->hash % FC_NUM_BUCKETS]; *link != entry;
+      link = &(*link)->bucket_next);
+  *link = entry->bucket_next;
+  pthread_rwlock_unlock(lock);
+
+  if (entry->clock_next == entry) {
+    cache->hand = NULL;
+  } else {
+    entry->clock_prev->clock_next = entry->clock_next;
+    entry->clock_next->clock_prev = entry->clock_prev;
+    if (cache->hand == entry) cache->hand = entry->clock_next;
+  }
+  cache->used -= entry->length;
+  fc_release(entry);
+}
+
+/* Sweeps the CLOCK hand until the cache fits its budget: entries hit since
+ * the last sweep get a second chance, the rest are evicted. */
+static void fc_evict(file_cache_t *cache) {
+  fc_entry_t *entry;
+
+  while (cache->used > cache->budget && cache->hand != NULL) {
+    entry = cache->hand;
+    cache->hand = entry->clock_next;
+    if (__atomic_exchange_n(&entry->referenced, 0, __ATOMIC_RELAXED))
+      continue;
+    fc_unlink(cache, entry);
+  }
+}
+
+static fc_entry_t *fc_add(file_cache_t *cache, const char *key, char *data,
+    size_t length, size_t head_length, void (*destroy)(void *), int tag,
+    unsigned long generation) {
+  fc_entry_t *entry, *old;
+  pthread_rwlock_t *lock;
+  unsigned int hash;
+
+  if (length > cache->max_entry || length > cache->budget) {
+    if (destroy != NULL)
+      destroy(data);
+    else
+      free(data);
+    return NULL;
+  }
+
+  entry = calloc(1, sizeof(fc_entry_t));
+  entry->key = strdup(key);
+  entry->data = data;
+  entry->length = length;
+  entry->head_length = head_length;
+  entry->destroy = destroy;
+  entry->tag = tag;
+  entry->hash = hash = fc_hash(key);
+  entry->refcount = 2;
+  lock = &cache->locks[hash % FC_NUM_LOCKS];
+
+  pthread_mutex_lock(&cache->clock_lock);
+  if (cache->generation != generation) {
+    pthread_mutex_unlock(&cache->clock_lock);
+    entry->refcount = 1;
+    fc_release(entry);
+    return NULL;
+  }
+
+  /* Replace a concurrent insert of the same key. */
+  pthread_rwlock_rdlock(lock);
+  for (old = cache->buckets[hash % FC_NUM_BUCKETS]; old != NULL;
+      old = old->bucket_next)
+    if (old->hash == hash && strcmp(old->key, key) == 0) break;
+  pthread_rwlock_unlock(lock);
+  if (old != NULL) fc_unlink(cache, old);
+
+  pthread_rwlock_wrlock(lock);
+  entry->bucket_next = cache->buckets[hash % FC_NUM_BUCKETS];
+  cache->buckets[hash % FC_NUM_BUCKETS] = entry;
+  pthread_rwlock_unlock(lock);
+
+  /* New entries go just behind the hand, the last place it will look. */
+  if (cache->hand == NULL) {
+    entry->clock_prev = entry->clock_next = entry;
+    cache->hand = entry;
+  } else {
+    entry->clock_next = cache->hand;
+    entry->clock_prev = cache->hand->clock_prev;
+    entry->clock_prev->clock_next = entry;
+    cache->hand->clock_prev = entry;
+  }
+  cache->used += length;
+  fc_evict(cache);
+  pthread_mutex_unlock(&cache->clock_lock);
+
+  return entry;
+}
+
+fc_entry_t *fc_insert(file_cache_t *cache, const char *key, char *data,
+    size_t length, size_t head_length, int tag, unsigned long generation) {
+  return fc_add(cache, key, data, length, head_length, NULL, tag, generation);
+}
+
+fc_entry_t *fc_insert_object(file_cache_t *cache, const char *key, void *data,
+    size_t length, void (*destroy)(void *), int tag, unsigned long generation) {
+  return fc_add(cache, key, data, length, 0, destroy, tag, generation);
+}
+
+/* Drops the entries tagged TAG, or all of them when TAG < 0. */
+static void fc_invalidate(file_cache_t *cache, int tag) {
+  fc_entry_t *entry, *next;
+  size_t remaining;
+
+  pthread_mutex_lock(&cache->clock_lock);
+  __atomic_add_fetch(&cache->generation, 1, __ATOMIC_RELEASE);
+  entry = cache->hand;
+  remaining = 0;
+  if (entry != NULL) {
+    do {
+      remaining++;
+      entry = entry->clock_next;
+    } while (entry != cache->hand);
+  }
+  while (remaining-- > 0) {
+    next = entry->clock_next;
+    if (tag < 0 || entry->tag == tag) fc_unlink(cache, entry);
+    entry = next;
+  }
+  pthread_mutex_unlock(&cache->clock_lock);
+}
+
+void fc_invalidate_tag(file_cache_t *cache, int tag) {
+  fc_invalidate(cache, tag);
+}
+
+void fc_invalidate_all(file_cache_t *cache) {
+  fc_invalidate(cache, -1);
+}
+
+static void fc_invalidate_everywhere(int tag) {
+  file_cache_t *cache;
+
+  pthread_mutex_lock(&fc_caches_lock);
+  for (cache = fc_caches; cache != NULL; cache = cache->next_cache)
+    fc_invalidate(cache, tag);
+  pthread_mutex_unlock(&fc_caches_lock);
+}
+
+static void *fc_watch_routine(void *aux) {
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *event;
+  ssize_t length;
+  int last_tag;
+
+  while (1) {
+    length = read(fc_inotify_fd, buffer, sizeof(buffer));
+    if (length < 0 && errno == EINTR) continue;
+    if (length <= 0) {
+      perror("Failed to read inotify events");
+      return NULL;
+    }
+
+    /* Editors tend to produce bursts of events for one directory. */
+    last_tag = -2;
+    for (char *next = buffer; next < buffer + length;
+        next += sizeof(struct inotify_event) + event->len) {
+      event = (struct inotify_event *) next;
+      if (event->mask & IN_Q_OVERFLOW) {
+        fc_invalidate_everywhere(-1);
+        last_tag = -2;
+      } else if (event->wd != last_tag) {
+        fc_invalidate_everywhere(event->wd);
+        last_tag = event->wd;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void fc_start_watching(void) {
+  pthread_t thread;
+
+  fc_inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (fc_inotify_fd == -1) {
+    perror("Failed to initialize inotify, caching disabled");
+    return;
+  }
+  pthread_create(&thread, NULL, fc_watch_routine, NULL);
+  pthread_detach(thread);
+}
+
+int fc_watch(const char *directory) {
+  pthread_once(&fc_inotify_once, fc_start_watching);
+  if (fc_inotify_fd == -1) return -1;
+  return inotify_add_watch(fc_inotify_fd, directory, FC_WATCH_MASK);
+}
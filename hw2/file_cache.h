@@ -0,0 +1,75 @@
+#ifndef __FILE_CACHE__
+#define __FILE_CACHE__
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* FILE_CACHE keeps small hot responses in memory, keyed by request path.
+ * Each entry is a single block (response headers followed by the body), so a
+ * hit is answered with one write. Lookups only take a shared lock on one of
+ * FC_NUM_LOCKS shards; inserts and evictions (CLOCK, under a byte budget)
+ * serialize on a separate lock. Entries are invalidated when inotify reports
+ * a change in the directory they were read from. */
+
+#define FC_NUM_BUCKETS 4096
+#define FC_NUM_LOCKS 64
+
+typedef struct fc_entry {
+  char *key;
+  char *data;                 /* Response headers followed by the body. */
+  size_t length;
+  size_t head_length;         /* Offset of the blank line ending the headers. */
+  int tag;                    /* Watch (see fc_watch) the entry came from. */
+  void (*destroy)(void *data);  /* Frees an object's DATA, instead of free. */
+  unsigned int hash;
+  int refcount;               /* One for the cache, one per fc_lookup. */
+  int referenced;             /* CLOCK bit, set by every hit. */
+  struct fc_entry *bucket_next;
+  struct fc_entry *clock_prev;
+  struct fc_entry *clock_next;
+} fc_entry_t;
+
+typedef struct file_cache {
+  size_t budget;              /* Bytes of data the cache may hold. */
+  size_t max_entry;           /* Larger entries are never cached. */
+  size_t used;
+  unsigned long generation;   /* Bumped by every invalidation. */
+  fc_entry_t *buckets[FC_NUM_BUCKETS];
+  pthread_rwlock_t locks[FC_NUM_LOCKS];
+  pthread_mutex_t clock_lock; /* Guards the CLOCK ring, used and generation. */
+  fc_entry_t *hand;
+  struct file_cache *next_cache;
+} file_cache_t;
+
+/* Initializes CACHE and subscribes it to invalidations from fc_watch. */
+void fc_init(file_cache_t *cache, size_t budget, size_t max_entry);
+
+/* Returns the entry for KEY with a reference the caller must fc_release, or
+ * NULL on a miss. */
+fc_entry_t *fc_lookup(file_cache_t *cache, const char *key);
+void fc_release(fc_entry_t *entry);
+
+/* Watches DIRECTORY for changes and returns the tag to pass to fc_insert for
+ * entries derived from its files, or -1 if it cannot be watched. */
+int fc_watch(const char *directory);
+
+/* Returns the generation to pass to fc_insert. Take it before reading the
+ * data that goes into the entry. */
+unsigned long fc_generation(file_cache_t *cache);
+
+/* Takes ownership of DATA and caches it under KEY. Returns the new entry with
+ * a reference for the caller, or NULL (and frees DATA) if it does not fit or
+ * something was invalidated since GENERATION, as the data may be stale. */
+fc_entry_t *fc_insert(file_cache_t *cache, const char *key, char *data,
+    size_t length, size_t head_length, int tag, unsigned long generation);
+
+/* As fc_insert, for DATA that is an object DESTROY frees rather than a
+ * response, charged as LENGTH bytes against the budget. */
+fc_entry_t *fc_insert_object(file_cache_t *cache, const char *key, void *data,
+    size_t length, void (*destroy)(void *), int tag, unsigned long generation);
+
+/* Drops every entry derived from the directory watched as TAG. */
+void fc_invalidate_tag(file_cache_t *cache, int tag);
+void fc_invalidate_all(file_cache_t *cache);
+
+#endif
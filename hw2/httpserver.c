@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
@@ -5,6 +7,7 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,9 +16,26 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <unistd.h>
 
+#include "access_log.h"
+#include "admission.h"
+#include "arena.h"
+#include "autoscale.h"
+#include "deque.h"
+#include "dir_listing.h"
+#include "docroot.h"
+#include "encoding.h"
+#include "event_loop.h"
+#include "file_cache.h"
+#include "keepalive.h"
 #include "libhttp.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "proxy_cache.h"
+#include "relay.h"
+#include "upstream.h"
+#include "uring.h"
+#include "watchdog.h"
 #include "wq.h"
 
 /*
@@ -24,100 +44,489 @@
  * handle_proxy_request. Their values are set up in main() using the
  * command line arguments (already implemented for you).
  */
-wq_t work_queue;
+wq_t *work_queues;
 int num_threads;
+int min_threads;
+int max_threads;
+int num_listeners;
 int server_port;
 char *server_files_directory;
-char *server_proxy_hostname;
-int server_proxy_port;
+char *server_proxy_targets;
+int use_event_loop;
+int use_io_uring;
+file_cache_t file_cache;
+size_t file_cache_size = 32 << 20;
+size_t file_cache_max_file = 256 << 10;
+file_cache_t encoded_cache;
+size_t encoded_cache_size = 16 << 20;
+docroot_t docroot;
+size_t path_cache_size = 256;
+int keepalive_timeout_ms = 5000;
+int keepalive_max_requests = 100;
+int header_timeout_ms = 10000;
+int send_timeout_ms = 30000;
+int proxy_timeout_ms = 30000;
+int use_watchdog;
+up_group_t upstreams;
+enum up_balance upstream_balance = UP_ROUND_ROBIN;
+int upstream_max_connections = 64;
+proxy_cache_t proxy_cache;
+size_t proxy_cache_size = 0;
+size_t proxy_cache_max_object = 1 << 20;
+char *proxy_cache_spill_path;
+size_t proxy_cache_spill_size = 256 << 20;
+char *access_log_path;
+enum ad_policy overload_policy = AD_BLOCK;
+unsigned long queue_limit = AD_DEFAULT_LIMIT;
+
+
+/*
+ * With the default FIFO scheduler, each worker serves the connections
+ * accepted into one listener's queue. With --scheduler steal, each worker
+ * gets connections in its own inbox and deque instead (see steal_next_task).
+ */
+struct worker {
+  wq_t inbox;
+  dq_t deque;
+  wq_t *work_queue;           /* Where connections for this worker arrive. */
+  int index;
+  int idle;                   /* Out of work, and about to sleep on its inbox. */
+  int next_victim;
+  void (*request_handler)(int);
+  arena_t arena;              /* What the response being served is built in. */
+  pthread_t thread;
+};
+
+struct worker **workers;     /* max_threads slots, NULL where free. */
+void (*workers_request_handler)(int);
+int use_work_stealing;
+
+/* Pushed on a work queue to have one of its workers exit (see autoscale.h). */
+#define RETIRE_WORKER -2
 
+extern __thread struct worker *current_worker;
 
-void send_info_message(int fd, const char* message){
+
+void send_info_message(struct http_response *response, const char* message){
   char message_template[4096];
 
-  http_start_response(fd, 200);
-  http_send_header(fd, "Content-Type", "text/html");
-  http_end_headers(fd);
-  sprintf(message_template, "<center>"
+  http_response_init(response, 200, "text/html");
+  snprintf(message_template, sizeof(message_template), "<center>"
                             "<h1>Welcome to httpserver!</h1>"
                             "<hr>"
                             "<p>%s.</p>"
                             "</center>", message);
-  http_send_string(fd, message_template);
+  http_response_append_body(response, message_template, strlen(message_template));
 }
 
 
-void send_not_found(int fd, const char* requested_file){
+void send_not_found(struct http_response *response, const char* requested_file){
   char message_template[4096];
 
-  http_start_response(fd, 404);
-  http_send_header(fd, "Content-Type", "text/html");
-  http_end_headers(fd);
-  sprintf(message_template, "<center>"
+  http_response_init(response, 404, "text/html");
+  snprintf(message_template, sizeof(message_template), "<center>"
                             "<h1>Welcome to httpserver!</h1>"
                             "<hr>"
                             "<p>Sorry, %s can not be found.</p>"
                             "</center>", requested_file);
-  http_send_string(fd, message_template); 
+  http_response_append_body(response, message_template, strlen(message_template));
 }
 
-void list_directory(int fd, const char* dir_name){
-  DIR* cur_dir = opendir(dir_name);
-  struct dirent* dir_entry = readdir(cur_dir);
+void release_cached_file(void *entry){
+  fc_release(entry);
+}
 
-  http_start_response(fd, 200);
-  http_send_header(fd, "Content-Type", "text/html");
-  http_end_headers(fd);
+#define VALIDATOR_SIZE 64
 
-  while(dir_entry != NULL){
-    char href_template[4096];
+/*
+ * Formats the validators of the file FILE_STAT describes: an ETag made of its
+ * inode, size and modification time (SUFFIX tells apart a variant coded
+ * here), and its Last-Modified date. Each buffer takes VALIDATOR_SIZE bytes.
+ */
+void format_validators(const struct stat* file_stat, const char* suffix, char* etag, char* last_modified){
+  snprintf(etag, VALIDATOR_SIZE, "\"%llx-%llx-%llx%s\"",
+      (unsigned long long)file_stat->st_ino, (unsigned long long)file_stat->st_size,
+      (unsigned long long)file_stat->st_mtim.tv_sec * 1000000000ULL + file_stat->st_mtim.tv_nsec,
+      suffix);
+  http_format_date(file_stat->st_mtime, last_modified, VALIDATOR_SIZE);
+}
+
+/*
+ * Whether the client already holds the response with validators ETAG and
+ * LAST_MODIFIED, going by REQUEST's If-None-Match, or else (and only if it
+ * has none) its If-Modified-Since.
+ */
+int is_not_modified(struct http_request *request, const char* etag, const char* last_modified){
+  char* if_none_match = http_request_header(request, "If-None-Match");
+  if(if_none_match != NULL) return http_etag_matches(if_none_match, etag);
+
+  char* if_modified_since = http_request_header(request, "If-Modified-Since");
+  if(if_modified_since == NULL) return 0;
+  time_t since = http_parse_date(if_modified_since);
+  time_t modified = http_parse_date(last_modified);
+  return since != -1 && modified != -1 && modified <= since;
+}
+
+void send_not_modified(struct http_response *response, const char* etag, const char* last_modified, const char* vary){
+  http_response_init(response, 304, NULL);
+  http_response_add_header(response, "ETag", etag);
+  if(last_modified[0] != '\0')
+    http_response_add_header(response, "Last-Modified", last_modified);
+  if(vary != NULL)
+    http_response_add_header(response, "Vary", vary);
+}
 
-    sprintf(href_template, "<a href=%s>%s</a>\n", dir_entry->d_name, dir_entry->d_name);
-    
-    http_send_string(fd, href_template);
-    dir_entry = readdir(cur_dir);
+/*
+ * Answers REQUEST with the cached response in ENTRY, or with a 304 if the
+ * client's copy is still current by the validators ENTRY was stored with.
+ */
+void send_cached(struct http_request *request, struct http_response *response, fc_entry_t* entry){
+  char etag[VALIDATOR_SIZE], last_modified[VALIDATOR_SIZE], vary[VALIDATOR_SIZE];
+
+  if((http_request_header(request, "If-None-Match") != NULL ||
+        http_request_header(request, "If-Modified-Since") != NULL) &&
+      http_head_value(entry->data, entry->head_length, "ETag", etag, sizeof(etag)) == 0){
+    if(http_head_value(entry->data, entry->head_length, "Last-Modified", last_modified, sizeof(last_modified)) == -1)
+      last_modified[0] = '\0';
+  }else{
+    etag[0] = '\0';
+  }
+  if(etag[0] != '\0' && is_not_modified(request, etag, last_modified)){
+    int varies = http_head_value(entry->data, entry->head_length, "Vary", vary, sizeof(vary)) == 0;
+    fc_release(entry);
+    send_not_modified(response, etag, last_modified, varies ? vary : NULL);
+    return;
   }
 
-  closedir(cur_dir);
+  http_response_init(response, 200, NULL);
+  http_response_set_raw(response, entry->data, entry->length,
+      entry->head_length, release_cached_file, entry);
+}
+
+/*
+ * Narrows RESPONSE, a file of SIZE bytes, to the byte ranges REQUEST asks
+ * for, unless its If-Range names an older ETAG or LAST_MODIFIED. Returns 1 if
+ * the response is now partial (or a 416), and so not to be cached.
+ */
+int send_ranges(struct http_request *request, struct http_response *response, off_t size, const char* etag, const char* last_modified){
+  struct http_range ranges[LIBHTTP_MAX_RANGES];
+  char* range = http_request_header(request, "Range");
+  char* if_range = http_request_header(request, "If-Range");
+
+  if(range == NULL) return 0;
+  if(if_range != NULL && strcmp(if_range, etag) != 0 && strcmp(if_range, last_modified) != 0)
+    return 0;
+  int num_ranges = http_parse_ranges(range, size, ranges, LIBHTTP_MAX_RANGES);
+  if(num_ranges == -1) return 0;
+  http_response_set_ranges(response, ranges, num_ranges, size);
+  return 1;
+}
+
+/* Watches the directory holding FILE_PATH, and returns the tag to cache
+ * responses derived from it with (see fc_watch). */
+int watch_directory_of(const char* file_path){
+  char directory[strlen(file_path) + 1];
+  strcpy(directory, file_path);
+  *strrchr(directory, '/') = '\0';
+  return fc_watch(directory);
 }
 
-void send_file(int fd, int requested_fd, const char* requested_file_name){
-  char buffer[4096];
-  ssize_t bytes_read;
+/*
+ * Copies a small response (headers, then the file or in-memory body) into
+ * CACHE under CACHE_KEY, and switches RESPONSE over to the cached copy. TAG
+ * and GENERATION must be taken before the file is read, so a change racing
+ * with the read either shows up in the copy or invalidates it.
+ */
+void cache_file(file_cache_t* cache, struct http_response *response, const char* cache_key, int tag, unsigned long generation){
+  char headers[LIBHTTP_HEAD_MAX_SIZE];
+  size_t headers_length, body_length;
+
+  if(tag == -1) return;
+
+  body_length = response->file_fd >= 0 ? response->file_length : response->body_length;
+  headers_length = http_response_format_headers(response, headers, sizeof(headers));
+  char* data = malloc(headers_length + body_length);
+  if(data == NULL) return;
+  memcpy(data, headers, headers_length);
+  if(response->file_fd < 0){
+    memcpy(data + headers_length, response->body, body_length);
+  }else if(pread(response->file_fd, data + headers_length, body_length, 0) != body_length){
+    free(data);
+    return;
+  }
 
-  http_start_response(fd, 200);
-  char length[1024];
-  sprintf(length, "%d", (int)lseek(requested_fd, 0, SEEK_END));
-  lseek(requested_fd, 0, SEEK_SET);
-  http_send_header(fd, "Content-Type", http_get_mime_type((char*)requested_file_name));
-  http_send_header(fd, "Content-Length", length);
-  http_end_headers(fd);
+  fc_entry_t* entry = fc_insert(cache, cache_key, data,
+      headers_length + body_length, headers_length - 2, tag, generation);
+  if(entry == NULL) return;
+  http_response_set_raw(response, entry->data, entry->length,
+      entry->head_length, release_cached_file, entry);
+  /* Both are part of the cached copy now. */
+  response->headers_length = 0;
+  http_response_free_body(response);
+}
 
-  bytes_read = read(requested_fd, buffer, 4096);
-  while(bytes_read > 0){
-    http_send_data(fd, buffer, bytes_read);
-    bytes_read = read(requested_fd, buffer, 4096);
+/*
+ * Opens the precompressed sibling of RELATIVE_NAME (RELATIVE_NAME.br or .gz,
+ * under the docroot) in one of ENCODINGS, brotli first, provided it is at
+ * least as new as the file itself. Sets *ENCODING to the one found, or
+ * returns -1 if there is none.
+ */
+int open_precompressed(int requested_fd, const char* relative_name, int encodings, int* encoding){
+  struct stat file_stat, sibling_stat;
+  char sibling_name[strlen(relative_name) + 4];
+
+  if(fstat(requested_fd, &file_stat) == -1) return -1;
+  for(int candidate = ENC_BR; candidate >= ENC_GZIP; candidate >>= 1){
+    if(!(encodings & candidate)) continue;
+    snprintf(sibling_name, sizeof(sibling_name), "%s%s", relative_name, enc_suffix(candidate));
+    int sibling_fd = dr_open(&docroot, sibling_name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if(sibling_fd == -1) continue;
+    if(fstat(sibling_fd, &sibling_stat) == 0 && S_ISREG(sibling_stat.st_mode) &&
+        sibling_stat.st_mtime >= file_stat.st_mtime){
+      fcntl(sibling_fd, F_SETFL, 0);
+      *encoding = candidate;
+      return sibling_fd;
+    }
+    close(sibling_fd);
   }
-  
+  return -1;
+}
+
+/*
+ * Gzips a small text file into RESPONSE, with validators ETAG and
+ * LAST_MODIFIED, and caches the result in encoded_cache under CACHE_KEY so
+ * the file is not compressed again until it changes. Returns -1 (leaving
+ * RESPONSE alone) if the file is too large to cache, or does not get
+ * smaller.
+ */
+int send_gzipped(struct http_response *response, int requested_fd, const char* requested_file_name, char* content_type, const char* cache_key, const char* etag, const char* last_modified){
+  unsigned long generation = fc_generation(&encoded_cache);
+  int tag = watch_directory_of(requested_file_name);
+  char *plain, *compressed;
+  size_t compressed_length;
+  struct stat file_stat;
+  int status;
+
+  if(fstat(requested_fd, &file_stat) == -1 || file_stat.st_size > file_cache_max_file)
+    return -1;
+  plain = malloc(file_stat.st_size);
+  if(plain == NULL) return -1;
+  status = pread(requested_fd, plain, file_stat.st_size, 0) == file_stat.st_size ?
+      enc_gzip(plain, file_stat.st_size, &compressed, &compressed_length) : -1;
+  free(plain);
+  if(status == -1) return -1;
+
   close(requested_fd);
+  http_response_init(response, 200, content_type);
+  http_response_add_header(response, "Content-Encoding", "gzip");
+  http_response_add_header(response, "Vary", "Accept-Encoding");
+  http_response_add_header(response, "ETag", etag);
+  http_response_add_header(response, "Last-Modified", last_modified);
+  response->body = compressed;
+  response->body_length = response->body_capacity = compressed_length;
+  cache_file(&encoded_cache, response, cache_key, tag, generation);
+  return 0;
 }
 
+/*
+ * Responds to REQUEST with a file (REQUESTED_FILE_NAME, or RELATIVE_NAME under
+ * the docroot), and caches the response under CACHE_KEY if
+ * it is small and whole. ENCODINGS are the codings the client accepts, if the
+ * file looked compressible from the request path: then a text file is sent
+ * from an up-to-date precompressed sibling, or else gzipped here, and the
+ * response goes into encoded_cache, so that no file is compressed on every
+ * request. Conditional requests the file still satisfies get a 304, and
+ * ranges are served from an uncoded file only.
+ */
+void send_file(struct http_request *request, struct http_response *response, int requested_fd, const char* requested_file_name, const char* relative_name, const char* cache_key, int encodings){
+  char* content_type = http_get_mime_type((char*)requested_file_name);
+  char* vary = enc_compressible(content_type) ? "Accept-Encoding" : NULL;
+  file_cache_t* cache = encodings ? &encoded_cache : &file_cache;
+  size_t cache_size = encodings ? encoded_cache_size : file_cache_size;
+  char etag[VALIDATOR_SIZE], last_modified[VALIDATOR_SIZE];
+  struct stat file_stat;
+  int encoding = 0;
+
+  if(encodings && enc_compressible(content_type)){
+    int encoded_fd = open_precompressed(requested_fd, relative_name, encodings, &encoding);
+    if(encoded_fd >= 0){
+      close(requested_fd);
+      requested_fd = encoded_fd;
+    }else if((encodings & ENC_GZIP) && encoded_cache_size > 0 && fstat(requested_fd, &file_stat) == 0){
+      /* Checked before compressing, which a current client can do without. */
+      format_validators(&file_stat, "-gzip", etag, last_modified);
+      if(is_not_modified(request, etag, last_modified)){
+        close(requested_fd);
+        send_not_modified(response, etag, last_modified, vary);
+        return;
+      }
+      if(send_gzipped(response, requested_fd, requested_file_name, content_type, cache_key, etag, last_modified) == 0)
+        return;
+    }
+  }
+
+  if(fstat(requested_fd, &file_stat) == -1){
+    close(requested_fd);
+    send_not_found(response, request->path);
+    return;
+  }
+  format_validators(&file_stat, "", etag, last_modified);
+  if(is_not_modified(request, etag, last_modified)){
+    close(requested_fd);
+    send_not_modified(response, etag, last_modified, vary);
+    return;
+  }
+
+  http_response_init(response, 200, content_type);
+  http_response_set_file(response, requested_fd);
+  if(encoding)
+    http_response_add_header(response, "Content-Encoding", enc_name(encoding));
+  if(vary != NULL)
+    http_response_add_header(response, "Vary", vary);
+  http_response_add_header(response, "ETag", etag);
+  http_response_add_header(response, "Last-Modified", last_modified);
+  if(!encoding){
+    http_response_add_header(response, "Accept-Ranges", "bytes");
+    if(send_ranges(request, response, file_stat.st_size, etag, last_modified)) return;
+  }
+  if(cache_size > 0 && response->file_length <= file_cache_max_file){
+    unsigned long generation = fc_generation(cache);
+    cache_file(cache, response, cache_key, watch_directory_of(requested_file_name), generation);
+  }
+}
+
+
+#define LISTING_PAGE_SIZE 1000
+
+/* Returns the value of parameter NAME in QUERY ("a=1&b=2"), which runs up
+ * to the next '&', or NULL if it is absent. */
+const char* query_parameter(const char* query, const char* name){
+  size_t name_length = strlen(name);
+
+  while(query != NULL && *query != '\0'){
+    if(strncmp(query, name, name_length) == 0 && query[name_length] == '=')
+      return query + name_length + 1;
+    query = strchr(query, '&');
+    if(query != NULL) query++;
+  }
+  return NULL;
+}
+
+/*
+ * Responds with the listing of directory RELATIVE_NAME, reached at URL_PATH: HTML,
+ * or with format=json in QUERY, a page of JSON (picked with offset= and
+ * limit=). The listing is rendered once and cached under CACHE_KEY, in the
+ * cache ENCODINGS would send it to, until the directory changes; its ETag is
+ * a hash of the rendering, since entries can change without the
+ * directory's mtime doing so.
+ */
+void list_directory(struct http_request *request, struct http_response *response, const char* relative_name, const char* url_path, const char* query, const char* cache_key, int encodings){
+  char dir_name[strlen(docroot.path) + strlen(relative_name) + 2];
+  snprintf(dir_name, sizeof(dir_name), "%s/%s", docroot.path, relative_name);
+  file_cache_t* cache = encodings ? &encoded_cache : &file_cache;
+  size_t cache_size = encodings ? encoded_cache_size : file_cache_size;
+  int tag = cache_size > 0 ? fc_watch(dir_name) : -1;
+  unsigned long generation = fc_generation(cache);
+  const char* format = query_parameter(query, "format");
+  int json = format != NULL && strncmp(format, "json", 4) == 0 && (format[4] == '\0' || format[4] == '&');
+  char etag[VALIDATOR_SIZE];
+  dl_listing_t listing;
+  size_t body_length;
+  char* body;
+
+  if(dl_read(dr_open(&docroot, relative_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC), &listing) == -1){
+    send_not_found(response, url_path);
+    return;
+  }
+  if(json){
+    const char* offset = query_parameter(query, "offset");
+    const char* limit = query_parameter(query, "limit");
+    body = dl_json(&listing, url_path, offset ? strtoull(offset, NULL, 10) : 0,
+        limit ? strtoull(limit, NULL, 10) : LISTING_PAGE_SIZE, &body_length);
+  }else{
+    body = dl_html(&listing, url_path, &body_length);
+  }
+  dl_free(&listing);
+  if(body == NULL){
+    http_response_init(response, 500, "text/html");
+    return;
+  }
+
+  unsigned int hash = 2166136261u;
+  for(size_t i = 0; i < body_length; i++)
+    hash = (hash ^ (unsigned char)body[i]) * 16777619u;
+  snprintf(etag, sizeof(etag), "\"l-%zx-%x\"", body_length, hash);
+  if(is_not_modified(request, etag, "")){
+    free(body);
+    send_not_modified(response, etag, "", NULL);
+    return;
+  }
 
-int is_a_directory(const char* path){
-  struct stat path_stat;
-  stat(path, &path_stat);
-  return S_ISDIR(path_stat.st_mode);
+  http_response_init(response, 200, json ? "application/json" : "text/html");
+  http_response_add_header(response, "ETag", etag);
+  response->body = body;
+  response->body_length = response->body_capacity = body_length;
+  if(cache_size > 0)
+    cache_file(cache, response, cache_key, tag, generation);
 }
 
-int is_a_file(const char* path){
-  struct stat path_stat;
-  stat(path, &path_stat);
-  return S_ISREG(path_stat.st_mode);
+/*
+ * Answers 414 if LOCATION does not fit in the response's headers, rather
+ * than a redirect that leads nowhere.
+ */
+void send_redirect(struct http_response *response, const char* location){
+  http_response_init(response, 301, "text/html");
+  if(http_response_add_header(response, "Location", location) == -1)
+    http_response_init(response, 414, "text/html");
 }
 
 /*
- * Reads an HTTP request from stream (fd), and writes an HTTP response
- * containing:
+ * Answers MT_PATH with the counters of every thread (see metrics.h), and the
+ * connections waiting in each queue, in the Prometheus text format.
+ */
+void send_stats(struct http_response *response){
+  char* text = NULL;
+  size_t length = 0;
+  FILE* out = open_memstream(&text, &length);
+
+  http_response_init(response, 200, "text/plain; version=0.0.4");
+  http_response_add_header(response, "Cache-Control", "no-store");
+  if(out == NULL) return;
+  mt_report(out);
+
+  /* The event loop and rings have no queues: each accepts its own. */
+  if(!use_event_loop && !use_io_uring){
+    fprintf(out, "# HELP httpserver_queue_depth Connections waiting for a worker.\n"
+        "# TYPE httpserver_queue_depth gauge\n");
+    if(!use_work_stealing){
+      for(int i = 0; i < num_listeners; i++)
+        fprintf(out, "httpserver_queue_depth{queue=\"listener%d\"} %lu\n", i, wq_size(&work_queues[i]));
+    }else{
+      for(int i = 0; i < num_threads; i++){
+        fprintf(out, "httpserver_queue_depth{queue=\"inbox%d\"} %lu\n", i, wq_size(&workers[i]->inbox));
+        fprintf(out, "httpserver_queue_depth{queue=\"deque%d\"} %ld\n", i, dq_size(&workers[i]->deque));
+      }
+    }
+    if(max_threads > min_threads) as_report(out);
+    if(overload_policy != AD_BLOCK) ad_report(out);
+    if(use_watchdog) wd_report(out);
+  }
+  if(use_io_uring) ur_report(out);
+  if(upstreams.num_pools > 0) up_group_report(&upstreams, out);
+  if(proxy_cache_size > 0) pc_report(&proxy_cache, out);
+  if(server_proxy_targets != NULL) rl_report(out);
+  if(al_enabled()){
+    fprintf(out, "# HELP httpserver_access_log_dropped_total Access log lines lost to full rings.\n"
+        "# TYPE httpserver_access_log_dropped_total counter\n"
+        "httpserver_access_log_dropped_total %lu\n", al_dropped());
+  }
+  fclose(out);
+  http_response_append_body(response, text, length);
+  free(text);
+}
+
+/*
+ * Decides the response to a parsed files request:
  *
  *   1) If user requested an existing file, respond with the file
  *   2) If user requested a directory and index.html exists in the directory,
@@ -125,54 +534,140 @@ int is_a_file(const char* path){
  *   3) If user requested a directory and index.html doesn't exist, send a list
  *      of files in the directory with links to each.
  *   4) Send a 404 Not Found response.
+ *
+ * Nothing is written to the client here, so both the blocking workers and the
+ * event loop can share this logic.
  */
-void handle_files_request(int fd) {
+void prepare_files_response(struct http_request *request, struct http_response *response) {
   int requested_fd;
 
-  struct http_request *request = http_request_parse(fd);
-  if(request == NULL) {
-    close(fd);
+  if(strcmp(request->method, "GET") != 0){
+    send_info_message(response, "Currently only GET method is supported");
     return;
   }
-
-  if(strcmp(request->method, "GET") != 0){
-    send_info_message(fd, "Currently only GET method is supported");
-    close(fd);
+  if(strcmp(request->path, MT_PATH) == 0){
+    send_stats(response);
     return;
   }
 
-  char requested_path[strlen(server_files_directory) + strlen(request->path) + 1];
-  strcpy(requested_path, server_files_directory);
-  strcat(requested_path, request->path);
-  
-  if(is_a_directory((const char*)requested_path)){
-    strcat(requested_path, "index.html");
-    requested_fd = open(requested_path, O_RDONLY);
-    if (requested_fd == -1){
-      requested_path[strlen(requested_path) - strlen("index.html")] = '\0';
+  int path_length = strlen(request->path);
+  /* The query only matters to listings; files are found by the path. */
+  char path[path_length + 1];
+  strcpy(path, request->path);
+  char* query = strchr(path, '?');
+  if(query != NULL) *query++ = '\0';
 
-      strcat(requested_path, "/");
-      list_directory(fd, requested_path);
+  /*
+   * Compressible responses are cached apart, per set of codings accepted,
+   * since each set gets a different response. Whether a file compresses is
+   * told from its name, before it is looked up; a directory serves its
+   * index.html, or a listing, which is HTML as well.
+   */
+  char* name = path[0] != '\0' && path[strlen(path) - 1] == '/' ? "index.html" : path;
+  int encodings = enc_compressible(http_get_mime_type(name)) ?
+      enc_accepted(http_request_header(request, "Accept-Encoding")) : 0;
+  char cache_key[path_length + 16];
+  snprintf(cache_key, sizeof(cache_key), encodings ? "%s\t%d" : "%s", request->path, encodings);
+  file_cache_t* cache = encodings ? &encoded_cache : &file_cache;
+
+  /* Ranges are sent from the file itself; coded responses are sent whole. */
+  int ranged = encodings == 0 && http_request_header(request, "Range") != NULL;
+  if(!ranged && (encodings ? encoded_cache_size > 0 : file_cache_size > 0)){
+    fc_entry_t* entry = fc_lookup(cache, cache_key);
+    if(entry != NULL){
+      send_cached(request, response, entry);
+      return;
+    }
+  }
+
+  char relative[path_length + strlen("/index.html") + 1];
+  struct stat file_stat;
+  requested_fd = dr_normalize(path, relative, sizeof(relative)) == 0 ?
+      dr_lookup(&docroot, relative, &file_stat) : -1;
+  if(requested_fd == -1){
+    send_not_found(response, request->path);
+    return;
+  }
 
-      close(fd);
+  if(S_ISDIR(file_stat.st_mode)){
+    close(requested_fd);
+    /* Relative links in the listing or index.html resolve against "dir/". */
+    if(path[0] == '\0' || path[strlen(path) - 1] != '/'){
+      char location[path_length + 2];
+      snprintf(location, sizeof(location), "%s/%s%s", path, query ? "?" : "", query ? query : "");
+      send_redirect(response, location);
       return;
     }
-    send_file(fd, requested_fd, requested_path);
-  }else if (is_a_file(requested_path)){
-    requested_fd = open(requested_path, O_RDONLY);
+    size_t directory_length = strlen(relative);
+    strcat(relative, directory_length > 0 ? "/index.html" : "index.html");
+    requested_fd = dr_lookup(&docroot, relative, &file_stat);
+    if(requested_fd >= 0 && !S_ISREG(file_stat.st_mode)){
+      close(requested_fd);
+      requested_fd = -1;
+    }
     if(requested_fd == -1){
-      send_not_found(fd, request->path);
-      close(fd);
+      relative[directory_length] = '\0';
+      list_directory(request, response, relative, path, query, cache_key, encodings);
       return;
     }
-    send_file(fd, requested_fd, requested_path);
-  }else{
-    send_not_found(fd, request->path);
-    close(fd);
-    return;
   }
 
-  close(fd);
+  char requested_path[strlen(docroot.path) + strlen(relative) + 2];
+  snprintf(requested_path, sizeof(requested_path), "%s/%s", docroot.path, relative);
+  send_file(request, response, requested_fd, requested_path, relative, cache_key, encodings);
+}
+
+/*
+ * Reads HTTP requests from stream (fd), and writes the HTTP responses chosen
+ * by prepare_files_response. Requests that were pipelined behind one another
+ * are answered in a row; once the client has nothing more buffered, the
+ * connection is parked until it sends again (see keepalive.h), so the worker
+ * is free for other clients in the meantime.
+ */
+void handle_files_request(int fd) {
+  struct http_connection temporary_connection;
+  struct http_connection *connection;
+  struct http_response response;
+  int keep_alive;
+
+  ka_connection_t *ka_connection = keepalive_timeout_ms > 0 ? ka_get(fd) : NULL;
+  if (ka_connection != NULL) {
+    connection = &ka_connection->http;
+  } else {
+    connection = &temporary_connection;
+    http_connection_init(connection, fd);
+  }
+
+  do {
+    wd_arm(WD_HEAD, fd);
+    struct http_request *request = http_connection_next_request(connection);
+    if(request == NULL) {
+      keep_alive = 0;
+      break;
+    }
+
+    keep_alive = ka_connection != NULL && request->keep_alive &&
+        connection->num_requests < keepalive_max_requests;
+
+    long long start = mt_now_ns();
+    prepare_files_response(request, &response);
+    http_response_set_keep_alive(&response, request, keep_alive);
+    wd_arm(WD_SEND, fd);
+    http_response_send(fd, &response);
+    long long latency = mt_now_ns() - start;
+    size_t bytes = http_response_content_length(&response);
+    mt_record(request->path, response.status_code, bytes, latency);
+    al_log(request->method, request->path, response.status_code, bytes, latency);
+    http_response_free(&response);
+  } while (keep_alive && http_connection_has_request(connection));
+
+  wd_disarm();
+  if (keep_alive)
+    ka_park(ka_connection, current_worker->work_queue);
+  else if (ka_connection != NULL)
+    ka_close(ka_connection);
+  else
+    close(fd);
 }
 
 int ends_with(const char* c1, const char* c2, int length1, int length2){
@@ -185,199 +680,499 @@ int ends_with(const char* c1, const char* c2, int length1, int length2){
   return 1;
 }
 
-void* proxy_worker(void* aux){
-  int from = *(int*)aux;
-  int to = *((int*)aux + 1);
-
-  char buffer[(1 << 16)];
-  int bytes_read = read(from, buffer, (1 << 16));
-  while(bytes_read > 0){
-    int offset = 0;
-    int bytes_written = write(to, buffer, bytes_read);
-    if(bytes_written < 0){
-      close(from);
-      free(aux);
-
-      return NULL;
-    }
-    offset += bytes_written;
-    while(offset < bytes_read){
-      bytes_written = write(to, buffer + offset, bytes_read - offset + 1);
-      if(bytes_written < 0){
-        close(from);
-        free(aux);
-
-        return NULL;
-      }
-      offset += bytes_written; 
-    }
-
-    bytes_read = read(from, buffer, (1 << 16));          
-  }
-
-  close(from);
-  free(aux);
-
-  return NULL;
-}
-
 /*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target. HTTP requests from the client (fd) should be sent to the
- * proxy target, and HTTP responses from the proxy target should be sent to
- * the client (fd).
+ * Reads HTTP requests from stream (fd) and forwards each to one of the proxy
+ * targets (upstreams, parsed from server_proxy_targets) over pooled upstream
+ * connections, sending each response back to the client (fd).
+ * Persistent client connections are handled as in handle_files_request.
  *
  *   +--------+     +------------+     +--------------+
  *   | client | <-> | httpserver | <-> | proxy target |
  *   +--------+     +------------+     +--------------+
  */
 void handle_proxy_request(int fd) {
+  struct http_connection temporary_connection;
+  struct http_connection *connection;
+  enum px_result result = PX_CLOSE;
+
+  ka_connection_t *ka_connection = keepalive_timeout_ms > 0 ? ka_get(fd) : NULL;
+  if (ka_connection != NULL) {
+    connection = &ka_connection->http;
+  } else {
+    connection = &temporary_connection;
+    http_connection_init(connection, fd);
+  }
+  /* Bodies of any length, and chunked ones, go through to the upstream. */
+  http_connection_stream_bodies(connection);
+
+  do {
+    wd_arm(WD_HEAD, fd);
+    struct http_request *request = http_connection_next_request(connection);
+    if (request == NULL) {
+      result = PX_CLOSE;
+      break;
+    }
 
-  /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
-  */
+    long long start = mt_now_ns();
+    int keep_alive = ka_connection != NULL && request->keep_alive &&
+        connection->num_requests < keepalive_max_requests;
+    int status_code;
+    size_t bytes;
+
+    /* The stats are the proxy's own; they are not forwarded, unless the
+     * request has a body, which only forwarding reads past. */
+    if (strcmp(request->path, MT_PATH) == 0 && strcmp(request->method, "GET") == 0 &&
+        request->content_length == 0 && !request->chunked) {
+      struct http_response response;
+      send_stats(&response);
+      http_response_set_keep_alive(&response, request, keep_alive);
+      wd_arm(WD_SEND, fd);
+      http_response_send(fd, &response);
+      status_code = response.status_code;
+      bytes = http_response_content_length(&response);
+      http_response_free(&response);
+      result = keep_alive ? PX_KEEP_ALIVE : PX_CLOSE;
+    } else {
+      wd_arm(WD_PROXY, fd);
+      result = px_forward(&upstreams, proxy_cache_size > 0 ? &proxy_cache : NULL,
+          connection, request, keep_alive, &status_code, &bytes);
+    }
+    long long latency = mt_now_ns() - start;
+    mt_record(request->path, status_code, bytes, latency);
+    al_log(request->method, request->path, status_code, bytes, latency);
+  } while (result == PX_KEEP_ALIVE && http_connection_has_request(connection));
+
+  wd_disarm();
+  if (result == PX_UPGRADED) {
+    /* The relay thread owns fd now. */
+    if (ka_connection != NULL) ka_release(ka_connection);
+  } else if (result == PX_KEEP_ALIVE) {
+    ka_park(ka_connection, current_worker->work_queue);
+  } else if (ka_connection != NULL) {
+    ka_close(ka_connection);
+  } else {
+    close(fd);
+  }
+}
 
+/*
+ * Resolves every proxy target once at startup, so that a misspelled host
+ * fails right away, and so that the event loop, which must not block on DNS
+ * while it has other connections to drive, finds them cached from then on.
+ */
+void resolve_proxy_targets() {
   struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
 
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+  for (int i = 0; i < upstreams.num_pools; i++) {
+    up_pool_t *pool = &upstreams.pools[i];
+    if (up_resolve(pool->host, pool->port, &target_address) == -1) {
+      fprintf(stderr, "Cannot find host: %s\n", pool->host);
+      exit(ENXIO);
+    }
+  }
+}
 
-  int client_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (client_socket_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    exit(errno);
+/* The worker running on this thread, if any. */
+__thread struct worker *current_worker;
+
+/* Tries every other worker's deque once, starting after the last victim. */
+int steal_from_others(struct worker *worker, int *client_socket_number) {
+  for (int i = 1; i < num_threads; i++) {
+    struct worker *victim = workers[(worker->next_victim + i) % num_threads];
+    if (victim == worker) continue;
+    if (dq_steal(&victim->deque, client_socket_number)) {
+      worker->next_victim = victim->index;
+      return 1;
+    }
   }
+  return 0;
+}
 
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    exit(ENXIO);
+/* Wakes one sleeping worker to come and steal from WORKER. The fence pairs
+ * with the one after a worker sets its idle flag, so a worker going to sleep
+ * either sees the new work or is seen here. */
+void wake_idle_worker(struct worker *worker) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (int i = 1; i < num_threads; i++) {
+    struct worker *other = workers[(worker->index + i) % num_threads];
+    int idle = 1;
+    if (__atomic_compare_exchange_n(&other->idle, &idle, 0, 0,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      wq_push(other->work_queue, -1);
+      return;
+    }
   }
+}
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
+/*
+ * Work-stealing scheduling. Connections handed to a worker -- new ones from
+ * its acceptor, or its own keep-alive connections coming back from the idle
+ * watcher -- arrive in its inbox and are moved to its deque, where the worker
+ * takes the newest from the bottom (warm in its cache) and idle workers steal
+ * the oldest from the top. A worker with nothing left sleeps on its inbox; it
+ * is woken by new work for itself, or by a -1 from a busy worker with work
+ * to spare.
+ */
+int steal_next_task(struct worker *worker) {
+  int client_socket_number;
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(client_socket_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+  while (1) {
+    while (dq_size(&worker->deque) < DQ_CAPACITY &&
+        wq_try_pop(worker->work_queue, &client_socket_number))
+      if (client_socket_number >= 0)
+        dq_push(&worker->deque, client_socket_number);
+    if (dq_size(&worker->deque) > 1)
+      wake_idle_worker(worker);
+
+    if (dq_pop(&worker->deque, &client_socket_number) ||
+        steal_from_others(worker, &client_socket_number))
+      return client_socket_number;
+
+    __atomic_store_n(&worker->idle, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!steal_from_others(worker, &client_socket_number))
+      client_socket_number = wq_pop(worker->work_queue);
+    __atomic_store_n(&worker->idle, 0, __ATOMIC_RELAXED);
+    if (client_socket_number >= 0)
+      return client_socket_number;
+  }
+}
 
-  if (connection_status < 0) {
-    /* Dummy request parsing, just to be compliant. */
-    http_request_parse(fd);
+void* worker_routine(void* aux){
+    struct worker *worker = aux;
+    current_worker = worker;
+
+    ar_init(&worker->arena, AR_BLOCK_SIZE);
+    http_use_arena(&worker->arena);
+    wd_register();
+    http_on_progress(wd_progress);
+    mt_register("worker", worker->index);
+    while(1){
+      int client_socket_number = use_work_stealing ?
+          steal_next_task(worker) : ad_pop(worker->work_queue - work_queues);
+      if (client_socket_number == RETIRE_WORKER) break;
+      long long start = mt_now_ns();
+      worker->request_handler(client_socket_number);
+      mt_busy(mt_now_ns() - start);
+    }
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
-    return;
+    /* Retired: the slot, counters and log ring go to the next worker. */
+    ar_destroy(&worker->arena);
+    http_use_arena(NULL);
+    http_on_progress(NULL);
+    wd_unregister();
+    mt_unregister();
+    al_unregister();
+    __atomic_store_n(&workers[worker->index], NULL, __ATOMIC_RELEASE);
+    free(worker);
+    return NULL;
+}
 
+struct worker *new_worker(int index, wq_t *work_queue,
+    void (*request_handler)(int)) {
+  struct worker* worker;
+  if (posix_memalign((void **) &worker, 64, sizeof(struct worker))) {
+    perror("Failed to allocate worker");
+    exit(ENOMEM);
   }
-  /* 
-  * TODO: Your solution for task 3 belongs here! 
-  */
-  pthread_t* thread_a = malloc(sizeof(pthread_t));
-  pthread_t* thread_b = malloc(sizeof(pthread_t));
-  int* a_to_b = malloc(sizeof(int) * 2);
-  int* b_to_a = malloc(sizeof(int) * 2);
-  a_to_b[0] = fd;
-  b_to_a[0] = client_socket_fd;
-  a_to_b[1] = client_socket_fd;
-  b_to_a[1] = fd;
-  pthread_create(thread_a, NULL, proxy_worker, a_to_b);
-  pthread_create(thread_b, NULL, proxy_worker, b_to_a);
+  worker->index = index;
+  worker->idle = 0;
+  worker->next_victim = index;
+  worker->request_handler = request_handler;
+  worker->work_queue = work_queue;
+  return worker;
 }
 
-void* worker_routine(void* aux){
-    void(*request_handler)(int) = aux;
+void start_worker(struct worker *worker) {
+  if (pthread_create(&worker->thread, NULL, worker_routine, worker) != 0) {
+    perror("Failed to start worker");
+    exit(errno);
+  }
+  pthread_detach(worker->thread);
+}
 
-    while(1){
-      int client_socket_number  = wq_pop(&work_queue);
-      request_handler(client_socket_number);
+/*
+ * Starts one more worker on listener QUEUE's work queue, in the first free
+ * slot. Called by the pool sizer, the only one to add or retire workers
+ * once the pool has started. Returns -1 if no slot is free, as happens
+ * right after a shrink until the retiring workers have exited, or if the
+ * thread cannot be started.
+ */
+int add_worker(int queue) {
+  for (int i = 0; i < max_threads; i++) {
+    if (__atomic_load_n(&workers[i], __ATOMIC_ACQUIRE) != NULL) continue;
+    struct worker *worker = new_worker(i, &work_queues[queue],
+        workers_request_handler);
+    workers[i] = worker;
+    if (pthread_create(&worker->thread, NULL, worker_routine, worker) != 0) {
+      workers[i] = NULL;
+      free(worker);
+      return -1;
     }
-    
-    return NULL;
+    pthread_detach(worker->thread);
+    return 0;
+  }
+  return -1;
 }
 
+/* Has the next worker to pop listener QUEUE's work queue exit. */
+void remove_worker(int queue) {
+  wq_push(&work_queues[queue], RETIRE_WORKER);
+}
 
 void init_thread_pool(int num_threads, void (*request_handler)(int)) {
+  workers = calloc(max_threads, sizeof(struct worker *));
+  workers_request_handler = request_handler;
+
   /*
-   * TODO: Part of your solution for Task 2 goes here!
+   * Workers are dealt round-robin over the listeners, so every listener has
+   * at least one worker as long as num_threads >= num_listeners. All of them
+   * exist before any starts, since stealing looks at the others.
    */
   for(int i = 0; i < num_threads; i++){
-    pthread_t* thread = malloc(sizeof(pthread_t));
-    pthread_create(thread, NULL, worker_routine, request_handler);
+    struct worker* worker;
+    if (use_work_stealing) {
+      worker = new_worker(i, NULL, request_handler);
+      wq_init(&worker->inbox);
+      dq_init(&worker->deque);
+      worker->work_queue = &worker->inbox;
+    } else {
+      worker = new_worker(i, &work_queues[i % num_listeners], request_handler);
+    }
+    workers[i] = worker;
+  }
+
+  for(int i = 0; i < num_threads; i++)
+    start_worker(workers[i]);
+
+  if (max_threads > min_threads) {
+    static as_config_t config;
+    int initial[num_listeners];
+    for (int i = 0; i < num_listeners; i++)
+      initial[i] = num_threads / num_listeners + (i < num_threads % num_listeners);
+    config.min_workers = min_threads;
+    config.max_workers = max_threads;
+    config.add_worker = add_worker;
+    config.remove_worker = remove_worker;
+    as_init(work_queues, num_listeners, initial, &config);
   }
 }
 
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Pins the calling thread to one online CPU, chosen by INDEX.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+void pin_to_cpu(int index) {
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpu_set;
+
+  if (num_cpus < 1) return;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(index % num_cpus, &cpu_set);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+}
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
+/*
+ * Opens a TCP stream socket listening on all interfaces with port number
+ * server_port. With REUSE_PORT several such sockets can share the port, and
+ * the kernel spreads incoming connections across them.
+ */
+int open_server_socket(int reuse_port) {
+  struct sockaddr_in server_address;
+  int socket_number;
 
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
+  socket_number = socket(PF_INET, SOCK_STREAM, 0);
+  if (socket_number == -1) {
     perror("Failed to create a new socket");
     exit(errno);
   }
 
   int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+  if (setsockopt(socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
         sizeof(socket_option)) == -1) {
     perror("Failed to set socket options");
     exit(errno);
   }
 
+  if (reuse_port && setsockopt(socket_number, SOL_SOCKET, SO_REUSEPORT,
+        &socket_option, sizeof(socket_option)) == -1) {
+    perror("Failed to set SO_REUSEPORT");
+    exit(errno);
+  }
+
   memset(&server_address, 0, sizeof(server_address));
   server_address.sin_family = AF_INET;
   server_address.sin_addr.s_addr = INADDR_ANY;
   server_address.sin_port = htons(server_port);
 
-  if (bind(*socket_number, (struct sockaddr *) &server_address,
+  if (bind(socket_number, (struct sockaddr *) &server_address,
         sizeof(server_address)) == -1) {
     perror("Failed to bind on socket");
     exit(errno);
   }
 
-  if (listen(*socket_number, 1024) == -1) {
+  if (listen(socket_number, 1024) == -1) {
     perror("Failed to listen on socket");
     exit(errno);
   }
 
-  printf("Listening on port %d...\n", server_port);
+  return socket_number;
+}
 
-  init_thread_pool(num_threads, request_handler);
+/*
+ * An acceptor owns one listening socket and feeds its own work queue.
+ */
+struct acceptor {
+  int index;
+  int socket_number;
+  wq_t *work_queue;
+  int next_worker;            /* With --scheduler steal, the next inbox. */
+  pthread_t thread;
+};
+
+/*
+ * Answers a connection the server is too busy for with a 503, without reading
+ * its request, and closes it (see admission.h). Whatever the client already
+ * sent is read first, so closing does not reset the connection under the
+ * response.
+ */
+void shed_connection(int fd) {
+  static const char response[] = "HTTP/1.1 503 Service Unavailable\r\n"
+      "Content-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+  char discard[4096];
+  ka_connection_t *ka_connection = keepalive_timeout_ms > 0 ? ka_get(fd) : NULL;
+
+  send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  shutdown(fd, SHUT_WR);
+  while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+    ;
+  if (ka_connection != NULL)
+    ka_close(ka_connection);
+  else
+    close(fd);
+}
+
+/* Hands a new connection to the listener's queue if it admits it, or with
+ * work stealing to the next of the listener's workers in turn. */
+void dispatch_connection(struct acceptor *acceptor, int client_socket_number) {
+  if (!use_work_stealing) {
+    if (ad_admit(acceptor->index, client_socket_number))
+      wq_push(acceptor->work_queue, client_socket_number);
+    return;
+  }
+  wq_push(workers[acceptor->next_worker]->work_queue, client_socket_number);
+  acceptor->next_worker += num_listeners;
+  if (acceptor->next_worker >= num_threads)
+    acceptor->next_worker = acceptor->index;
+}
+
+void* acceptor_routine(void* aux) {
+  struct acceptor *acceptor = aux;
+  int client_socket_number;
+
+  if (num_listeners > 1)
+    pin_to_cpu(acceptor->index);
 
   while (1) {
-    client_socket_number = accept(*socket_number,
-        (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
+    /* Requests are logged once answered (see access_log.h), not here. */
+    client_socket_number = accept(acceptor->socket_number, NULL, NULL);
     if (client_socket_number < 0) {
       perror("Error accepting socket");
       continue;
     }
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+    dispatch_connection(acceptor, client_socket_number);
+  }
 
-    // TODO: Change me?
-    wq_push(&work_queue, client_socket_number);
+  return NULL;
+}
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+/*
+ * Opens num_listeners TCP stream sockets on all interfaces with port number
+ * server_port. Saves the fd number of the first server socket in
+ * *socket_number. For each accepted connection, calls request_handler with
+ * the accepted fd number.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+  int server_sockets[num_listeners];
+
+  for (int i = 0; i < num_listeners; i++)
+    server_sockets[i] = open_server_socket(num_listeners > 1);
+  *socket_number = server_sockets[0];
+
+  printf("Listening on port %d...\n", server_port);
+
+  if (use_event_loop) {
+    el_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.num_reactors = num_threads;
+    config.pin_reactors = num_listeners > 1;
+    config.keepalive_timeout_ms = keepalive_timeout_ms;
+    config.keepalive_max_requests = keepalive_max_requests;
+    if (request_handler == handle_proxy_request) {
+      config.upstreams = &upstreams;
+      rl_init();
+    }
+    else
+      config.files_handler = prepare_files_response;
+    el_serve_forever(server_sockets, num_listeners, &config);
+  }
+
+  if (use_io_uring && request_handler != handle_files_request) {
+    printf("io_uring only serves files; serving with threads\n");
+    use_io_uring = 0;
+  } else if (use_io_uring && !ur_supported()) {
+    printf("io_uring is not available; serving with threads\n");
+    use_io_uring = 0;
+  }
+  if (use_io_uring) {
+    ur_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.num_rings = num_threads;
+    config.pin_rings = num_listeners > 1;
+    config.keepalive_timeout_ms = keepalive_timeout_ms;
+    config.keepalive_max_requests = keepalive_max_requests;
+    config.files_handler = prepare_files_response;
+    ur_serve_forever(server_sockets, num_listeners, &config);
   }
 
-  shutdown(*socket_number, SHUT_RDWR);
-  close(*socket_number);
+  /* Queues keep producer and consumer indexes on separate cache lines. */
+  if (posix_memalign((void **) &work_queues, 64, sizeof(wq_t) * num_listeners)) {
+    perror("Failed to allocate work queues");
+    exit(ENOMEM);
+  }
+  for (int i = 0; i < num_listeners; i++)
+    wq_init(&work_queues[i]);
+  ad_init(work_queues, num_listeners, overload_policy, queue_limit, shed_connection);
+
+  if (keepalive_timeout_ms > 0)
+    ka_init(keepalive_timeout_ms);
+
+  if (header_timeout_ms > 0 || send_timeout_ms > 0 || proxy_timeout_ms > 0) {
+    int timeouts_ms[WD_NUM_PHASES];
+    timeouts_ms[WD_HEAD] = header_timeout_ms;
+    timeouts_ms[WD_SEND] = send_timeout_ms;
+    timeouts_ms[WD_PROXY] = proxy_timeout_ms;
+    wd_init(timeouts_ms);
+    use_watchdog = 1;
+  }
+
+  if (request_handler == handle_proxy_request)
+    rl_init();
+
+  init_thread_pool(num_threads, request_handler);
+
+  /* The calling thread becomes the last acceptor. */
+  for (int i = 0; i < num_listeners; i++) {
+    struct acceptor *acceptor = malloc(sizeof(struct acceptor));
+    acceptor->index = i;
+    acceptor->socket_number = server_sockets[i];
+    acceptor->work_queue = &work_queues[i];
+    acceptor->next_worker = i;
+    if (i == num_listeners - 1)
+      acceptor_routine(acceptor);
+    else
+      pthread_create(&acceptor->thread, NULL, acceptor_routine, acceptor);
+  }
 }
 
 int server_fd;
@@ -389,8 +1184,88 @@ void signal_callback_handler(int signum) {
 }
 
 char *USAGE =
-  "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5] [--listeners 1] [--event-loop|--io-uring]\n"
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80[,host:port...] --port 8000 [--num-threads 5] [--listeners 1] [--event-loop]\n"
+  "\n"
+  "  --event-loop    serve with --num-threads non-blocking epoll reactors\n"
+  "                  instead of a pool of blocking workers\n"
+  "  --io-uring      serve files from --num-threads io_uring rings, which\n"
+  "                  batch accepts, receives, file reads and sends into few\n"
+  "                  system calls; falls back to the pool on kernels without\n"
+  "                  io_uring\n"
+  "  --scheduler fifo|steal\n"
+  "                  how the pool's workers get connections: from one FIFO\n"
+  "                  queue per listener (default), or from per-worker deques\n"
+  "                  that idle workers steal from\n"
+  "  --min-threads N, --max-threads N\n"
+  "                  let the pool of workers shrink to N and grow to N,\n"
+  "                  starting from --num-threads: it grows while queued\n"
+  "                  connections wait over 5 ms and shrinks after 2 seconds\n"
+  "                  with idle workers (default both --num-threads; fifo only);\n"
+  "                  only then does /__stats show the workers per queue, the\n"
+  "                  wait estimates and the workers added and removed\n"
+  "  --overload block|reject|drop-oldest|codel\n"
+  "                  what a listener's queue does when its workers fall\n"
+  "                  behind: make the acceptor wait (default), answer new\n"
+  "                  connections 503 once --queue-limit are queued, answer\n"
+  "                  the oldest queued one 503 to make room instead, or also\n"
+  "                  answer 503 to those that keep waiting over 5 ms for\n"
+  "                  100 ms (CoDel); fifo only\n"
+  "  --queue-limit N most connections queued per listener before shedding\n"
+  "                  (default 1024)\n"
+  "  --listeners N   open N SO_REUSEPORT sockets, each with its own acceptor\n"
+  "                  pinned to a core and its own work queue\n"
+  "  --cache-size B  keep up to B bytes of small files in memory (default\n"
+  "                  32 MiB, 0 disables the cache)\n"
+  "  --cache-max-file B\n"
+  "                  only cache files of at most B bytes (default 256 KiB)\n"
+  "  --compress-cache B\n"
+  "                  keep up to B bytes of compressed text files in memory\n"
+  "                  for clients that accept them (default 16 MiB); 0 only\n"
+  "                  serves precompressed FILE.br and FILE.gz siblings\n"
+  "  --path-cache N  keep up to N resolved files and directories open\n"
+  "                  (default 256)\n"
+  "  --keepalive-timeout S\n"
+  "                  close persistent connections idle for S seconds\n"
+  "                  (default 5, 0 closes after every response)\n"
+  "  --keepalive-requests N\n"
+  "                  close persistent connections after N requests (default 100)\n"
+  "  --header-timeout S\n"
+  "                  close connections whose request head takes over S\n"
+  "                  seconds to arrive (default 10; pool only)\n"
+  "  --send-timeout S\n"
+  "                  close connections that take no response bytes for S\n"
+  "                  seconds, noticed within 2S (default 30; pool only)\n"
+  "  --proxy-timeout S\n"
+  "                  close proxied connections on which nothing moves for S\n"
+  "                  seconds, upgraded ones included; also bounds connecting\n"
+  "                  to a target and each read or write on it (default 30)\n"
+  "  --balance round-robin|least-conn|hash\n"
+  "                  how requests are spread over several proxy targets: in\n"
+  "                  turn (default), to the one with the fewest requests in\n"
+  "                  flight, or by a consistent hash of the path; a target\n"
+  "                  that fails 3 times in a row is skipped for 10 seconds\n"
+  "  --upstream-connections N\n"
+  "                  keep at most N connections open to each proxy target\n"
+  "                  (default 64)\n"
+  "  --dns-ttl S     look proxy targets up again after S seconds (default 60)\n"
+  "  --proxy-cache B keep up to B bytes of cacheable proxied responses in\n"
+  "                  memory (default 0, disabled; not with --event-loop)\n"
+  "  --proxy-cache-max-object B\n"
+  "                  only cache responses of at most B bytes (default 1 MiB)\n"
+  "  --proxy-cache-spill FILE\n"
+  "                  move responses evicted from memory to FILE, mapped into\n"
+  "                  memory and overwritten oldest first\n"
+  "  --proxy-cache-spill-size B\n"
+  "                  size of the spill file (default 256 MiB)\n"
+  "  --access-log FILE\n"
+  "                  append a line per request answered to FILE (- for\n"
+  "                  standard output), written from a background thread\n"
+  "\n"
+  "GET /__stats answers with request counts, latencies, status codes, busy time,\n"
+  "queue depths, pool sizes, shed connections, expired deadlines, the health,\n"
+  "counts and latencies of each proxy target and the proxy cache's hits in the\n"
+  "Prometheus text format (with --event-loop, only when serving files).\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -399,12 +1274,13 @@ void exit_with_usage() {
 
 int main(int argc, char **argv) {
   signal(SIGINT, signal_callback_handler);
+  signal(SIGPIPE, SIG_IGN);
 
   /* Default settings */
   server_port = 8000;
   void (*request_handler)(int) = NULL;
-  wq_init(&work_queue);
   num_threads = 1;
+  num_listeners = 1;
 
   int i;
   for (i = 1; i < argc; i++) {
@@ -419,21 +1295,11 @@ int main(int argc, char **argv) {
     } else if (strcmp("--proxy", argv[i]) == 0) {
       request_handler = handle_proxy_request;
 
-      char *proxy_target = argv[++i];
-      if (!proxy_target) {
+      server_proxy_targets = argv[++i];
+      if (!server_proxy_targets) {
         fprintf(stderr, "Expected argument after --proxy\n");
         exit_with_usage();
       }
-
-      char *colon_pointer = strchr(proxy_target, ':');
-      if (colon_pointer != NULL) {
-        *colon_pointer = '\0';
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = atoi(colon_pointer + 1);
-      } else {
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = 80;
-      }
     } else if (strcmp("--port", argv[i]) == 0) {
       char *server_port_string = argv[++i];
       if (!server_port_string) {
@@ -447,6 +1313,179 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--min-threads", argv[i]) == 0) {
+      char *min_threads_str = argv[++i];
+      if (!min_threads_str || (min_threads = atoi(min_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --min-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-threads", argv[i]) == 0) {
+      char *max_threads_str = argv[++i];
+      if (!max_threads_str || (max_threads = atoi(max_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--overload", argv[i]) == 0) {
+      char *overload_str = argv[++i];
+      if (overload_str && strcmp(overload_str, "block") == 0) {
+        overload_policy = AD_BLOCK;
+      } else if (overload_str && strcmp(overload_str, "reject") == 0) {
+        overload_policy = AD_REJECT;
+      } else if (overload_str && strcmp(overload_str, "drop-oldest") == 0) {
+        overload_policy = AD_DROP_OLDEST;
+      } else if (overload_str && strcmp(overload_str, "codel") == 0) {
+        overload_policy = AD_CODEL;
+      } else {
+        fprintf(stderr, "Expected block, reject, drop-oldest or codel after --overload\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-limit", argv[i]) == 0) {
+      char *queue_limit_str = argv[++i];
+      if (!queue_limit_str || (queue_limit = strtoul(queue_limit_str, NULL, 10)) < 1 ||
+          queue_limit > WQ_CAPACITY) {
+        fprintf(stderr, "Expected positive integer at most %d after --queue-limit\n", WQ_CAPACITY);
+        exit_with_usage();
+      }
+    } else if (strcmp("--listeners", argv[i]) == 0) {
+      char *num_listeners_str = argv[++i];
+      if (!num_listeners_str || (num_listeners = atoi(num_listeners_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --listeners\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-size", argv[i]) == 0) {
+      char *cache_size_str = argv[++i];
+      if (!cache_size_str) {
+        fprintf(stderr, "Expected number of bytes after --cache-size\n");
+        exit_with_usage();
+      }
+      file_cache_size = strtoull(cache_size_str, NULL, 10);
+    } else if (strcmp("--cache-max-file", argv[i]) == 0) {
+      char *cache_max_file_str = argv[++i];
+      if (!cache_max_file_str) {
+        fprintf(stderr, "Expected number of bytes after --cache-max-file\n");
+        exit_with_usage();
+      }
+      file_cache_max_file = strtoull(cache_max_file_str, NULL, 10);
+    } else if (strcmp("--compress-cache", argv[i]) == 0) {
+      char *compress_cache_str = argv[++i];
+      if (!compress_cache_str) {
+        fprintf(stderr, "Expected number of bytes after --compress-cache\n");
+        exit_with_usage();
+      }
+      encoded_cache_size = strtoull(compress_cache_str, NULL, 10);
+    } else if (strcmp("--path-cache", argv[i]) == 0) {
+      char *path_cache_str = argv[++i];
+      if (!path_cache_str) {
+        fprintf(stderr, "Expected number of files after --path-cache\n");
+        exit_with_usage();
+      }
+      path_cache_size = strtoull(path_cache_str, NULL, 10);
+    } else if (strcmp("--keepalive-timeout", argv[i]) == 0) {
+      char *keepalive_timeout_str = argv[++i];
+      if (!keepalive_timeout_str) {
+        fprintf(stderr, "Expected number of seconds after --keepalive-timeout\n");
+        exit_with_usage();
+      }
+      keepalive_timeout_ms = atof(keepalive_timeout_str) * 1000;
+    } else if (strcmp("--header-timeout", argv[i]) == 0) {
+      char *header_timeout_str = argv[++i];
+      if (!header_timeout_str) {
+        fprintf(stderr, "Expected number of seconds after --header-timeout\n");
+        exit_with_usage();
+      }
+      header_timeout_ms = atof(header_timeout_str) * 1000;
+    } else if (strcmp("--send-timeout", argv[i]) == 0) {
+      char *send_timeout_str = argv[++i];
+      if (!send_timeout_str) {
+        fprintf(stderr, "Expected number of seconds after --send-timeout\n");
+        exit_with_usage();
+      }
+      send_timeout_ms = atof(send_timeout_str) * 1000;
+    } else if (strcmp("--proxy-timeout", argv[i]) == 0) {
+      char *proxy_timeout_str = argv[++i];
+      if (!proxy_timeout_str) {
+        fprintf(stderr, "Expected number of seconds after --proxy-timeout\n");
+        exit_with_usage();
+      }
+      proxy_timeout_ms = atof(proxy_timeout_str) * 1000;
+    } else if (strcmp("--keepalive-requests", argv[i]) == 0) {
+      char *keepalive_requests_str = argv[++i];
+      if (!keepalive_requests_str || (keepalive_max_requests = atoi(keepalive_requests_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --keepalive-requests\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--upstream-connections", argv[i]) == 0) {
+      char *upstream_connections_str = argv[++i];
+      if (!upstream_connections_str || (upstream_max_connections = atoi(upstream_connections_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --upstream-connections\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--balance", argv[i]) == 0) {
+      char *balance_str = argv[++i];
+      if (balance_str && strcmp(balance_str, "round-robin") == 0) {
+        upstream_balance = UP_ROUND_ROBIN;
+      } else if (balance_str && strcmp(balance_str, "least-conn") == 0) {
+        upstream_balance = UP_LEAST_CONNECTIONS;
+      } else if (balance_str && strcmp(balance_str, "hash") == 0) {
+        upstream_balance = UP_HASH;
+      } else {
+        fprintf(stderr, "Expected round-robin, least-conn or hash after --balance\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-cache", argv[i]) == 0) {
+      char *proxy_cache_str = argv[++i];
+      if (!proxy_cache_str) {
+        fprintf(stderr, "Expected number of bytes after --proxy-cache\n");
+        exit_with_usage();
+      }
+      proxy_cache_size = strtoull(proxy_cache_str, NULL, 10);
+    } else if (strcmp("--proxy-cache-max-object", argv[i]) == 0) {
+      char *proxy_cache_max_object_str = argv[++i];
+      if (!proxy_cache_max_object_str) {
+        fprintf(stderr, "Expected number of bytes after --proxy-cache-max-object\n");
+        exit_with_usage();
+      }
+      proxy_cache_max_object = strtoull(proxy_cache_max_object_str, NULL, 10);
+    } else if (strcmp("--proxy-cache-spill", argv[i]) == 0) {
+      proxy_cache_spill_path = argv[++i];
+      if (!proxy_cache_spill_path) {
+        fprintf(stderr, "Expected file name after --proxy-cache-spill\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-cache-spill-size", argv[i]) == 0) {
+      char *proxy_cache_spill_size_str = argv[++i];
+      if (!proxy_cache_spill_size_str ||
+          (proxy_cache_spill_size = strtoull(proxy_cache_spill_size_str, NULL, 10)) == 0) {
+        fprintf(stderr, "Expected positive number of bytes after --proxy-cache-spill-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--dns-ttl", argv[i]) == 0) {
+      char *dns_ttl_str = argv[++i];
+      if (!dns_ttl_str) {
+        fprintf(stderr, "Expected number of seconds after --dns-ttl\n");
+        exit_with_usage();
+      }
+      up_set_dns_ttl(atof(dns_ttl_str) * 1000);
+    } else if (strcmp("--access-log", argv[i]) == 0) {
+      access_log_path = argv[++i];
+      if (!access_log_path) {
+        fprintf(stderr, "Expected file name after --access-log\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--event-loop", argv[i]) == 0) {
+      use_event_loop = 1;
+    } else if (strcmp("--io-uring", argv[i]) == 0) {
+      use_io_uring = 1;
+    } else if (strcmp("--scheduler", argv[i]) == 0) {
+      char *scheduler_str = argv[++i];
+      if (scheduler_str && strcmp(scheduler_str, "fifo") == 0) {
+        use_work_stealing = 0;
+      } else if (scheduler_str && strcmp(scheduler_str, "steal") == 0) {
+        use_work_stealing = 1;
+      } else {
+        fprintf(stderr, "Expected fifo or steal after --scheduler\n");
+        exit_with_usage();
+      }
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -455,11 +1494,81 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (server_files_directory == NULL && server_proxy_hostname == NULL) {
+  if (use_event_loop && use_io_uring) {
+    fprintf(stderr, "Expected at most one of --event-loop and --io-uring\n");
+    exit_with_usage();
+  }
+
+  if (overload_policy != AD_BLOCK && (use_event_loop || use_io_uring || use_work_stealing)) {
+    fprintf(stderr, "Expected the pool with --scheduler fifo with --overload\n");
+    exit_with_usage();
+  }
+
+  if (server_files_directory == NULL && server_proxy_targets == NULL) {
     fprintf(stderr, "Please specify either \"--files [DIRECTORY]\" or \n"
-                    "                      \"--proxy [HOSTNAME:PORT]\"\n");
+                    "                      \"--proxy [HOSTNAME:PORT,...]\"\n");
+    exit_with_usage();
+  }
+
+  if (request_handler == handle_proxy_request) {
+    up_set_io_timeout(proxy_timeout_ms);
+    rl_set_idle_timeout(proxy_timeout_ms);
+    if (up_group_init(&upstreams, server_proxy_targets, upstream_balance,
+          upstream_max_connections) == -1) {
+      fprintf(stderr, "Expected at most %d HOSTNAME[:PORT] separated by commas "
+          "after --proxy\n", UP_MAX_UPSTREAMS);
+      exit_with_usage();
+    }
+    resolve_proxy_targets();
+
+    if (proxy_cache_size > 0) {
+      pc_init(&proxy_cache, proxy_cache_size, proxy_cache_max_object);
+      if (proxy_cache_spill_path != NULL &&
+          pc_spill_to(&proxy_cache, proxy_cache_spill_path,
+            proxy_cache_spill_size) == -1) {
+        perror("Failed to map the proxy cache spill file");
+        exit(errno);
+      }
+    }
+  }
+
+  fc_init(&file_cache, file_cache_size, file_cache_max_file);
+  fc_init(&encoded_cache, encoded_cache_size, file_cache_max_file);
+  if (request_handler == handle_files_request &&
+      dr_init(&docroot, server_files_directory, path_cache_size) == -1) {
+    perror("Failed to open the files directory");
+    exit(errno);
+  }
+
+  if (access_log_path != NULL && al_init(access_log_path) == -1) {
+    perror("Failed to open the access log");
+    exit(errno);
+  }
+
+  /* Every listener needs at least one worker (or reactor) draining it. */
+  if (num_threads < num_listeners)
+    num_threads = num_listeners;
+
+  /* Without bounds the pool stays at --num-threads; with them it starts
+   * there (within the bounds) and the pool sizer takes over. */
+  if (min_threads == 0)
+    min_threads = num_threads;
+  if (max_threads == 0)
+    max_threads = num_threads > min_threads ? num_threads : min_threads;
+  if (min_threads > max_threads) {
+    fprintf(stderr, "Expected --min-threads at most --max-threads\n");
+    exit_with_usage();
+  }
+  if (min_threads < num_listeners)
+    min_threads = num_listeners;
+  if (max_threads < min_threads)
+    max_threads = min_threads;
+  if (max_threads > min_threads && use_work_stealing) {
+    fprintf(stderr, "Expected --scheduler fifo with --min-threads or --max-threads\n");
     exit_with_usage();
   }
+  if (num_threads < min_threads) num_threads = min_threads;
+  if (num_threads > max_threads) num_threads = max_threads;
 
   serve_forever(&server_fd, request_handler);
 
@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "keepalive.h"
+
+#define KA_MAX_EVENTS 256
+#define KA_TICK_MS 250
+
+static ka_connection_t **ka_table;
+static size_t ka_table_size;
+static int ka_timeout_ms;
+static int ka_epoll_fd;
+
+/* Guards the idle list and the registered flags. */
+static pthread_mutex_t ka_lock = PTHREAD_MUTEX_INITIALIZER;
+static ka_connection_t *ka_idle_head;
+static ka_connection_t *ka_idle_tail;
+
+static int ka_expired(struct timespec *deadline, struct timespec *now) {
+  return now->tv_sec > deadline->tv_sec ||
+      (now->tv_sec == deadline->tv_sec && now->tv_nsec >= deadline->tv_nsec);
+}
+
+static void ka_unlink(ka_connection_t *connection) {
+  if (connection->prev) connection->prev->next = connection->next;
+  else ka_idle_head = connection->next;
+  if (connection->next) connection->next->prev = connection->prev;
+  else ka_idle_tail = connection->prev;
+  connection->prev = connection->next = NULL;
+}
+
+static void *ka_watch_routine(void *aux) {
+  struct epoll_event events[KA_MAX_EVENTS];
+  ka_connection_t *ready[KA_MAX_EVENTS];
+  ka_connection_t *connection;
+  struct timespec now;
+  int num_events, i;
+
+  while (1) {
+    num_events = epoll_wait(ka_epoll_fd, events, KA_MAX_EVENTS, KA_TICK_MS);
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to wait for idle connections");
+      exit(errno);
+    }
+
+    pthread_mutex_lock(&ka_lock);
+    for (i = 0; i < num_events; i++) {
+      ready[i] = events[i].data.ptr;
+      ka_unlink(ready[i]);
+    }
+
+    /* Everyone parks for the same timeout, so the list is in deadline order. */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (ka_idle_head != NULL && ka_expired(&ka_idle_head->deadline, &now)) {
+      connection = ka_idle_head;
+      ka_unlink(connection);
+      ka_close(connection);
+    }
+    pthread_mutex_unlock(&ka_lock);
+
+    for (i = 0; i < num_events; i++)
+      wq_push(ready[i]->work_queue, ready[i]->http.fd);
+  }
+
+  return NULL;
+}
+
+void ka_init(int timeout_ms) {
+  struct rlimit limit;
+  pthread_t thread;
+
+  ka_timeout_ms = timeout_ms;
+  ka_table_size = 65536;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    ka_table_size = limit.rlim_cur;
+  ka_table = calloc(ka_table_size, sizeof(ka_connection_t *));
+
+  ka_epoll_fd = epoll_create1(0);
+  if (ka_table == NULL || ka_epoll_fd == -1) {
+    perror("Failed to set up keep-alive connections");
+    exit(errno);
+  }
+  pthread_create(&thread, NULL, ka_watch_routine, NULL);
+  pthread_detach(thread);
+}
+
+ka_connection_t *ka_get(int fd) {
+  ka_connection_t *connection;
+
+  if (fd < 0 || (size_t) fd >= ka_table_size) return NULL;
+
+  /* Slots are kept once allocated, since fd numbers are reused quickly. */
+  connection = ka_table[fd];
+  if (connection == NULL) {
+    connection = calloc(1, sizeof(ka_connection_t));
+    if (connection == NULL) return NULL;
+    ka_table[fd] = connection;
+  }
+  if (!connection->in_use) {
+    http_connection_init(&connection->http, fd);
+    connection->in_use = 1;
+    connection->registered = 0;
+  }
+  return connection;
+}
+
+void ka_park(ka_connection_t *connection, wq_t *work_queue) {
+  struct epoll_event event;
+  int operation;
+
+  connection->work_queue = work_queue;
+
+  pthread_mutex_lock(&ka_lock);
+  clock_gettime(CLOCK_MONOTONIC, &connection->deadline);
+  connection->deadline.tv_sec += ka_timeout_ms / 1000;
+  connection->deadline.tv_nsec += (ka_timeout_ms % 1000) * 1000000L;
+  if (connection->deadline.tv_nsec >= 1000000000L) {
+    connection->deadline.tv_sec++;
+    connection->deadline.tv_nsec -= 1000000000L;
+  }
+  connection->prev = ka_idle_tail;
+  connection->next = NULL;
+  if (ka_idle_tail) ka_idle_tail->next = connection;
+  else ka_idle_head = connection;
+  ka_idle_tail = connection;
+
+  /* One-shot, so only one worker ever owns the fd at a time. */
+  event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  event.data.ptr = connection;
+  operation = connection->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(ka_epoll_fd, operation, connection->http.fd, &event) == -1) {
+    ka_unlink(connection);
+    ka_close(connection);
+  } else {
+    connection->registered = 1;
+  }
+  pthread_mutex_unlock(&ka_lock);
+}
+
+void ka_close(ka_connection_t *connection) {
+  /* Once closed, the fd number may be accepted again at any moment. */
+  connection->in_use = 0;
+  close(connection->http.fd);
+}
+
+void ka_release(ka_connection_t *connection) {
+  connection->in_use = 0;
+}
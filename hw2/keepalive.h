@@ -0,0 +1,43 @@
+#ifndef __KEEPALIVE__
+#define __KEEPALIVE__
+
+#include <time.h>
+
+#include "libhttp.h"
+#include "wq.h"
+
+/* KEEPALIVE holds persistent connections between requests. The state of a
+ * connection (its read buffer, which may already hold the start of the next
+ * request) lives in a table indexed by fd, so whichever worker pops the fd
+ * picks it up. Idle connections wait in an epoll set watched by a single
+ * thread instead of a worker: when the client sends its next request the fd
+ * is pushed back on its work queue, and after the idle timeout it is closed. */
+
+typedef struct ka_connection {
+  struct http_connection http;
+  wq_t *work_queue;             /* Where the fd goes once it is readable. */
+  int in_use;
+  int registered;               /* Added to the idle epoll set. */
+  struct timespec deadline;
+  struct ka_connection *prev;   /* Idle list, oldest first. */
+  struct ka_connection *next;
+} ka_connection_t;
+
+/* Starts the idle watcher. Connections idle for TIMEOUT_MS are closed. */
+void ka_init(int timeout_ms);
+
+/* Returns the state of connection FD, fresh if FD was not seen since it was
+ * last closed, or NULL if FD is beyond the table. */
+ka_connection_t *ka_get(int fd);
+
+/* Hands an idle CONNECTION to the watcher until it is readable again. */
+void ka_park(ka_connection_t *connection, wq_t *work_queue);
+
+/* Closes CONNECTION and forgets its state. */
+void ka_close(ka_connection_t *connection);
+
+/* Forgets CONNECTION's state but leaves its fd open, for a connection that
+ * is handed over to something else for good. */
+void ka_release(ka_connection_t *connection);
+
+#endif
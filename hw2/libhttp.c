@@ -1,70 +1,411 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "libhttp.h"
 
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define LIBHTTP_COPY_CHUNK_SIZE 65536
 
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
+enum http_parser_state {
+  HTTP_PARSER_METHOD,
+  HTTP_PARSER_PATH,
+  HTTP_PARSER_VERSION,
+  HTTP_PARSER_LINE_LF,      /* After a CR ending the request or a header line. */
+  HTTP_PARSER_HEADER,       /* At the start of a header line. */
+  HTTP_PARSER_NAME,
+  HTTP_PARSER_VALUE_START,
+  HTTP_PARSER_VALUE,
+  HTTP_PARSER_HEAD_LF,      /* After the CR of the blank line. */
+  HTTP_PARSER_BODY,         /* Head parsed, waiting for the body to arrive. */
+  HTTP_PARSER_DONE,
+  HTTP_PARSER_ERROR,
+};
+
 struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
+  struct http_connection *connection = malloc(sizeof(struct http_connection));
+  if (!connection) http_fatal_error("Malloc failed");
 
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
+  http_connection_init(connection, fd);
+  struct http_request *request = http_connection_next_request(connection);
+  if (request == NULL) free(connection);
+  return request;
+}
 
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
+void http_request_free(struct http_request *request) {
+  /* Requests from http_request_parse live inside their connection. */
+  free((char *) request - offsetof(struct http_connection, request));
+}
 
-  char *read_start, *read_end;
-  size_t read_size;
+char *http_request_header(struct http_request *request, const char *name) {
+  size_t name_length = strlen(name);
 
-  do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
-
-    free(read_buffer);
-    return request;
-  } while (0);
-
-  /* An error occurred. */
-  free(request);
-  free(read_buffer);
+  for (size_t i = 0; i < request->num_headers; i++)
+    if (request->headers[i].name_length == name_length &&
+        strcasecmp(request->headers[i].name, name) == 0)
+      return request->headers[i].value;
   return NULL;
+}
+
+static void http_parser_reset(struct http_connection *connection) {
+  connection->state = HTTP_PARSER_METHOD;
+  connection->parsed = 0;
+  memset(&connection->request, 0, offsetof(struct http_request, headers));
+}
+
+void http_connection_init(struct http_connection *connection, int fd) {
+  connection->fd = fd;
+  connection->start = 0;
+  connection->length = 0;
+  connection->request_length = 0;
+  connection->num_requests = 0;
+  connection->stream_bodies = 0;
+  http_parser_reset(connection);
+}
+
+/* Moves the request being parsed to the start of the buffer. */
+static void http_connection_compact(struct http_connection *connection) {
+  struct http_request *request = &connection->request;
+  size_t shift = connection->start;
+
+  memmove(connection->buffer, connection->buffer + shift,
+      connection->length - shift);
+  connection->length -= shift;
+  connection->start = 0;
+
+  if (request->method) request->method -= shift;
+  if (request->path) request->path -= shift;
+  for (size_t i = 0; i < request->num_headers; i++) {
+    request->headers[i].name -= shift;
+    request->headers[i].value -= shift;
+  }
+}
+
+char *http_connection_space(struct http_connection *connection, size_t *room) {
+  if (connection->length == LIBHTTP_REQUEST_MAX_SIZE &&
+      connection->request_length == 0)
+    http_connection_compact(connection);
+  *room = LIBHTTP_REQUEST_MAX_SIZE - connection->length;
+  return connection->buffer + connection->length;
+}
+
+void http_connection_received(struct http_connection *connection, size_t bytes) {
+  connection->length += bytes;
+}
+
+ssize_t http_connection_read(struct http_connection *connection) {
+  size_t room;
+  char *space = http_connection_space(connection, &room);
+
+  ssize_t bytes_read = read(connection->fd, space, room);
+  if (bytes_read > 0) http_connection_received(connection, bytes_read);
+  return bytes_read;
+}
+
+/* Case-insensitively matches TOKEN against the comma-separated list VALUE. */
+static int http_list_contains(char *value, const char *token) {
+  size_t token_length = strlen(token);
+
+  while (*value) {
+    while (*value == ' ' || *value == '\t' || *value == ',') value++;
+    size_t length = strcspn(value, ",");
+    size_t trimmed = length;
+    while (trimmed > 0 && (value[trimmed - 1] == ' ' || value[trimmed - 1] == '\t'))
+      trimmed--;
+    if (trimmed == token_length && strncasecmp(value, token, trimmed) == 0)
+      return 1;
+    value += length;
+  }
+  return 0;
+}
+
+/* Records the header whose value was just terminated, acting on the ones
+ * this library understands. Returns -1 if it makes the request malformed. */
+static int http_connection_add_header(struct http_connection *connection,
+    char *base) {
+  struct http_request *request = &connection->request;
+  struct http_header *header = &request->headers[request->num_headers++];
+  char *end;
+
+  header->name = base + connection->name;
+  header->name_length = connection->name_length;
+  header->value = base + connection->token;
+  header->value_length = connection->token_end - connection->token;
+
+  if (header->name_length == strlen("Content-Length") &&
+      strcasecmp(header->name, "Content-Length") == 0) {
+    if (header->value_length == 0 || *header->value < '0' || *header->value > '9')
+      return -1;
+    errno = 0;
+    unsigned long long content_length = strtoull(header->value, &end, 10);
+    if (*end != '\0' || errno == ERANGE ||
+        (content_length > LIBHTTP_REQUEST_MAX_SIZE && !connection->stream_bodies))
+      return -1;
+    request->content_length = content_length;
+  } else if (header->name_length == strlen("Transfer-Encoding") &&
+      strcasecmp(header->name, "Transfer-Encoding") == 0) {
+    /* Only a caller streaming bodies can find where a chunked one ends, and
+     * guessing its length wrong would misread whatever is pipelined behind
+     * it. Other codings cannot be framed at all. */
+    if (!connection->stream_bodies || strcasecmp(header->value, "chunked") != 0)
+      return -1;
+    request->chunked = 1;
+  }
+  return 0;
+}
+
+/* Called once the blank line ending the head, which HEAD_LENGTH includes,
+ * is parsed. */
+static int http_connection_end_head(struct http_connection *connection,
+    size_t head_length) {
+  struct http_request *request = &connection->request;
+  char *value = http_request_header(request, "Connection");
+
+  if (request->minor_version >= 1)
+    request->keep_alive = value == NULL || !http_list_contains(value, "close");
+  else
+    request->keep_alive = value != NULL && http_list_contains(value, "keep-alive");
+
+  /* Both would let the two ends of a proxy disagree on where it ends. */
+  if (request->chunked && http_request_header(request, "Content-Length") != NULL)
+    return -1;
+
+  /* Unless streamed, the body is skipped, so it has to fit in the buffer too. */
+  connection->head_length = head_length;
+  return !connection->stream_bodies &&
+      head_length + request->content_length > LIBHTTP_REQUEST_MAX_SIZE ? -1 : 0;
+}
+
+/*
+ * Runs the parser over the bytes that arrived since it last stopped. Method,
+ * path, header names and values are terminated in place by overwriting the
+ * delimiter that follows them, which the parser has already consumed. Each
+ * state scans as far as it can before the next one takes over, so a request
+ * that arrives in one read is parsed in one pass without per-byte dispatch.
+ */
+static void http_connection_run(struct http_connection *connection) {
+  struct http_request *request = &connection->request;
+  char *base = connection->buffer + connection->start;
+  char *end = connection->buffer + connection->length;
+  char *p = base + connection->parsed;
+  int state = connection->state;
+  char *version, *value_end;
+
+  while (p < end && state < HTTP_PARSER_BODY) {
+    switch (state) {
+      case HTTP_PARSER_METHOD:
+        while (p < end && *p >= 'A' && *p <= 'Z') p++;
+        if (p == end) break;
+        if (*p != ' ' || p == base) goto error;
+        *p++ = '\0';
+        request->method = base;
+        connection->token = p - base;
+        state = HTTP_PARSER_PATH;
+        break;
+
+      case HTTP_PARSER_PATH:
+        while (p < end && (unsigned char) *p > ' ' && *p != 0x7f) p++;
+        if (p == end) break;
+        if ((*p != ' ' && *p != '\r' && *p != '\n') ||
+            p == base + connection->token)
+          goto error;
+        /* A request line without a version is HTTP/0.9 style. */
+        state = *p == ' ' ? HTTP_PARSER_VERSION :
+            *p == '\r' ? HTTP_PARSER_LINE_LF : HTTP_PARSER_HEADER;
+        *p++ = '\0';
+        request->path = base + connection->token;
+        connection->token = p - base;
+        break;
+
+      case HTTP_PARSER_VERSION:
+        while (p < end && *p != '\r' && *p != '\n') p++;
+        if (p == end) break;
+        state = *p == '\r' ? HTTP_PARSER_LINE_LF : HTTP_PARSER_HEADER;
+        *p++ = '\0';
+        version = base + connection->token;
+        if (strncmp(version, "HTTP/1.", 7) == 0 && version[7] >= '1' &&
+            version[7] <= '9')
+          request->minor_version = 1;
+        break;
+
+      case HTTP_PARSER_LINE_LF:
+        if (*p++ != '\n') goto error;
+        state = HTTP_PARSER_HEADER;
+        break;
+
+      case HTTP_PARSER_HEADER:
+        if (*p == '\r') {
+          p++;
+          state = HTTP_PARSER_HEAD_LF;
+          break;
+        }
+        if (*p == '\n') {
+          p++;
+          if (http_connection_end_head(connection, p - base) < 0) goto error;
+          state = HTTP_PARSER_BODY;
+          break;
+        }
+        /* Folded header lines are obsolete; RFC 7230 lets us reject them. */
+        if (*p == ' ' || *p == '\t' || *p == ':') goto error;
+        if (request->num_headers == LIBHTTP_MAX_HEADERS) goto error;
+        connection->name = p - base;
+        state = HTTP_PARSER_NAME;
+        /* Fall through. */
+
+      case HTTP_PARSER_NAME:
+        while (p < end && *p != ':' && (unsigned char) *p > ' ') p++;
+        if (p == end) break;
+        if (*p != ':') goto error;
+        *p++ = '\0';
+        connection->name_length = p - 1 - base - connection->name;
+        state = HTTP_PARSER_VALUE_START;
+        /* Fall through. */
+
+      case HTTP_PARSER_VALUE_START:
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p == end) break;
+        connection->token = connection->token_end = p - base;
+        state = HTTP_PARSER_VALUE;
+        /* Fall through. */
+
+      case HTTP_PARSER_VALUE:
+        value_end = base + connection->token_end;
+        for (; p < end && *p != '\r' && *p != '\n'; p++)
+          if (*p != ' ' && *p != '\t') value_end = p + 1;
+        connection->token_end = value_end - base;
+        if (p == end) break;
+        state = *p == '\r' ? HTTP_PARSER_LINE_LF : HTTP_PARSER_HEADER;
+        p++;
+        *value_end = '\0';
+        if (http_connection_add_header(connection, base) < 0) goto error;
+        break;
+
+      case HTTP_PARSER_HEAD_LF:
+        if (*p++ != '\n') goto error;
+        if (http_connection_end_head(connection, p - base) < 0) goto error;
+        state = HTTP_PARSER_BODY;
+        break;
+    }
+  }
+
+  connection->parsed = p - base;
+  if (state == HTTP_PARSER_BODY && (connection->stream_bodies ||
+        connection->length - connection->start >=
+        connection->head_length + request->content_length))
+    state = HTTP_PARSER_DONE;
+  connection->state = state;
+  return;
+
+error:
+  connection->state = HTTP_PARSER_ERROR;
+}
+
+/* Drops the request returned last and parses as much of the next one as has
+ * arrived, without returning it. */
+static enum http_parse_status http_connection_advance(
+    struct http_connection *connection) {
+  if (connection->request_length > 0) {
+    connection->start += connection->request_length;
+    connection->request_length = 0;
+    if (connection->start == connection->length)
+      connection->start = connection->length = 0;
+    http_parser_reset(connection);
+  }
+
+  if (connection->state < HTTP_PARSER_DONE)
+    http_connection_run(connection);
+
+  if (connection->state == HTTP_PARSER_DONE)
+    return HTTP_PARSE_OK;
+  if (connection->state == HTTP_PARSER_ERROR)
+    return HTTP_PARSE_ERROR;
+  /* Out of room for the rest of a request that started at the very front. */
+  if (connection->start == 0 && connection->length == LIBHTTP_REQUEST_MAX_SIZE)
+    return HTTP_PARSE_ERROR;
+  return HTTP_PARSE_INCOMPLETE;
+}
+
+enum http_parse_status http_connection_parse(struct http_connection *connection,
+    struct http_request **request) {
+  enum http_parse_status status = http_connection_advance(connection);
+  if (status != HTTP_PARSE_OK) return status;
+
+  if (connection->stream_bodies) {
+    /* Room for reading the body through the buffer, in case it must be. */
+    if (connection->start > 0) http_connection_compact(connection);
+    connection->request_length = connection->head_length;
+  } else {
+    connection->request_length = connection->head_length +
+        connection->request.content_length;
+  }
+  connection->num_requests++;
+  *request = &connection->request;
+  return HTTP_PARSE_OK;
+}
+
+int http_connection_has_request(struct http_connection *connection) {
+  return http_connection_advance(connection) == HTTP_PARSE_OK;
+}
+
+struct http_request *http_connection_next_request(
+    struct http_connection *connection) {
+  struct http_request *request;
+
+  while (1) {
+    switch (http_connection_parse(connection, &request)) {
+      case HTTP_PARSE_OK:
+        return request;
+      case HTTP_PARSE_ERROR:
+        return NULL;
+      case HTTP_PARSE_INCOMPLETE:
+        if (http_connection_read(connection) <= 0) return NULL;
+        break;
+    }
+  }
+}
+
+char *http_connection_body(struct http_connection *connection) {
+  return connection->buffer + connection->start + connection->head_length;
+}
+
+void http_connection_stream_bodies(struct http_connection *connection) {
+  connection->stream_bodies = 1;
+}
+
+/* Body bytes taken so far are counted in request_length, past the head. */
+char *http_connection_buffered_body(struct http_connection *connection,
+    size_t *length) {
+  size_t offset = connection->start + connection->request_length;
 
+  *length = connection->length - offset;
+  return connection->buffer + offset;
+}
+
+void http_connection_take_body(struct http_connection *connection,
+    size_t length) {
+  connection->request_length += length;
+  /* Once all taken, what was read of the body makes room for the rest. */
+  if (connection->start + connection->request_length == connection->length) {
+    connection->length = connection->start + connection->head_length;
+    connection->request_length = connection->head_length;
+  }
 }
 
 char* http_get_response_message(int status_code) {
@@ -73,6 +414,8 @@ char* http_get_response_message(int status_code) {
       return "Continue";
     case 200:
       return "OK";
+    case 206:
+      return "Partial Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -89,21 +432,192 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 414:
+      return "URI Too Long";
+    case 416:
+      return "Range Not Satisfiable";
+    case 502:
+      return "Bad Gateway";
     default:
       return "Internal Server Error";
   }
 }
 
+void http_head_init(struct http_head *head, char *buffer, size_t size,
+    int status_code) {
+  head->buffer = buffer;
+  head->size = size;
+  head->length = 0;
+  head->ended = 0;
+  head->overflow = 0;
+
+  char *message = http_get_response_message(status_code);
+  size_t message_length = strlen(message);
+  if (size < strlen("HTTP/1.1 000 \r\n") + message_length ||
+      status_code < 100 || status_code > 999) {
+    head->overflow = 1;
+    return;
+  }
+  memcpy(buffer, "HTTP/1.1 ", 9);
+  buffer[9] = '0' + status_code / 100;
+  buffer[10] = '0' + status_code / 10 % 10;
+  buffer[11] = '0' + status_code % 10;
+  buffer[12] = ' ';
+  memcpy(buffer + 13, message, message_length);
+  memcpy(buffer + 13 + message_length, "\r\n", 2);
+  head->length = 15 + message_length;
+}
+
+/* Appends the N bytes at DATA, or marks HEAD overflowed if they do not fit. */
+static void http_head_append(struct http_head *head, const char *data,
+    size_t n) {
+  if (head->overflow || head->size - head->length < n) {
+    head->overflow = 1;
+    return;
+  }
+  memcpy(head->buffer + head->length, data, n);
+  head->length += n;
+}
+
+/* Appends "NAME: VALUE\r\n" whole, or not at all. */
+static void http_head_append_line(struct http_head *head, const char *name,
+    const char *value, size_t value_length) {
+  size_t name_length = strlen(name);
+
+  if (head->overflow ||
+      head->size - head->length < name_length + value_length + 4) {
+    head->overflow = 1;
+    return;
+  }
+  http_head_append(head, name, name_length);
+  http_head_append(head, ": ", 2);
+  http_head_append(head, value, value_length);
+  http_head_append(head, "\r\n", 2);
+}
+
+void http_head_add(struct http_head *head, const char *name, const char *value) {
+  http_head_append_line(head, name, value, strlen(value));
+}
+
+void http_head_add_number(struct http_head *head, const char *name,
+    long long value) {
+  char digits[24];
+  char *start = digits + sizeof(digits);
+  unsigned long long magnitude = value < 0 ? -(unsigned long long) value : value;
+
+  do {
+    *--start = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude > 0);
+  if (value < 0) *--start = '-';
+  http_head_append_line(head, name, start, digits + sizeof(digits) - start);
+}
+
+size_t http_head_end(struct http_head *head) {
+  if (!head->ended) {
+    http_head_append(head, "\r\n", 2);
+    head->ended = 1;
+  }
+  return head->overflow ? 0 : head->length;
+}
+
+int http_head_send(int fd, struct http_head *head, const char *body,
+    size_t body_length, int flags) {
+  struct iovec iov_array[2];
+  struct iovec *iov = iov_array;
+  int iov_count = body_length > 0 ? 2 : 1;
+
+  if (http_head_end(head) == 0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  iov_array[0].iov_base = head->buffer;
+  iov_array[0].iov_len = head->length;
+  iov_array[1].iov_base = (char *) body;
+  iov_array[1].iov_len = body_length;
+  return http_send_iov(fd, &iov, &iov_count, flags);
+}
+
+int http_head_value(const char *head, size_t length, const char *name,
+    char *value, size_t size) {
+  const char *end = head + length, *line, *line_end, *colon, *start;
+  size_t name_length = strlen(name);
+
+  /* Skip the status line. */
+  line = memchr(head, '\n', length);
+  for (line = line ? line + 1 : end; line < end; line = line_end + 1) {
+    line_end = memchr(line, '\n', end - line);
+    if (line_end == NULL) line_end = end;
+    colon = memchr(line, ':', line_end - line);
+    if (colon == NULL || (size_t) (colon - line) != name_length ||
+        strncasecmp(line, name, name_length) != 0)
+      continue;
+
+    start = colon + 1;
+    while (start < line_end && (*start == ' ' || *start == '\t')) start++;
+    length = line_end - start;
+    while (length > 0 && (start[length - 1] == '\r' ||
+          start[length - 1] == ' ' || start[length - 1] == '\t'))
+      length--;
+    if (length >= size) return -1;
+    memcpy(value, start, length);
+    value[length] = '\0';
+    return 0;
+  }
+  return -1;
+}
+
+/* The head being collected by http_start_response, or fd -1 if none. */
+static __thread struct {
+  int fd;
+  struct http_head head;
+  char buffer[LIBHTTP_HEAD_MAX_SIZE];
+} http_pending = { .fd = -1 };
+
+/* Sends whatever was collected for FD so far, with FLAGS. */
+static void http_pending_flush(int flags) {
+  struct iovec iov_array[1];
+  struct iovec *iov = iov_array;
+  int iov_count = 1;
+
+  iov_array[0].iov_base = http_pending.buffer;
+  iov_array[0].iov_len = http_pending.head.length;
+  if (http_send_iov(http_pending.fd, &iov, &iov_count, flags) < 0 &&
+      errno == ENOTSOCK)
+    http_send_data(http_pending.fd, iov->iov_base, iov->iov_len);
+  http_pending.fd = -1;
+}
+
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
-      http_get_response_message(status_code));
+  if (http_pending.fd >= 0) http_pending_flush(MSG_NOSIGNAL);
+  http_pending.fd = fd;
+  http_head_init(&http_pending.head, http_pending.buffer,
+      sizeof(http_pending.buffer), status_code);
 }
 
 void http_send_header(int fd, char *key, char *value) {
+  if (http_pending.fd == fd) {
+    http_head_add(&http_pending.head, key, value);
+    if (!http_pending.head.overflow) return;
+
+    /* Too long to collect: send what is there and write the rest directly. */
+    http_pending.head.overflow = 0;
+    http_pending_flush(MSG_NOSIGNAL);
+  }
   dprintf(fd, "%s: %s\r\n", key, value);
 }
 
 void http_end_headers(int fd) {
+  if (http_pending.fd == fd) {
+    http_head_end(&http_pending.head);
+    /* Not corked: there may be no body to push it out, as after a 304. */
+    if (!http_pending.head.overflow) {
+      http_pending_flush(MSG_NOSIGNAL);
+      return;
+    }
+    http_pending.head.overflow = 0;
+    http_pending_flush(MSG_NOSIGNAL);
+  }
   dprintf(fd, "\r\n");
 }
 
@@ -122,6 +636,457 @@ void http_send_data(int fd, char *data, size_t size) {
   }
 }
 
+void http_format_date(time_t time, char *buffer, size_t size) {
+  struct tm tm;
+
+  gmtime_r(&time, &tm);
+  strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+time_t http_parse_date(const char *value) {
+  struct tm tm;
+  char *end;
+
+  memset(&tm, 0, sizeof(tm));
+  end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') return -1;
+  return timegm(&tm);
+}
+
+int http_etag_matches(const char *value, const char *etag) {
+  size_t etag_length;
+
+  if (strncmp(etag, "W/", 2) == 0) etag += 2;
+  etag_length = strlen(etag);
+  while (*value) {
+    while (*value == ' ' || *value == '\t' || *value == ',') value++;
+    size_t length = strcspn(value, ",");
+    size_t trimmed = length;
+    while (trimmed > 0 && (value[trimmed - 1] == ' ' || value[trimmed - 1] == '\t'))
+      trimmed--;
+    if (trimmed == 1 && *value == '*') return 1;
+    if (trimmed > 2 && strncmp(value, "W/", 2) == 0)
+      trimmed -= 2, length -= 2, value += 2;
+    if (trimmed == etag_length && strncmp(value, etag, trimmed) == 0)
+      return 1;
+    value += length;
+  }
+  return 0;
+}
+
+/* Parses the digits at *VALUE into *NUMBER, advancing *VALUE past them.
+ * Returns -1 if there are none. */
+static int http_parse_position(const char **value, off_t *number) {
+  const char *digits = *value;
+
+  *number = 0;
+  while (**value >= '0' && **value <= '9') {
+    /* Too far for any file: saturate, it can only be unsatisfiable. */
+    if (*number < ((off_t) 1 << 60)) *number = *number * 10 + (**value - '0');
+    (*value)++;
+  }
+  return *value == digits ? -1 : 0;
+}
+
+int http_parse_ranges(const char *value, off_t size, struct http_range *ranges,
+    int max_ranges) {
+  off_t first, last, total = 0;
+  int num_ranges = 0;
+
+  if (strncasecmp(value, "bytes=", 6) != 0) return -1;
+  value += 6;
+  while (1) {
+    while (*value == ' ' || *value == '\t') value++;
+    if (*value == '-') {
+      /* A suffix: the last N bytes. */
+      value++;
+      if (http_parse_position(&value, &last) == -1) return -1;
+      first = last < size ? size - last : 0;
+      last = last > 0 ? size - 1 : -1;
+    } else {
+      if (http_parse_position(&value, &first) == -1 || *value++ != '-')
+        return -1;
+      if (*value >= '0' && *value <= '9') {
+        http_parse_position(&value, &last);
+        if (last < first) return -1;
+        if (last >= size) last = size - 1;
+      } else {
+        last = size - 1;
+      }
+    }
+
+    /* Ranges starting past the end (or empty suffixes) are skipped. */
+    if (first <= last && first < size) {
+      total += last - first + 1;
+      if (num_ranges == max_ranges || total > size) return -1;
+      ranges[num_ranges].first = first;
+      ranges[num_ranges].last = last;
+      num_ranges++;
+    }
+
+    while (*value == ' ' || *value == '\t') value++;
+    if (*value == '\0') return num_ranges;
+    if (*value++ != ',') return -1;
+  }
+}
+
+static __thread arena_t *http_arena;
+static __thread void (*http_progress)(void);
+
+void http_use_arena(arena_t *arena) {
+  http_arena = arena;
+}
+
+void http_on_progress(void (*progress)(void)) {
+  http_progress = progress;
+}
+
+void http_response_init(struct http_response *response, int status_code,
+    char *content_type) {
+  memset(response, 0, sizeof(*response));
+  response->status_code = status_code;
+  response->content_type = content_type;
+  response->file_fd = -1;
+  response->arena = http_arena;
+}
+
+void http_response_append_body(struct http_response *response, char *data,
+    size_t size) {
+  if (response->body_length + size > response->body_capacity) {
+    size_t capacity = response->body_capacity ? response->body_capacity : 4096;
+    while (capacity < response->body_length + size) capacity *= 2;
+    if (response->arena != NULL && (response->body == NULL || response->body_in_arena)) {
+      response->body = ar_grow(response->arena, response->body,
+          response->body_length, capacity);
+      response->body_in_arena = 1;
+    } else {
+      response->body = realloc(response->body, capacity);
+    }
+    if (!response->body) http_fatal_error("Malloc failed");
+    response->body_capacity = capacity;
+  }
+  memcpy(response->body + response->body_length, data, size);
+  response->body_length += size;
+}
+
+void http_response_set_file(struct http_response *response, int file_fd) {
+  struct stat file_stat;
+  response->file_fd = file_fd;
+  response->file_length = fstat(file_fd, &file_stat) == 0 ? file_stat.st_size : 0;
+}
+
+void http_response_set_ranges(struct http_response *response,
+    struct http_range *ranges, int num_ranges, off_t size) {
+  char text[256];
+  int length;
+
+  if (num_ranges == 0) {
+    response->status_code = 416;
+    snprintf(text, sizeof(text), "bytes */%lld", (long long) size);
+    http_response_add_header(response, "Content-Range", text);
+    if (response->file_fd >= 0) close(response->file_fd);
+    response->file_fd = -1;
+    response->file_length = 0;
+    return;
+  }
+
+  response->status_code = 206;
+  if (num_ranges == 1) {
+    snprintf(text, sizeof(text), "bytes %lld-%lld/%lld",
+        (long long) ranges[0].first, (long long) ranges[0].last,
+        (long long) size);
+    http_response_add_header(response, "Content-Range", text);
+    response->file_offset = ranges[0].first;
+    response->file_length = ranges[0].last - ranges[0].first + 1;
+    return;
+  }
+
+  /* One part per range, and a last one for the closing boundary. */
+  size_t parts_size = (num_ranges + 1) * sizeof(struct http_part);
+  response->parts = response->arena != NULL ?
+      ar_alloc(response->arena, parts_size) : malloc(parts_size);
+  if (!response->parts) http_fatal_error("Malloc failed");
+  memset(response->parts, 0, parts_size);
+  response->num_parts = num_ranges + 1;
+  response->file_length = 0;
+  for (int i = 0; i < num_ranges; i++) {
+    length = snprintf(text, sizeof(text), "\r\n--" LIBHTTP_BOUNDARY "\r\n"
+        "Content-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+        response->content_type, (long long) ranges[i].first,
+        (long long) ranges[i].last, (long long) size);
+    if (length >= (int) sizeof(text)) length = sizeof(text) - 1;
+    response->parts[i].text_offset = response->body_length;
+    response->parts[i].text_length = length;
+    response->parts[i].file_offset = ranges[i].first;
+    response->parts[i].file_length = ranges[i].last - ranges[i].first + 1;
+    response->file_length += response->parts[i].file_length;
+    http_response_append_body(response, text, length);
+  }
+  length = strlen("\r\n--" LIBHTTP_BOUNDARY "--\r\n");
+  response->parts[num_ranges].text_offset = response->body_length;
+  response->parts[num_ranges].text_length = length;
+  http_response_append_body(response, "\r\n--" LIBHTTP_BOUNDARY "--\r\n", length);
+  response->content_type = "multipart/byteranges; boundary=" LIBHTTP_BOUNDARY;
+}
+
+void http_response_set_raw(struct http_response *response, char *raw,
+    size_t raw_length, size_t raw_head_length, void (*release)(void *),
+    void *release_arg) {
+  if (response->file_fd >= 0) close(response->file_fd);
+  response->file_fd = -1;
+  response->raw = raw;
+  response->raw_length = raw_length;
+  response->raw_head_length = raw_head_length;
+  response->release = release;
+  response->release_arg = release_arg;
+}
+
+void http_response_set_keep_alive(struct http_response *response,
+    struct http_request *request, int keep_alive) {
+  /* Persistence is the default from HTTP/1.1 on; 1.0 has to be told. */
+  if (!keep_alive)
+    response->connection = "close";
+  else if (request->minor_version == 0)
+    response->connection = "keep-alive";
+  else
+    response->connection = NULL;
+}
+
+int http_response_add_header(struct http_response *response, const char *name,
+    const char *value) {
+  struct http_head head = {
+    .buffer = response->headers,
+    .size = sizeof(response->headers),
+    .length = response->headers_length,
+  };
+
+  http_head_add(&head, name, value);
+  if (head.overflow) return -1;
+  response->headers_length = head.length;
+  return 0;
+}
+
+/* Appends the headers that vary per request, which cached responses lack. */
+static void http_response_add_variable_headers(struct http_response *response,
+    struct http_head *head) {
+  http_head_append(head, response->headers, response->headers_length);
+  if (response->connection != NULL)
+    http_head_add(head, "Connection", response->connection);
+}
+
+off_t http_response_content_length(struct http_response *response) {
+  /* The raw head stops short of the blank line. */
+  if (response->raw != NULL)
+    return response->raw_length - response->raw_head_length - 2;
+  if (response->file_fd < 0) return response->body_length;
+  if (response->parts != NULL) return response->file_length + response->body_length;
+  return response->file_length;
+}
+
+size_t http_response_format_headers(struct http_response *response,
+    char *buffer, size_t size) {
+  struct http_head head;
+
+  http_head_init(&head, buffer, size, response->status_code);
+  if (response->content_type != NULL)
+    http_head_add(&head, "Content-Type", response->content_type);
+  /* A 304 describes the body it stands in for; it has none of its own. */
+  if (response->status_code != 304)
+    http_head_add_number(&head, "Content-Length",
+        (long long) http_response_content_length(response));
+  http_response_add_variable_headers(response, &head);
+  return http_head_end(&head);
+}
+
+/*
+ * Lays out everything sent ahead of the file (status line, headers and any
+ * in-memory body) as at most three iovecs, formatting what is not prepared
+ * yet into HEADERS. Returns the number of iovecs used.
+ */
+int http_response_prepare(struct http_response *response, char *headers,
+    size_t size, struct iovec iov[3]) {
+  struct http_head head;
+
+  if (response->raw == NULL) {
+    iov[0].iov_base = headers;
+    iov[0].iov_len = http_response_format_headers(response, headers, size);
+    /* The body of a multipart response is sent between its parts. */
+    if (response->parts != NULL) return 1;
+    iov[1].iov_base = response->body;
+    iov[1].iov_len = response->body_length;
+    return response->body_length > 0 ? 2 : 1;
+  }
+
+  if (response->connection == NULL && response->headers_length == 0) {
+    iov[0].iov_base = response->raw;
+    iov[0].iov_len = response->raw_length;
+    return 1;
+  }
+
+  head.buffer = headers;
+  head.size = size;
+  head.length = 0;
+  head.overflow = 0;
+  http_response_add_variable_headers(response, &head);
+  iov[0].iov_base = response->raw;
+  iov[0].iov_len = response->raw_head_length;
+  iov[1].iov_base = headers;
+  iov[1].iov_len = head.overflow ? 0 : head.length;
+  iov[2].iov_base = response->raw + response->raw_head_length;
+  iov[2].iov_len = response->raw_length - response->raw_head_length;
+  return 3;
+}
+
+void http_response_send(int fd, struct http_response *response) {
+  char headers[LIBHTTP_HEAD_MAX_SIZE];
+  struct iovec iov_array[3];
+  struct iovec *iov = iov_array;
+  int iov_count;
+  off_t position = 0;
+  int part = 0, cork = 1;
+
+  iov_count = http_response_prepare(response, headers, sizeof(headers), iov);
+  if (response->file_fd < 0) {
+    http_send_iov(fd, &iov, &iov_count, MSG_NOSIGNAL);
+    return;
+  }
+
+  /* Hold the headers back so they leave in the same segment as the file. */
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+  if (http_send_iov(fd, &iov, &iov_count, MSG_NOSIGNAL) == 0)
+    http_response_send_file(fd, response, &part, &position);
+  cork = 0;
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+}
+
+int http_response_send_file(int fd, struct http_response *response, int *part,
+    off_t *position) {
+  int num_parts = response->parts != NULL ? response->num_parts : 1;
+  const char *text = NULL;
+  size_t text_length = 0;
+  off_t file_offset = response->file_offset;
+  off_t file_length = response->file_length;
+  off_t offset;
+  ssize_t bytes_sent;
+  int status;
+
+  while (*part < num_parts) {
+    if (response->parts != NULL) {
+      struct http_part *current = &response->parts[*part];
+      text = response->body + current->text_offset;
+      text_length = current->text_length;
+      file_offset = current->file_offset;
+      file_length = current->file_length;
+    }
+
+    if (*position < (off_t) text_length) {
+      bytes_sent = send(fd, text + *position, text_length - *position,
+          MSG_NOSIGNAL | (file_length > 0 ? MSG_MORE : 0));
+      if (bytes_sent < 0 && errno == EINTR) continue;
+      if (bytes_sent < 0) return -1;
+      if (http_progress != NULL) http_progress();
+      *position += bytes_sent;
+      continue;
+    }
+
+    if (*position < (off_t) text_length + file_length) {
+      offset = file_offset + (*position - text_length);
+      status = http_send_file(fd, response->file_fd, &offset,
+          text_length + file_length - *position);
+      *position = text_length + (offset - file_offset);
+      if (status < 0) return -1;
+    }
+    (*part)++;
+    *position = 0;
+  }
+  return 0;
+}
+
+void http_response_free_body(struct http_response *response) {
+  if (!response->body_in_arena) free(response->body);
+  response->body = NULL;
+  response->body_in_arena = 0;
+  response->body_length = response->body_capacity = 0;
+}
+
+void http_response_free(struct http_response *response) {
+  http_response_free_body(response);
+  if (response->arena == NULL) free(response->parts);
+  response->parts = NULL;
+  if (response->arena != NULL) ar_reset(response->arena);
+  if (response->file_fd >= 0) close(response->file_fd);
+  response->file_fd = -1;
+  if (response->release != NULL) response->release(response->release_arg);
+  response->release = NULL;
+  response->raw = NULL;
+}
+
+int http_send_file(int fd, int file_fd, off_t *offset, size_t size) {
+  char buffer[LIBHTTP_COPY_CHUNK_SIZE];
+  ssize_t bytes_sent, bytes_read;
+  int use_sendfile = 1;
+
+  while (size > 0) {
+    if (use_sendfile) {
+      bytes_sent = sendfile(fd, file_fd, offset, size);
+      if (bytes_sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        /* Not a file the kernel can splice from; copy it instead. */
+        use_sendfile = 0;
+        continue;
+      }
+    } else {
+      bytes_read = pread(file_fd, buffer,
+          size < sizeof(buffer) ? size : sizeof(buffer), *offset);
+      if (bytes_read <= 0) {
+        errno = EIO;
+        return -1;
+      }
+      bytes_sent = write(fd, buffer, bytes_read);
+      if (bytes_sent > 0) *offset += bytes_sent;
+    }
+
+    if (bytes_sent < 0 && errno == EINTR) continue;
+    if (bytes_sent < 0) return -1;
+    if (bytes_sent == 0) {
+      /* The file is shorter than the Content-Length already sent. */
+      errno = EIO;
+      return -1;
+    }
+    if (http_progress != NULL) http_progress();
+    size -= bytes_sent;
+  }
+  return 0;
+}
+
+int http_send_iov(int fd, struct iovec **iov, int *iov_count, int flags) {
+  struct msghdr message;
+  ssize_t bytes_sent;
+
+  while (*iov_count > 0) {
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = *iov;
+    message.msg_iovlen = *iov_count;
+    bytes_sent = sendmsg(fd, &message, flags);
+    if (bytes_sent < 0 && errno == EINTR) continue;
+    if (bytes_sent < 0) return -1;
+    if (http_progress != NULL) http_progress();
+    http_iov_advance(iov, iov_count, bytes_sent);
+  }
+  return 0;
+}
+
+void http_iov_advance(struct iovec **iov, int *iov_count, size_t bytes) {
+  while (*iov_count > 0 && bytes >= (*iov)->iov_len) {
+    bytes -= (*iov)->iov_len;
+    (*iov)++;
+    (*iov_count)--;
+  }
+  if (*iov_count > 0) {
+    (*iov)->iov_base = (char *) (*iov)->iov_base + bytes;
+    (*iov)->iov_len -= bytes;
+  }
+}
+
 char *http_get_mime_type(char *file_name) {
   char *file_extension = strrchr(file_name, '.');
   if (file_extension == NULL) {
@@ -20,18 +20,168 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "arena.h"
+
+#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define LIBHTTP_MAX_HEADERS 64
+
 /*
- * Functions for parsing an HTTP request.
+ * Functions for parsing an HTTP request. Every string in a request (method,
+ * path, header names and values) is a NUL-terminated slice of the buffer it
+ * was read into, valid until the next request is parsed from that buffer.
  */
+struct http_header {
+  char *name;
+  size_t name_length;
+  char *value;            /* Without surrounding whitespace. */
+  size_t value_length;
+};
+
 struct http_request {
   char *method;
   char *path;
+  int minor_version;      /* 1 for HTTP/1.1, 0 for HTTP/1.0 and older. */
+  int keep_alive;         /* The client lets the connection persist. */
+  size_t content_length;
+  int chunked;            /* The body is chunked (only when streaming bodies). */
+  size_t num_headers;
+  struct http_header headers[LIBHTTP_MAX_HEADERS];
 };
 
+/* Reads one request from FD into a buffer of its own, which
+ * http_request_free releases. Returns NULL on EOF or a malformed request. */
 struct http_request *http_request_parse(int fd);
+void http_request_free(struct http_request *request);
+
+/* Returns the value of header NAME (matched case-insensitively), or NULL. */
+char *http_request_header(struct http_request *request, const char *name);
+
+/*
+ * Functions for reading successive (possibly pipelined) requests from one
+ * persistent connection. The parser is resumable: each call picks up where
+ * the last one stopped, so a request split across many reads is scanned
+ * once, and bytes read past the end of a request stay in the buffer for the
+ * next call. Nothing is allocated; the returned request lives in the
+ * connection.
+ */
+struct http_connection {
+  int fd;
+  size_t start;           /* Offset of the request being parsed. */
+  size_t length;          /* Bytes in buffer. */
+  size_t request_length;  /* Bytes of the last request, dropped on next parse. */
+  int num_requests;       /* Requests parsed so far. */
+
+  /* Parser state, as offsets from start so the buffer can be compacted. */
+  int state;
+  size_t parsed;
+  size_t token;
+  size_t token_end;
+  size_t name;
+  size_t name_length;
+  size_t head_length;
+  int stream_bodies;      /* See http_connection_stream_bodies. */
+
+  struct http_request request;
+  char buffer[LIBHTTP_REQUEST_MAX_SIZE];
+};
+
+enum http_parse_status {
+  HTTP_PARSE_OK,
+  HTTP_PARSE_INCOMPLETE,  /* Read more with http_connection_read. */
+  HTTP_PARSE_ERROR,
+};
+
+void http_connection_init(struct http_connection *connection, int fd);
+ssize_t http_connection_read(struct http_connection *connection);
+
+/* For callers that receive into the connection themselves (see uring.h):
+ * the next bytes go at the returned address, which has room for *ROOM of
+ * them, and http_connection_received records how many arrived. */
+char *http_connection_space(struct http_connection *connection, size_t *room);
+void http_connection_received(struct http_connection *connection, size_t bytes);
+enum http_parse_status http_connection_parse(struct http_connection *connection,
+    struct http_request **request);
+
+/* Returns whether the next request has fully arrived already. */
+int http_connection_has_request(struct http_connection *connection);
+
+/* Blocks until the next request arrives. Returns NULL on EOF or error. */
+struct http_request *http_connection_next_request(
+    struct http_connection *connection);
+
+/* Returns the body of the request returned last (content_length bytes). */
+char *http_connection_body(struct http_connection *connection);
+
+/*
+ * Has CONNECTION return each request as soon as its head has arrived, with
+ * however long a body, or a chunked one, for the caller to read itself:
+ * first what arrived with the head, which http_connection_buffered_body
+ * returns (and maybe the start of the next request after it), then more
+ * with http_connection_read or straight from the socket. The bytes of the
+ * body that came through the buffer must be given back with
+ * http_connection_take_body, and the whole body read, before the next
+ * request is parsed.
+ */
+void http_connection_stream_bodies(struct http_connection *connection);
+char *http_connection_buffered_body(struct http_connection *connection,
+    size_t *length);
+void http_connection_take_body(struct http_connection *connection,
+    size_t length);
+
+/*
+ * Functions for building the status line and headers of a response in a
+ * caller-provided buffer (usually on the stack), so that they leave in the
+ * same writev as the start of the body instead of one write per line:
+ *
+ *     char buffer[LIBHTTP_HEAD_MAX_SIZE];
+ *     struct http_head head;
+ *
+ *     http_head_init(&head, buffer, sizeof(buffer), 200);
+ *     http_head_add(&head, "Content-Type", "text/html");
+ *     http_head_add_number(&head, "Content-Length", body_length);
+ *     http_head_send(fd, &head, body, body_length, MSG_NOSIGNAL);
+ *
+ * A line that does not fit marks the head as overflowed, and it is not sent.
+ */
+#define LIBHTTP_HEAD_MAX_SIZE 1024
+
+struct http_head {
+  char *buffer;
+  size_t size;
+  size_t length;
+  int ended;              /* The blank line has been appended. */
+  int overflow;
+};
+
+void http_head_init(struct http_head *head, char *buffer, size_t size,
+    int status_code);
+void http_head_add(struct http_head *head, const char *name, const char *value);
+void http_head_add_number(struct http_head *head, const char *name,
+    long long value);
+
+/* Appends the blank line. Returns the length of the head, or 0 on overflow. */
+size_t http_head_end(struct http_head *head);
+
+/* Ends HEAD if needed and sends it followed by BODY with one writev. Returns
+ * 0 once everything is sent, or -1 on error (ENOBUFS if HEAD overflowed). */
+int http_head_send(int fd, struct http_head *head, const char *body,
+    size_t body_length, int flags);
+
+/* Copies the value of header NAME from the LENGTH-byte response head HEAD
+ * (a status line, then "Name: value\r\n" lines) into VALUE, NUL-terminated.
+ * Returns -1 if there is no such header, or its value does not fit in SIZE. */
+int http_head_value(const char *head, size_t length, const char *name,
+    char *value, size_t size);
 
 /*
- * Functions for sending an HTTP response.
+ * Functions for sending an HTTP response a line at a time. The status line
+ * and headers are collected in a per-thread http_head and sent together at
+ * http_end_headers, right away, since a body need not follow. Responses
+ * built with http_head or http_response send the head along with the body.
  */
 void http_start_response(int fd, int status_code);
 void http_send_header(int fd, char *key, char *value);
@@ -39,6 +189,153 @@ void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
 void http_send_data(int fd, char *data, size_t size);
 
+/*
+ * Sends SIZE bytes of FILE_FD from *OFFSET, advancing *OFFSET, without
+ * copying them through user space (sendfile). Files the kernel cannot send
+ * that way are copied with pread/write instead. Returns 0 once everything is
+ * sent, or -1 on error -- including EAGAIN on a non-blocking socket, after
+ * which the call can be repeated with the advanced offset.
+ */
+int http_send_file(int fd, int file_fd, off_t *offset, size_t size);
+
+/*
+ * Sends the *IOV_COUNT buffers at *IOV with sendmsg(FLAGS), advancing both
+ * past what was sent. Returns 0 once everything is sent, or -1 on error
+ * (including EAGAIN on a non-blocking socket).
+ */
+int http_send_iov(int fd, struct iovec **iov, int *iov_count, int flags);
+
+/* Advances *IOV and *IOV_COUNT past BYTES that were sent. */
+void http_iov_advance(struct iovec **iov, int *iov_count, size_t bytes);
+
+/*
+ * Helpers for conditional and range requests. Dates are IMF-fixdate
+ * ("Sun, 06 Nov 1994 08:49:37 GMT"), the only form servers send; byte
+ * ranges are inclusive, as in the Range header.
+ */
+#define LIBHTTP_DATE_SIZE 32
+#define LIBHTTP_MAX_RANGES 16
+
+struct http_range {
+  off_t first;
+  off_t last;
+};
+
+void http_format_date(time_t time, char *buffer, size_t size);
+
+/* Returns the time VALUE stands for, or -1 if it is not a date. */
+time_t http_parse_date(const char *value);
+
+/* Whether ETAG is in the If-None-Match list VALUE ("*" matches any), weakly
+ * compared: a W/ prefix is ignored on either side. */
+int http_etag_matches(const char *value, const char *etag);
+
+/* Parses the Range header VALUE for a SIZE-byte representation into at most
+ * MAX_RANGES RANGES, clipped to SIZE. Returns the number of ranges, 0 if none
+ * of them can be satisfied, or -1 if the header is malformed or asks for more
+ * than the whole representation: it is then ignored, as if absent. */
+int http_parse_ranges(const char *value, off_t size, struct http_range *ranges,
+    int max_ranges);
+
+/*
+ * Functions for describing a whole response up front, so that it can be sent
+ * either with blocking writes or piece by piece from a non-blocking event
+ * loop. The body is either an in-memory buffer or the contents of file_fd,
+ * which http_response_free closes. Alternatively, raw holds the complete
+ * response (headers included) prepared ahead of time, which is sent with a
+ * single write and handed back through release(release_arg) when freed.
+ * Its blank line starts at raw_head_length, where the Connection header and
+ * any headers added with http_response_add_header are spliced in.
+ *
+ * A file body is sent from file_offset on. For a multipart/byteranges body,
+ * the file is sent in parts instead, each led by text from the body buffer
+ * (a boundary and the part's headers); file_length is then the sum of the
+ * parts' file bytes.
+ */
+#define LIBHTTP_RESPONSE_HEADERS_SIZE 512
+#define LIBHTTP_BOUNDARY "httpserver-byteranges-5f3a9c1e"
+
+struct http_part {
+  size_t text_offset;
+  size_t text_length;
+  off_t file_offset;
+  off_t file_length;
+};
+
+struct http_response {
+  int status_code;
+  char *content_type;
+  char *connection;       /* Connection header value, or NULL to omit it. */
+  char headers[LIBHTTP_RESPONSE_HEADERS_SIZE];  /* Extra "Name: value\r\n" lines. */
+  size_t headers_length;
+  char *body;
+  size_t body_length;
+  size_t body_capacity;
+  int file_fd;
+  off_t file_offset;
+  off_t file_length;
+  struct http_part *parts;
+  int num_parts;
+  char *raw;
+  size_t raw_length;
+  size_t raw_head_length;
+  void (*release)(void *release_arg);
+  void *release_arg;
+  arena_t *arena;         /* Where body and parts come from, or NULL: malloc. */
+  int body_in_arena;      /* Else a body set by the caller is malloc'd. */
+};
+
+/* Responses initialized on the calling thread from now on take the memory
+ * they build up (the body, by http_response_append_body, and the parts of a
+ * multipart body) from ARENA, or from malloc if it is NULL (the default).
+ * http_response_free resets the arena, so a thread must set one per
+ * response in flight: a worker its own, an event loop each connection's. */
+void http_use_arena(arena_t *arena);
+
+/* Has the calling thread call PROGRESS (unless NULL, the default) whenever
+ * bytes of a response leave, so a send deadline can be pushed back. */
+void http_on_progress(void (*progress)(void));
+
+void http_response_init(struct http_response *response, int status_code,
+    char *content_type);
+void http_response_append_body(struct http_response *response, char *data,
+    size_t size);
+void http_response_set_file(struct http_response *response, int file_fd);
+
+/* Frees the body of RESPONSE, once a raw copy of it has replaced it. */
+void http_response_free_body(struct http_response *response);
+void http_response_set_raw(struct http_response *response, char *raw,
+    size_t raw_length, size_t raw_head_length, void (*release)(void *),
+    void *release_arg);
+
+/* Narrows the file RESPONSE sends (SIZE bytes) to NUM_RANGES RANGES: a 206
+ * with a Content-Range for one range, a multipart/byteranges 206 for more,
+ * or a 416 without the file when there are none. */
+void http_response_set_ranges(struct http_response *response,
+    struct http_range *ranges, int num_ranges, off_t size);
+void http_response_set_keep_alive(struct http_response *response,
+    struct http_request *request, int keep_alive);
+
+/* Adds a header to RESPONSE. Returns -1 if there is no room left for it. */
+int http_response_add_header(struct http_response *response, const char *name,
+    const char *value);
+size_t http_response_format_headers(struct http_response *response,
+    char *buffer, size_t size);
+
+/* Bytes of body RESPONSE sends (the file's included), as in its
+ * Content-Length. */
+off_t http_response_content_length(struct http_response *response);
+int http_response_prepare(struct http_response *response, char *headers,
+    size_t size, struct iovec iov[3]);
+void http_response_send(int fd, struct http_response *response);
+
+/* Sends the file part of RESPONSE, resuming at byte *POSITION of part *PART
+ * (both 0 to begin with) and advancing them. Returns 0 once everything is
+ * sent, or -1 on error, including EAGAIN on a non-blocking socket. */
+int http_response_send_file(int fd, struct http_response *response, int *part,
+    off_t *position);
+void http_response_free(struct http_response *response);
+
 /*
  * Helper function: gets the Content-Type based on a file name.
  */
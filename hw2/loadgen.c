@@ -0,0 +1,555 @@
+/*
+ * Load generator for httpserver. Each thread drives its share of the
+ * connections from an epoll loop and times every response:
+ *
+ *   - closed loop (the default): each connection sends its next request as
+ *     soon as the last response is in, so the load follows the server;
+ *   - open loop (--rate R): requests are due at a fixed total rate whatever
+ *     the server does, and are timed from when they were due rather than
+ *     sent, so a stalled server shows up in the latencies instead of
+ *     quietly lowering the load (coordinated omission).
+ *
+ * Paths are picked at random by weight from --mix, to model a mix of file
+ * sizes. With --upstream it is the other end instead: a stand-in proxy
+ * target answering every request with a body of --body-size bytes.
+ *
+ * Usage: ./loadgen [options] host:port
+ *        ./loadgen --upstream port [--body-size bytes]
+ *
+ *   --connections N  connections kept busy (default 16)
+ *   --threads N      threads to drive them (default 2)
+ *   --duration S     seconds to run for (default 10)
+ *   --rate R         open loop at R requests per second in all
+ *   --no-keepalive   open a new connection for every request
+ *   --mix P:W,...    request path P with weight W (default "/:1")
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libhttp.h"
+
+#define MAX_PATHS 32
+#define HEAD_MAX_SIZE 8192
+
+struct path {
+  char *request;              /* The whole request text for the path. */
+  size_t request_length;
+  int weight;
+};
+
+struct connection {
+  int fd;
+  int busy;                   /* A request is out on it. */
+  struct path *path;
+  size_t request_sent;
+  double due;                 /* When the request was due (or sent). */
+  char head[HEAD_MAX_SIZE];
+  size_t head_length;
+  int head_done;
+  long long body_left;
+  int status_code;
+  int close_after;            /* The server will close, or we said we would. */
+};
+
+struct worker {
+  int index;
+  int num_connections;
+  double rate;                /* This thread's share, or 0 for closed loop. */
+  pthread_t thread;
+
+  long requests;
+  long errors;
+  long non_2xx;
+  long late;                  /* Open loop: due, but never sent. */
+  unsigned long long bytes;
+  double *latencies;
+  long latencies_capacity;
+};
+
+static struct sockaddr_in target;
+static struct path paths[MAX_PATHS];
+static int num_paths;
+static int total_weight;
+static int keep_alive = 1;
+static double duration = 10;
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record_latency(struct worker *worker, double latency) {
+  if (worker->requests == worker->latencies_capacity) {
+    worker->latencies_capacity = worker->latencies_capacity ?
+        worker->latencies_capacity * 2 : 65536;
+    worker->latencies = realloc(worker->latencies,
+        sizeof(double) * worker->latencies_capacity);
+    if (worker->latencies == NULL) {
+      perror("Failed to record latencies");
+      exit(ENOMEM);
+    }
+  }
+  worker->latencies[worker->requests++] = latency;
+}
+
+static int open_connection(int epoll_fd, struct connection *connection) {
+  struct epoll_event event;
+  int one = 1;
+
+  /* Connecting blocks, but on a local network it is quick, and it is timed
+   * with the request it is for. */
+  connection->fd = socket(PF_INET, SOCK_STREAM, 0);
+  if (connection->fd < 0) return -1;
+  if (connect(connection->fd, (struct sockaddr *) &target, sizeof(target)) == -1) {
+    close(connection->fd);
+    connection->fd = -1;
+    return -1;
+  }
+  setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(connection->fd, F_SETFL, O_NONBLOCK);
+  event.events = EPOLLIN;
+  event.data.ptr = connection;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &event);
+  return 0;
+}
+
+static void close_connection(struct connection *connection) {
+  if (connection->fd >= 0) close(connection->fd);
+  connection->fd = -1;
+}
+
+static void set_writable_wanted(int epoll_fd, struct connection *connection,
+    int wanted) {
+  struct epoll_event event;
+  event.events = EPOLLIN | (wanted ? EPOLLOUT : 0);
+  event.data.ptr = connection;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+/* Sends what is left of CONNECTION's request. Returns -1 on error. */
+static int send_request(int epoll_fd, struct connection *connection) {
+  struct path *path = connection->path;
+  ssize_t sent;
+
+  while (connection->request_sent < path->request_length) {
+    sent = send(connection->fd, path->request + connection->request_sent,
+        path->request_length - connection->request_sent, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent < 0 && errno == EAGAIN) {
+      set_writable_wanted(epoll_fd, connection, 1);
+      return 0;
+    }
+    if (sent < 0) return -1;
+    connection->request_sent += sent;
+  }
+  return 0;
+}
+
+static struct path *pick_path(unsigned int *seed) {
+  int pick = rand_r(seed) % total_weight;
+  for (int i = 0; i < num_paths; i++) {
+    if (pick < paths[i].weight) return &paths[i];
+    pick -= paths[i].weight;
+  }
+  return &paths[num_paths - 1];
+}
+
+/* Starts a request on the idle CONNECTION, due at DUE. */
+static int start_request(struct worker *worker, int epoll_fd,
+    struct connection *connection, double due, unsigned int *seed) {
+  if (connection->fd < 0 && open_connection(epoll_fd, connection) == -1) {
+    worker->errors++;
+    return -1;
+  }
+  connection->busy = 1;
+  connection->path = pick_path(seed);
+  connection->request_sent = 0;
+  connection->due = due;
+  connection->head_length = 0;
+  connection->head_done = 0;
+  connection->body_left = 0;
+  connection->close_after = !keep_alive;
+  if (send_request(epoll_fd, connection) == -1) {
+    close_connection(connection);
+    connection->busy = 0;
+    worker->errors++;
+    return -1;
+  }
+  return 0;
+}
+
+/* Reads the status code, Content-Length and Connection of a complete head. */
+static int parse_head(struct connection *connection) {
+  char *line, *end;
+
+  connection->head[connection->head_length] = '\0';
+  if (strncmp(connection->head, "HTTP/1.", 7) != 0) return -1;
+  connection->status_code = atoi(connection->head + 9);
+  connection->body_left = -1;
+  for (line = strstr(connection->head, "\r\n"); line != NULL;
+      line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+      connection->body_left = strtoll(line + 17, &end, 10);
+    else if (strncasecmp(line + 2, "Connection: close", 17) == 0)
+      connection->close_after = 1;
+  }
+  /* Every response the server sends has a length. */
+  return connection->body_left < 0 ? -1 : 0;
+}
+
+/* Takes in what the server has sent. Returns 1 once the response is
+ * complete, 0 if more is to come, or -1 on error. */
+static int read_response(struct worker *worker, struct connection *connection,
+    char *buffer, size_t size) {
+  ssize_t bytes;
+  size_t room;
+  char *end;
+
+  while (1) {
+    if (!connection->head_done) {
+      room = HEAD_MAX_SIZE - 1 - connection->head_length;
+      if (room == 0) return -1;
+      bytes = recv(connection->fd, connection->head + connection->head_length,
+          room, 0);
+    } else {
+      if (connection->body_left == 0) return 1;
+      bytes = recv(connection->fd, buffer,
+          connection->body_left < (long long) size ? connection->body_left : size, 0);
+    }
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes < 0 && errno == EAGAIN) return 0;
+    if (bytes <= 0) return -1;
+
+    if (connection->head_done) {
+      connection->body_left -= bytes;
+      worker->bytes += bytes;
+      continue;
+    }
+    connection->head_length += bytes;
+    connection->head[connection->head_length] = '\0';
+    end = strstr(connection->head, "\r\n\r\n");
+    if (end == NULL) continue;
+    size_t head_length = end + 4 - connection->head;
+    size_t extra = connection->head_length - head_length;
+    connection->head_length = head_length - 2;
+    if (parse_head(connection) == -1) return -1;
+    connection->head_done = 1;
+    /* Nothing is pipelined, so what came after the head is body. */
+    if ((long long) extra > connection->body_left) return -1;
+    connection->body_left -= extra;
+    worker->bytes += extra;
+  }
+}
+
+static void *worker_routine(void *aux) {
+  struct worker *worker = aux;
+  struct connection *connections = calloc(worker->num_connections,
+      sizeof(struct connection));
+  struct connection **idle = malloc(sizeof(struct connection *) *
+      worker->num_connections);
+  struct epoll_event events[64];
+  char buffer[65536];
+  unsigned int seed = worker->index * 7919 + 1;
+  int epoll_fd = epoll_create1(0);
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  struct itimerspec due_at = { { 0, 0 }, { 0, 0 } };
+  struct epoll_event timer_event = { .events = EPOLLIN, .data.ptr = NULL };
+  uint64_t expirations;
+  int num_idle = 0, num_events, status;
+  double start = now_seconds(), end = start + duration, now, next_due = start;
+  double interval = worker->rate > 0 ? 1 / worker->rate : 0;
+  struct connection *connection;
+
+  for (int i = 0; i < worker->num_connections; i++) {
+    connections[i].fd = -1;
+    idle[num_idle++] = &connections[i];
+  }
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_event);
+
+  while ((now = now_seconds()) < end) {
+    /* Hand out whatever is due to idle connections. */
+    while (num_idle > 0 && (interval == 0 || next_due <= now)) {
+      connection = idle[--num_idle];
+      if (start_request(worker, epoll_fd, connection,
+            interval == 0 ? now : next_due, &seed) == -1) {
+        idle[num_idle++] = connection;
+        if (interval == 0) break;
+      }
+      next_due += interval;
+    }
+
+    /* epoll_wait only sleeps in whole milliseconds, which would show up
+     * in the latencies; the timer wakes it when the next request is due. */
+    if (interval > 0 && num_idle > 0) {
+      due_at.it_value.tv_sec = (time_t) next_due;
+      due_at.it_value.tv_nsec = (long) ((next_due - (time_t) next_due) * 1e9);
+      timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &due_at, NULL);
+    }
+    num_events = epoll_wait(epoll_fd, events, 64, 100);
+
+    for (int i = 0; i < num_events; i++) {
+      connection = events[i].data.ptr;
+      if (connection == NULL) {
+        read(timer_fd, &expirations, sizeof(expirations));
+        continue;
+      }
+      if (!connection->busy) {
+        /* The server closed an idle keep-alive connection. */
+        close_connection(connection);
+        continue;
+      }
+
+      status = 0;
+      if (events[i].events & EPOLLOUT) {
+        set_writable_wanted(epoll_fd, connection, 0);
+        status = send_request(epoll_fd, connection);
+      }
+      if (status == 0 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        status = read_response(worker, connection, buffer, sizeof(buffer));
+      if (status == 0) continue;
+
+      if (status == 1) {
+        record_latency(worker, now_seconds() - connection->due);
+        if (connection->status_code < 200 || connection->status_code >= 300)
+          worker->non_2xx++;
+        if (connection->close_after) close_connection(connection);
+      } else {
+        worker->errors++;
+        close_connection(connection);
+      }
+      connection->busy = 0;
+      idle[num_idle++] = connection;
+    }
+  }
+
+  if (interval > 0 && next_due < end)
+    worker->late = (long) ((end - next_due) / interval);
+  for (int i = 0; i < worker->num_connections; i++)
+    close_connection(&connections[i]);
+  close(timer_fd);
+  close(epoll_fd);
+  free(connections);
+  free(idle);
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(double *sorted, long count, double fraction) {
+  long index = (long) (fraction * count);
+  if (count == 0) return 0;
+  return sorted[index < count ? index : count - 1];
+}
+
+static void report(struct worker *workers, int num_threads, double elapsed) {
+  long requests = 0, errors = 0, non_2xx = 0, late = 0, count = 0;
+  unsigned long long bytes = 0;
+  double *latencies;
+
+  for (int i = 0; i < num_threads; i++) {
+    requests += workers[i].requests;
+    errors += workers[i].errors;
+    non_2xx += workers[i].non_2xx;
+    late += workers[i].late;
+    bytes += workers[i].bytes;
+  }
+  latencies = malloc(sizeof(double) * (requests > 0 ? requests : 1));
+  for (int i = 0; i < num_threads; i++) {
+    memcpy(latencies + count, workers[i].latencies,
+        sizeof(double) * workers[i].requests);
+    count += workers[i].requests;
+  }
+  qsort(latencies, count, sizeof(double), compare_doubles);
+
+  printf("requests    %ld (%ld errors, %ld not 2xx", requests, errors, non_2xx);
+  if (late > 0) printf(", %ld due but never sent", late);
+  printf(")\n");
+  printf("throughput  %.1f requests/s, %.2f MB/s\n", requests / elapsed,
+      bytes / elapsed / 1e6);
+  printf("latency ms  p50 %.3f  p90 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+      percentile(latencies, count, 0.5) * 1e3,
+      percentile(latencies, count, 0.9) * 1e3,
+      percentile(latencies, count, 0.99) * 1e3,
+      percentile(latencies, count, 0.999) * 1e3,
+      count > 0 ? latencies[count - 1] * 1e3 : 0);
+  free(latencies);
+}
+
+/* Parses "path:weight,..." into paths[], each with its request for HOST. */
+static int parse_mix(char *mix, const char *host) {
+  char *item, *save, *colon;
+
+  for (item = strtok_r(mix, ",", &save); item != NULL;
+      item = strtok_r(NULL, ",", &save)) {
+    if (num_paths == MAX_PATHS) return -1;
+    colon = strrchr(item, ':');
+    paths[num_paths].weight = colon != NULL ? atoi(colon + 1) : 1;
+    if (colon != NULL) *colon = '\0';
+    if (item[0] != '/' || paths[num_paths].weight <= 0) return -1;
+    paths[num_paths].request_length = asprintf(&paths[num_paths].request,
+        "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", item, host,
+        keep_alive ? "" : "Connection: close\r\n");
+    total_weight += paths[num_paths].weight;
+    num_paths++;
+  }
+  return num_paths > 0 ? 0 : -1;
+}
+
+/* Answers every request on one connection with the same response. */
+static void *upstream_connection_routine(void *aux) {
+  struct http_connection *connection = aux;
+  struct http_response *response = (struct http_response *) (connection + 1);
+
+  while (http_connection_next_request(connection) != NULL)
+    http_response_send(connection->fd, response);
+  close(connection->fd);
+  free(connection);
+  return NULL;
+}
+
+static int run_upstream(int port, size_t body_size) {
+  struct sockaddr_in address;
+  struct http_response response;
+  struct http_connection *connection;
+  int server_socket, fd, one = 1;
+  pthread_t thread;
+  char *body = malloc(body_size > 0 ? body_size : 1);
+
+  memset(body, 'x', body_size);
+  http_response_init(&response, 200, "application/octet-stream");
+  http_response_append_body(&response, body, body_size);
+  free(body);
+
+  server_socket = socket(PF_INET, SOCK_STREAM, 0);
+  setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if (bind(server_socket, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+      listen(server_socket, 1024) == -1) {
+    perror("Failed to start the stand-in upstream");
+    return EXIT_FAILURE;
+  }
+  printf("Answering on port %d with %zu-byte bodies\n", port, body_size);
+  fflush(stdout);
+
+  /* One thread per connection: the proxy keeps few, and reuses them. */
+  while (1) {
+    fd = accept(server_socket, NULL, NULL);
+    if (fd < 0) continue;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    connection = malloc(sizeof(struct http_connection) + sizeof(response));
+    http_connection_init(connection, fd);
+    memcpy(connection + 1, &response, sizeof(response));
+    pthread_create(&thread, NULL, upstream_connection_routine, connection);
+    pthread_detach(thread);
+  }
+}
+
+static void exit_with_usage() {
+  fprintf(stderr, "Usage: ./loadgen [--connections N] [--threads N] "
+      "[--duration S] [--rate R] [--no-keepalive] [--mix PATH:WEIGHT,...] "
+      "host:port\n"
+      "       ./loadgen --upstream PORT [--body-size BYTES]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  int num_connections = 16, num_threads = 2, upstream_port = 0;
+  double rate = 0, start, elapsed;
+  size_t body_size = 1024;
+  char *mix = NULL, *target_name = NULL, *colon;
+  char default_mix[] = "/:1";
+  struct addrinfo hints, *result;
+  struct worker *workers;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--no-keepalive") == 0) {
+      keep_alive = 0;
+    } else if (argv[i][0] == '-' && i + 1 == argc) {
+      exit_with_usage();
+    } else if (strcmp(argv[i], "--connections") == 0) {
+      num_connections = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--duration") == 0) {
+      duration = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--rate") == 0) {
+      rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--mix") == 0) {
+      mix = argv[++i];
+    } else if (strcmp(argv[i], "--upstream") == 0) {
+      upstream_port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--body-size") == 0) {
+      body_size = strtoull(argv[++i], NULL, 10);
+    } else if (argv[i][0] != '-' && target_name == NULL) {
+      target_name = argv[i];
+    } else {
+      exit_with_usage();
+    }
+  }
+
+  if (upstream_port > 0) return run_upstream(upstream_port, body_size);
+  if (target_name == NULL || (colon = strrchr(target_name, ':')) == NULL ||
+      num_connections <= 0 || num_threads <= 0 || duration <= 0)
+    exit_with_usage();
+  if (num_threads > num_connections) num_threads = num_connections;
+
+  *colon = '\0';
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(target_name, colon + 1, &hints, &result) != 0) {
+    fprintf(stderr, "Cannot find host: %s\n", target_name);
+    return EXIT_FAILURE;
+  }
+  memcpy(&target, result->ai_addr, sizeof(target));
+  freeaddrinfo(result);
+  if (parse_mix(mix != NULL ? mix : default_mix, target_name) == -1) {
+    fprintf(stderr, "Expected PATH:WEIGHT,... after --mix\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("%s loop, %d connections over %d threads, %s, %.1f s",
+      rate > 0 ? "open" : "closed", num_connections, num_threads,
+      keep_alive ? "keep-alive" : "a connection per request", duration);
+  if (rate > 0) printf(", %.0f requests/s due", rate);
+  printf("\n");
+
+  workers = calloc(num_threads, sizeof(struct worker));
+  start = now_seconds();
+  for (int i = 0; i < num_threads; i++) {
+    workers[i].index = i;
+    workers[i].num_connections = num_connections / num_threads +
+        (i < num_connections % num_threads);
+    workers[i].rate = rate * workers[i].num_connections / num_connections;
+    pthread_create(&workers[i].thread, NULL, worker_routine, &workers[i]);
+  }
+  for (int i = 0; i < num_threads; i++)
+    pthread_join(workers[i].thread, NULL);
+  elapsed = now_seconds() - start;
+
+  report(workers, num_threads, elapsed);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "docroot.h"
+#include "metrics.h"
+
+/* Counters only their thread writes: a relaxed load and store, so that a
+ * concurrent scrape reads whole values without a locked instruction here. */
+#define MT_ADD(counter, n) \
+  __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), \
+      __ATOMIC_RELAXED)
+#define MT_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+static __thread mt_thread_t *mt_self;
+static mt_thread_t *mt_threads;
+
+/* Interned routes: a slot, once set, never changes. */
+static char *mt_routes[MT_MAX_ROUTES];
+
+static long long mt_started_ns;
+
+long long mt_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void mt_register(const char *name, int index) {
+  mt_thread_t *thread;
+  long long zero = 0;
+  char full_name[sizeof(thread->name)];
+  int unowned;
+
+  snprintf(full_name, sizeof(full_name), "%s%d", name, index);
+  for (thread = __atomic_load_n(&mt_threads, __ATOMIC_ACQUIRE); thread != NULL;
+      thread = thread->next) {
+    unowned = 1;
+    if (strcmp(thread->name, full_name) == 0 &&
+        __atomic_compare_exchange_n(&thread->unowned, &unowned, 0, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      mt_self = thread;
+      return;
+    }
+  }
+
+  if (posix_memalign((void **) &thread, 64, sizeof(mt_thread_t))) return;
+  memset(thread, 0, sizeof(mt_thread_t));
+  memcpy(thread->name, full_name, sizeof(full_name));
+  __atomic_compare_exchange_n(&mt_started_ns, &zero, mt_now_ns(), 0,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+  thread->next = __atomic_load_n(&mt_threads, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&mt_threads, &thread->next, thread, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  mt_self = thread;
+}
+
+void mt_unregister(void) {
+  if (mt_self == NULL) return;
+  __atomic_store_n(&mt_self->unowned, 1, __ATOMIC_RELEASE);
+  mt_self = NULL;
+}
+
+/* The route PATH is counted under, interning it if INTERN: the first
+ * segment of the path decoded and normalized, so that "/a/../b/c" and
+ * "/%62/c" are both "/b". Files at the top level are all "/", apart from the
+ * stats themselves. */
+static int mt_route(const char *path, int intern) {
+  size_t path_length = strcspn(path, "?");
+  char raw[path_length + 1], relative[path_length + 1];
+  size_t length;
+  char *route, *name;
+
+  memcpy(raw, path, path_length);
+  raw[path_length] = '\0';
+  if (dr_normalize(raw, relative, sizeof(relative)) == -1) return MT_MAX_ROUTES;
+  length = strcspn(relative, "/");
+  if (relative[length] != '/' &&
+      (path_length == 0 || raw[path_length - 1] != '/') &&
+      strcmp(relative, MT_PATH + 1) != 0)
+    length = 0;
+
+  for (int i = 0; i < MT_MAX_ROUTES; i++) {
+    route = __atomic_load_n(&mt_routes[i], __ATOMIC_ACQUIRE);
+    if (route == NULL) {
+      if (!intern) return MT_MAX_ROUTES;
+      name = malloc(length + 2);
+      if (name == NULL) return MT_MAX_ROUTES;
+      name[0] = '/';
+      memcpy(name + 1, relative, length);
+      name[length + 1] = '\0';
+      if (__atomic_compare_exchange_n(&mt_routes[i], &route, name, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return i;
+      /* Another thread took the slot; it may have been for this route. */
+      free(name);
+    }
+    if (strncmp(route + 1, relative, length) == 0 && route[length + 1] == '\0')
+      return i;
+  }
+  return MT_MAX_ROUTES;
+}
+
+/* Bucket of a latency: exact below 4 us, then 4 per power of two. */
+static int mt_bucket(unsigned long long us) {
+  int exponent, bucket;
+
+  if (us < 4) return us;
+  exponent = 63 - __builtin_clzll(us);
+  bucket = 4 * (exponent - 1) + ((us >> (exponent - 2)) & 3);
+  return bucket < MT_BUCKETS ? bucket : MT_BUCKETS - 1;
+}
+
+/* Smallest latency (us) above every one in BUCKET. */
+static unsigned long long mt_bucket_limit(int bucket) {
+  if (bucket < 4) return bucket + 1;
+  return (unsigned long long) (5 + bucket % 4) << (bucket / 4 - 1);
+}
+
+void mt_record(const char *path, int status_code, size_t bytes,
+    long long latency_ns) {
+  mt_thread_t *thread = mt_self;
+  mt_route_counters_t *counters;
+  unsigned long long us = latency_ns > 0 ? latency_ns / 1000 : 0;
+
+  if (thread == NULL) return;
+  counters = &thread->routes[mt_route(path, status_code < 400)];
+  MT_ADD(counters->bytes, bytes);
+  MT_ADD(counters->latency_sum_us, us);
+  MT_ADD(counters->latency[mt_bucket(us)], 1);
+  if (status_code >= 100 && status_code < 600)
+    MT_ADD(thread->status[status_code], 1);
+}
+
+void mt_busy(long long ns) {
+  if (mt_self != NULL) MT_ADD(mt_self->busy_ns, ns);
+}
+
+/* Prints NAME as a label value, escaped. */
+static void mt_label(FILE *out, const char *name) {
+  for (; *name; name++) {
+    if (*name == '\\' || *name == '"') fputc('\\', out);
+    if (*name == '\n')
+      fputs("\\n", out);
+    else
+      fputc(*name, out);
+  }
+}
+
+static const char *mt_route_name(int route) {
+  if (route == MT_MAX_ROUTES) return "other";
+  return __atomic_load_n(&mt_routes[route], __ATOMIC_ACQUIRE);
+}
+
+/* Starts a sample of METRIC for ROUTE, up to the closing brace. */
+static void mt_sample(FILE *out, const char *metric, const char *route) {
+  fprintf(out, "%s{route=\"", metric);
+  mt_label(out, route);
+  fputc('"', out);
+}
+
+void mt_report(FILE *out) {
+  mt_thread_t *first = __atomic_load_n(&mt_threads, __ATOMIC_ACQUIRE), *thread;
+  mt_route_counters_t *sums;
+  unsigned long long cumulative, target;
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  const char *route;
+  int i, j, k;
+
+  fprintf(out, "# HELP httpserver_uptime_seconds Time since the first thread started.\n"
+      "# TYPE httpserver_uptime_seconds gauge\n"
+      "httpserver_uptime_seconds %.3f\n",
+      (mt_now_ns() - __atomic_load_n(&mt_started_ns, __ATOMIC_RELAXED)) / 1e9);
+
+  fprintf(out, "# HELP httpserver_thread_busy_seconds_total Time each thread spent serving.\n"
+      "# TYPE httpserver_thread_busy_seconds_total counter\n");
+  for (thread = first; thread != NULL; thread = thread->next)
+    fprintf(out, "httpserver_thread_busy_seconds_total{thread=\"%s\"} %.6f\n",
+        thread->name, MT_LOAD(thread->busy_ns) / 1e9);
+
+  fprintf(out, "# HELP httpserver_responses_total Responses sent, by status code.\n"
+      "# TYPE httpserver_responses_total counter\n");
+  for (i = 100; i < 600; i++) {
+    unsigned long count = 0;
+    for (thread = first; thread != NULL; thread = thread->next)
+      count += MT_LOAD(thread->status[i]);
+    if (count > 0)
+      fprintf(out, "httpserver_responses_total{code=\"%d\"} %lu\n", i, count);
+  }
+
+  /* Sum every route first: each metric's samples have to come together. */
+  sums = calloc(MT_MAX_ROUTES + 1, sizeof(mt_route_counters_t));
+  if (sums == NULL) return;
+  for (i = 0; i <= MT_MAX_ROUTES; i++) {
+    for (thread = first; thread != NULL; thread = thread->next) {
+      mt_route_counters_t *counters = &thread->routes[i];
+      sums[i].bytes += MT_LOAD(counters->bytes);
+      sums[i].latency_sum_us += MT_LOAD(counters->latency_sum_us);
+      for (j = 0; j < MT_BUCKETS; j++)
+        sums[i].latency[j] += MT_LOAD(counters->latency[j]);
+    }
+    /* Counted from the buckets, so that the histogram adds up. */
+    for (j = 0; j < MT_BUCKETS; j++)
+      sums[i].requests += sums[i].latency[j];
+  }
+
+  fprintf(out, "# HELP httpserver_requests_total Requests answered, by route.\n"
+      "# TYPE httpserver_requests_total counter\n");
+  for (i = 0; i <= MT_MAX_ROUTES; i++) {
+    route = mt_route_name(i);
+    if (route == NULL || sums[i].requests == 0) continue;
+    mt_sample(out, "httpserver_requests_total", route);
+    fprintf(out, "} %lu\n", sums[i].requests);
+  }
+
+  fprintf(out, "# HELP httpserver_response_bytes_total Bytes of responses, by route.\n"
+      "# TYPE httpserver_response_bytes_total counter\n");
+  for (i = 0; i <= MT_MAX_ROUTES; i++) {
+    route = mt_route_name(i);
+    if (route == NULL || sums[i].requests == 0) continue;
+    mt_sample(out, "httpserver_response_bytes_total", route);
+    fprintf(out, "} %lu\n", sums[i].bytes);
+  }
+
+  /* Exposed at powers of two; the finer buckets serve the quantiles. */
+  fprintf(out, "# HELP httpserver_request_duration_seconds Time from request parsed to response sent.\n"
+      "# TYPE httpserver_request_duration_seconds histogram\n");
+  for (i = 0; i <= MT_MAX_ROUTES; i++) {
+    route = mt_route_name(i);
+    if (route == NULL || sums[i].requests == 0) continue;
+    cumulative = 0;
+    for (j = 0, k = 0; k <= 26; k++) {
+      while (j < MT_BUCKETS && mt_bucket_limit(j) <= 1ULL << k)
+        cumulative += sums[i].latency[j++];
+      mt_sample(out, "httpserver_request_duration_seconds_bucket", route);
+      fprintf(out, ",le=\"%.6f\"} %llu\n", (1ULL << k) / 1e6, cumulative);
+    }
+    mt_sample(out, "httpserver_request_duration_seconds_bucket", route);
+    fprintf(out, ",le=\"+Inf\"} %lu\n", sums[i].requests);
+    mt_sample(out, "httpserver_request_duration_seconds_sum", route);
+    fprintf(out, "} %.6f\n", sums[i].latency_sum_us / 1e6);
+    mt_sample(out, "httpserver_request_duration_seconds_count", route);
+    fprintf(out, "} %lu\n", sums[i].requests);
+  }
+
+  fprintf(out, "# HELP httpserver_request_duration_quantile_seconds Latency quantiles, to within 25%%.\n"
+      "# TYPE httpserver_request_duration_quantile_seconds gauge\n");
+  for (i = 0; i <= MT_MAX_ROUTES; i++) {
+    route = mt_route_name(i);
+    if (route == NULL || sums[i].requests == 0) continue;
+    for (k = 0; k < (int) (sizeof(quantiles) / sizeof(quantiles[0])); k++) {
+      target = (unsigned long long) (quantiles[k] * sums[i].requests + 0.5);
+      if (target == 0) target = 1;
+      for (j = 0, cumulative = 0; j < MT_BUCKETS - 1; j++) {
+        cumulative += sums[i].latency[j];
+        if (cumulative >= target) break;
+      }
+      mt_sample(out, "httpserver_request_duration_quantile_seconds", route);
+      fprintf(out, ",quantile=\"%g\"} %g\n", quantiles[k],
+          mt_bucket_limit(j) / 1e6);
+    }
+  }
+  free(sums);
+}
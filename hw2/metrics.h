@@ -0,0 +1,60 @@
+#ifndef __METRICS__
+#define __METRICS__
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* METRICS counts requests per route (the first segment of the path), bytes,
+ * status codes, latencies and busy time. Every serving thread registers its
+ * own block of counters and is the only one to write it, with plain
+ * (relaxed) stores -- no locks or atomic read-modify-writes on the hot path.
+ * A scrape sums the blocks of all threads as it goes, and prints them in the
+ * Prometheus text format. */
+
+#define MT_PATH "/__stats"        /* Where the server answers with mt_report. */
+#define MT_MAX_ROUTES 32          /* Further routes are counted as "other". */
+#define MT_BUCKETS 108            /* 4 per power of two, up to 2^27 us. */
+
+typedef struct mt_route_counters {
+  unsigned long requests;          /* Only in sums: the buckets added up. */
+  unsigned long bytes;
+  unsigned long long latency_sum_us;
+  unsigned long latency[MT_BUCKETS];
+} mt_route_counters_t;
+
+typedef struct mt_thread {
+  char name[16];
+  unsigned long long busy_ns;
+  unsigned long status[600];
+  mt_route_counters_t routes[MT_MAX_ROUTES + 1];
+  int unowned;                /* Left by a thread that exited. */
+  struct mt_thread *next;
+} mt_thread_t;
+
+/* Gives the calling thread its counters, named NAME and INDEX
+ * ("worker", 3 -> worker3). Threads that never register are not counted.
+ * Counters left behind under that name by mt_unregister are taken over,
+ * so threads that come and go do not add up. */
+void mt_register(const char *name, int index);
+
+/* Leaves the calling thread's counters, for a thread about to exit. */
+void mt_unregister(void);
+
+/* Nanoseconds on the monotonic clock, to time requests and work with. */
+long long mt_now_ns(void);
+
+/* Counts a request for PATH answered with STATUS_CODE, in BYTES bytes and
+ * LATENCY_NS nanoseconds, under its route. A route only gets a slot of its
+ * own once a request to it succeeds (with a status below 400), so that
+ * requests for nothing, from scanners say, cannot take them all; until
+ * then its requests count as "other". */
+void mt_record(const char *path, int status_code, size_t bytes,
+    long long latency_ns);
+
+/* Adds NS nanoseconds to the time the calling thread has spent working. */
+void mt_busy(long long ns);
+
+/* Prints every counter, summed over threads, to OUT. */
+void mt_report(FILE *out);
+
+#endif
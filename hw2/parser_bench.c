@@ -0,0 +1,179 @@
+/*
+ * Measures how many requests per second one core parses, comparing the
+ * original parser (one malloc'd copy of the request plus copies of the
+ * method and path, headers dropped) against the incremental parser in
+ * libhttp, fed a whole request at once, in small chunks as if it arrived
+ * over many reads, and pipelined many to a buffer.
+ *
+ * Usage: ./parser_bench [seconds_per_case]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhttp.h"
+
+#define BENCH_PIPELINE_DEPTH 16
+
+static const char *requests[] = {
+  "GET / HTTP/1.1\r\n"
+  "Host: localhost:8000\r\n"
+  "User-Agent: curl/8.5.0\r\n"
+  "Accept: */*\r\n"
+  "\r\n",
+
+  "GET /my_documents/WEB_SCALE.jpg HTTP/1.1\r\n"
+  "Host: localhost:8000\r\n"
+  "Connection: keep-alive\r\n"
+  "sec-ch-ua: \"Chromium\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+  "sec-ch-ua-mobile: ?0\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+      "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+  "sec-ch-ua-platform: \"Linux\"\r\n"
+  "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+  "Sec-Fetch-Site: same-origin\r\n"
+  "Sec-Fetch-Mode: no-cors\r\n"
+  "Sec-Fetch-Dest: image\r\n"
+  "Referer: http://localhost:8000/my_documents/\r\n"
+  "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+  "Accept-Language: en-US,en;q=0.9\r\n"
+  "If-None-Match: \"5d2c-114b2-6620f1b3\"\r\n"
+  "\r\n",
+};
+
+/* The original http_request_parse, minus its read(). */
+struct legacy_request {
+  char *method;
+  char *path;
+};
+
+static struct legacy_request *legacy_parse(char *request_text) {
+  struct legacy_request *request = malloc(sizeof(struct legacy_request));
+  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
+  char *read_start, *read_end;
+  size_t read_size;
+
+  strcpy(read_buffer, request_text);
+  read_start = read_end = read_buffer;
+  while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
+  read_size = read_end - read_start;
+  request->method = malloc(read_size + 1);
+  memcpy(request->method, read_start, read_size);
+  request->method[read_size] = '\0';
+
+  read_start = ++read_end;
+  while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
+  read_size = read_end - read_start;
+  request->path = malloc(read_size + 1);
+  memcpy(request->path, read_start, read_size);
+  request->path[read_size] = '\0';
+
+  while (*read_end != '\0' && *read_end != '\n') read_end++;
+  free(read_buffer);
+  return request;
+}
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct http_connection connection;
+static volatile size_t sink;
+
+/* Appends SIZE bytes to the connection as if read from its socket. */
+static void feed(const char *data, size_t size) {
+  memcpy(connection.buffer + connection.length, data, size);
+  connection.length += size;
+}
+
+/* Parses one request delivered CHUNK bytes at a time (0: all at once). */
+static int parse_chunked(const char *request_text, size_t length, size_t chunk) {
+  struct http_request *request;
+  size_t offset = 0;
+
+  http_connection_init(&connection, -1);
+  if (chunk == 0) chunk = length;
+  while (offset < length) {
+    size_t size = length - offset < chunk ? length - offset : chunk;
+    feed(request_text + offset, size);
+    offset += size;
+    if (http_connection_parse(&connection, &request) == HTTP_PARSE_OK) {
+      sink += request->num_headers;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Parses up to BENCH_PIPELINE_DEPTH requests read into the buffer together. */
+static int parse_pipelined(const char *request_text, size_t length) {
+  struct http_request *request;
+  int parsed = 0;
+
+  http_connection_init(&connection, -1);
+  for (int i = 0; i < BENCH_PIPELINE_DEPTH &&
+      connection.length + length <= LIBHTTP_REQUEST_MAX_SIZE; i++)
+    feed(request_text, length);
+  while (http_connection_parse(&connection, &request) == HTTP_PARSE_OK) {
+    sink += request->num_headers;
+    parsed++;
+  }
+  return parsed;
+}
+
+static int parse_legacy(const char *request_text) {
+  struct legacy_request *request = legacy_parse((char *) request_text);
+  sink += strlen(request->path);
+  free(request->method);
+  free(request->path);
+  free(request);
+  return 1;
+}
+
+/* Returns requests per second for MODE over about SECONDS. */
+static double measure(int mode, const char *request_text, double seconds) {
+  size_t length = strlen(request_text);
+  long long parsed = 0;
+  double start = now_seconds(), elapsed;
+
+  do {
+    for (int i = 0; i < 1000; i++) {
+      switch (mode) {
+        case 0: parsed += parse_legacy(request_text); break;
+        case 1: parsed += parse_chunked(request_text, length, 0); break;
+        case 2: parsed += parse_chunked(request_text, length, 16); break;
+        case 3: parsed += parse_chunked(request_text, length, 1); break;
+        case 4: parsed += parse_pipelined(request_text, length); break;
+      }
+    }
+    elapsed = now_seconds() - start;
+  } while (elapsed < seconds);
+  return parsed / elapsed;
+}
+
+int main(int argc, char **argv) {
+  double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+  const char *modes[] = {"legacy", "whole", "16B reads", "1B reads", "pipelined"};
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  for (size_t r = 0; r < sizeof(requests) / sizeof(requests[0]); r++) {
+    struct http_request *request;
+    size_t length = strlen(requests[r]);
+
+    http_connection_init(&connection, -1);
+    feed(requests[r], length);
+    if (http_connection_parse(&connection, &request) != HTTP_PARSE_OK) {
+      fprintf(stderr, "Failed to parse sample request %zu\n", r);
+      return EXIT_FAILURE;
+    }
+    printf("request %zu: %zu bytes, %zu headers\n", r, length,
+        request->num_headers);
+    for (int mode = 0; mode < 5; mode++)
+      printf("  %-10s %12.0f requests/s\n", modes[mode],
+          measure(mode, requests[r], seconds));
+  }
+  return EXIT_SUCCESS;
+}
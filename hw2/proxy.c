@@ -0,0 +1,748 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proxy.h"
+#include "relay.h"
+#include "watchdog.h"
+
+#define PX_HEAD_MAX_SIZE LIBHTTP_REQUEST_MAX_SIZE
+#define PX_SPLICE_SIZE 65536
+
+/* Headers that only concern one hop, which are not forwarded. */
+static const char *px_hop_by_hop[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade",
+  NULL,
+};
+
+/* A response head read from the upstream, followed in BUFFER by whatever
+ * part of the body arrived with it. */
+struct px_response {
+  char buffer[PX_HEAD_MAX_SIZE];
+  size_t length;              /* Bytes in buffer. */
+  size_t head_length;
+  int status_code;
+  int keep_alive;             /* The server lets the connection persist. */
+  int chunked;
+  long long content_length;   /* -1 if not given. */
+};
+
+enum px_chunk_state {
+  PX_CHUNK_SIZE,
+  PX_CHUNK_EXTENSION,
+  PX_CHUNK_DATA,
+  PX_CHUNK_DATA_END,
+  PX_CHUNK_TRAILER,
+  PX_CHUNK_DONE,
+};
+
+/* Where a chunked body being relayed has got to. */
+struct px_chunks {
+  enum px_chunk_state state;
+  unsigned long long remaining;
+  int digits;
+  int line_empty;             /* Nothing yet on the current trailer line. */
+};
+
+/* Pipe for splicing bodies, one per worker. */
+static __thread int px_pipe[2] = {-1, -1};
+
+void px_bad_gateway(int fd) {
+  char *message = "<center><h1>502 Bad Gateway</h1><hr></center>";
+  char head_buffer[LIBHTTP_HEAD_MAX_SIZE];
+  struct http_head head;
+
+  http_head_init(&head, head_buffer, sizeof(head_buffer), 502);
+  http_head_add(&head, "Content-Type", "text/html");
+  http_head_add_number(&head, "Content-Length", strlen(message));
+  http_head_add(&head, "Connection", "close");
+  http_head_send(fd, &head, message, strlen(message), MSG_NOSIGNAL);
+}
+
+/* Appends DATA to BUFFER. Returns -1 if it does not fit. */
+static int px_append(char *buffer, size_t size, size_t *length,
+    const char *data, size_t data_length) {
+  if (*length + data_length > size) return -1;
+  memcpy(buffer + *length, data, data_length);
+  *length += data_length;
+  return 0;
+}
+
+static int px_is_hop_by_hop(const char *name, size_t name_length,
+    int upgrade) {
+  for (int i = 0; px_hop_by_hop[i] != NULL; i++) {
+    if (strlen(px_hop_by_hop[i]) == name_length &&
+        strncasecmp(px_hop_by_hop[i], name, name_length) == 0)
+      return !(upgrade && strcmp(px_hop_by_hop[i], "Upgrade") == 0);
+  }
+  return 0;
+}
+
+/* Whether the comma-separated VALUE lists TOKEN. */
+static int px_has_token(const char *value, size_t length, const char *token) {
+  size_t token_length = strlen(token), i = 0, start, end;
+
+  while (i < length) {
+    while (i < length && (value[i] == ' ' || value[i] == '\t' || value[i] == ','))
+      i++;
+    start = i;
+    while (i < length && value[i] != ',') i++;
+    end = i;
+    while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t'))
+      end--;
+    if (end - start == token_length &&
+        strncasecmp(value + start, token, token_length) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/* Writes the head REQUEST is forwarded with into BUFFER. HTTP/1.0 requests
+ * stay HTTP/1.0, so the response comes back in a form the client reads,
+ * but ask for the upstream connection to persist. */
+static int px_request_head(struct http_request *request, int upgrade,
+    char *buffer, size_t size, size_t *length) {
+  int failed = 0;
+
+  *length = 0;
+  failed |= px_append(buffer, size, length, request->method,
+      strlen(request->method));
+  failed |= px_append(buffer, size, length, " ", 1);
+  failed |= px_append(buffer, size, length, request->path,
+      strlen(request->path));
+  failed |= px_append(buffer, size, length, request->minor_version ?
+      " HTTP/1.1\r\n" : " HTTP/1.0\r\n", 11);
+
+  for (size_t i = 0; i < request->num_headers; i++) {
+    struct http_header *header = &request->headers[i];
+    if (px_is_hop_by_hop(header->name, header->name_length, upgrade))
+      continue;
+    failed |= px_append(buffer, size, length, header->name,
+        header->name_length);
+    failed |= px_append(buffer, size, length, ": ", 2);
+    failed |= px_append(buffer, size, length, header->value,
+        header->value_length);
+    failed |= px_append(buffer, size, length, "\r\n", 2);
+  }
+
+  if (upgrade)
+    failed |= px_append(buffer, size, length, "Connection: upgrade\r\n", 21);
+  else if (!request->minor_version)
+    failed |= px_append(buffer, size, length, "Connection: keep-alive\r\n", 24);
+  failed |= px_append(buffer, size, length, "\r\n", 2);
+  return failed ? -1 : 0;
+}
+
+/* Reads from FD until RESPONSE holds a whole head. Returns -1 on EOF, an
+ * error, or a head too large for the buffer. */
+static int px_read_head(int fd, struct px_response *response) {
+  size_t searched = 0;
+  ssize_t bytes_read;
+  char *end;
+
+  while (1) {
+    end = memmem(response->buffer + searched, response->length - searched,
+        "\r\n\r\n", 4);
+    if (end != NULL) {
+      response->head_length = end + 4 - response->buffer;
+      return 0;
+    }
+    if (response->length >= 3) searched = response->length - 3;
+    if (response->length == sizeof(response->buffer)) return -1;
+
+    bytes_read = recv(fd, response->buffer + response->length,
+        sizeof(response->buffer) - response->length, 0);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) return -1;
+    response->length += bytes_read;
+  }
+}
+
+/* Parses the head in RESPONSE, and copies it to BUFFER without its
+ * hop-by-hop headers and blank line. Returns -1 if it is malformed. */
+static int px_parse_head(struct px_response *response, int upgrade,
+    char *buffer, size_t size, size_t *length) {
+  char *line = response->buffer, *head_end;
+  char *line_end, *colon, *value, *value_end;
+  size_t name_length;
+  int minor_version;
+
+  head_end = response->buffer + response->head_length - 2;
+  line_end = memchr(line, '\n', head_end - line);
+  if (line_end == NULL || line_end - line < 12 ||
+      strncmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ')
+    return -1;
+  minor_version = line[7] - '0';
+  response->status_code = atoi(line + 9);
+  if (response->status_code < 100 || response->status_code > 999) return -1;
+  response->keep_alive = minor_version >= 1;
+  response->chunked = 0;
+  response->content_length = -1;
+
+  *length = 0;
+  if (px_append(buffer, size, length, line, line_end + 1 - line) == -1)
+    return -1;
+
+  for (line = line_end + 1; line < head_end; line = line_end + 1) {
+    line_end = memchr(line, '\n', head_end - line);
+    if (line_end == NULL) return -1;
+    colon = memchr(line, ':', line_end - line);
+    if (colon == NULL) return -1;
+    name_length = colon - line;
+    value = colon + 1;
+    value_end = line_end;
+    while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+    while (value_end > value && (value_end[-1] == '\r' ||
+          value_end[-1] == ' ' || value_end[-1] == '\t'))
+      value_end--;
+
+    if (name_length == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+      char *end;
+      response->content_length = strtoll(value, &end, 10);
+      if (end != value_end || response->content_length < 0) return -1;
+    } else if (name_length == 17 &&
+        strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+      response->chunked = px_has_token(value, value_end - value, "chunked");
+    } else if (name_length == 10 && strncasecmp(line, "Connection", 10) == 0) {
+      if (px_has_token(value, value_end - value, "close"))
+        response->keep_alive = 0;
+      else if (px_has_token(value, value_end - value, "keep-alive"))
+        response->keep_alive = 1;
+    }
+
+    if (px_is_hop_by_hop(line, name_length,
+          upgrade && response->status_code == 101))
+      continue;
+    if (px_append(buffer, size, length, line, line_end + 1 - line) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+/* Scans LENGTH bytes of a chunked body. Returns how many of them belong to
+ * it (all, unless its end is among them), or -1 if it is malformed. */
+static ssize_t px_scan_chunks(struct px_chunks *chunks, const char *data,
+    size_t length) {
+  size_t i = 0, skip;
+  int digit;
+
+  while (i < length && chunks->state != PX_CHUNK_DONE) {
+    char c = data[i];
+    switch (chunks->state) {
+      case PX_CHUNK_SIZE:
+        digit = c >= '0' && c <= '9' ? c - '0' :
+            c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+            c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit >= 0) {
+          if (++chunks->digits > 15) return -1;
+          chunks->remaining = chunks->remaining * 16 + digit;
+          i++;
+          break;
+        }
+        if (chunks->digits == 0) return -1;
+        chunks->state = PX_CHUNK_EXTENSION;
+        break;
+      case PX_CHUNK_EXTENSION:
+        if (data[i++] != '\n') break;
+        chunks->line_empty = 1;
+        chunks->state = chunks->remaining > 0 ? PX_CHUNK_DATA : PX_CHUNK_TRAILER;
+        break;
+      case PX_CHUNK_DATA:
+        skip = length - i < chunks->remaining ? length - i : chunks->remaining;
+        i += skip;
+        chunks->remaining -= skip;
+        if (chunks->remaining == 0) chunks->state = PX_CHUNK_DATA_END;
+        break;
+      case PX_CHUNK_DATA_END:
+        i++;
+        if (c == '\n') {
+          chunks->digits = 0;
+          chunks->state = PX_CHUNK_SIZE;
+        } else if (c != '\r') {
+          return -1;
+        }
+        break;
+      case PX_CHUNK_TRAILER:
+        i++;
+        if (c == '\n') {
+          if (chunks->line_empty) chunks->state = PX_CHUNK_DONE;
+          chunks->line_empty = 1;
+        } else if (c != '\r') {
+          chunks->line_empty = 0;
+        }
+        break;
+      case PX_CHUNK_DONE:
+        break;
+    }
+  }
+  return i;
+}
+
+static int px_send(int fd, const char *data, size_t length) {
+  struct iovec iov = {(void *) data, length};
+  struct iovec *iov_pointer = &iov;
+  int iov_count = 1;
+
+  return length == 0 ? 0 : http_send_iov(fd, &iov_pointer, &iov_count,
+      MSG_NOSIGNAL);
+}
+
+static int px_send_two(int fd, const char *first, size_t first_length,
+    const char *second, size_t second_length) {
+  struct iovec iov[2] = {
+    {(void *) first, first_length},
+    {(void *) second, second_length},
+  };
+  struct iovec *iov_pointer = iov;
+  int iov_count = second_length > 0 ? 2 : 1;
+
+  return http_send_iov(fd, &iov_pointer, &iov_count, MSG_NOSIGNAL);
+}
+
+/* Moves LENGTH bytes (or, if negative, everything up to EOF) from FROM to
+ * TO through this worker's pipe. Returns -1 on an error or early EOF. */
+static int px_splice(int from, int to, long long length) {
+  ssize_t bytes, sent;
+
+  if (px_pipe[0] < 0 && pipe2(px_pipe, O_CLOEXEC) == -1) return -1;
+
+  while (length != 0) {
+    bytes = splice(from, NULL, px_pipe[1], NULL,
+        length < 0 || length > PX_SPLICE_SIZE ? PX_SPLICE_SIZE : length,
+        SPLICE_F_MOVE);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes == 0 && length < 0) return 0;
+    if (bytes <= 0) return -1;
+    if (length > 0) length -= bytes;
+    rl_account(bytes);
+    wd_progress();
+
+    while (bytes > 0) {
+      sent = splice(px_pipe[0], NULL, to, NULL, bytes, SPLICE_F_MOVE);
+      if (sent < 0 && errno == EINTR) continue;
+      if (sent <= 0) {
+        /* Whatever is left in the pipe must not go to the next client. */
+        close(px_pipe[0]);
+        close(px_pipe[1]);
+        px_pipe[0] = px_pipe[1] = -1;
+        return -1;
+      }
+      bytes -= sent;
+    }
+  }
+  return 0;
+}
+
+/* Reads exactly LENGTH bytes from FD into BUFFER. */
+static int px_recv_all(int fd, char *buffer, size_t length) {
+  ssize_t bytes;
+
+  while (length > 0) {
+    bytes = recv(fd, buffer, length, 0);
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes <= 0) return -1;
+    wd_progress();
+    buffer += bytes;
+    length -= bytes;
+  }
+  return 0;
+}
+
+/* Relays a chunked body, the start of which is in RESPONSE after its head.
+ * Returns -1 on error, 1 if the server sent more than the body, else 0. */
+static int px_relay_chunks(int upstream_fd, int client_fd,
+    struct px_response *response, const char *head, size_t head_length) {
+  struct px_chunks chunks = {PX_CHUNK_SIZE, 0, 0, 0};
+  char *data = response->buffer + response->head_length;
+  size_t length = response->length - response->head_length;
+  ssize_t body_length;
+
+  body_length = px_scan_chunks(&chunks, data, length);
+  if (body_length < 0 ||
+      px_send_two(client_fd, head, head_length, data, body_length) == -1)
+    return -1;
+
+  while (chunks.state != PX_CHUNK_DONE) {
+    length = recv(upstream_fd, response->buffer, sizeof(response->buffer), 0);
+    if ((ssize_t) length <= 0) {
+      if ((ssize_t) length < 0 && errno == EINTR) continue;
+      return -1;
+    }
+    wd_progress();
+    body_length = px_scan_chunks(&chunks, response->buffer, length);
+    if (body_length < 0 || px_send(client_fd, response->buffer, body_length) == -1)
+      return -1;
+    rl_account(body_length);
+  }
+  return (size_t) body_length < length;
+}
+
+/*
+ * Sends REQUEST to UPSTREAM_FD, its head as HEAD, followed by its body: what
+ * arrived with the head goes in the same write, and the rest as it comes
+ * from the client, spliced when its length is known, else relayed chunk by
+ * chunk through the connection's buffer, so that a request pipelined behind
+ * it stays there. A client expecting 100 Continue is sent one first. Sets
+ * *STREAMED once the body has been read from the client past the buffer, so
+ * that the request cannot be sent again. Returns how many bytes of the body
+ * were sent from the buffer without being taken from it yet (see
+ * http_connection_take_body), or -1 on an error on either side.
+ */
+static ssize_t px_send_request(int upstream_fd,
+    struct http_connection *connection, struct http_request *request,
+    const char *head, size_t head_length, int *streamed) {
+  struct px_chunks chunks = {PX_CHUNK_SIZE, 0, 0, 0};
+  char *expect = http_request_header(request, "Expect");
+  size_t length;
+  char *body = http_connection_buffered_body(connection, &length);
+  ssize_t body_length;
+
+  *streamed = 0;
+  if (!request->chunked) {
+    body_length = length < request->content_length ? length :
+        request->content_length;
+    if (px_send_two(upstream_fd, head, head_length, body, body_length) == -1)
+      return -1;
+    if ((size_t) body_length == request->content_length) return body_length;
+  } else {
+    body_length = px_scan_chunks(&chunks, body, length);
+    if (body_length < 0 ||
+        px_send_two(upstream_fd, head, head_length, body, body_length) == -1)
+      return -1;
+    if (chunks.state == PX_CHUNK_DONE) return body_length;
+  }
+
+  *streamed = 1;
+  http_connection_take_body(connection, body_length);
+  if (request->minor_version >= 1 && expect != NULL &&
+      px_has_token(expect, strlen(expect), "100-continue") &&
+      px_send(connection->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25) == -1)
+    return -1;
+  if (!request->chunked)
+    return px_splice(connection->fd, upstream_fd,
+        request->content_length - body_length);
+
+  do {
+    if (http_connection_read(connection) <= 0) return -1;
+    wd_progress();
+    body = http_connection_buffered_body(connection, &length);
+    body_length = px_scan_chunks(&chunks, body, length);
+    if (body_length < 0 || px_send(upstream_fd, body, body_length) == -1)
+      return -1;
+    rl_account(body_length);
+    if (chunks.state != PX_CHUNK_DONE)
+      http_connection_take_body(connection, body_length);
+  } while (chunks.state != PX_CHUNK_DONE);
+  return body_length;
+}
+
+/* Whether the response to REQUEST may come from, and go into, the cache.
+ * Requests that carry a body or credentials, ask for part of a response,
+ * or ask to bypass caches, go to the upstream. */
+static int px_cacheable_request(struct http_request *request, int upgrade) {
+  char *cache_control = http_request_header(request, "Cache-Control");
+  char *pragma = http_request_header(request, "Pragma");
+
+  if (upgrade || request->content_length > 0 || request->chunked ||
+      (strcmp(request->method, "GET") != 0 &&
+       strcmp(request->method, "HEAD") != 0) ||
+      http_request_header(request, "Authorization") != NULL ||
+      http_request_header(request, "Range") != NULL)
+    return 0;
+  if (cache_control != NULL &&
+      (px_has_token(cache_control, strlen(cache_control), "no-cache") ||
+       px_has_token(cache_control, strlen(cache_control), "no-store") ||
+       px_has_token(cache_control, strlen(cache_control), "max-age=0")))
+    return 0;
+  return pragma == NULL || !px_has_token(pragma, strlen(pragma), "no-cache");
+}
+
+/* Sends ENTRY from the cache, with its current Age. */
+static int px_send_cached(int client_fd, pc_entry_t *entry, int keep_alive) {
+  char extra[96];
+  struct iovec iov[3];
+  struct iovec *iov_pointer = iov;
+  int iov_count = 3;
+
+  iov[0].iov_base = entry->data;
+  iov[0].iov_len = entry->head_length;
+  iov[1].iov_base = extra;
+  iov[1].iov_len = sprintf(extra, "Age: %ld\r\nConnection: %s\r\n\r\n",
+      pc_age(entry), keep_alive ? "keep-alive" : "close");
+  iov[2].iov_base = entry->data + entry->head_length;
+  iov[2].iov_len = entry->length - entry->head_length;
+  if (iov[2].iov_len == 0) iov_count = 2;
+  return http_send_iov(client_fd, &iov_pointer, &iov_count, MSG_NOSIGNAL);
+}
+
+/* Completes an Upgrade: the client and the upstream exchange whatever they
+ * have already sent each other, then the relay thread takes both over. */
+static enum px_result px_upgrade(up_pool_t *pool, int upstream_fd,
+    struct http_connection *connection, struct px_response *response,
+    const char *head, size_t head_length) {
+  size_t client_start = connection->start + connection->request_length;
+
+  if (px_send_two(connection->fd, head, head_length,
+        response->buffer + response->head_length,
+        response->length - response->head_length) == -1 ||
+      px_send(upstream_fd, connection->buffer + client_start,
+        connection->length - client_start) == -1) {
+    up_release(pool, upstream_fd, 0);
+    return PX_CLOSE;
+  }
+  up_forget(pool);
+  rl_add(connection->fd, upstream_fd);
+  return PX_UPGRADED;
+}
+
+static long long px_now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+/* Reads past interim responses (100 Continue: the body has been sent
+ * already) to the final head, and parses it into HEAD. */
+static int px_final_head(int upstream_fd, struct px_response *response,
+    int upgrade, char *head, size_t head_size, size_t *head_length) {
+  while (1) {
+    if (px_parse_head(response, upgrade, head, head_size, head_length) == -1)
+      return -1;
+    if (response->status_code >= 200 || response->status_code == 101)
+      return 0;
+    response->length -= response->head_length;
+    memmove(response->buffer, response->buffer + response->head_length,
+        response->length);
+    if (px_read_head(upstream_fd, response) == -1) return -1;
+  }
+}
+
+/*
+ * Sends the request to one of GROUP's servers and reads the final response
+ * head into RESPONSE and HEAD. A server that cannot be connected to counts
+ * a failure and the next one is tried, and so is a reused connection that
+ * the server had closed before answering, unless part of the body has been
+ * read from the client already. Once a server has the request, though, it
+ * is not sent again elsewhere: it may have been acted on. Failing while the
+ * body streams, a server is not counted as failed: it may be the client.
+ * Returns the upstream connection, with *POOL_OUT set and the request
+ * counted in flight there, and the body taken from CONNECTION, or -1 if no
+ * server answered.
+ */
+static int px_exchange(up_group_t *group, struct http_connection *connection,
+    struct http_request *request, const char *request_head,
+    size_t request_head_length, int upgrade, struct px_response *response,
+    char *head, size_t head_size, size_t *head_length, up_pool_t **pool_out) {
+  unsigned long long tried = 0;
+  up_pool_t *pool;
+  long long start;
+  ssize_t body_length;
+  int upstream_fd, reused, streamed;
+
+  while ((pool = up_group_pick(group, request->path, tried)) != NULL) {
+    up_pool_enter(pool);
+    upstream_fd = up_acquire(pool, &reused);
+    if (upstream_fd < 0) {
+      /* A pool that stayed full is busy, not failing. */
+      if (errno != EBUSY) up_pool_failed(pool);
+      up_pool_leave(pool);
+      tried |= 1ULL << pool->index;
+      continue;
+    }
+
+    start = px_now_us();
+    response->length = 0;
+    body_length = px_send_request(upstream_fd, connection, request,
+        request_head, request_head_length, &streamed);
+    if (body_length == -1 || px_read_head(upstream_fd, response) == -1) {
+      up_release(pool, upstream_fd, 0);
+      up_pool_leave(pool);
+      if (streamed && body_length == -1) return -1;
+      if (reused && response->length == 0 && !streamed) continue;
+      up_pool_failed(pool);
+      return -1;
+    }
+    http_connection_take_body(connection, body_length);
+    if (px_final_head(upstream_fd, response, upgrade, head, head_size,
+          head_length) == -1) {
+      up_release(pool, upstream_fd, 0);
+      up_pool_leave(pool);
+      up_pool_failed(pool);
+      return -1;
+    }
+
+    up_pool_succeeded(pool, px_now_us() - start);
+    *pool_out = pool;
+    return upstream_fd;
+  }
+  return -1;
+}
+
+/* Sends the response from UPSTREAM_FD, whose head is in RESPONSE and HEAD,
+ * to the client, and hands the upstream connection back to POOL. While
+ * fetching for FLIGHT, a response the cache may keep is read into memory
+ * rather than spliced, and stored in CACHE, with the entry in *STORED. */
+static enum px_result px_respond(up_pool_t *pool, int upstream_fd,
+    struct http_connection *connection, struct http_request *request,
+    struct px_response *response, char *head, size_t head_length,
+    int upgrade, int keep_alive, proxy_cache_t *cache, pc_flight_t *flight,
+    pc_entry_t **stored) {
+  size_t leftover, body_start, stored_head_length = head_length;
+  int client_fd = connection->fd, reusable, no_body;
+  char *data = NULL;
+  long lifetime = -1, age;
+  int status = 0;
+
+  if (upgrade && response->status_code == 101) {
+    memcpy(head + head_length, "Connection: upgrade\r\n\r\n", 23);
+    return px_upgrade(pool, upstream_fd, connection, response, head,
+        head_length + 23);
+  }
+
+  no_body = strcmp(request->method, "HEAD") == 0 ||
+      response->status_code < 200 || response->status_code == 204 ||
+      response->status_code == 304;
+  /* Without a length, the body ends when the server closes. */
+  if (!no_body && !response->chunked && response->content_length < 0)
+    keep_alive = 0;
+  reusable = response->keep_alive &&
+      (no_body || response->chunked || response->content_length >= 0);
+
+  /* Chunked and close-delimited bodies are never stored. */
+  if (flight != NULL && (no_body || (!response->chunked &&
+          response->content_length >= 0 &&
+          (size_t) response->content_length <= cache->max_entry)))
+    lifetime = pc_lifetime(head, head_length, response->status_code, &age);
+  if (lifetime >= 0) {
+    data = malloc(head_length + (no_body ? 0 : response->content_length));
+    if (data != NULL) memcpy(data, head, head_length);
+  }
+
+  head_length += sprintf(head + head_length, "Connection: %s\r\n\r\n",
+      keep_alive ? "keep-alive" : "close");
+
+  body_start = response->head_length;
+  leftover = response->length - body_start;
+  if (no_body) {
+    status = px_send(client_fd, head, head_length);
+    if (leftover > 0) reusable = 0;
+  } else if (response->chunked) {
+    status = px_relay_chunks(upstream_fd, client_fd, response, head,
+        head_length);
+    if (status == 1) reusable = 0;
+  } else if (response->content_length >= 0) {
+    if ((long long) leftover > response->content_length) {
+      leftover = response->content_length;
+      reusable = 0;
+    }
+    if (data != NULL) {
+      memcpy(data + stored_head_length, response->buffer + body_start,
+          leftover);
+      if (px_recv_all(upstream_fd, data + stored_head_length + leftover,
+            response->content_length - leftover) == -1) {
+        /* Nothing has been sent yet. */
+        free(data);
+        up_release(pool, upstream_fd, 0);
+        px_bad_gateway(client_fd);
+        return PX_CLOSE;
+      }
+      rl_account(response->content_length - leftover);
+      status = px_send_two(client_fd, head, head_length,
+          data + stored_head_length, response->content_length);
+    } else {
+      status = px_send_two(client_fd, head, head_length,
+          response->buffer + body_start, leftover);
+      if (status == 0)
+        status = px_splice(upstream_fd, client_fd,
+            response->content_length - leftover);
+    }
+  } else {
+    status = px_send_two(client_fd, head, head_length,
+        response->buffer + body_start, leftover);
+    if (status == 0)
+      status = px_splice(upstream_fd, client_fd, -1);
+  }
+  rl_account(head_length + (no_body ? 0 : leftover));
+
+  /* Upstream errors were handled above: what failed is the client. */
+  if (data != NULL)
+    *stored = pc_insert(cache, flight->key, data, stored_head_length +
+        (no_body ? 0 : response->content_length), stored_head_length,
+        lifetime, age);
+
+  if (status < 0) {
+    up_release(pool, upstream_fd, 0);
+    return PX_CLOSE;
+  }
+  up_release(pool, upstream_fd, reusable);
+  return keep_alive ? PX_KEEP_ALIVE : PX_CLOSE;
+}
+
+enum px_result px_forward(up_group_t *group, proxy_cache_t *cache,
+    struct http_connection *connection, struct http_request *request,
+    int keep_alive, int *status_code, size_t *bytes) {
+  char request_head[PX_HEAD_MAX_SIZE + 64];
+  char head[PX_HEAD_MAX_SIZE + 64];
+  char key[PX_HEAD_MAX_SIZE + 16];
+  struct px_response response;
+  size_t request_head_length, head_length;
+  int upgrade = http_request_header(request, "Upgrade") != NULL;
+  int upstream_fd;
+  enum px_result result;
+  up_pool_t *pool;
+  pc_flight_t *flight = NULL;
+  pc_entry_t *entry = NULL;
+
+  *status_code = 502;
+  *bytes = 0;
+  if (cache != NULL && px_cacheable_request(request, upgrade)) {
+    snprintf(key, sizeof(key), "%s %s", request->method, request->path);
+    entry = pc_lookup(cache, key, &flight);
+    if (entry != NULL) {
+      /* The stored head starts with "HTTP/1.x NNN". */
+      *status_code = atoi(entry->data + 9);
+      *bytes = entry->length - entry->head_length;
+      result = px_send_cached(connection->fd, entry, keep_alive) == 0 &&
+          keep_alive ? PX_KEEP_ALIVE : PX_CLOSE;
+      pc_release(entry);
+      return result;
+    }
+  }
+
+  if (px_request_head(request, upgrade, request_head, sizeof(request_head),
+        &request_head_length) == -1) {
+    if (flight != NULL) pc_land(cache, flight, NULL);
+    px_bad_gateway(connection->fd);
+    return PX_CLOSE;
+  }
+
+  /* Room is left after HEAD for the Connection header and blank line. */
+  upstream_fd = px_exchange(group, connection, request, request_head,
+      request_head_length, upgrade, &response, head, sizeof(head) - 32,
+      &head_length, &pool);
+  if (upstream_fd < 0) {
+    if (flight != NULL) pc_land(cache, flight, NULL);
+    px_bad_gateway(connection->fd);
+    return PX_CLOSE;
+  }
+
+  *status_code = response.status_code;
+  /* Chunked and close-delimited bodies are not counted. */
+  if (response.content_length > 0 && strcmp(request->method, "HEAD") != 0)
+    *bytes = response.content_length;
+  result = px_respond(pool, upstream_fd, connection, request, &response, head,
+      head_length, upgrade, keep_alive, cache, flight, &entry);
+  up_pool_leave(pool);
+  if (flight != NULL) pc_land(cache, flight, entry);
+  if (entry != NULL) pc_release(entry);
+  return result;
+}
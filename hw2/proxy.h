@@ -0,0 +1,38 @@
+#ifndef __PROXY__
+#define __PROXY__
+
+/* PROXY forwards HTTP requests to the upstream server over pooled
+ * persistent connections (see upstream.h) and relays the responses back.
+ * Each request goes to the server its group picks (see up_group_pick).
+ * Heads are only rewritten to drop hop-by-hop headers such as Connection.
+ * Bodies pass through untouched, either way and of any length, spliced
+ * socket to socket when their length is known, else relayed chunk by
+ * chunk, so that the upstream connection can be reused once a response is
+ * complete, and the client's once its request is. */
+
+#include "libhttp.h"
+#include "proxy_cache.h"
+#include "upstream.h"
+
+enum px_result {
+  PX_KEEP_ALIVE,  /* The client connection can take another request. */
+  PX_CLOSE,       /* The client connection must be closed. */
+  PX_UPGRADED,    /* The client was handed to the relay thread (see relay.h)
+                   * along with its upstream connection. */
+};
+
+/* Forwards REQUEST, just parsed from CONNECTION, which must stream bodies
+ * (see http_connection_stream_bodies), to one of GROUP's servers
+ * and sends the response to the client, or a 502 if no server answers.
+ * With a CACHE, GET and HEAD requests are answered from it when they can
+ * be, and what they fetch is stored in it when allowed. KEEP_ALIVE is
+ * whether the client connection may persist. The status code sent back is
+ * left in *STATUS_CODE, and the length of its body, when known, in *BYTES. */
+enum px_result px_forward(up_group_t *group, proxy_cache_t *cache,
+    struct http_connection *connection, struct http_request *request,
+    int keep_alive, int *status_code, size_t *bytes);
+
+/* Sends a 502 Bad Gateway that closes the connection. */
+void px_bad_gateway(int fd);
+
+#endif
@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "proxy_cache.h"
+
+static unsigned int pc_hash(const char *key) {
+  unsigned int hash = 2166136261u;
+  while (*key) {
+    hash ^= (unsigned char) *key++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+void pc_init(proxy_cache_t *cache, size_t budget, size_t max_entry) {
+  memset(cache, 0, sizeof(*cache));
+  cache->budget = budget;
+  cache->max_entry = max_entry;
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_cond_init(&cache->landed, NULL);
+}
+
+int pc_spill_to(proxy_cache_t *cache, const char *path, size_t size) {
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  char *spill;
+
+  if (fd == -1) return -1;
+  if (ftruncate(fd, size) == -1) {
+    close(fd);
+    return -1;
+  }
+  spill = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (spill == MAP_FAILED) return -1;
+  cache->spill = spill;
+  cache->spill_size = size;
+  return 0;
+}
+
+void pc_release(pc_entry_t *entry) {
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+  free(entry->key);
+  if (!entry->spilled) free(entry->data);
+  free(entry);
+}
+
+long pc_age(pc_entry_t *entry) {
+  return entry->age + (time(NULL) - entry->stored);
+}
+
+/* Returns the entry for KEY, or NULL. Needs the lock. */
+static pc_entry_t *pc_find(proxy_cache_t *cache, const char *key,
+    unsigned int hash) {
+  pc_entry_t *entry;
+
+  for (entry = cache->buckets[hash % PC_NUM_BUCKETS]; entry != NULL;
+      entry = entry->bucket_next)
+    if (entry->hash == hash && strcmp(entry->key, key) == 0) break;
+  return entry;
+}
+
+static void pc_list_remove(pc_entry_t **head, pc_entry_t **tail,
+    pc_entry_t *entry) {
+  if (entry->prev) entry->prev->next = entry->next;
+  else *head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else *tail = entry->prev;
+}
+
+static void pc_list_push_front(pc_entry_t **head, pc_entry_t **tail,
+    pc_entry_t *entry) {
+  entry->prev = NULL;
+  entry->next = *head;
+  if (*head) (*head)->prev = entry;
+  else *tail = entry;
+  *head = entry;
+}
+
+static void pc_list_push_back(pc_entry_t **head, pc_entry_t **tail,
+    pc_entry_t *entry) {
+  entry->next = NULL;
+  entry->prev = *tail;
+  if (*tail) (*tail)->next = entry;
+  else *head = entry;
+  *tail = entry;
+}
+
+static void pc_link(proxy_cache_t *cache, pc_entry_t *entry) {
+  entry->bucket_next = cache->buckets[entry->hash % PC_NUM_BUCKETS];
+  cache->buckets[entry->hash % PC_NUM_BUCKETS] = entry;
+  if (entry->spilled) {
+    pc_list_push_back(&cache->spill_head, &cache->spill_tail, entry);
+  } else {
+    pc_list_push_front(&cache->lru_head, &cache->lru_tail, entry);
+    cache->used += entry->length;
+  }
+}
+
+/* Drops ENTRY from the cache. Needs the lock. */
+static void pc_unlink(proxy_cache_t *cache, pc_entry_t *entry) {
+  pc_entry_t **link;
+
+  for (link = &cache->buckets[entry->hash % PC_NUM_BUCKETS]; *link != entry;
+      link = &(*link)->bucket_next);
+  *link = entry->bucket_next;
+  if (entry->spilled) {
+    pc_list_remove(&cache->spill_head, &cache->spill_tail, entry);
+  } else {
+    pc_list_remove(&cache->lru_head, &cache->lru_tail, entry);
+    cache->used -= entry->length;
+  }
+  pc_release(entry);
+}
+
+/* Copies ENTRY, about to be evicted from memory, to the spill log, over
+ * the oldest spilled entries. Gives up if one of those is still being sent,
+ * as its bytes cannot be overwritten yet. Needs the lock. */
+static void pc_spill(proxy_cache_t *cache, pc_entry_t *entry) {
+  size_t offset = cache->spill_next;
+  pc_entry_t *oldest, *spilled;
+
+  if (entry->length > cache->spill_size) return;
+
+  /* Entries past the end of the log are the oldest: wrapping drops them. */
+  if (offset + entry->length > cache->spill_size) {
+    while ((oldest = cache->spill_head) != NULL &&
+        oldest->spill_offset >= offset) {
+      if (__atomic_load_n(&oldest->refcount, __ATOMIC_ACQUIRE) > 1) return;
+      pc_unlink(cache, oldest);
+    }
+    offset = 0;
+    cache->spill_next = 0;
+  }
+  while ((oldest = cache->spill_head) != NULL &&
+      oldest->spill_offset >= offset &&
+      oldest->spill_offset < offset + entry->length) {
+    if (__atomic_load_n(&oldest->refcount, __ATOMIC_ACQUIRE) > 1) return;
+    pc_unlink(cache, oldest);
+  }
+
+  spilled = malloc(sizeof(pc_entry_t));
+  if (spilled == NULL) return;
+  *spilled = *entry;
+  spilled->key = strdup(entry->key);
+  if (spilled->key == NULL) {
+    free(spilled);
+    return;
+  }
+  spilled->data = cache->spill + offset;
+  memcpy(spilled->data, entry->data, entry->length);
+  spilled->refcount = 1;
+  spilled->spilled = 1;
+  spilled->spill_offset = offset;
+  pc_link(cache, spilled);
+  cache->spill_next = offset + entry->length;
+  cache->spills++;
+}
+
+/* Evicts least recently used entries until the cache fits its budget,
+ * spilling those still fresh. Needs the lock. */
+static void pc_evict(proxy_cache_t *cache) {
+  time_t now = time(NULL);
+  pc_entry_t *entry;
+
+  while (cache->used > cache->budget && cache->lru_tail != NULL) {
+    entry = cache->lru_tail;
+    if (cache->spill != NULL && entry->expires > now)
+      pc_spill(cache, entry);
+    pc_unlink(cache, entry);
+  }
+}
+
+pc_entry_t *pc_lookup(proxy_cache_t *cache, const char *key,
+    pc_flight_t **flight_out) {
+  unsigned int hash = pc_hash(key);
+  pc_entry_t *entry;
+  pc_flight_t *flight;
+
+  *flight_out = NULL;
+  pthread_mutex_lock(&cache->lock);
+  entry = pc_find(cache, key, hash);
+  if (entry != NULL && entry->expires <= time(NULL)) {
+    pc_unlink(cache, entry);
+    entry = NULL;
+  }
+  if (entry != NULL) {
+    __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL);
+    if (!entry->spilled) {
+      pc_list_remove(&cache->lru_head, &cache->lru_tail, entry);
+      pc_list_push_front(&cache->lru_head, &cache->lru_tail, entry);
+    }
+    cache->hits++;
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+  }
+
+  for (flight = cache->flights; flight != NULL; flight = flight->next)
+    if (flight->hash == hash && strcmp(flight->key, key) == 0) break;
+  if (flight != NULL) {
+    flight->waiters++;
+    while (!flight->landed)
+      pthread_cond_wait(&cache->landed, &cache->lock);
+    entry = flight->entry;
+    if (entry != NULL) cache->coalesced++;
+    else cache->misses++;
+    if (--flight->waiters == 0) {
+      free(flight->key);
+      free(flight);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+  }
+
+  /* Without memory for a flight, the miss just is not coalesced. */
+  cache->misses++;
+  flight = calloc(1, sizeof(pc_flight_t));
+  if (flight != NULL && (flight->key = strdup(key)) != NULL) {
+    flight->hash = hash;
+    flight->next = cache->flights;
+    cache->flights = flight;
+    *flight_out = flight;
+  } else {
+    free(flight);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return NULL;
+}
+
+void pc_land(proxy_cache_t *cache, pc_flight_t *flight, pc_entry_t *entry) {
+  pc_flight_t **link;
+
+  pthread_mutex_lock(&cache->lock);
+  for (link = &cache->flights; *link != flight; link = &(*link)->next);
+  *link = flight->next;
+  if (entry != NULL)
+    __atomic_add_fetch(&entry->refcount, flight->waiters, __ATOMIC_ACQ_REL);
+  flight->entry = entry;
+  flight->landed = 1;
+  if (flight->waiters == 0) {
+    free(flight->key);
+    free(flight);
+  } else {
+    pthread_cond_broadcast(&cache->landed);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/* Drops Age lines from the head at the start of DATA, moving what follows
+ * down. Returns the number of bytes removed. */
+static size_t pc_strip_age(char *data, size_t length, size_t head_length) {
+  char *line = data, *end = data + head_length, *line_end;
+  size_t removed = 0, line_length;
+
+  while (line < end) {
+    line_end = memchr(line, '\n', end - line);
+    if (line_end == NULL) break;
+    line_length = line_end + 1 - line;
+    if (line_length > 4 && strncasecmp(line, "Age:", 4) == 0) {
+      memmove(line, line_end + 1, data + length - removed - (line_end + 1));
+      removed += line_length;
+      end -= line_length;
+    } else {
+      line = line_end + 1;
+    }
+  }
+  return removed;
+}
+
+pc_entry_t *pc_insert(proxy_cache_t *cache, const char *key, char *data,
+    size_t length, size_t head_length, long lifetime, long age) {
+  size_t removed = pc_strip_age(data, length, head_length);
+  pc_entry_t *entry, *old;
+
+  length -= removed;
+  head_length -= removed;
+  if (length > cache->max_entry || length > cache->budget ||
+      (entry = calloc(1, sizeof(pc_entry_t))) == NULL) {
+    free(data);
+    return NULL;
+  }
+  entry->key = strdup(key);
+  if (entry->key == NULL) {
+    free(data);
+    free(entry);
+    return NULL;
+  }
+  entry->hash = pc_hash(key);
+  entry->data = data;
+  entry->length = length;
+  entry->head_length = head_length;
+  entry->stored = time(NULL);
+  entry->expires = entry->stored + lifetime - age;
+  entry->age = age;
+  entry->refcount = 2;
+
+  pthread_mutex_lock(&cache->lock);
+  while ((old = pc_find(cache, key, entry->hash)) != NULL)
+    pc_unlink(cache, old);
+  pc_link(cache, entry);
+  cache->stored++;
+  pc_evict(cache);
+  pthread_mutex_unlock(&cache->lock);
+  return entry;
+}
+
+/* Whether the comma-separated directives in VALUE include NAME, and if so
+ * and NUMBER is not NULL, its argument (-1 if missing). */
+static int pc_directive(const char *value, size_t length, const char *name,
+    long *number) {
+  size_t name_length = strlen(name), i = 0, start;
+
+  while (i < length) {
+    while (i < length && (value[i] == ' ' || value[i] == '\t' || value[i] == ','))
+      i++;
+    start = i;
+    while (i < length && value[i] != ',' && value[i] != '=' && value[i] != ' ')
+      i++;
+    if (i - start == name_length &&
+        strncasecmp(value + start, name, name_length) == 0) {
+      if (number != NULL) {
+        *number = -1;
+        while (i < length && value[i] == ' ') i++;
+        if (i < length && value[i] == '=') {
+          i++;
+          if (i < length && value[i] == '"') i++;
+          if (i < length && value[i] >= '0' && value[i] <= '9')
+            *number = strtol(value + i, NULL, 10);
+        }
+      }
+      return 1;
+    }
+    /* Skip the argument, which may be a quoted string with commas in it. */
+    while (i < length && value[i] != ',') {
+      if (value[i++] != '"') continue;
+      while (i < length && value[i] != '"') i++;
+      i++;
+    }
+  }
+  return 0;
+}
+
+/* Parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), or returns -1. */
+static time_t pc_parse_date(const char *value, size_t length) {
+  char date[64];
+  struct tm tm;
+  char *end;
+
+  if (length >= sizeof(date)) return -1;
+  memcpy(date, value, length);
+  date[length] = '\0';
+  memset(&tm, 0, sizeof(tm));
+  end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') return -1;
+  return timegm(&tm);
+}
+
+static int pc_is(const char *name, size_t name_length, const char *header) {
+  return strlen(header) == name_length &&
+      strncasecmp(name, header, name_length) == 0;
+}
+
+long pc_lifetime(const char *head, size_t length, int status_code, long *age) {
+  const char *end = head + length, *line, *line_end, *colon;
+  const char *value, *value_end;
+  long max_age = -1, shared_max_age = -1, lifetime;
+  time_t date = -1, expires = -1;
+  int has_expires = 0;
+  size_t name_length;
+
+  *age = 0;
+  /* Responses cacheable by default (RFC 9110, section 15.1). */
+  switch (status_code) {
+    case 200: case 203: case 204: case 300: case 301: case 308: case 404:
+    case 405: case 410: case 414: case 501:
+      break;
+    default:
+      return -1;
+  }
+
+  line = memchr(head, '\n', length);
+  if (line == NULL) return -1;
+  for (line++; line < end; line = line_end + 1) {
+    line_end = memchr(line, '\n', end - line);
+    if (line_end == NULL) break;
+    colon = memchr(line, ':', line_end - line);
+    if (colon == NULL) continue;
+    name_length = colon - line;
+    value = colon + 1;
+    value_end = line_end;
+    while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+    while (value_end > value && (value_end[-1] == '\r' ||
+          value_end[-1] == ' ' || value_end[-1] == '\t'))
+      value_end--;
+
+    if (pc_is(line, name_length, "Cache-Control")) {
+      if (pc_directive(value, value_end - value, "no-store", NULL) ||
+          pc_directive(value, value_end - value, "private", NULL) ||
+          pc_directive(value, value_end - value, "no-cache", NULL))
+        return -1;
+      pc_directive(value, value_end - value, "max-age", &max_age);
+      pc_directive(value, value_end - value, "s-maxage", &shared_max_age);
+    } else if (pc_is(line, name_length, "Expires")) {
+      has_expires = 1;
+      expires = pc_parse_date(value, value_end - value);
+    } else if (pc_is(line, name_length, "Date")) {
+      date = pc_parse_date(value, value_end - value);
+    } else if (pc_is(line, name_length, "Age")) {
+      *age = strtol(value, NULL, 10);
+      if (*age < 0) *age = 0;
+    } else if (pc_is(line, name_length, "Vary") ||
+        pc_is(line, name_length, "Set-Cookie")) {
+      /* Variants are not told apart, and cookies are per client. */
+      return -1;
+    }
+  }
+
+  if (shared_max_age >= 0)
+    lifetime = shared_max_age;
+  else if (max_age >= 0)
+    lifetime = max_age;
+  else if (has_expires)
+    lifetime = expires < 0 ? 0 : expires - (date >= 0 ? date : time(NULL));
+  else
+    return -1;
+  return lifetime > *age ? lifetime : -1;
+}
+
+/* Reads the counters without the lock, as it may be called from a signal
+ * handler. */
+void pc_report(proxy_cache_t *cache, FILE *out) {
+  pthread_mutex_lock(&cache->lock);
+  fprintf(out, "# HELP httpserver_proxy_cache_lookups_total Proxied requests "
+      "looked up in the cache, by outcome.\n"
+      "# TYPE httpserver_proxy_cache_lookups_total counter\n"
+      "httpserver_proxy_cache_lookups_total{result=\"hit\"} %lu\n"
+      "httpserver_proxy_cache_lookups_total{result=\"coalesced\"} %lu\n"
+      "httpserver_proxy_cache_lookups_total{result=\"miss\"} %lu\n"
+      "# HELP httpserver_proxy_cache_stored_total Responses stored.\n"
+      "# TYPE httpserver_proxy_cache_stored_total counter\n"
+      "httpserver_proxy_cache_stored_total %lu\n"
+      "# HELP httpserver_proxy_cache_spilled_total Responses moved to the "
+      "spill file.\n"
+      "# TYPE httpserver_proxy_cache_spilled_total counter\n"
+      "httpserver_proxy_cache_spilled_total %lu\n"
+      "# HELP httpserver_proxy_cache_bytes Bytes of responses in memory.\n"
+      "# TYPE httpserver_proxy_cache_bytes gauge\n"
+      "httpserver_proxy_cache_bytes %zu\n"
+      "# HELP httpserver_proxy_cache_budget_bytes Most bytes kept in memory.\n"
+      "# TYPE httpserver_proxy_cache_budget_bytes gauge\n"
+      "httpserver_proxy_cache_budget_bytes %zu\n", cache->hits,
+      cache->coalesced, cache->misses, cache->stored, cache->spills,
+      cache->used, cache->budget);
+  pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,113 @@
+#ifndef __PROXY_CACHE__
+#define __PROXY_CACHE__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+/* PROXY_CACHE keeps upstream responses that their Cache-Control or Expires
+ * headers allow a shared cache to store, keyed by request method and path,
+ * until they go stale. Entries live in memory under a byte budget, least
+ * recently used first out; with a spill file, evicted entries move to a
+ * memory-mapped log on disk instead, where the oldest are overwritten.
+ * Concurrent misses for one key are coalesced: the first fetches from the
+ * upstream while the others wait for what it stores. */
+
+#define PC_NUM_BUCKETS 4096
+
+typedef struct pc_entry {
+  char *key;
+  unsigned int hash;
+  /* The response head, without Age, Connection or the blank line, followed
+   * by the body. */
+  char *data;
+  size_t length;
+  size_t head_length;
+  time_t stored;
+  time_t expires;
+  long age;                   /* Age of the response when it was stored. */
+  int refcount;               /* One for the cache, one per pc_lookup. */
+  int spilled;                /* DATA is in the spill file. */
+  size_t spill_offset;
+  struct pc_entry *bucket_next;
+  /* In memory: the LRU list, most recent first. Spilled: the spill log,
+   * oldest first. */
+  struct pc_entry *prev;
+  struct pc_entry *next;
+} pc_entry_t;
+
+/* A fetch other requests for KEY are waiting on. */
+typedef struct pc_flight {
+  char *key;
+  unsigned int hash;
+  int landed;
+  int waiters;
+  pc_entry_t *entry;          /* What the fetch stored, if anything. */
+  struct pc_flight *next;
+} pc_flight_t;
+
+typedef struct proxy_cache {
+  size_t budget;              /* Bytes of entries kept in memory. */
+  size_t max_entry;           /* Larger responses are never stored. */
+  size_t used;
+  pc_entry_t *buckets[PC_NUM_BUCKETS];
+  pc_entry_t *lru_head;
+  pc_entry_t *lru_tail;
+
+  char *spill;                /* Mapped spill file, or NULL. */
+  size_t spill_size;
+  size_t spill_next;          /* Where the next spilled entry goes. */
+  pc_entry_t *spill_head;
+  pc_entry_t *spill_tail;
+
+  pc_flight_t *flights;
+  pthread_mutex_t lock;
+  pthread_cond_t landed;      /* Broadcast whenever a flight lands. */
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long coalesced;    /* Misses answered by another's fetch. */
+  unsigned long stored;
+  unsigned long spills;
+} proxy_cache_t;
+
+void pc_init(proxy_cache_t *cache, size_t budget, size_t max_entry);
+
+/* Maps SIZE bytes of the file at PATH (created or truncated) to spill
+ * entries evicted from memory into. Returns -1 if it cannot. */
+int pc_spill_to(proxy_cache_t *cache, const char *path, size_t size);
+
+/* Returns a fresh entry for KEY with a reference the caller must
+ * pc_release, waiting first if another request is fetching it. On a miss,
+ * returns NULL, and sets *FLIGHT if the caller is now the one fetching:
+ * it must then pc_land the flight, whatever the fetch turns out to be. */
+pc_entry_t *pc_lookup(proxy_cache_t *cache, const char *key,
+    pc_flight_t **flight);
+void pc_release(pc_entry_t *entry);
+
+/* How many seconds a response with status STATUS_CODE and the headers in
+ * HEAD (LENGTH bytes, one "Name: value\r\n" line each after the status
+ * line) stays fresh, with the Age it arrived with in *AGE. Returns -1 if a
+ * shared cache must not store it, or has no freshness lifetime for it. */
+long pc_lifetime(const char *head, size_t length, int status_code, long *age);
+
+/* Takes ownership of DATA (the head, as for pc_lifetime, then the body)
+ * and stores it under KEY for LIFETIME seconds, less AGE. Any Age header is
+ * dropped from the head, as pc_age replaces it. Returns the entry with a
+ * reference for the caller, or NULL (and frees DATA) if it does not fit. */
+pc_entry_t *pc_insert(proxy_cache_t *cache, const char *key, char *data,
+    size_t length, size_t head_length, long lifetime, long age);
+
+/* Ends FLIGHT, handing ENTRY (or NULL if nothing was stored) to the
+ * requests waiting on it. */
+void pc_land(proxy_cache_t *cache, pc_flight_t *flight, pc_entry_t *entry);
+
+/* Seconds since ENTRY's response was generated, for its Age header. */
+long pc_age(pc_entry_t *entry);
+
+/* Prints the lookups by outcome, the responses stored and spilled, and the
+ * bytes in memory, in the Prometheus text format. */
+void pc_report(proxy_cache_t *cache, FILE *out);
+
+#endif
@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "relay.h"
+#include "timer_wheel.h"
+
+#define RL_MAX_EVENTS 256
+#define RL_PIPE_SIZE 65536
+#define RL_SAMPLE_INTERVAL_MS 1000
+#define RL_TICK_MS 100
+
+/* Shared by every relay, so the report covers the event loop's too. */
+static unsigned long long rl_bytes_moved;
+static long rl_open_directions;
+static unsigned long long rl_bytes_per_second;  /* Over the last sample. */
+
+/* One socket of a relayed pair. */
+typedef struct rl_end {
+  int fd;
+  uint32_t events;            /* Events registered with epoll, 0 if none. */
+  rl_direction_t *reading;    /* Bytes read from this socket. */
+  rl_direction_t *writing;    /* Bytes written to this socket. */
+  struct rl_pair *pair;
+} rl_end_t;
+
+typedef struct rl_pair {
+  rl_end_t client;
+  rl_end_t upstream;
+  rl_direction_t to_upstream;
+  rl_direction_t to_client;
+  int closed;
+  tw_timer_t idle;            /* Closes the pair once nothing moves. */
+  struct rl_pair *next;       /* In the incoming or the closed list. */
+} rl_pair_t;
+
+static int rl_epoll_fd = -1;
+
+/* Owned by the relay thread, like the pairs. */
+static tw_wheel_t rl_wheel;
+static int rl_idle_timeout_ms;
+static unsigned long rl_timed_out_pairs;
+
+/* Pairs handed over by rl_add, registered by the relay thread once
+ * RL_WAKEUP_FD fires, so that only the relay thread ever touches a pair. */
+static int rl_wakeup_fd = -1;
+static rl_pair_t *rl_incoming;
+static pthread_mutex_t rl_incoming_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void rl_set_nonblocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+int rl_direction_init(rl_direction_t *direction, int from, int to) {
+  direction->from = from;
+  direction->to = to;
+  direction->pending = 0;
+  direction->read_closed = 0;
+  direction->write_closed = 0;
+  if (pipe2(direction->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+    direction->pipe[0] = direction->pipe[1] = -1;
+    return -1;
+  }
+  /* The default already; this only makes the capacity rl_wants_read
+   * assumes explicit. */
+  fcntl(direction->pipe[1], F_SETPIPE_SZ, RL_PIPE_SIZE);
+  rl_set_nonblocking(from);
+  rl_set_nonblocking(to);
+  __atomic_add_fetch(&rl_open_directions, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void rl_direction_free(rl_direction_t *direction) {
+  if (direction->pipe[0] < 0) return;
+  close(direction->pipe[0]);
+  close(direction->pipe[1]);
+  direction->pipe[0] = direction->pipe[1] = -1;
+  __atomic_sub_fetch(&rl_open_directions, 1, __ATOMIC_RELAXED);
+}
+
+int rl_pump(rl_direction_t *direction) {
+  ssize_t bytes;
+
+  while (1) {
+    if (direction->pending > 0) {
+      bytes = splice(direction->pipe[0], NULL, direction->to, NULL,
+          direction->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (bytes < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+      direction->pending -= bytes;
+      __atomic_add_fetch(&rl_bytes_moved, bytes, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    /* Everything FROM sent has been delivered: pass its EOF on. */
+    if (direction->read_closed) {
+      if (!direction->write_closed) {
+        shutdown(direction->to, SHUT_WR);
+        direction->write_closed = 1;
+      }
+      return 0;
+    }
+
+    bytes = splice(direction->from, NULL, direction->pipe[1], NULL,
+        RL_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    if (bytes == 0)
+      direction->read_closed = 1;
+    direction->pending += bytes;
+  }
+}
+
+void rl_account(size_t bytes) {
+  __atomic_add_fetch(&rl_bytes_moved, bytes, __ATOMIC_RELAXED);
+}
+
+int rl_wants_read(rl_direction_t *direction) {
+  return !direction->read_closed && direction->pending < RL_PIPE_SIZE;
+}
+
+int rl_wants_write(rl_direction_t *direction) {
+  return direction->pending > 0;
+}
+
+int rl_done(rl_direction_t *direction) {
+  return direction->write_closed;
+}
+
+/* Registers END for the events its directions are waiting on. A socket
+ * with nothing to wait for is taken out of epoll altogether, since a hung
+ * up socket would otherwise keep reporting EPOLLHUP. */
+static void rl_watch(rl_end_t *end) {
+  struct epoll_event event;
+  uint32_t events = 0;
+
+  if (rl_wants_read(end->reading)) events |= EPOLLIN;
+  if (rl_wants_write(end->writing)) events |= EPOLLOUT;
+  if (events == end->events) return;
+
+  event.events = events;
+  event.data.ptr = end;
+  if (events == 0)
+    epoll_ctl(rl_epoll_fd, EPOLL_CTL_DEL, end->fd, &event);
+  else
+    epoll_ctl(rl_epoll_fd, end->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+        end->fd, &event);
+  end->events = events;
+}
+
+static void rl_close(rl_pair_t *pair, rl_pair_t **closed) {
+  if (pair->closed) return;
+  pair->closed = 1;
+  tw_cancel(&rl_wheel, &pair->idle);
+  close(pair->client.fd);
+  close(pair->upstream.fd);
+  rl_direction_free(&pair->to_upstream);
+  rl_direction_free(&pair->to_client);
+  pair->next = *closed;
+  *closed = pair;
+}
+
+/* Gives PAIR another idle timeout from NOW. */
+static void rl_touch(rl_pair_t *pair, long long now) {
+  if (rl_idle_timeout_ms > 0)
+    tw_schedule(&rl_wheel, &pair->idle, now + rl_idle_timeout_ms);
+}
+
+static void rl_expire(tw_timer_t *timer, void *arg) {
+  rl_close(timer->data, arg);
+  __atomic_fetch_add(&rl_timed_out_pairs, 1, __ATOMIC_RELAXED);
+}
+
+static void rl_handle(rl_end_t *end, uint32_t events, rl_pair_t **closed,
+    long long now) {
+  rl_pair_t *pair = end->pair;
+
+  if (events & EPOLLERR) {
+    rl_close(pair, closed);
+    return;
+  }
+  if ((events & (EPOLLIN | EPOLLHUP)) && rl_pump(end->reading) < 0) {
+    rl_close(pair, closed);
+    return;
+  }
+  if ((events & (EPOLLOUT | EPOLLHUP)) && rl_pump(end->writing) < 0) {
+    rl_close(pair, closed);
+    return;
+  }
+
+  if (rl_done(&pair->to_upstream) && rl_done(&pair->to_client)) {
+    rl_close(pair, closed);
+    return;
+  }
+  rl_watch(&pair->client);
+  rl_watch(&pair->upstream);
+  rl_touch(pair, now);
+}
+
+static void rl_register_incoming(long long now) {
+  rl_pair_t *incoming, *pair;
+  uint64_t count;
+
+  if (read(rl_wakeup_fd, &count, sizeof(count)) < 0) return;
+  pthread_mutex_lock(&rl_incoming_lock);
+  incoming = rl_incoming;
+  rl_incoming = NULL;
+  pthread_mutex_unlock(&rl_incoming_lock);
+
+  while (incoming != NULL) {
+    pair = incoming;
+    incoming = pair->next;
+    rl_watch(&pair->client);
+    rl_watch(&pair->upstream);
+    tw_timer_init(&pair->idle, pair);
+    rl_touch(pair, now);
+  }
+}
+
+static long long rl_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/* Samples the throughput since the last sample, for the report. */
+static void rl_sample(long long elapsed_ms) {
+  static unsigned long long sampled;
+  unsigned long long moved = __atomic_load_n(&rl_bytes_moved, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&rl_bytes_per_second, (moved - sampled) * 1000 / elapsed_ms,
+      __ATOMIC_RELAXED);
+  sampled = moved;
+}
+
+static void *rl_routine(void *aux) {
+  struct epoll_event events[RL_MAX_EVENTS];
+  rl_pair_t *closed = NULL, *pair;
+  long long now, last_sample = rl_now_ms();
+  int num_events, timeout, idle_timeout;
+
+  tw_init(&rl_wheel, RL_TICK_MS, last_sample);
+  while (1) {
+    now = rl_now_ms();
+    if (now - last_sample >= RL_SAMPLE_INTERVAL_MS) {
+      rl_sample(now - last_sample);
+      last_sample = now;
+    }
+    timeout = (int) (last_sample + RL_SAMPLE_INTERVAL_MS - now);
+    idle_timeout = tw_timeout_ms(&rl_wheel, now);
+    if (idle_timeout >= 0 && idle_timeout < timeout) timeout = idle_timeout;
+
+    num_events = epoll_wait(rl_epoll_fd, events, RL_MAX_EVENTS, timeout);
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to wait for relay events");
+      exit(errno);
+    }
+
+    now = rl_now_ms();
+    for (int i = 0; i < num_events; i++) {
+      rl_end_t *end = events[i].data.ptr;
+      if (end == NULL)
+        rl_register_incoming(now);
+      else if (!end->pair->closed)
+        rl_handle(end, events[i].events, &closed, now);
+    }
+    tw_advance(&rl_wheel, now, rl_expire, &closed);
+
+    /* Later events in the batch may point at a pair closed earlier in it. */
+    while (closed != NULL) {
+      pair = closed;
+      closed = pair->next;
+      free(pair);
+    }
+  }
+
+  return NULL;
+}
+
+void rl_init(void) {
+  struct epoll_event event;
+  pthread_t thread;
+
+  rl_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  rl_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (rl_epoll_fd == -1 || rl_wakeup_fd == -1) {
+    perror("Failed to create relay epoll instance");
+    exit(errno);
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  epoll_ctl(rl_epoll_fd, EPOLL_CTL_ADD, rl_wakeup_fd, &event);
+  if (pthread_create(&thread, NULL, rl_routine, NULL) != 0) {
+    perror("Failed to start relay thread");
+    exit(errno);
+  }
+  pthread_detach(thread);
+}
+
+void rl_set_idle_timeout(int timeout_ms) {
+  rl_idle_timeout_ms = timeout_ms;
+}
+
+void rl_report(FILE *out) {
+  fprintf(out, "# HELP httpserver_relay_bytes_total Bytes moved between proxied "
+      "clients and their upstreams.\n"
+      "# TYPE httpserver_relay_bytes_total counter\n"
+      "httpserver_relay_bytes_total %llu\n"
+      "# HELP httpserver_relay_bytes_per_second Bytes moved over the last second.\n"
+      "# TYPE httpserver_relay_bytes_per_second gauge\n"
+      "httpserver_relay_bytes_per_second %llu\n"
+      "# HELP httpserver_relay_connections Pairs being relayed.\n"
+      "# TYPE httpserver_relay_connections gauge\n"
+      "httpserver_relay_connections %ld\n"
+      "# HELP httpserver_relay_timed_out_total Upgraded connections closed for "
+      "moving nothing.\n"
+      "# TYPE httpserver_relay_timed_out_total counter\n"
+      "httpserver_relay_timed_out_total %lu\n",
+      __atomic_load_n(&rl_bytes_moved, __ATOMIC_RELAXED),
+      __atomic_load_n(&rl_bytes_per_second, __ATOMIC_RELAXED),
+      __atomic_load_n(&rl_open_directions, __ATOMIC_RELAXED) / 2,
+      __atomic_load_n(&rl_timed_out_pairs, __ATOMIC_RELAXED));
+}
+
+void rl_add(int client_fd, int upstream_fd) {
+  rl_pair_t *pair = calloc(1, sizeof(rl_pair_t));
+  uint64_t one = 1;
+
+  if (pair == NULL) {
+    close(client_fd);
+    close(upstream_fd);
+    return;
+  }
+  pair->to_client.pipe[0] = -1;
+  if (rl_direction_init(&pair->to_upstream, client_fd, upstream_fd) == -1 ||
+      rl_direction_init(&pair->to_client, upstream_fd, client_fd) == -1) {
+    perror("Failed to create relay pipe");
+    rl_direction_free(&pair->to_upstream);
+    rl_direction_free(&pair->to_client);
+    close(client_fd);
+    close(upstream_fd);
+    free(pair);
+    return;
+  }
+
+  pair->client.fd = client_fd;
+  pair->client.reading = &pair->to_upstream;
+  pair->client.writing = &pair->to_client;
+  pair->client.pair = pair;
+  pair->upstream.fd = upstream_fd;
+  pair->upstream.reading = &pair->to_client;
+  pair->upstream.writing = &pair->to_upstream;
+  pair->upstream.pair = pair;
+
+  pthread_mutex_lock(&rl_incoming_lock);
+  pair->next = rl_incoming;
+  rl_incoming = pair;
+  pthread_mutex_unlock(&rl_incoming_lock);
+  if (write(rl_wakeup_fd, &one, sizeof(one)) < 0)
+    perror("Failed to wake the relay thread");
+}
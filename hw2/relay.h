@@ -0,0 +1,67 @@
+#ifndef __RELAY__
+#define __RELAY__
+
+/* RELAY moves bytes between proxied clients and their upstreams with
+ * splice(2): each direction gets a pipe, and data goes socket -> pipe ->
+ * socket without ever being copied into user space. One epoll thread drives
+ * every pair handed over by the thread pool, so a proxied connection costs
+ * two pipes instead of two threads. The event loop drives its own pairs with
+ * the same rl_pump.
+ *
+ * Directions close independently: once one end sends EOF and everything it
+ * sent has been delivered, the other end's write side is shut down, and the
+ * pair is only closed when both directions are done. */
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/* Bytes flowing from one socket to another through a pipe. */
+typedef struct rl_direction {
+  int from;
+  int to;
+  int pipe[2];
+  size_t pending;       /* Bytes in the pipe not yet spliced to TO. */
+  int read_closed;      /* FROM has sent EOF. */
+  int write_closed;     /* TO has been shut down for writing. */
+} rl_direction_t;
+
+/* Sets up DIRECTION from FROM to TO, both non-blocking. Returns -1 if no
+ * pipe could be created. */
+int rl_direction_init(rl_direction_t *direction, int from, int to);
+
+/* Moves as many bytes as both sockets allow. Returns -1 on a socket error,
+ * after which the pair should be closed. */
+int rl_pump(rl_direction_t *direction);
+
+/* Whether DIRECTION wants to read from FROM, or to write to TO. */
+int rl_wants_read(rl_direction_t *direction);
+int rl_wants_write(rl_direction_t *direction);
+
+/* Whether FROM has closed and everything it sent has been delivered. */
+int rl_done(rl_direction_t *direction);
+
+/* Closes DIRECTION's pipe (but not its sockets). */
+void rl_direction_free(rl_direction_t *direction);
+
+/* Starts the relay thread, which also samples the bytes moved per second
+ * by every relay (including the event loop's). */
+void rl_init(void);
+
+/* Counts BYTES moved between a client and an upstream outside rl_pump, so
+ * the report covers them too. */
+void rl_account(size_t bytes);
+
+/* Relays between CLIENT_FD and the connected UPSTREAM_FD until both
+ * directions are done, then closes both. Closes them at once on failure. */
+void rl_add(int client_fd, int upstream_fd);
+
+/* Has the relay thread close pairs that move nothing for TIMEOUT_MS (0, the
+ * default, keeps them open). Call before rl_init. */
+void rl_set_idle_timeout(int timeout_ms);
+
+/* Prints the bytes moved by every relay, in all and over the last second,
+ * the pairs being relayed and those closed for being idle, in the
+ * Prometheus text format. */
+void rl_report(FILE *out);
+
+#endif
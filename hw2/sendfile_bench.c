@@ -0,0 +1,169 @@
+/*
+ * Compares the throughput of the original send_file body loop (read into a
+ * 4 KB buffer, then http_send_data) against http_send_file (sendfile), by
+ * sending files of 1 KB up to 1 GB over a loopback TCP connection.
+ *
+ * Usage: ./sendfile_bench [max_file_size_bytes] [scratch_directory]
+ */
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libhttp.h"
+
+#define BENCH_BYTES_PER_SIZE (256L << 20)
+#define BENCH_MAX_REPS 2000
+
+pthread_mutex_t received_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t received_changed = PTHREAD_COND_INITIALIZER;
+long long received;
+
+void* drain_routine(void* aux) {
+  int fd = *(int*)aux;
+  static char buffer[1 << 16];
+  ssize_t bytes_read;
+
+  while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
+    pthread_mutex_lock(&received_lock);
+    received += bytes_read;
+    pthread_cond_signal(&received_changed);
+    pthread_mutex_unlock(&received_lock);
+  }
+  return NULL;
+}
+
+void wait_for_received(long long target) {
+  pthread_mutex_lock(&received_lock);
+  while (received < target)
+    pthread_cond_wait(&received_changed, &received_lock);
+  pthread_mutex_unlock(&received_lock);
+}
+
+/* The body loop send_file used before http_send_file. */
+void send_file_copy(int fd, int file_fd) {
+  char buffer[4096];
+  ssize_t bytes_read;
+
+  lseek(file_fd, 0, SEEK_SET);
+  bytes_read = read(file_fd, buffer, 4096);
+  while (bytes_read > 0) {
+    http_send_data(fd, buffer, bytes_read);
+    bytes_read = read(file_fd, buffer, 4096);
+  }
+}
+
+void send_file_zero_copy(int fd, int file_fd, size_t size) {
+  off_t offset = 0;
+  http_send_file(fd, file_fd, &offset, size);
+}
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int make_file(const char *directory, size_t size) {
+  char path[4096];
+  char chunk[1 << 16];
+  size_t written = 0;
+
+  snprintf(path, sizeof(path), "%s/sendfile_bench.XXXXXX", directory);
+  int file_fd = mkstemp(path);
+  if (file_fd == -1) {
+    perror("Failed to create scratch file");
+    exit(errno);
+  }
+  unlink(path);
+
+  for (size_t i = 0; i < sizeof(chunk); i++) chunk[i] = 'a' + i % 26;
+  while (written < size) {
+    size_t length = size - written < sizeof(chunk) ? size - written : sizeof(chunk);
+    if (write(file_fd, chunk, length) != (ssize_t) length) {
+      perror("Failed to fill scratch file");
+      exit(errno);
+    }
+    written += length;
+  }
+  return file_fd;
+}
+
+/* Returns MB/s over REPS sends, after one untimed send to warm the cache. */
+double measure(int zero_copy, int fd, int file_fd, size_t size, int reps) {
+  long long target = received;
+  double start = 0;
+
+  for (int i = 0; i <= reps; i++) {
+    if (i == 1) start = now_seconds();
+    if (zero_copy)
+      send_file_zero_copy(fd, file_fd, size);
+    else
+      send_file_copy(fd, file_fd);
+    target += size;
+    wait_for_received(target);
+  }
+  return (double) size * reps / (now_seconds() - start) / (1 << 20);
+}
+
+void connect_loopback(int *sender, int *receiver) {
+  struct sockaddr_in address;
+  socklen_t address_length = sizeof(address);
+  int server = socket(PF_INET, SOCK_STREAM, 0);
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (server == -1 || bind(server, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+      listen(server, 1) == -1 ||
+      getsockname(server, (struct sockaddr *) &address, &address_length) == -1) {
+    perror("Failed to open loopback listener");
+    exit(errno);
+  }
+
+  /* Each rep waits for the previous one to drain, so keep Nagle from
+   * holding back the final partial segment of every file. */
+  int no_delay = 1;
+  *sender = socket(PF_INET, SOCK_STREAM, 0);
+  setsockopt(*sender, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+  if (connect(*sender, (struct sockaddr *) &address, sizeof(address)) == -1) {
+    perror("Failed to connect over loopback");
+    exit(errno);
+  }
+  *receiver = accept(server, NULL, NULL);
+  close(server);
+}
+
+int main(int argc, char **argv) {
+  size_t max_size = argc > 1 ? strtoull(argv[1], NULL, 10) : (1UL << 30);
+  const char *directory = argc > 2 ? argv[2] : "/tmp";
+  int sender, receiver;
+  pthread_t drain_thread;
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  connect_loopback(&sender, &receiver);
+  pthread_create(&drain_thread, NULL, drain_routine, &receiver);
+
+  printf("%12s %6s %14s %14s %8s\n", "size", "reps", "read+write MB/s",
+      "sendfile MB/s", "speedup");
+  for (size_t size = 1 << 10; size <= max_size; size <<= 4) {
+    int file_fd = make_file(directory, size);
+    long reps = BENCH_BYTES_PER_SIZE / size;
+    if (reps < 3) reps = 3;
+    if (reps > BENCH_MAX_REPS) reps = BENCH_MAX_REPS;
+
+    double copy_rate = measure(0, sender, file_fd, size, reps);
+    double zero_copy_rate = measure(1, sender, file_fd, size, reps);
+    printf("%12zu %6ld %14.1f %14.1f %7.2fx\n", size, reps, copy_rate,
+        zero_copy_rate, zero_copy_rate / copy_rate);
+    close(file_fd);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,259 @@
+#!/bin/bash
+#
+# Runs httpserver through cases that once broke it, in each of its modes,
+# and fails on the first one that does. Arguments are passed on to
+# httpserver. Memory errors only show up for sure in a server built with
+# AddressSanitizer, which aborts on the first one:
+#
+#   ./test.sh
+#   make clean && make CFLAGS='-ggdb3 -c -Wall -std=gnu99 -fsanitize=address' \
+#       LDFLAGS='-pthread -fsanitize=address' && ./test.sh
+#
+# Proxy cases need python3, for an upstream that answers with the length
+# and MD5 of each request body it gets. PORT can be set in the environment.
+
+set -e
+cd "$(dirname "$0")"
+make -s all
+
+PORT=${PORT:-8092}
+UPSTREAM_PORT=$((PORT + 1))
+MODES=("" --event-loop --io-uring)
+
+root=$(mktemp -d)
+server=
+upstream=
+cleanup() {
+  [ -n "$server" ] && kill "$server" 2>/dev/null
+  [ -n "$upstream" ] && kill "$upstream" 2>/dev/null
+  rm -rf "$root"
+}
+trap cleanup EXIT INT TERM
+
+echo "<h1>hello</h1>" > "$root/index.html"
+head -c 300000 /dev/urandom > "$root/upload.bin"
+upload="$(wc -c < "$root/upload.bin") $(md5sum < "$root/upload.bin" | cut -d' ' -f1)"
+
+cat > "$root/upstream.py" <<'EOF'
+import hashlib, socketserver, sys
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        while True:
+            head = {}
+            if not self.rfile.readline():
+                return
+            while True:
+                line = self.rfile.readline().strip()
+                if not line:
+                    break
+                name, value = line.split(b":", 1)
+                head[name.strip().lower()] = value.strip()
+            if head.get(b"transfer-encoding") == b"chunked":
+                body = b""
+                while True:
+                    size = int(self.rfile.readline().split(b";")[0], 16)
+                    if size == 0:
+                        while self.rfile.readline().strip():
+                            pass
+                        break
+                    body += self.rfile.read(size)
+                    self.rfile.readline()
+            else:
+                body = self.rfile.read(int(head.get(b"content-length", 0)))
+            answer = b"%d %s" % (len(body), hashlib.md5(body).hexdigest().encode())
+            self.wfile.write(b"HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s"
+                % (len(answer), answer))
+
+socketserver.ThreadingTCPServer.allow_reuse_address = True
+socketserver.ThreadingTCPServer(("127.0.0.1", int(sys.argv[1])), Handler).serve_forever()
+EOF
+
+# Waits until something accepts connections on port $1.
+wait_for() {
+  for i in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/"$1") 2>/dev/null && return 0
+    sleep 0.1
+  done
+  echo "Nothing listening on port $1" >&2
+  exit 1
+}
+
+# Waits until nothing accepts connections on port $1.
+wait_closed() {
+  for i in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/"$1") 2>/dev/null || return 0
+    sleep 0.1
+  done
+}
+
+# Starts httpserver with arguments $@ on $PORT, its output in $root/log.
+start() {
+  ./httpserver --port "$PORT" "$@" > "$root/log" 2>&1 &
+  server=$!
+  wait_for "$PORT"
+}
+
+stop() {
+  kill "$server"
+  wait "$server" 2>/dev/null || true
+  server=
+  wait_closed "$PORT"
+}
+
+# Fails test $1 unless the server is still running.
+check_alive() {
+  sleep 0.2
+  kill -0 "$server" 2>/dev/null && return 0
+  echo "FAIL $1: the server died" >&2
+  cat "$root/log" >&2
+  server=
+  exit 1
+}
+
+# Fails test $1 unless $2 and $3 are equal.
+check_equal() {
+  [ "$2" = "$3" ] && return 0
+  echo "FAIL $1: expected '$3', got '$2'" >&2
+  exit 1
+}
+
+# A connection closing without a request, after one that made a response,
+# frees only its own response.
+test_empty_after_request() {
+  local name="empty connection after a request ${1:-(pool)}"
+
+  start --files "$root" $1
+  check_equal "$name" "$(curl -s "localhost:$PORT/")" "<h1>hello</h1>"
+  (exec 3<>/dev/tcp/127.0.0.1/"$PORT")
+  check_alive "$name"
+  check_equal "$name" "$(curl -s "localhost:$PORT/")" "<h1>hello</h1>"
+  check_alive "$name"
+  stop
+  echo "ok   $name"
+}
+
+# Paths that lead nowhere are not given routes on the stats, and paths
+# that lead to the same place share one.
+test_stats_routes() {
+  local name="routes on the stats ${1:-(pool)}" path routes
+
+  mkdir -p "$root/docs"
+  echo "<h1>docs</h1>" > "$root/docs/index.html"
+  start --files "$root" $1
+  for path in /docs/ /%64ocs/ /x/../docs/ /.. /%2e%2e /nope/ /scan/a; do
+    curl -s -o /dev/null --path-as-is "localhost:$PORT$path"
+  done
+  routes=$(curl -s "localhost:$PORT/__stats" |
+    sed -n 's/^httpserver_requests_total{route="\(.*\)"} \(.*\)/\1 \2/p' | sort | tr '\n' ,)
+  check_equal "$name" "$routes" "/docs 3,other 4,"
+  stop
+  echo "ok   $name"
+}
+
+# A request body that looks like a request is skipped, not answered.
+test_body_not_request() {
+  local name="request-shaped body ${1:-(pool)}" inner answers
+
+  echo secret > "$root/secret.txt"
+  start --files "$root" $1
+  inner=$'GET /secret.txt HTTP/1.1\r\nHost: x\r\n\r\n'
+  answers=$(exec 3<>/dev/tcp/127.0.0.1/"$PORT"
+    printf 'POST / HTTP/1.1\r\nHost: x\r\nContent-Length: %d\r\n\r\n%s' \
+        "${#inner}" "$inner" >&3
+    timeout 1 cat <&3 | grep -o 'HTTP/1\.1 [0-9]' | wc -l)
+  check_equal "$name" "$answers" 1
+  check_alive "$name"
+  stop
+  echo "ok   $name"
+}
+
+# A directory whose redirect would not fit in the headers is answered 414,
+# not 301 without a Location.
+test_long_redirect() {
+  local name="redirect too long ${1:-(pool)}" dir=$(printf 'd%.0s' $(seq 200))
+
+  mkdir -p "$root/$dir/$dir/$dir"
+  start --files "$root" $1
+  check_equal "$name" "$(curl -s -o /dev/null -w '%{http_code}' \
+      "localhost:$PORT/$dir/$dir")" 301
+  check_equal "$name" "$(curl -s -o /dev/null -w '%{http_code}' \
+      "localhost:$PORT/$dir/$dir/$dir")" 414
+  check_alive "$name"
+  stop
+  echo "ok   $name"
+}
+
+# A client that never finishes its head is cut off at the header timeout.
+test_header_timeout() {
+  local name="header timeout" started elapsed
+
+  start --files "$root" --header-timeout 1
+  started=$(date +%s%N)
+  (exec 3<>/dev/tcp/127.0.0.1/"$PORT"; printf 'GET / HTTP/1.1\r\n' >&3
+    timeout 5 cat <&3 > /dev/null) || true
+  elapsed=$((($(date +%s%N) - started) / 1000000))
+  [ "$elapsed" -ge 900 ] && [ "$elapsed" -lt 2500 ] ||
+    check_equal "$name" "cut off after ${elapsed} ms" "cut off after about 1000 ms"
+  check_alive "$name"
+  stop
+  echo "ok   $name"
+}
+
+# Request bodies of any length, chunked or not, reach the upstream whole,
+# and the connection goes on to the next request.
+test_proxy_bodies() {
+  local name="proxied request bodies ${1:-(pool)}" url="localhost:$PORT/echo"
+
+  start --proxy "localhost:$UPSTREAM_PORT" $1
+  check_equal "$name, small" "$(curl -s --data-binary hello "$url")" \
+      "5 $(printf hello | md5sum | cut -d' ' -f1)"
+  check_equal "$name, large" \
+      "$(curl -s --data-binary @"$root/upload.bin" "$url")" "$upload"
+  check_equal "$name, chunked" "$(curl -s -H 'Transfer-Encoding: chunked' \
+      --data-binary @"$root/upload.bin" "$url")" "$upload"
+  check_equal "$name, then another" "$(curl -s -H 'Transfer-Encoding: chunked' \
+      --data-binary @"$root/upload.bin" "$url" --next --data-binary hi "$url")" \
+      "${upload}2 $(printf hi | md5sum | cut -d' ' -f1)"
+  check_alive "$name"
+  stop
+  echo "ok   $name"
+}
+
+# Each proxy target's requests and latencies, and the relay's throughput,
+# show on the stats, also while its address is looked up again after every
+# use.
+test_upstream_stats() {
+  local name="proxy targets on the stats" target="localhost:$UPSTREAM_PORT" stats
+
+  start --proxy "$target" --dns-ttl 0
+  curl -s -o /dev/null "localhost:$PORT/a" --next -o /dev/null "localhost:$PORT/b"
+  stats=$(curl -s "localhost:$PORT/__stats")
+  check_equal "$name" "$(grep -Fx -e "httpserver_upstream_requests_total{upstream=\"$target\"} 2" \
+      -e "httpserver_upstream_response_head_seconds_count{upstream=\"$target\"} 2" \
+      <<< "$stats" | wc -l)" 2
+  check_equal "$name" "$(grep -c '^httpserver_relay_bytes_per_second ' <<< "$stats")" 1
+  check_alive "$name"
+  stop
+  echo "ok   $name"
+}
+
+for mode in "${MODES[@]}"; do
+  test_empty_after_request "$mode"
+  test_stats_routes "$mode"
+  test_body_not_request "$mode"
+  test_long_redirect "$mode"
+done
+test_header_timeout
+
+if command -v python3 > /dev/null; then
+  python3 "$root/upstream.py" "$UPSTREAM_PORT" &
+  upstream=$!
+  wait_for "$UPSTREAM_PORT"
+  for mode in "" --event-loop; do
+    test_proxy_bodies "$mode"
+  done
+  test_upstream_stats
+else
+  echo "skip proxied request bodies: install python3 to run them"
+fi
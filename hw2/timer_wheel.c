@@ -0,0 +1,122 @@
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_SPAN (1ULL << (TW_LEVELS * TW_BITS))  /* Ticks the levels reach. */
+
+static void tw_unlink(tw_timer_t *timer) {
+  if (timer->next != NULL) timer->next->pprev = timer->pprev;
+  *timer->pprev = timer->next;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+/* Puts TIMER in the slot for its expiry, as seen from the wheel's tick. */
+static void tw_link(tw_wheel_t *wheel, tw_timer_t *timer) {
+  unsigned long long expires = timer->expires, delta;
+  tw_timer_t **slot;
+  int level = 0;
+
+  if (expires < wheel->now) expires = wheel->now;
+  delta = expires - wheel->now;
+  if (delta >= TW_SPAN) {
+    expires = wheel->now + TW_SPAN - 1;
+    delta = TW_SPAN - 1;
+  }
+  while (delta >= 1ULL << ((level + 1) * TW_BITS))
+    level++;
+  slot = &wheel->slots[level][(expires >> (level * TW_BITS)) & TW_MASK];
+
+  timer->next = *slot;
+  if (timer->next != NULL) timer->next->pprev = &timer->next;
+  *slot = timer;
+  timer->pprev = slot;
+}
+
+/* Moves the timers of slot INDEX of LEVEL down the levels. Returns INDEX, so
+ * the caller goes on up only when this level has come round too. */
+static int tw_cascade(tw_wheel_t *wheel, int level, int index) {
+  tw_timer_t *timer = wheel->slots[level][index], *next;
+
+  wheel->slots[level][index] = NULL;
+  for (; timer != NULL; timer = next) {
+    next = timer->next;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    tw_link(wheel, timer);
+  }
+  return index;
+}
+
+void tw_init(tw_wheel_t *wheel, int tick_ms, long long now_ms) {
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->start_ms = now_ms;
+  wheel->tick_ms = tick_ms;
+}
+
+void tw_timer_init(tw_timer_t *timer, void *data) {
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+  timer->data = data;
+}
+
+void tw_schedule(tw_wheel_t *wheel, tw_timer_t *timer, long long expires_ms) {
+  long long ticks = (expires_ms - wheel->start_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+
+  if (timer->pprev != NULL)
+    tw_unlink(timer);
+  else
+    wheel->pending++;
+  timer->expires = ticks > 0 ? ticks : 0;
+  tw_link(wheel, timer);
+}
+
+void tw_cancel(tw_wheel_t *wheel, tw_timer_t *timer) {
+  if (timer->pprev == NULL) return;
+  tw_unlink(timer);
+  wheel->pending--;
+}
+
+int tw_pending(tw_timer_t *timer) {
+  return timer->pprev != NULL;
+}
+
+void tw_advance(tw_wheel_t *wheel, long long now_ms,
+    void (*expire)(tw_timer_t *timer, void *arg), void *arg) {
+  long long target = (now_ms - wheel->start_ms) / wheel->tick_ms;
+  tw_timer_t *timer;
+  int index, level;
+
+  while ((long long) wheel->now <= target) {
+    index = wheel->now & TW_MASK;
+    for (level = 1; index == 0 && level < TW_LEVELS; level++)
+      index = tw_cascade(wheel, level, (wheel->now >> (level * TW_BITS)) & TW_MASK);
+    index = wheel->now & TW_MASK;
+    wheel->now++;
+
+    /* Expired timers are taken one at a time: EXPIRE may cancel others. */
+    while ((timer = wheel->slots[0][index]) != NULL) {
+      tw_unlink(timer);
+      wheel->pending--;
+      expire(timer, arg);
+    }
+  }
+}
+
+int tw_timeout_ms(tw_wheel_t *wheel, long long now_ms) {
+  unsigned long long tick = wheel->now;
+  long long timeout;
+
+  if (wheel->pending == 0) return -1;
+  /* The next non-empty slot of this turn, or else the next cascade (which
+   * may be the very next tick). */
+  if ((tick & TW_MASK) != 0) {
+    while (wheel->slots[0][tick & TW_MASK] == NULL && ((tick + 1) & TW_MASK) != 0)
+      tick++;
+    if (wheel->slots[0][tick & TW_MASK] == NULL) tick++;
+  }
+  timeout = wheel->start_ms + (long long) tick * wheel->tick_ms - now_ms;
+  return timeout > 0 ? (int) timeout : 0;
+}
@@ -0,0 +1,61 @@
+#ifndef __TIMER_WHEEL__
+#define __TIMER_WHEEL__
+
+/* TIMER_WHEEL keeps timers in a hierarchical timing wheel: TW_LEVELS wheels
+ * of TW_SLOTS slots each, where a slot of the first level holds the timers
+ * due in one tick and a slot of each level above spans a whole turn of the
+ * level below. Scheduling and cancelling a timer are O(1) list operations.
+ * Advancing runs one slot of the first level per tick, and each time that
+ * level comes round, moves the next slot of the level above down into it
+ * (and so on up), so every timer is moved at most once per level. Timers
+ * due further out than the top level reaches wait in it, and are placed
+ * again when they come round.
+ *
+ * A wheel is not thread-safe: it belongs to one thread, or its users share
+ * a lock. */
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4
+
+typedef struct tw_timer {
+  struct tw_timer *next;
+  struct tw_timer **pprev;      /* What points at this timer, NULL if idle. */
+  unsigned long long expires;   /* In ticks. */
+  void *data;
+} tw_timer_t;
+
+typedef struct tw_wheel {
+  long long start_ms;
+  int tick_ms;
+  unsigned long long now;       /* The next tick to run. */
+  unsigned long pending;
+  tw_timer_t *slots[TW_LEVELS][TW_SLOTS];
+} tw_wheel_t;
+
+/* Sets up an empty WHEEL that ticks every TICK_MS from NOW_MS. */
+void tw_init(tw_wheel_t *wheel, int tick_ms, long long now_ms);
+
+/* Sets up an idle TIMER carrying DATA for whoever it expires to. */
+void tw_timer_init(tw_timer_t *timer, void *data);
+
+/* Has TIMER expire once the clock reaches EXPIRES_MS, rounded up to a tick;
+ * first cancelling it if it is pending. */
+void tw_schedule(tw_wheel_t *wheel, tw_timer_t *timer, long long expires_ms);
+
+/* Stops TIMER if it is pending. */
+void tw_cancel(tw_wheel_t *wheel, tw_timer_t *timer);
+
+/* Whether TIMER is waiting to expire. */
+int tw_pending(tw_timer_t *timer);
+
+/* Runs the ticks up to NOW_MS, calling EXPIRE with ARG for every timer due,
+ * which is idle by then and may be scheduled again. */
+void tw_advance(tw_wheel_t *wheel, long long now_ms,
+    void (*expire)(tw_timer_t *timer, void *arg), void *arg);
+
+/* Returns how many milliseconds from NOW_MS tw_advance next has work to do,
+ * or -1 if no timer is pending: a bound for sleeping between advances. */
+int tw_timeout_ms(tw_wheel_t *wheel, long long now_ms);
+
+#endif
@@ -0,0 +1,529 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upstream.h"
+
+#define UP_DNS_CACHE_SIZE UP_MAX_UPSTREAMS  /* Room for every target. */
+#define UP_IDLE_TIMEOUT_MS 30000  /* Servers close idle connections too. */
+#define UP_RING_REPLICAS 160      /* Points per server on the hash ring. */
+
+typedef struct up_dns_entry {
+  char *host;
+  int port;
+  struct sockaddr_in address;
+  long long expires;
+  int refreshing;                 /* A lookup is under way off-thread. */
+} up_dns_entry_t;
+
+static up_dns_entry_t up_dns_cache[UP_DNS_CACHE_SIZE];
+static int up_dns_next;           /* Slot replaced when the cache is full. */
+static int up_dns_ttl_ms = 60000;
+static int up_io_timeout_ms = 30000;  /* For connect, and each read or write. */
+static pthread_mutex_t up_dns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long up_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+void up_set_dns_ttl(int ttl_ms) {
+  up_dns_ttl_ms = ttl_ms;
+}
+
+void up_set_io_timeout(int timeout_ms) {
+  up_io_timeout_ms = timeout_ms;
+}
+
+/* Returns the cache slot for HOST:PORT, or NULL. Called with the lock held. */
+static up_dns_entry_t *up_dns_find(const char *host, int port) {
+  for (int i = 0; i < UP_DNS_CACHE_SIZE; i++) {
+    up_dns_entry_t *entry = &up_dns_cache[i];
+    if (entry->host != NULL && entry->port == port &&
+        strcmp(entry->host, host) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+/* Looks HOST:PORT up into ADDRESS, blocking. */
+static int up_lookup(const char *host, int port, struct sockaddr_in *address) {
+  struct addrinfo hints, *result;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, NULL, &hints, &result) != 0 || result == NULL)
+    return -1;
+  memcpy(address, result->ai_addr, sizeof(*address));
+  address->sin_port = htons(port);
+  freeaddrinfo(result);
+  return 0;
+}
+
+/* Stores ADDRESS for HOST:PORT, replacing the oldest slot if it is new.
+ * Called with the lock held. */
+static up_dns_entry_t *up_dns_store(const char *host, int port,
+    struct sockaddr_in *address) {
+  up_dns_entry_t *entry = up_dns_find(host, port);
+
+  if (entry == NULL) {
+    entry = &up_dns_cache[up_dns_next];
+    up_dns_next = (up_dns_next + 1) % UP_DNS_CACHE_SIZE;
+    free(entry->host);
+    entry->host = strdup(host);
+    entry->port = port;
+    entry->refreshing = 0;
+  }
+  entry->address = *address;
+  entry->expires = up_now_ms() + up_dns_ttl_ms;
+  return entry;
+}
+
+typedef struct up_dns_refresh {
+  char *host;
+  int port;
+} up_dns_refresh_t;
+
+/* Looks an expired entry up again. If that fails, the old address stays in
+ * use, and the next caller tries again. */
+static void *up_dns_refresh(void *arg) {
+  up_dns_refresh_t *refresh = arg;
+  struct sockaddr_in address;
+  up_dns_entry_t *entry;
+  int found = up_lookup(refresh->host, refresh->port, &address) == 0;
+
+  pthread_mutex_lock(&up_dns_lock);
+  if (found) up_dns_store(refresh->host, refresh->port, &address);
+  entry = up_dns_find(refresh->host, refresh->port);
+  if (entry != NULL) entry->refreshing = 0;
+  pthread_mutex_unlock(&up_dns_lock);
+  free(refresh->host);
+  free(refresh);
+  return NULL;
+}
+
+/* Starts refreshing ENTRY on its own thread, unless that is under way.
+ * Called with the lock held. */
+static void up_dns_start_refresh(up_dns_entry_t *entry) {
+  up_dns_refresh_t *refresh;
+  pthread_t thread;
+
+  if (entry->refreshing) return;
+  refresh = malloc(sizeof(*refresh));
+  if (refresh == NULL) return;
+  refresh->host = strdup(entry->host);
+  refresh->port = entry->port;
+  if (refresh->host == NULL ||
+      pthread_create(&thread, NULL, up_dns_refresh, refresh) != 0) {
+    free(refresh->host);
+    free(refresh);
+    return;
+  }
+  pthread_detach(thread);
+  entry->refreshing = 1;
+}
+
+int up_resolve(const char *host, int port, struct sockaddr_in *address) {
+  up_dns_entry_t *entry;
+
+  pthread_mutex_lock(&up_dns_lock);
+  entry = up_dns_find(host, port);
+  if (entry != NULL) {
+    /* An expired address is still served while a fresh one is looked up,
+     * so that the event loop never waits on DNS for a known host. */
+    *address = entry->address;
+    if (entry->expires <= up_now_ms()) up_dns_start_refresh(entry);
+    pthread_mutex_unlock(&up_dns_lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&up_dns_lock);
+
+  /* Looked up without the lock; racing misses only duplicate the work. */
+  if (up_lookup(host, port, address) == -1) return -1;
+  pthread_mutex_lock(&up_dns_lock);
+  up_dns_store(host, port, address);
+  pthread_mutex_unlock(&up_dns_lock);
+  return 0;
+}
+
+void up_pool_init(up_pool_t *pool, const char *host, int port,
+    int max_connections) {
+  pthread_condattr_t attributes;
+
+  pool->host = strdup(host);
+  pool->port = port;
+  pool->max_connections = max_connections;
+  pool->num_connections = 0;
+  pool->idle = malloc(sizeof(int) * max_connections);
+  pool->idle_since = malloc(sizeof(long long) * max_connections);
+  pool->num_idle = 0;
+  if (pool->host == NULL || pool->idle == NULL || pool->idle_since == NULL) {
+    perror("Failed to allocate upstream pool");
+    exit(ENOMEM);
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&pool->released, &attributes);
+  pthread_condattr_destroy(&attributes);
+  pool->index = 0;
+  pool->in_flight = 0;
+  pool->opened = 0;
+  pool->reused = 0;
+  pool->failures_in_a_row = 0;
+  pool->ejected_until = 0;
+  pool->requests = 0;
+  pool->failures = 0;
+  memset(pool->latency_histogram, 0, sizeof(pool->latency_histogram));
+}
+
+static int up_connect(up_pool_t *pool) {
+  struct sockaddr_in address;
+  struct timeval timeout = {up_io_timeout_ms / 1000, up_io_timeout_ms % 1000 * 1000};
+  int fd, one = 1;
+
+  if (up_resolve(pool->host, pool->port, &address) == -1) {
+    fprintf(stderr, "Cannot find host: %s\n", pool->host);
+    return -1;
+  }
+  fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+
+  /* A blocking connect gives up after SO_SNDTIMEO too. */
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Whether idle FD is still open with nothing unexpected to read. */
+static int up_alive(int fd) {
+  char byte;
+  ssize_t peeked = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int up_acquire(up_pool_t *pool, int *reused) {
+  long long now = up_now_ms(), deadline = now + up_io_timeout_ms;
+  struct timespec until = { deadline / 1000, deadline % 1000 * 1000000 };
+  int fd, expired = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    /* The oldest have been idle longest, and are the likeliest to be gone. */
+    while (expired < pool->num_idle &&
+        now - pool->idle_since[expired] >= UP_IDLE_TIMEOUT_MS)
+      close(pool->idle[expired++]);
+    if (expired > 0) {
+      pool->num_idle -= expired;
+      pool->num_connections -= expired;
+      memmove(pool->idle, pool->idle + expired, sizeof(int) * pool->num_idle);
+      memmove(pool->idle_since, pool->idle_since + expired,
+          sizeof(long long) * pool->num_idle);
+      expired = 0;
+    }
+
+    while (pool->num_idle > 0) {
+      fd = pool->idle[--pool->num_idle];
+      if (up_alive(fd)) {
+        pool->reused++;
+        pthread_mutex_unlock(&pool->lock);
+        *reused = 1;
+        return fd;
+      }
+      close(fd);
+      pool->num_connections--;
+    }
+
+    if (pool->num_connections < pool->max_connections) break;
+    if (up_io_timeout_ms == 0) {
+      pthread_cond_wait(&pool->released, &pool->lock);
+    } else if (pthread_cond_timedwait(&pool->released, &pool->lock,
+          &until) == ETIMEDOUT) {
+      pthread_mutex_unlock(&pool->lock);
+      errno = EBUSY;
+      return -1;
+    }
+    now = up_now_ms();
+  }
+  pool->num_connections++;
+  pool->opened++;
+  pthread_mutex_unlock(&pool->lock);
+
+  *reused = 0;
+  fd = up_connect(pool);
+  if (fd == -1) up_release(pool, -1, 0);
+  return fd;
+}
+
+void up_release(up_pool_t *pool, int fd, int reusable) {
+  if (!reusable && fd >= 0) close(fd);
+
+  pthread_mutex_lock(&pool->lock);
+  if (reusable) {
+    pool->idle[pool->num_idle] = fd;
+    pool->idle_since[pool->num_idle] = up_now_ms();
+    pool->num_idle++;
+  } else {
+    pool->num_connections--;
+  }
+  pthread_cond_signal(&pool->released);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void up_forget(up_pool_t *pool) {
+  up_release(pool, -1, 0);
+}
+
+void up_pool_succeeded(up_pool_t *pool, long long latency_us) {
+  int bucket = 0;
+
+  __atomic_add_fetch(&pool->requests, 1, __ATOMIC_RELAXED);
+  if (__atomic_exchange_n(&pool->failures_in_a_row, 0, __ATOMIC_RELAXED) >=
+      UP_MAX_FAILURES)
+    printf("Upstream %s:%d is back\n", pool->host, pool->port);
+  if (latency_us < 0) return;
+  while (bucket < UP_HISTOGRAM_BUCKETS - 1 && latency_us >= 1LL << bucket)
+    bucket++;
+  __atomic_add_fetch(&pool->latency_histogram[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&pool->latency_sum_us, latency_us, __ATOMIC_RELAXED);
+}
+
+void up_pool_failed(up_pool_t *pool) {
+  __atomic_add_fetch(&pool->failures, 1, __ATOMIC_RELAXED);
+
+  /* Once ejected, a server stays at the limit, so that the first request
+   * it fails after coming back ejects it again. */
+  if (__atomic_add_fetch(&pool->failures_in_a_row, 1, __ATOMIC_RELAXED) >=
+      UP_MAX_FAILURES) {
+    long long now = up_now_ms();
+    if (__atomic_exchange_n(&pool->ejected_until, now + UP_EJECT_MS,
+          __ATOMIC_RELAXED) <= now)
+      printf("Ejecting upstream %s:%d for %d s after %d failures in a row\n",
+          pool->host, pool->port, UP_EJECT_MS / 1000, UP_MAX_FAILURES);
+  }
+}
+
+void up_pool_enter(up_pool_t *pool) {
+  __atomic_add_fetch(&pool->in_flight, 1, __ATOMIC_RELAXED);
+}
+
+void up_pool_leave(up_pool_t *pool) {
+  __atomic_sub_fetch(&pool->in_flight, 1, __ATOMIC_RELAXED);
+}
+
+/* FNV-1a. */
+static unsigned long long up_hash(const char *data, size_t length) {
+  unsigned long long hash = 14695981039346656037ULL;
+
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= 1099511628211ULL;
+  }
+  /* Mixes the low bits FNV leaves weak into the high ones the ring sorts by. */
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static int up_compare_points(const void *a, const void *b) {
+  const up_ring_point_t *x = a, *y = b;
+  return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+int up_group_init(up_group_t *group, const char *list, enum up_balance balance,
+    int max_connections) {
+  char *copy = strdup(list), *entry, *save, *colon;
+  char point_name[512];
+  int port;
+
+  group->num_pools = 0;
+  group->balance = balance;
+  group->next = 0;
+  group->pools = calloc(UP_MAX_UPSTREAMS, sizeof(up_pool_t));
+  if (copy == NULL || group->pools == NULL) {
+    perror("Failed to allocate upstreams");
+    exit(ENOMEM);
+  }
+
+  for (entry = strtok_r(copy, ",", &save); entry != NULL;
+      entry = strtok_r(NULL, ",", &save)) {
+    if (group->num_pools == UP_MAX_UPSTREAMS) return -1;
+    port = 80;
+    colon = strchr(entry, ':');
+    if (colon != NULL) {
+      *colon = '\0';
+      port = atoi(colon + 1);
+    }
+    if (*entry == '\0' || port <= 0 || port > 65535) return -1;
+    up_pool_init(&group->pools[group->num_pools], entry, port, max_connections);
+    group->pools[group->num_pools].index = group->num_pools;
+    group->num_pools++;
+  }
+  free(copy);
+  if (group->num_pools == 0) return -1;
+
+  group->ring_size = group->num_pools * UP_RING_REPLICAS;
+  group->ring = malloc(sizeof(up_ring_point_t) * group->ring_size);
+  if (group->ring == NULL) {
+    perror("Failed to allocate upstreams");
+    exit(ENOMEM);
+  }
+  for (int i = 0; i < group->num_pools; i++) {
+    for (int j = 0; j < UP_RING_REPLICAS; j++) {
+      int length = snprintf(point_name, sizeof(point_name), "%s:%d#%d",
+          group->pools[i].host, group->pools[i].port, j);
+      group->ring[i * UP_RING_REPLICAS + j].hash = up_hash(point_name, length);
+      group->ring[i * UP_RING_REPLICAS + j].pool = i;
+    }
+  }
+  qsort(group->ring, group->ring_size, sizeof(up_ring_point_t),
+      up_compare_points);
+  return 0;
+}
+
+/* Index of the first ring point at or after HASH, wrapping around. */
+static int up_ring_find(up_group_t *group, unsigned long long hash) {
+  int low = 0, high = group->ring_size;
+
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (group->ring[middle].hash < hash) low = middle + 1;
+    else high = middle;
+  }
+  return low == group->ring_size ? 0 : low;
+}
+
+up_pool_t *up_group_pick(up_group_t *group, const char *key,
+    unsigned long long tried) {
+  long long now = up_now_ms(), soonest = 0;
+  up_pool_t *chosen = NULL, *fallback = NULL, *pool;
+  int on_ring = group->balance == UP_HASH && key != NULL;
+  int start, count = group->num_pools;
+
+  if (on_ring) {
+    /* Walks the ring from the key's point, so that only the keys of a
+     * server that is out move, and they spread over the others. */
+    start = up_ring_find(group, up_hash(key, strlen(key)));
+    count = group->ring_size;
+  } else {
+    start = __atomic_fetch_add(&group->next, 1, __ATOMIC_RELAXED) %
+        group->num_pools;
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (on_ring)
+      pool = &group->pools[group->ring[(start + i) % count].pool];
+    else
+      pool = &group->pools[(start + i) % count];
+    if (tried & (1ULL << pool->index)) continue;
+
+    long long ejected_until = __atomic_load_n(&pool->ejected_until,
+        __ATOMIC_RELAXED);
+    if (ejected_until > now) {
+      if (fallback == NULL || ejected_until < soonest) {
+        fallback = pool;
+        soonest = ejected_until;
+      }
+      continue;
+    }
+
+    if (group->balance != UP_LEAST_CONNECTIONS) return pool;
+    if (chosen == NULL || __atomic_load_n(&pool->in_flight, __ATOMIC_RELAXED) <
+        __atomic_load_n(&chosen->in_flight, __ATOMIC_RELAXED))
+      chosen = pool;
+  }
+  return chosen != NULL ? chosen : fallback;
+}
+
+/* Prints one sample of METRIC for POOL, up to the closing brace. */
+static void up_sample(FILE *out, const char *metric, up_pool_t *pool) {
+  fprintf(out, "%s{upstream=\"%s:%d\"", metric, pool->host, pool->port);
+}
+
+void up_group_report(up_group_t *group, FILE *out) {
+  long long now = up_now_ms();
+  unsigned long cumulative;
+  up_pool_t *pool;
+  int i, j;
+
+  fprintf(out, "# HELP httpserver_upstream_up Whether each proxy target is "
+      "being sent requests, or ejected.\n"
+      "# TYPE httpserver_upstream_up gauge\n");
+  for (i = 0; i < group->num_pools; i++) {
+    pool = &group->pools[i];
+    up_sample(out, "httpserver_upstream_up", pool);
+    fprintf(out, "} %d\n",
+        __atomic_load_n(&pool->ejected_until, __ATOMIC_RELAXED) <= now);
+  }
+
+  fprintf(out, "# HELP httpserver_upstream_requests_total Requests answered "
+      "by each proxy target.\n"
+      "# TYPE httpserver_upstream_requests_total counter\n");
+  for (i = 0; i < group->num_pools; i++) {
+    pool = &group->pools[i];
+    up_sample(out, "httpserver_upstream_requests_total", pool);
+    fprintf(out, "} %lu\n", __atomic_load_n(&pool->requests, __ATOMIC_RELAXED));
+  }
+
+  fprintf(out, "# HELP httpserver_upstream_failures_total Failures to connect "
+      "to or hear back from each proxy target.\n"
+      "# TYPE httpserver_upstream_failures_total counter\n");
+  for (i = 0; i < group->num_pools; i++) {
+    pool = &group->pools[i];
+    up_sample(out, "httpserver_upstream_failures_total", pool);
+    fprintf(out, "} %lu\n", __atomic_load_n(&pool->failures, __ATOMIC_RELAXED));
+  }
+
+  fprintf(out, "# HELP httpserver_upstream_connections_total Connections to "
+      "each proxy target, opened or reused from the pool.\n"
+      "# TYPE httpserver_upstream_connections_total counter\n");
+  for (i = 0; i < group->num_pools; i++) {
+    unsigned long opened, reused;
+    pool = &group->pools[i];
+    pthread_mutex_lock(&pool->lock);
+    opened = pool->opened;
+    reused = pool->reused;
+    pthread_mutex_unlock(&pool->lock);
+    up_sample(out, "httpserver_upstream_connections_total", pool);
+    fprintf(out, ",how=\"opened\"} %lu\n", opened);
+    up_sample(out, "httpserver_upstream_connections_total", pool);
+    fprintf(out, ",how=\"reused\"} %lu\n", reused);
+  }
+
+  fprintf(out, "# HELP httpserver_upstream_response_head_seconds Time from "
+      "sending a request to each proxy target to its response head.\n"
+      "# TYPE httpserver_upstream_response_head_seconds histogram\n");
+  for (i = 0; i < group->num_pools; i++) {
+    pool = &group->pools[i];
+    cumulative = 0;
+    for (j = 0; j < UP_HISTOGRAM_BUCKETS; j++) {
+      cumulative += __atomic_load_n(&pool->latency_histogram[j],
+          __ATOMIC_RELAXED);
+      if (j == UP_HISTOGRAM_BUCKETS - 1) break;
+      up_sample(out, "httpserver_upstream_response_head_seconds_bucket", pool);
+      fprintf(out, ",le=\"%.6f\"} %lu\n", (1LL << j) / 1e6, cumulative);
+    }
+    up_sample(out, "httpserver_upstream_response_head_seconds_bucket", pool);
+    fprintf(out, ",le=\"+Inf\"} %lu\n", cumulative);
+    up_sample(out, "httpserver_upstream_response_head_seconds_sum", pool);
+    fprintf(out, "} %.6f\n",
+        __atomic_load_n(&pool->latency_sum_us, __ATOMIC_RELAXED) / 1e6);
+    up_sample(out, "httpserver_upstream_response_head_seconds_count", pool);
+    fprintf(out, "} %lu\n", cumulative);
+  }
+}
@@ -0,0 +1,133 @@
+#ifndef __UPSTREAM__
+#define __UPSTREAM__
+
+/* UPSTREAM keeps warm connections to the servers proxy mode forwards to.
+ * Each server has a pool of connections, opened on demand up to a cap and
+ * returned after each response the server lets persist, so a proxied
+ * request usually costs neither a DNS lookup nor a TCP handshake. The pools
+ * form a group that spreads requests over the servers, and stops sending
+ * to a server for a while after it fails repeatedly. Everything is shared
+ * by every worker. */
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+
+/* Fills ADDRESS for HOST:PORT. Only a host never seen before is looked up
+ * on the calling thread; once the previous answer is older than the DNS TTL
+ * it is still returned, while a thread of its own looks HOST up again.
+ * Thread-safe, unlike gethostbyname. Returns -1 if HOST cannot be resolved. */
+int up_resolve(const char *host, int port, struct sockaddr_in *address);
+
+/* How long resolved addresses are reused before being refreshed (default
+ * 60 s; 0 refreshes after every use). */
+void up_set_dns_ttl(int ttl_ms);
+
+/* How long connecting to a server, each read or write on the connection,
+ * and waiting for a connection of a full pool, may take (default 30 s; 0
+ * waits forever). */
+void up_set_io_timeout(int timeout_ms);
+
+/* Bucket i of a latency histogram counts latencies under 2^i us. */
+#define UP_HISTOGRAM_BUCKETS 32
+
+typedef struct up_pool {
+  char *host;
+  int port;
+  int index;                  /* In its group. */
+  int max_connections;
+  int num_connections;        /* Idle and in use. */
+  int in_flight;              /* Requests being served. */
+
+  /* Idle connections, oldest first; the newest is reused first. */
+  int *idle;
+  long long *idle_since;
+  int num_idle;
+
+  pthread_mutex_t lock;
+  pthread_cond_t released;    /* Signalled when a connection frees up. */
+
+  unsigned long opened;
+  unsigned long reused;
+
+  /* Passive health: consecutive failures, and until when (on the
+   * CLOCK_MONOTONIC ms clock) the server is left out after too many. */
+  int failures_in_a_row;
+  long long ejected_until;
+
+  unsigned long requests;
+  unsigned long failures;
+  unsigned long latency_histogram[UP_HISTOGRAM_BUCKETS];
+  unsigned long long latency_sum_us;
+} up_pool_t;
+
+void up_pool_init(up_pool_t *pool, const char *host, int port,
+    int max_connections);
+
+/* Returns a connected socket to POOL's server: the most recently idle one,
+ * or a new one while under the cap, waiting for a release otherwise, for
+ * up to the I/O timeout. Sets *REUSED if it was idle, in which case the
+ * server may have closed it in the meantime. Returns -1 if no connection
+ * could be made, with errno EBUSY if none was released in time. */
+int up_acquire(up_pool_t *pool, int *reused);
+
+/* Hands FD back once its response has been read in full, or closes it if
+ * it is not REUSABLE. */
+void up_release(up_pool_t *pool, int fd, int reusable);
+
+/* Stops counting a connection the caller has taken over for good. */
+void up_forget(up_pool_t *pool);
+
+/* Records a request answered by POOL's server, and the time to its response
+ * head in microseconds (or -1 if there is none to record). */
+void up_pool_succeeded(up_pool_t *pool, long long latency_us);
+
+/* Records a failure to connect to or hear back from POOL's server. After
+ * UP_MAX_FAILURES in a row the server is ejected for UP_EJECT_MS. */
+void up_pool_failed(up_pool_t *pool);
+
+/* Counts a request served by POOL, for least-connections balancing. */
+void up_pool_enter(up_pool_t *pool);
+void up_pool_leave(up_pool_t *pool);
+
+#define UP_MAX_UPSTREAMS 64
+#define UP_MAX_FAILURES 3
+#define UP_EJECT_MS 10000
+
+enum up_balance {
+  UP_ROUND_ROBIN,
+  UP_LEAST_CONNECTIONS,
+  UP_HASH,                    /* Consistent hashing on the request path. */
+};
+
+typedef struct up_ring_point {
+  unsigned long long hash;
+  int pool;
+} up_ring_point_t;
+
+typedef struct up_group {
+  up_pool_t *pools;
+  int num_pools;
+  enum up_balance balance;
+  unsigned long next;         /* Round-robin position. */
+  up_ring_point_t *ring;      /* Sorted by hash, for UP_HASH. */
+  int ring_size;
+} up_group_t;
+
+/* Sets up a pool for each server in LIST ("host[:port],host[:port],...",
+ * port 80 by default). Returns -1 if LIST is malformed or too long. */
+int up_group_init(up_group_t *group, const char *list, enum up_balance balance,
+    int max_connections);
+
+/* Chooses the server for a request with KEY (its path, used for UP_HASH;
+ * may be NULL), skipping ejected servers and those in the TRIED bitmask.
+ * If every untried server is ejected, the one back soonest is chosen.
+ * Returns NULL once every server has been tried. */
+up_pool_t *up_group_pick(up_group_t *group, const char *key,
+    unsigned long long tried);
+
+/* Prints each server's health, request and connection counts and latency
+ * histogram, in the Prometheus text format. */
+void up_group_report(up_group_t *group, FILE *out);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Measures the latency of one proxied round trip to a local stand-in
+ * upstream, as proxy mode used to make it (look the host up, connect, send
+ * the request, read the response, close) and through an up_pool_t (reuse a
+ * warm connection, send, read, release).
+ *
+ * Usage: ./upstream_bench [requests_per_case] [host]
+ */
+#include <netinet/in.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libhttp.h"
+#include "upstream.h"
+
+static const char request_text[] =
+  "GET /index.html HTTP/1.1\r\n"
+  "Host: localhost\r\n"
+  "\r\n";
+
+static const char response_text[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Content-Length: 2\r\n"
+  "\r\n"
+  "ok";
+
+/* Serves one connection at a time, as many requests as each one sends. */
+static void *upstream_routine(void *aux) {
+  int server_socket = *(int *) aux;
+  struct http_connection *connection = malloc(sizeof(struct http_connection));
+
+  while (1) {
+    int fd = accept(server_socket, NULL, NULL);
+    if (fd < 0) continue;
+    http_connection_init(connection, fd);
+    while (http_connection_next_request(connection) != NULL)
+      send(fd, response_text, sizeof(response_text) - 1, MSG_NOSIGNAL);
+    close(fd);
+  }
+  return NULL;
+}
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Sends the request on FD and reads the whole response. */
+static int round_trip(int fd) {
+  char buffer[256];
+  size_t received = 0;
+  ssize_t bytes;
+
+  if (send(fd, request_text, sizeof(request_text) - 1, MSG_NOSIGNAL) < 0)
+    return -1;
+  while (received < sizeof(response_text) - 1) {
+    bytes = recv(fd, buffer, sizeof(buffer), 0);
+    if (bytes <= 0) return -1;
+    received += bytes;
+  }
+  return 0;
+}
+
+/* What handle_proxy_request did before: a lookup and a connect each time. */
+static int cold_request(const char *host, int port) {
+  struct hostent *entry = gethostbyname2(host, AF_INET);
+  struct sockaddr_in address;
+  int fd, status;
+
+  if (entry == NULL) return -1;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  memcpy(&address.sin_addr, entry->h_addr_list[0], sizeof(address.sin_addr));
+  fd = socket(PF_INET, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+    close(fd);
+    return -1;
+  }
+  status = round_trip(fd);
+  close(fd);
+  return status;
+}
+
+static int pooled_request(up_pool_t *pool) {
+  int reused, status;
+  int fd = up_acquire(pool, &reused);
+
+  if (fd < 0) return -1;
+  status = round_trip(fd);
+  up_release(pool, fd, status == 0);
+  return status;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, double *latencies, long count) {
+  double total = 0;
+
+  for (long i = 0; i < count; i++) total += latencies[i];
+  qsort(latencies, count, sizeof(double), compare_doubles);
+  printf("%-8s %10.1f %10.1f %10.1f %10.1f\n", name, total / count * 1e6,
+      latencies[count / 2] * 1e6, latencies[count * 99 / 100] * 1e6,
+      count / total);
+}
+
+int main(int argc, char **argv) {
+  long count = argc > 1 ? atol(argv[1]) : 10000;
+  const char *host = argc > 2 ? argv[2] : "localhost";
+  double *latencies = malloc(sizeof(double) * count);
+  struct sockaddr_in address;
+  socklen_t address_length = sizeof(address);
+  int server_socket, port;
+  pthread_t thread;
+  up_pool_t pool;
+
+  server_socket = socket(PF_INET, SOCK_STREAM, 0);
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(server_socket, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+      listen(server_socket, 1024) == -1 ||
+      getsockname(server_socket, (struct sockaddr *) &address,
+        &address_length) == -1) {
+    perror("Failed to start the stand-in upstream");
+    return EXIT_FAILURE;
+  }
+  port = ntohs(address.sin_port);
+  pthread_create(&thread, NULL, upstream_routine, &server_socket);
+  up_pool_init(&pool, host, port, 1);
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  printf("%ld round trips to %s:%d\n", count, host, port);
+  printf("%-8s %10s %10s %10s %10s\n", "", "mean us", "p50 us", "p99 us",
+      "requests/s");
+
+  for (int pooled = 0; pooled <= 1; pooled++) {
+    for (long i = 0; i < count; i++) {
+      double start = now_seconds();
+      if ((pooled ? pooled_request(&pool) : cold_request(host, port)) == -1) {
+        fprintf(stderr, "Round trip %ld failed\n", i);
+        return EXIT_FAILURE;
+      }
+      latencies[i] = now_seconds() - start;
+    }
+    report(pooled ? "pooled" : "connect", latencies, count);
+  }
+  printf("pool: %lu connections opened, %lu reused\n", pool.opened,
+      pool.reused);
+  return EXIT_SUCCESS;
+}
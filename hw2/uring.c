@@ -0,0 +1,628 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "arena.h"
+#include "metrics.h"
+#include "uring.h"
+
+#define UR_ENTRIES 1024           /* Submission queue size. */
+#define UR_PIPE_SIZE (1 << 20)   /* File bytes spliced at a time, at most. */
+#define UR_ARENA_BLOCK_SIZE (8 << 10)  /* Room for an error page or two. */
+
+/* What a completion is for, kept in the low bits of its user_data (the
+ * rest is the connection, which malloc aligns to at least 8). */
+enum ur_op {
+  UR_IGNORE,  /* Link timeouts, splices into pipes and closes. */
+  UR_ACCEPT,
+  UR_RECV,
+  UR_SEND,
+};
+#define UR_OP_MASK 7
+
+typedef struct ur_conn {
+  int fd;
+  struct http_connection *connection;
+  struct http_response response;
+  arena_t arena;              /* What the response is built in. */
+  int keep_alive;
+  long long request_start_ns;
+
+  /* The head and in-memory body, all sent with one sendmsg. */
+  char head[LIBHTTP_HEAD_MAX_SIZE];
+  struct iovec output[3];
+  struct iovec *output_iov;
+  int output_count;
+  struct msghdr message;
+
+  /* Then the file, as in http_response_send_file: the part and position in
+   * it, and the chunk of it spliced into PIPE, made for the first file the
+   * connection sends, and how much of that is in the socket. */
+  int file_part;
+  off_t file_position;
+  int pipe[2];
+  size_t pipe_size;
+  size_t chunk_length;
+  size_t chunk_sent;
+} ur_conn_t;
+
+typedef struct ur_ring {
+  int index;
+  int fd;
+  int server_socket;
+  int multishot;              /* Multishot accept works (Linux 5.19 on). */
+  ur_config_t *config;
+  pthread_t thread;
+
+  /* The rings shared with the kernel. SQ_LOCAL_TAIL runs ahead of SQ_TAIL
+   * by the entries queued since the last io_uring_enter. */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct __kernel_timespec idle_timeout;
+
+  /* Written by the ring's thread only; read by ur_report. */
+  unsigned long enters;
+  unsigned long submitted;
+  struct ur_ring *next;
+} ur_ring_t;
+
+static ur_ring_t *ur_rings;
+
+static int ur_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ur_supported(void) {
+  static const int needed[] = {
+    IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG,
+    IORING_OP_SPLICE, IORING_OP_LINK_TIMEOUT, IORING_OP_CLOSE,
+  };
+  struct io_uring_params params;
+  struct io_uring_probe *probe;
+  int fd, supported;
+
+  memset(&params, 0, sizeof(params));
+  fd = ur_setup(4, &params);
+  if (fd < 0) return 0;
+  probe = calloc(1, sizeof(struct io_uring_probe) +
+      256 * sizeof(struct io_uring_probe_op));
+  supported = probe != NULL &&
+      syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+  for (size_t i = 0; supported && i < sizeof(needed) / sizeof(needed[0]); i++)
+    supported = needed[i] <= probe->last_op &&
+        (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  close(fd);
+  return supported;
+}
+
+/* Sets up RING's io_uring and maps its queues. Must run on the thread that
+ * uses the ring, which is the only one to submit to it. */
+static int ur_ring_init(ur_ring_t *ring) {
+  struct io_uring_params params;
+  size_t sq_size, cq_size;
+  char *sq, *cq;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+  ring->fd = ur_setup(UR_ENTRIES, &params);
+  if (ring->fd < 0 && errno == EINVAL) {
+    /* Kernels before 6.0 know neither flag. */
+    memset(&params, 0, sizeof(params));
+    ring->fd = ur_setup(UR_ENTRIES, &params);
+  }
+  if (ring->fd < 0) return -1;
+
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) return -1;
+  cq = sq;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) return -1;
+  }
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+      IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) return -1;
+
+  ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  /* Entry i of the queue is always SQE i. */
+  for (unsigned i = 0; i < params.sq_entries; i++)
+    ((unsigned *) (sq + params.sq_off.array))[i] = i;
+  return 0;
+}
+
+/* Submits what has been queued and, with WAIT, waits for a completion. */
+static void ur_enter(ur_ring_t *ring, int wait) {
+  unsigned to_submit = ring->sq_local_tail -
+      __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  int submitted;
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  submitted = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait ? 1 : 0,
+      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  __atomic_store_n(&ring->enters, ring->enters + 1, __ATOMIC_RELAXED);
+  if (submitted > 0)
+    __atomic_store_n(&ring->submitted, ring->submitted + submitted,
+        __ATOMIC_RELAXED);
+}
+
+/* Returns the next N free submission entries in a row, cleared, submitting
+ * what is queued first if there are not enough. Linked entries must come
+ * from one call, so that they go to the kernel together. */
+static struct io_uring_sqe *ur_sqes(ur_ring_t *ring, unsigned n) {
+  struct io_uring_sqe *sqe;
+
+  while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) +
+      n > ring->sq_entries)
+    ur_enter(ring, 0);
+  for (unsigned i = 0; i < n; i++) {
+    sqe = &ring->sqes[(ring->sq_local_tail + i) & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+  }
+  sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+  ring->sq_local_tail += n;
+  return sqe;
+}
+
+/* Links SQE to the entry after it, which this returns. */
+static struct io_uring_sqe *ur_link(ur_ring_t *ring, struct io_uring_sqe *sqe) {
+  sqe->flags |= IOSQE_IO_LINK;
+  return sqe + 1 == ring->sqes + ring->sq_entries ? ring->sqes : sqe + 1;
+}
+
+static struct io_uring_sqe *ur_sqe(ur_ring_t *ring, int opcode, int fd,
+    ur_conn_t *conn, enum ur_op op) {
+  struct io_uring_sqe *sqe = ur_sqes(ring, 1);
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = (uintptr_t) conn | op;
+  return sqe;
+}
+
+static void ur_arm_accept(ur_ring_t *ring) {
+  struct io_uring_sqe *sqe = ur_sqe(ring, IORING_OP_ACCEPT, ring->server_socket,
+      NULL, UR_ACCEPT);
+  sqe->accept_flags = SOCK_CLOEXEC;
+  if (ring->multishot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* Closes CONN. Nothing of it is in flight: each connection has one
+ * operation at a time, and it has just completed. */
+static void ur_close(ur_ring_t *ring, ur_conn_t *conn) {
+  ur_sqe(ring, IORING_OP_CLOSE, conn->fd, NULL, UR_IGNORE);
+  http_response_free(&conn->response);
+  ar_destroy(&conn->arena);
+  if (conn->pipe[0] >= 0) {
+    ur_sqe(ring, IORING_OP_CLOSE, conn->pipe[0], NULL, UR_IGNORE);
+    ur_sqe(ring, IORING_OP_CLOSE, conn->pipe[1], NULL, UR_IGNORE);
+  }
+  free(conn->connection);
+  free(conn);
+}
+
+/* Waits for more of the request, for at most the keep-alive timeout. */
+static void ur_recv(ur_ring_t *ring, ur_conn_t *conn) {
+  int timed = ring->config->keepalive_timeout_ms > 0;
+  struct io_uring_sqe *sqe = ur_sqes(ring, timed ? 2 : 1);
+  size_t room;
+  char *space = http_connection_space(conn->connection, &room);
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->addr = (uintptr_t) space;
+  sqe->len = room;
+  sqe->user_data = (uintptr_t) conn | UR_RECV;
+  if (timed) {
+    sqe = ur_link(ring, sqe);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) &ring->idle_timeout;
+    sqe->len = 1;
+    sqe->user_data = UR_IGNORE;
+  }
+}
+
+/* Sends what is left of the head and in-memory body. */
+static void ur_send_output(ur_ring_t *ring, ur_conn_t *conn) {
+  struct http_response *response = &conn->response;
+  int file_pending = response->file_fd >= 0 &&
+      (response->file_length > 0 || response->parts != NULL);
+  struct io_uring_sqe *sqe = ur_sqe(ring, IORING_OP_SENDMSG, conn->fd, conn,
+      UR_SEND);
+
+  memset(&conn->message, 0, sizeof(conn->message));
+  conn->message.msg_iov = conn->output_iov;
+  conn->message.msg_iovlen = conn->output_count;
+  sqe->addr = (uintptr_t) &conn->message;
+  sqe->len = 1;
+  /* MSG_MORE lets the head share a segment with the start of the file. */
+  sqe->msg_flags = MSG_NOSIGNAL | (file_pending ? MSG_MORE : 0);
+}
+
+static void ur_prep_send(struct io_uring_sqe *sqe, ur_conn_t *conn,
+    const char *data, size_t length, int more) {
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->fd;
+  sqe->user_data = (uintptr_t) conn | UR_SEND;
+  sqe->addr = (uintptr_t) data;
+  sqe->len = length;
+  sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+}
+
+static void ur_send(ur_ring_t *ring, ur_conn_t *conn, const char *data,
+    size_t length, int more) {
+  ur_prep_send(ur_sqes(ring, 1), conn, data, length, more);
+}
+
+/* Splices LENGTH bytes of CONN's pipe into its socket. */
+static void ur_prep_splice_out(struct io_uring_sqe *sqe, ur_conn_t *conn,
+    size_t length, int more) {
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->fd = conn->fd;
+  sqe->off = -1;
+  sqe->splice_fd_in = conn->pipe[0];
+  sqe->splice_off_in = -1;
+  sqe->len = length;
+  sqe->splice_flags = SPLICE_F_MOVE | (more ? SPLICE_F_MORE : 0);
+  sqe->user_data = (uintptr_t) conn | UR_SEND;
+}
+
+static void ur_serve(ur_ring_t *ring, ur_conn_t *conn);
+
+/* Counts and logs the response just sent, then waits for the next request
+ * or closes. */
+static void ur_finish(ur_ring_t *ring, ur_conn_t *conn) {
+  struct http_response *response = &conn->response;
+  long long latency = mt_now_ns() - conn->request_start_ns;
+  size_t bytes = http_response_content_length(response);
+
+  /* The request stays parsed until the next one is. */
+  mt_record(conn->connection->request.path, response->status_code, bytes,
+      latency);
+  al_log(conn->connection->request.method, conn->connection->request.path,
+      response->status_code, bytes, latency);
+  http_response_free(response);
+  if (!conn->keep_alive) {
+    ur_close(ring, conn);
+    return;
+  }
+  ur_serve(ring, conn);
+}
+
+/* Makes CONN's pipe, as large as the system lets it be up to UR_PIPE_SIZE. */
+static int ur_make_pipe(ur_conn_t *conn) {
+  int size;
+
+  if (pipe2(conn->pipe, O_CLOEXEC) == -1) {
+    conn->pipe[0] = conn->pipe[1] = -1;
+    return -1;
+  }
+  size = fcntl(conn->pipe[1], F_SETPIPE_SZ, UR_PIPE_SIZE);
+  if (size == -1) size = fcntl(conn->pipe[1], F_GETPIPE_SZ);
+  conn->pipe_size = size > 0 ? size : 4096;
+  return 0;
+}
+
+/* Whether more of the response follows what is in the chunk. */
+static int ur_more_after_chunk(ur_conn_t *conn) {
+  struct http_response *response = &conn->response;
+  off_t end = response->file_length;
+
+  if (response->parts != NULL) {
+    struct http_part *current = &response->parts[conn->file_part];
+    if (conn->file_part + 1 < response->num_parts) return 1;
+    end = current->text_length + current->file_length;
+  }
+  return conn->file_position + (off_t) conn->chunk_length < end;
+}
+
+/* Takes the file part of the response a step further: the text ahead of
+ * the current part, the next chunk of it, or the next part. A chunk goes
+ * from the file to the socket through the pipe without being copied, in one
+ * submission: a splice into the pipe linked to one out of it. Should the
+ * first come up short, the second fails with -ECANCELED and the connection
+ * is closed. */
+static void ur_send_file(ur_ring_t *ring, ur_conn_t *conn) {
+  struct http_response *response = &conn->response;
+  int num_parts = response->parts != NULL ? response->num_parts : 1;
+  const char *text = NULL;
+  size_t text_length = 0;
+  off_t file_offset = response->file_offset;
+  off_t file_length = response->file_length;
+  off_t remaining;
+  struct io_uring_sqe *sqe;
+
+  if (response->file_fd < 0) {
+    ur_finish(ring, conn);
+    return;
+  }
+
+  while (conn->file_part < num_parts) {
+    if (response->parts != NULL) {
+      struct http_part *current = &response->parts[conn->file_part];
+      text = response->body + current->text_offset;
+      text_length = current->text_length;
+      file_offset = current->file_offset;
+      file_length = current->file_length;
+    }
+
+    if (conn->file_position < (off_t) text_length) {
+      ur_send(ring, conn, text + conn->file_position,
+          text_length - conn->file_position, file_length > 0);
+      return;
+    }
+
+    remaining = text_length + file_length - conn->file_position;
+    if (remaining > 0) {
+      if (conn->pipe[0] < 0 && ur_make_pipe(conn) == -1) {
+        ur_close(ring, conn);
+        return;
+      }
+      conn->chunk_length = remaining < (off_t) conn->pipe_size ?
+          (size_t) remaining : conn->pipe_size;
+      conn->chunk_sent = 0;
+      sqe = ur_sqes(ring, 2);
+      sqe->opcode = IORING_OP_SPLICE;
+      sqe->fd = conn->pipe[1];
+      sqe->off = -1;
+      sqe->splice_fd_in = response->file_fd;
+      sqe->splice_off_in = file_offset + (conn->file_position - text_length);
+      sqe->len = conn->chunk_length;
+      sqe->splice_flags = SPLICE_F_MOVE;
+      sqe->user_data = UR_IGNORE;
+      ur_prep_splice_out(ur_link(ring, sqe), conn, conn->chunk_length,
+          ur_more_after_chunk(conn));
+      return;
+    }
+    conn->file_part++;
+    conn->file_position = 0;
+  }
+  ur_finish(ring, conn);
+}
+
+/* Answers the request at the front of CONN's buffer, if it has all come. */
+static void ur_dispatch(ur_ring_t *ring, ur_conn_t *conn,
+    struct http_request *request) {
+  struct http_response *response = &conn->response;
+  ur_config_t *config = ring->config;
+
+  conn->request_start_ns = mt_now_ns();
+  http_use_arena(&conn->arena);
+  config->files_handler(request, response);
+  conn->keep_alive = config->keepalive_timeout_ms > 0 && request->keep_alive &&
+      conn->connection->num_requests < config->keepalive_max_requests;
+  http_response_set_keep_alive(response, request, conn->keep_alive);
+  http_use_arena(NULL);
+
+  conn->output_iov = conn->output;
+  conn->output_count = http_response_prepare(response, conn->head,
+      sizeof(conn->head), conn->output);
+  conn->file_part = 0;
+  conn->file_position = 0;
+  conn->chunk_length = 0;
+  ur_send_output(ring, conn);
+}
+
+static void ur_serve(ur_ring_t *ring, ur_conn_t *conn) {
+  struct http_request *request;
+
+  switch (http_connection_parse(conn->connection, &request)) {
+    case HTTP_PARSE_OK:
+      ur_dispatch(ring, conn, request);
+      break;
+    case HTTP_PARSE_INCOMPLETE:
+      ur_recv(ring, conn);
+      break;
+    case HTTP_PARSE_ERROR:
+      ur_close(ring, conn);
+      break;
+  }
+}
+
+static void ur_accepted(ur_ring_t *ring, int fd, unsigned flags) {
+  ur_conn_t *conn;
+
+  if (fd == -EINVAL && ring->multishot) {
+    /* Before 5.19: one accept per submission. */
+    ring->multishot = 0;
+    ur_arm_accept(ring);
+    return;
+  }
+  if (!(flags & IORING_CQE_F_MORE)) ur_arm_accept(ring);
+  if (fd < 0) return;
+
+  conn = calloc(1, sizeof(ur_conn_t));
+  if (conn != NULL) conn->connection = malloc(sizeof(struct http_connection));
+  if (conn == NULL || conn->connection == NULL) {
+    free(conn);
+    close(fd);
+    return;
+  }
+  conn->fd = fd;
+  conn->pipe[0] = conn->pipe[1] = -1;
+  ar_init(&conn->arena, UR_ARENA_BLOCK_SIZE);
+  http_connection_init(conn->connection, fd);
+  http_response_init(&conn->response, 0, NULL);
+  conn->response.arena = &conn->arena;
+  ur_recv(ring, conn);
+}
+
+static void ur_received(ur_ring_t *ring, ur_conn_t *conn, int result) {
+  if (result == -EINTR || result == -EAGAIN) {
+    ur_recv(ring, conn);
+    return;
+  }
+  /* Closed by the client, failed, or cancelled by the idle timeout. */
+  if (result <= 0) {
+    ur_close(ring, conn);
+    return;
+  }
+  http_connection_received(conn->connection, result);
+  ur_serve(ring, conn);
+}
+
+static void ur_sent(ur_ring_t *ring, ur_conn_t *conn, int result) {
+  if (result < 0 && result != -EINTR && result != -EAGAIN) {
+    ur_close(ring, conn);
+    return;
+  }
+  if (result < 0) result = 0;
+
+  if (conn->output_count > 0) {
+    http_iov_advance(&conn->output_iov, &conn->output_count, result);
+    if (conn->output_count > 0)
+      ur_send_output(ring, conn);
+    else
+      ur_send_file(ring, conn);
+  } else if (conn->chunk_length > 0) {
+    conn->chunk_sent += result;
+    if (conn->chunk_sent < conn->chunk_length) {
+      ur_prep_splice_out(ur_sqes(ring, 1), conn,
+          conn->chunk_length - conn->chunk_sent, ur_more_after_chunk(conn));
+      return;
+    }
+    conn->file_position += conn->chunk_length;
+    conn->chunk_length = 0;
+    ur_send_file(ring, conn);
+  } else {
+    conn->file_position += result;
+    ur_send_file(ring, conn);
+  }
+}
+
+static void ur_complete(ur_ring_t *ring, uint64_t user_data, int result,
+    unsigned flags) {
+  ur_conn_t *conn = (ur_conn_t *) (uintptr_t) (user_data & ~(uint64_t) UR_OP_MASK);
+
+  switch (user_data & UR_OP_MASK) {
+    case UR_ACCEPT: ur_accepted(ring, result, flags); break;
+    case UR_RECV: ur_received(ring, conn, result); break;
+    case UR_SEND: ur_sent(ring, conn, result); break;
+  }
+}
+
+static void *ur_ring_routine(void *aux) {
+  ur_ring_t *ring = aux;
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  long long busy_start;
+  uint64_t user_data;
+  int result;
+  unsigned flags;
+
+  if (ring->config->pin_rings) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(ring->index % (num_cpus > 0 ? num_cpus : 1), &cpu_set);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  }
+  if (ur_ring_init(ring) == -1) {
+    perror("Failed to set up io_uring");
+    exit(errno);
+  }
+  mt_register("ring", ring->index);
+  ring->next = __atomic_load_n(&ur_rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&ur_rings, &ring->next, ring, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  ur_arm_accept(ring);
+  while (1) {
+    ur_enter(ring, 1);
+    busy_start = mt_now_ns();
+
+    /* The entry is copied out and its slot handed back before it is acted
+     * on, since acting on it may wait for room in the queues. */
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring->cqes[head & ring->cq_mask];
+      user_data = cqe->user_data;
+      result = cqe->res;
+      flags = cqe->flags;
+      __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+      ur_complete(ring, user_data, result, flags);
+    }
+    mt_busy(mt_now_ns() - busy_start);
+  }
+  return NULL;
+}
+
+void ur_serve_forever(int *server_sockets, int num_server_sockets,
+    ur_config_t *config) {
+  ur_ring_t *ring;
+
+  for (int i = 0; i < config->num_rings; i++) {
+    ring = calloc(1, sizeof(ur_ring_t));
+    if (ring == NULL) {
+      perror("Failed to allocate io_uring");
+      exit(ENOMEM);
+    }
+    ring->index = i;
+    ring->server_socket = server_sockets[i % num_server_sockets];
+    ring->multishot = 1;
+    ring->config = config;
+    ring->idle_timeout.tv_sec = config->keepalive_timeout_ms / 1000;
+    ring->idle_timeout.tv_nsec = config->keepalive_timeout_ms % 1000 * 1000000LL;
+
+    /* The calling thread becomes the last ring. */
+    if (i == config->num_rings - 1)
+      ur_ring_routine(ring);
+    else
+      pthread_create(&ring->thread, NULL, ur_ring_routine, ring);
+  }
+}
+
+void ur_report(FILE *out) {
+  unsigned long enters = 0, submitted = 0;
+
+  for (ur_ring_t *ring = __atomic_load_n(&ur_rings, __ATOMIC_ACQUIRE);
+      ring != NULL; ring = ring->next) {
+    enters += __atomic_load_n(&ring->enters, __ATOMIC_RELAXED);
+    submitted += __atomic_load_n(&ring->submitted, __ATOMIC_RELAXED);
+  }
+  fprintf(out, "# HELP httpserver_uring_enters_total io_uring_enter calls made by the "
+      "rings.\n"
+      "# TYPE httpserver_uring_enters_total counter\n"
+      "httpserver_uring_enters_total %lu\n"
+      "# HELP httpserver_uring_submissions_total Operations submitted to io_uring.\n"
+      "# TYPE httpserver_uring_submissions_total counter\n"
+      "httpserver_uring_submissions_total %lu\n", enters, submitted);
+}
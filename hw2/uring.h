@@ -0,0 +1,42 @@
+#ifndef __URING__
+#define __URING__
+
+#include <stdio.h>
+
+#include "libhttp.h"
+
+/* URING serves files from io_uring rings, one per thread. The ring holds
+ * a multishot accept on a server socket. Each connection then has one
+ * operation in flight at a time: a recv (with a linked timeout while it
+ * waits for a request), a sendmsg of the response head and in-memory body,
+ * or a splice of part of the file through a pipe into the socket. The
+ * thread queues what every completion calls for and submits the lot in the
+ * same io_uring_enter it waits for the next completions with, so one
+ * system call does the work of many. */
+
+typedef void (*ur_files_handler_t)(struct http_request *request,
+    struct http_response *response);
+
+typedef struct ur_config {
+  int num_rings;
+  int pin_rings;              /* Pin ring thread i to CPU i. */
+  /* Persistent connections: idle timeout (0 disables) and request cap. */
+  int keepalive_timeout_ms;
+  int keepalive_max_requests;
+  /* Decides the response for each parsed request. */
+  ur_files_handler_t files_handler;
+} ur_config_t;
+
+/* Returns whether this kernel has io_uring, with every operation used. */
+int ur_supported(void);
+
+/* Serves SERVER_SOCKETS (already bound and listening) forever. Ring i
+ * accepts from socket i % NUM_SERVER_SOCKETS. */
+void ur_serve_forever(int *server_sockets, int num_server_sockets,
+    ur_config_t *config);
+
+/* Prints the io_uring_enter calls and submissions made so far, summed over
+ * rings, in the Prometheus text format. */
+void ur_report(FILE *out);
+
+#endif
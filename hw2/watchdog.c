@@ -0,0 +1,193 @@
+#include <errno.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "watchdog.h"
+
+typedef struct wd_thread {
+  pthread_mutex_t lock;       /* Between the thread and the watchdog. */
+  long long deadline_ms;      /* When to look again, 0 if disarmed. */
+  enum wd_phase phase;
+  int fd;
+  long long progress_ms;      /* Last progress, written by the thread alone. */
+  unsigned long long acked;   /* The client's, when last looked at. */
+  struct wd_thread *prev;
+  struct wd_thread *next;
+} wd_thread_t;
+
+static int wd_timeouts_ms[WD_NUM_PHASES];
+static int wd_started;
+static unsigned long wd_expired[WD_NUM_PHASES];
+static const char *wd_phase_names[WD_NUM_PHASES] = { "head", "send", "proxy" };
+
+static pthread_mutex_t wd_lock = PTHREAD_MUTEX_INITIALIZER;
+static wd_thread_t *wd_threads;
+static __thread wd_thread_t *wd_current;
+
+/* Deadlines are seconds long, so the coarse clock does, and costs no more
+ * than a memory read. */
+static long long wd_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/* Whether the client of THREAD's connection has taken bytes since the last
+ * look. A blocking sendfile or splice only returns once it is done, so the
+ * kernel may know of progress the thread has not reported yet. */
+static int wd_client_took_bytes(wd_thread_t *thread) {
+  struct tcp_info info;
+  socklen_t length = sizeof(info);
+
+  if (getsockopt(thread->fd, IPPROTO_TCP, TCP_INFO, &info, &length) == -1 ||
+      info.tcpi_bytes_acked == thread->acked)
+    return 0;
+  thread->acked = info.tcpi_bytes_acked;
+  return 1;
+}
+
+/* Called by the watchdog, under THREAD's lock, once its deadline is due. */
+static void wd_expire(wd_thread_t *thread, long long now) {
+  long long progress_ms = __atomic_load_n(&thread->progress_ms, __ATOMIC_RELAXED);
+  int timeout_ms = wd_timeouts_ms[thread->phase];
+
+  if (thread->phase != WD_HEAD) {
+    if (progress_ms + timeout_ms > now) {
+      thread->deadline_ms = progress_ms + timeout_ms;
+      return;
+    }
+    if (wd_client_took_bytes(thread)) {
+      thread->deadline_ms = now + timeout_ms;
+      return;
+    }
+  }
+  thread->deadline_ms = 0;
+  shutdown(thread->fd, SHUT_RDWR);
+  __atomic_fetch_add(&wd_expired[thread->phase], 1, __ATOMIC_RELAXED);
+}
+
+static void *wd_routine(void *aux) {
+  struct timespec tick = { 0, WD_TICK_MS * 1000000L };
+  wd_thread_t *thread;
+  long long now;
+
+  while (1) {
+    nanosleep(&tick, NULL);
+    now = wd_now_ms();
+    pthread_mutex_lock(&wd_lock);
+    for (thread = wd_threads; thread != NULL; thread = thread->next) {
+      /* Most are not due: skip those without taking their lock. */
+      if (__atomic_load_n(&thread->deadline_ms, __ATOMIC_RELAXED) == 0 ||
+          __atomic_load_n(&thread->deadline_ms, __ATOMIC_RELAXED) > now)
+        continue;
+      pthread_mutex_lock(&thread->lock);
+      if (thread->deadline_ms != 0 && thread->deadline_ms <= now)
+        wd_expire(thread, now);
+      pthread_mutex_unlock(&thread->lock);
+    }
+    pthread_mutex_unlock(&wd_lock);
+  }
+  return NULL;
+}
+
+void wd_init(const int *timeouts_ms) {
+  pthread_t thread;
+
+  for (int i = 0; i < WD_NUM_PHASES; i++)
+    wd_timeouts_ms[i] = timeouts_ms[i];
+  if (pthread_create(&thread, NULL, wd_routine, NULL) != 0) {
+    perror("Failed to start the watchdog");
+    exit(errno);
+  }
+  pthread_detach(thread);
+  wd_started = 1;
+}
+
+void wd_register(void) {
+  wd_thread_t *thread;
+
+  if (!wd_started || wd_current != NULL) return;
+  thread = malloc(sizeof(wd_thread_t));
+  if (thread == NULL) {
+    perror("Failed to allocate a deadline");
+    exit(ENOMEM);
+  }
+  pthread_mutex_init(&thread->lock, NULL);
+  thread->deadline_ms = 0;
+  thread->phase = WD_HEAD;
+  thread->fd = -1;
+  thread->progress_ms = 0;
+  thread->acked = 0;
+
+  pthread_mutex_lock(&wd_lock);
+  thread->prev = NULL;
+  thread->next = wd_threads;
+  if (wd_threads != NULL) wd_threads->prev = thread;
+  wd_threads = thread;
+  pthread_mutex_unlock(&wd_lock);
+  wd_current = thread;
+}
+
+void wd_unregister(void) {
+  wd_thread_t *thread = wd_current;
+
+  if (thread == NULL) return;
+  pthread_mutex_lock(&wd_lock);
+  if (thread->prev != NULL)
+    thread->prev->next = thread->next;
+  else
+    wd_threads = thread->next;
+  if (thread->next != NULL) thread->next->prev = thread->prev;
+  pthread_mutex_unlock(&wd_lock);
+  pthread_mutex_destroy(&thread->lock);
+  free(thread);
+  wd_current = NULL;
+}
+
+void wd_arm(enum wd_phase phase, int fd) {
+  wd_thread_t *thread = wd_current;
+  long long now;
+
+  if (thread == NULL) return;
+  now = wd_now_ms();
+  pthread_mutex_lock(&thread->lock);
+  if (wd_timeouts_ms[phase] > 0) {
+    thread->phase = phase;
+    thread->fd = fd;
+    thread->progress_ms = now;
+    thread->acked = 0;
+    __atomic_store_n(&thread->deadline_ms, now + wd_timeouts_ms[phase],
+        __ATOMIC_RELAXED);
+  } else {
+    __atomic_store_n(&thread->deadline_ms, 0, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&thread->lock);
+}
+
+void wd_progress(void) {
+  if (wd_current != NULL)
+    __atomic_store_n(&wd_current->progress_ms, wd_now_ms(), __ATOMIC_RELAXED);
+}
+
+void wd_disarm(void) {
+  wd_thread_t *thread = wd_current;
+
+  if (thread == NULL) return;
+  pthread_mutex_lock(&thread->lock);
+  __atomic_store_n(&thread->deadline_ms, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&thread->lock);
+}
+
+void wd_report(FILE *out) {
+  fprintf(out, "# HELP httpserver_deadline_expired_total Connections shut down "
+      "for taking too long, by phase.\n"
+      "# TYPE httpserver_deadline_expired_total counter\n");
+  for (int i = 0; i < WD_NUM_PHASES; i++)
+    fprintf(out, "httpserver_deadline_expired_total{phase=\"%s\"} %lu\n",
+        wd_phase_names[i], __atomic_load_n(&wd_expired[i], __ATOMIC_RELAXED));
+}
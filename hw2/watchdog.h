@@ -0,0 +1,58 @@
+#ifndef __WATCHDOG__
+#define __WATCHDOG__
+
+#include <stdio.h>
+
+/* WATCHDOG bounds how long one client can hold a worker of the pool, whose
+ * reads and writes block. Before each phase of serving a connection the
+ * worker arms a deadline for it:
+ *
+ *   WD_HEAD   reading a request head, which must arrive whole in time, so a
+ *             client trickling it a byte at a time is cut off too
+ *   WD_SEND   sending a response, which may go that long without progress
+ *   WD_PROXY  proxying a request, likewise (the upstream side is bounded by
+ *             the upstream sockets' own timeouts)
+ *
+ * Progress is what the worker reports with wd_progress, or else what the
+ * kernel counts as taken by the client since the deadline last came up, so
+ * a client that stops reading is cut off between one and two timeouts
+ * later.
+ *
+ * A worker serves one connection at a time, so it has one deadline, under
+ * a lock only the watchdog thread also takes. Every WD_TICK_MS the watchdog
+ * looks over the workers' deadlines, one load each for those not due, and
+ * when one has passed, shuts the connection down, so whatever read or write
+ * the worker is blocked in returns and the connection is closed. Arming,
+ * disarming and reporting progress are O(1), and cost nothing on threads
+ * that never registered. (The relay thread, which holds many connections,
+ * keeps their idle deadlines in a timer wheel instead; see relay.c.) */
+
+#define WD_TICK_MS 100
+
+enum wd_phase { WD_HEAD, WD_SEND, WD_PROXY, WD_NUM_PHASES };
+
+/* Starts the watchdog with a timeout per phase, in milliseconds (0 leaves
+ * that phase unbounded). */
+void wd_init(const int *timeouts_ms);
+
+/* Gives the calling thread a deadline of its own, or takes it back. */
+void wd_register(void);
+void wd_unregister(void);
+
+/* Sets the calling thread's deadline for PHASE of serving FD, replacing any
+ * other. */
+void wd_arm(enum wd_phase phase, int fd);
+
+/* Notes that bytes moved, which pushes back a WD_SEND or WD_PROXY deadline.
+ * Meant for http_on_progress. */
+void wd_progress(void);
+
+/* Clears the calling thread's deadline. Must come before its connection is
+ * closed or handed on, since the fd number may be reused at once. */
+void wd_disarm(void);
+
+/* Prints the deadlines that passed, by phase, in the Prometheus text
+ * format. */
+void wd_report(FILE *out);
+
+#endif
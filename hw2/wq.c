@@ -1,47 +1,223 @@
+#include <errno.h>
+#include <linux/futex.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 #include "wq.h"
-#include "utlist.h"
+
+/* Attempts at the ring before going to sleep on its futex. */
+#define WQ_SPINS 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define wq_relax() __asm__ __volatile__("pause")
+#else
+#define wq_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static void wq_futex_wait(unsigned int *word, unsigned int value) {
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void wq_futex_wake(unsigned int *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
 
 /* Initializes a work queue WQ. */
 void wq_init(wq_t *wq) {
+  if (posix_memalign((void **) &wq->cells, 64, sizeof(wq_cell_t) * WQ_CAPACITY)) {
+    perror("Failed to allocate work queue");
+    exit(errno);
+  }
+  wq->mask = WQ_CAPACITY - 1;
+  wq->timed = 0;
+  for (unsigned long i = 0; i < WQ_CAPACITY; i++)
+    wq->cells[i].sequence = i;
+
+  wq->enqueue_position = 0;
+  wq->dequeue_position = 0;
+  wq->not_empty = 0;
+  wq->sleeping_consumers = 0;
+  wq->not_full = 0;
+  wq->sleeping_producers = 0;
+}
 
-  /* TODO: Make me thread-safe! */
+void wq_set_timed(wq_t *wq) {
+  wq->timed = 1;
+}
+
+/* A cell is free for the producer at POSITION when its sequence equals
+ * POSITION, and holds an item for the consumer at POSITION when it equals
+ * POSITION + 1. Consuming hands the cell to the producer one lap later. */
+static int wq_ring_push(wq_t *wq, int client_socket_fd, long long pushed_ns) {
+  unsigned long position = __atomic_load_n(&wq->enqueue_position, __ATOMIC_RELAXED);
+  wq_cell_t *cell;
+  long difference;
 
-  wq->size = 0;
-  wq->head = NULL;
-  pthread_mutex_init(&wq->lock, NULL);
-  pthread_cond_init(&wq->queueuIsNotEmpty, NULL);
+  while (1) {
+    cell = &wq->cells[position & wq->mask];
+    difference = (long) (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - position);
+    if (difference == 0) {
+      if (__atomic_compare_exchange_n(&wq->enqueue_position, &position,
+            position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (difference < 0) {
+      return 0; /* Full: the consumer a lap behind has not taken its item. */
+    } else {
+      position = __atomic_load_n(&wq->enqueue_position, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->client_socket_fd = client_socket_fd;
+  cell->pushed_ns = pushed_ns;
+  __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static int wq_ring_pop(wq_t *wq, int *client_socket_fd, long long *pushed_ns) {
+  unsigned long position = __atomic_load_n(&wq->dequeue_position, __ATOMIC_RELAXED);
+  wq_cell_t *cell;
+  long difference;
+
+  while (1) {
+    cell = &wq->cells[position & wq->mask];
+    difference = (long) (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) -
+        (position + 1));
+    if (difference == 0) {
+      if (__atomic_compare_exchange_n(&wq->dequeue_position, &position,
+            position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (difference < 0) {
+      return 0; /* Empty: the producer for this cell has not filled it. */
+    } else {
+      position = __atomic_load_n(&wq->dequeue_position, __ATOMIC_RELAXED);
+    }
+  }
+
+  *client_socket_fd = cell->client_socket_fd;
+  if (pushed_ns != NULL) *pushed_ns = cell->pushed_ns;
+  __atomic_store_n(&cell->sequence, position + wq->mask + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+ * SLEEPERS counts the threads waiting on EVENT that nobody has signalled
+ * yet. A signal takes one of them off the count before waking, so while a
+ * woken consumer is still on its way, further pushes do not make another
+ * futex call for it. Miscounts only go the safe way: a thread that leaves
+ * futex_wait without being signalled stays counted, costing a spare wakeup.
+ */
+
+/* Wakes one thread sleeping on EVENT, if any. The fence orders the caller's
+ * push or pop before the check, pairing with the one in wq_prepare_sleep. */
+static void wq_signal(unsigned int *event, unsigned int *sleepers) {
+  unsigned int count;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  count = __atomic_load_n(sleepers, __ATOMIC_RELAXED);
+  while (count > 0) {
+    if (__atomic_compare_exchange_n(sleepers, &count, count - 1, 1,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      __atomic_add_fetch(event, 1, __ATOMIC_RELEASE);
+      wq_futex_wake(event);
+      return;
+    }
+  }
+}
+
+/* Counts the caller among SLEEPERS and returns the value of EVENT to wait
+ * on. The caller must retry the ring once more before waiting: any push or
+ * pop it misses changes EVENT first, so the wakeup cannot be lost. */
+static unsigned int wq_prepare_sleep(unsigned int *event, unsigned int *sleepers) {
+  unsigned int seen = __atomic_load_n(event, __ATOMIC_ACQUIRE);
+  __atomic_add_fetch(sleepers, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return seen;
+}
+
+/* Undoes wq_prepare_sleep when the retry succeeded, unless a signal has
+ * already taken the caller off the count (and changed EVENT). */
+static void wq_cancel_sleep(unsigned int *event, unsigned int *sleepers,
+    unsigned int seen) {
+  unsigned int count = __atomic_load_n(sleepers, __ATOMIC_RELAXED);
+
+  while (count > 0 && __atomic_load_n(event, __ATOMIC_ACQUIRE) == seen) {
+    if (__atomic_compare_exchange_n(sleepers, &count, count - 1, 1,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return;
+  }
 }
 
 /* Remove an item from the WQ. This function should block until there
  * is at least one item on the queue. */
 int wq_pop(wq_t *wq) {
-  pthread_mutex_lock(&wq->lock);
-
-  /* TODO: Make me blocking and thread-safe! */
-  if(wq->size == 0){
-    pthread_cond_wait(&wq->queueuIsNotEmpty, &wq->lock);
-  }
-  wq_item_t *wq_item = wq->head;
-  int client_socket_fd = wq->head->client_socket_fd;
-  wq->size--;
-  DL_DELETE(wq->head, wq->head);
-  pthread_mutex_unlock(&wq->lock);
-  free(wq_item);
+  return wq_pop_timed(wq, NULL);
+}
+
+int wq_pop_timed(wq_t *wq, long long *pushed_ns) {
+  int client_socket_fd, popped = 0;
+  unsigned int seen;
+
+  for (int i = 0; i < WQ_SPINS && !popped; i++) {
+    popped = wq_ring_pop(wq, &client_socket_fd, pushed_ns);
+    if (!popped) wq_relax();
+  }
+  while (!popped) {
+    seen = wq_prepare_sleep(&wq->not_empty, &wq->sleeping_consumers);
+    popped = wq_ring_pop(wq, &client_socket_fd, pushed_ns);
+    if (popped)
+      wq_cancel_sleep(&wq->not_empty, &wq->sleeping_consumers, seen);
+    else
+      wq_futex_wait(&wq->not_empty, seen);
+  }
+
+  wq_signal(&wq->not_full, &wq->sleeping_producers);
   return client_socket_fd;
 }
 
-/* Add ITEM to WQ. */
+int wq_try_pop(wq_t *wq, int *client_socket_fd) {
+  if (!wq_ring_pop(wq, client_socket_fd, NULL)) return 0;
+  wq_signal(&wq->not_full, &wq->sleeping_producers);
+  return 1;
+}
+
+/* Add ITEM to WQ. When the queue is full this waits for room: accepting
+ * more than WQ_CAPACITY connections ahead of the workers would not get them
+ * served any sooner. */
 void wq_push(wq_t *wq, int client_socket_fd) {
+  long long pushed_ns = 0;
+  struct timespec now;
+  int pushed;
+  unsigned int seen;
+
+  if (wq->timed) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pushed_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+  }
+  pushed = wq_ring_push(wq, client_socket_fd, pushed_ns);
+  while (!pushed) {
+    seen = wq_prepare_sleep(&wq->not_full, &wq->sleeping_producers);
+    pushed = wq_ring_push(wq, client_socket_fd, pushed_ns);
+    if (pushed)
+      wq_cancel_sleep(&wq->not_full, &wq->sleeping_producers, seen);
+    else
+      wq_futex_wait(&wq->not_full, seen);
+  }
 
-  pthread_mutex_lock(&wq->lock);
-  /* TODO: Make me thread-safe! */
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
-  wq_item->client_socket_fd = client_socket_fd;
-  DL_APPEND(wq->head, wq_item);
-  wq->size++;
+  wq_signal(&wq->not_empty, &wq->sleeping_consumers);
+}
+
+unsigned long wq_size(wq_t *wq) {
+  unsigned long dequeued = __atomic_load_n(&wq->dequeue_position, __ATOMIC_RELAXED);
+  unsigned long enqueued = __atomic_load_n(&wq->enqueue_position, __ATOMIC_RELAXED);
+  return (long) (enqueued - dequeued) > 0 ? enqueued - dequeued : 0;
+}
+
+unsigned long wq_popped(wq_t *wq) {
+  return __atomic_load_n(&wq->dequeue_position, __ATOMIC_RELAXED);
+}
 
-  pthread_cond_signal(&wq->queueuIsNotEmpty);
-  pthread_mutex_unlock(&wq->lock);
+unsigned int wq_sleeping_consumers(wq_t *wq) {
+  return __atomic_load_n(&wq->sleeping_consumers, __ATOMIC_RELAXED);
 }
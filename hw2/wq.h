@@ -1,27 +1,61 @@
 #ifndef __WQ__
 #define __WQ__
 
-#include <pthread.h>
-
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served.
+ *
+ * It is a bounded lock-free multi-producer/multi-consumer ring (Vyukov's
+ * design): every cell carries a sequence number that tells producers and
+ * consumers whose turn it is, so pushing and popping each take one
+ * compare-and-swap on their own index and never allocate. Threads only
+ * sleep (on a futex) when the queue is empty, or full for producers. */
+
+#define WQ_CAPACITY 4096 /* Must be a power of two. */
 
-typedef struct wq_item {
+typedef struct wq_cell {
+  unsigned long sequence;
   int client_socket_fd; // Client socket to be served.
-  struct wq_item *next;
-  struct wq_item *prev;
-} wq_item_t;
+  long long pushed_ns;  // When it was pushed, if the queue is timed.
+} wq_cell_t;
 
 typedef struct wq {
-  int size;
-  wq_item_t *head;
-  /* TODO: More stuff here, maybe? */
-  pthread_mutex_t lock;
-  pthread_cond_t  queueuIsNotEmpty;
+  wq_cell_t *cells;
+  unsigned long mask;
+  int timed;
+
+  /* Producers and consumers each get their own cache line. */
+  unsigned long enqueue_position __attribute__((aligned(64)));
+  unsigned long dequeue_position __attribute__((aligned(64)));
+
+  /* Futex words, bumped to wake threads sleeping on an empty or full queue. */
+  unsigned int not_empty __attribute__((aligned(64)));
+  unsigned int sleeping_consumers;
+  unsigned int not_full;
+  unsigned int sleeping_producers;
 } wq_t;
 
 void wq_init(wq_t *wq);
 void wq_push(wq_t *wq, int client_socket_fd);
 int wq_pop(wq_t *wq);
 
+/* Has WQ stamp items with the time they are pushed (CLOCK_MONOTONIC, in
+ * nanoseconds), which wq_pop_timed returns along with them. */
+void wq_set_timed(wq_t *wq);
+
+/* As wq_pop, also storing when the item was pushed in *PUSHED_NS. */
+int wq_pop_timed(wq_t *wq, long long *pushed_ns);
+
+/* Pops an item into *CLIENT_SOCKET_FD without blocking. Returns 0 if the
+ * queue is empty. */
+int wq_try_pop(wq_t *wq, int *client_socket_fd);
+
+/* Items in WQ at about this moment; only an estimate while others use it. */
+unsigned long wq_size(wq_t *wq);
+
+/* Items popped from WQ so far. */
+unsigned long wq_popped(wq_t *wq);
+
+/* Consumers asleep on WQ, waiting for an item; an estimate, as wq_size. */
+unsigned int wq_sleeping_consumers(wq_t *wq);
+
 #endif
@@ -0,0 +1,160 @@
+/*
+ * Measures work queue throughput under contention: N producer threads push
+ * items that N consumer threads pop, for N from 1 to 64, through the
+ * original queue (a utlist list allocated per item, under one mutex and
+ * condition variable) and through wq_t.
+ *
+ * Usage: ./wq_bench [items_per_run] [max_threads]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "utlist.h"
+#include "wq.h"
+
+/* The queue wq_t replaced. Its pop now waits in a loop, as a single
+ * condition check lets a spuriously woken consumer pop an empty list. */
+typedef struct mutex_wq_item {
+  int client_socket_fd;
+  struct mutex_wq_item *next;
+  struct mutex_wq_item *prev;
+} mutex_wq_item_t;
+
+typedef struct mutex_wq {
+  int size;
+  mutex_wq_item_t *head;
+  pthread_mutex_t lock;
+  pthread_cond_t queue_is_not_empty;
+} mutex_wq_t;
+
+void mutex_wq_init(mutex_wq_t *wq) {
+  wq->size = 0;
+  wq->head = NULL;
+  pthread_mutex_init(&wq->lock, NULL);
+  pthread_cond_init(&wq->queue_is_not_empty, NULL);
+}
+
+int mutex_wq_pop(mutex_wq_t *wq) {
+  pthread_mutex_lock(&wq->lock);
+  while (wq->size == 0)
+    pthread_cond_wait(&wq->queue_is_not_empty, &wq->lock);
+  mutex_wq_item_t *wq_item = wq->head;
+  int client_socket_fd = wq->head->client_socket_fd;
+  wq->size--;
+  DL_DELETE(wq->head, wq->head);
+  pthread_mutex_unlock(&wq->lock);
+  free(wq_item);
+  return client_socket_fd;
+}
+
+void mutex_wq_push(mutex_wq_t *wq, int client_socket_fd) {
+  pthread_mutex_lock(&wq->lock);
+  mutex_wq_item_t *wq_item = calloc(1, sizeof(mutex_wq_item_t));
+  wq_item->client_socket_fd = client_socket_fd;
+  DL_APPEND(wq->head, wq_item);
+  wq->size++;
+  pthread_cond_signal(&wq->queue_is_not_empty);
+  pthread_mutex_unlock(&wq->lock);
+}
+
+struct run {
+  int ring;                   /* Use wq_t rather than the mutex queue. */
+  mutex_wq_t mutex_queue;
+  wq_t *ring_queue;
+  long items_per_producer;
+  long long checksum;         /* Sum of everything popped. */
+};
+
+void *producer_routine(void *aux) {
+  struct run *run = aux;
+
+  for (long i = 1; i <= run->items_per_producer; i++) {
+    if (run->ring)
+      wq_push(run->ring_queue, i);
+    else
+      mutex_wq_push(&run->mutex_queue, i);
+  }
+  return NULL;
+}
+
+/* Pops until it receives the 0 pushed once all producers are done. */
+void *consumer_routine(void *aux) {
+  struct run *run = aux;
+  long long sum = 0;
+  int item;
+
+  while ((item = run->ring ? wq_pop(run->ring_queue) :
+        mutex_wq_pop(&run->mutex_queue)) != 0)
+    sum += item;
+  __atomic_add_fetch(&run->checksum, sum, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns millions of items per second through the queue. */
+double measure(int ring, int num_threads, long items) {
+  pthread_t producers[num_threads], consumers[num_threads];
+  struct run run;
+  double start, elapsed;
+
+  run.ring = ring;
+  run.items_per_producer = items / num_threads;
+  run.checksum = 0;
+  mutex_wq_init(&run.mutex_queue);
+  if (posix_memalign((void **) &run.ring_queue, 64, sizeof(wq_t))) {
+    perror("Failed to allocate work queue");
+    exit(EXIT_FAILURE);
+  }
+  wq_init(run.ring_queue);
+
+  start = now_seconds();
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&consumers[i], NULL, consumer_routine, &run);
+    pthread_create(&producers[i], NULL, producer_routine, &run);
+  }
+  for (int i = 0; i < num_threads; i++)
+    pthread_join(producers[i], NULL);
+  for (int i = 0; i < num_threads; i++) {
+    if (ring)
+      wq_push(run.ring_queue, 0);
+    else
+      mutex_wq_push(&run.mutex_queue, 0);
+  }
+  for (int i = 0; i < num_threads; i++)
+    pthread_join(consumers[i], NULL);
+  elapsed = now_seconds() - start;
+  free(run.ring_queue->cells);
+  free(run.ring_queue);
+
+  long long expected = (long long) num_threads * run.items_per_producer *
+      (run.items_per_producer + 1) / 2;
+  if (run.checksum != expected) {
+    fprintf(stderr, "Lost items: popped sum %lld, expected %lld\n",
+        run.checksum, expected);
+    exit(EXIT_FAILURE);
+  }
+  return (double) num_threads * run.items_per_producer / elapsed / 1e6;
+}
+
+int main(int argc, char **argv) {
+  long items = argc > 1 ? atol(argv[1]) : 2000000;
+  int max_threads = argc > 2 ? atoi(argv[2]) : 64;
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  printf("%8s %16s %16s %8s\n", "threads", "mutex Mitems/s", "ring Mitems/s",
+      "speedup");
+  for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    double mutex_rate = measure(0, num_threads, items);
+    double ring_rate = measure(1, num_threads, items);
+    printf("%8d %16.2f %16.2f %7.2fx\n", num_threads, mutex_rate, ring_rate,
+        ring_rate / mutex_rate);
+  }
+  return EXIT_SUCCESS;
+}